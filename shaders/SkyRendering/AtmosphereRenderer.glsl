@@ -249,9 +249,10 @@ void main() {
 
 layout(local_size_x = LOCAL_SIZE_X, local_size_y = LOCAL_SIZE_Y, local_size_z = LOCAL_SIZE_Z) in;
 layout(binding = 0, rgba16f) uniform imageCube env_luminance_image;
+layout(location = 0) uniform int first_face;
 
 void main() {
-    int index = int(gl_GlobalInvocationID.z);
+    int index = int(gl_GlobalInvocationID.z) + first_face;
     vec2 face_uv = (vec2(gl_GlobalInvocationID.xy) + vec2(0.5)) / vec2(imageSize(env_luminance_image));
     face_uv.y = 1.0 - face_uv.y;
     vec3 view_direction = ConvertCubUvToDir(index, face_uv);
@@ -269,7 +270,7 @@ void main() {
         luminance += ComputeGroundLuminance(transmittance_texture, earth_center, ground_position, sun_direction) * transmittance;
     }
 
-    imageStore(env_luminance_image, ivec3(gl_GlobalInvocationID.xyz), vec4(luminance, 0.0));
+    imageStore(env_luminance_image, ivec3(gl_GlobalInvocationID.xy, index), vec4(luminance, 0.0));
 }
 
 #endif
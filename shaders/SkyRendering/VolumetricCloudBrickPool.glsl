@@ -0,0 +1,38 @@
+#ifndef _VOLUMETRIC_CLOUD_BRICK_POOL_GLSL
+#define _VOLUMETRIC_CLOUD_BRICK_POOL_GLSL
+
+// Sparse voxel bricks (see VolumetricCloudBrickPool.h). A lod is described by an ivec4 with the
+// indirection grid size in xyz and its x offset in the indirection texture in w.
+
+// Must match VolumetricCloudBrickPool
+const int kBrickSize = 8;
+const int kBrickStorage = 9;
+const uint kBrickConstant = 0x80000000u;
+
+// brick starts at -1, bricks outside the grid are constant zero
+uint FetchBrickEntry(usampler3D indirection, ivec4 level, ivec3 brick) {
+    ivec3 index = brick + 1;
+    if (any(lessThan(index, ivec3(0))) || any(greaterThanEqual(index, level.xyz)))
+        return kBrickConstant;
+    return texelFetch(indirection, index + ivec3(level.w, 0, 0), 0).r;
+}
+
+// Trilinear sample, texel_pos is in texels of the lod (texel centres at i + 0.5)
+float SampleBricks(sampler3D atlas, usampler3D indirection, ivec4 level, vec3 texel_pos) {
+    vec3 corner = texel_pos - 0.5;
+    ivec3 brick = ivec3(floor(corner / float(kBrickSize)));
+    uint entry = FetchBrickEntry(indirection, level, brick);
+    if ((entry & kBrickConstant) != 0u)
+        return float(entry & 0xffu) / 255.0;
+    uvec3 slot = uvec3(entry & 0x3ffu, (entry >> 10) & 0x3ffu, entry >> 20);
+    vec3 local = clamp(corner - vec3(brick * kBrickSize), vec3(0.0), vec3(kBrickSize));
+    vec3 atlas_pos = vec3(slot * uint(kBrickStorage)) + local + 0.5;
+    return textureLod(atlas, atlas_pos / vec3(textureSize(atlas, 0)), 0.0).r;
+}
+
+// Every sample whose lower filter corner lies in brick reads zero
+bool IsBrickEmpty(usampler3D indirection, ivec4 level, ivec3 brick) {
+    return FetchBrickEntry(indirection, level, brick) == kBrickConstant;
+}
+
+#endif
@@ -25,6 +25,11 @@ layout(std140, binding = 1) uniform VolumetricCloudCommonBufferData{
 	float uAerialPerspectiveLutMaxDistance;
 	float uShadowFroxelMaxDistance;
 	float uEarthRadius;
+
+	uint uAmortizationBlockSize; // 2 or 4, reconstruct texels per render texel edge
+	uint uAmortizationPattern; // VolumetricCloud::AmortizationPattern
+	float uHistoryRejectionMotion;
+	float padding_;
 };
 
 const float kMinTransmittance = 0.01;
@@ -51,6 +56,11 @@ ivec2 IndexToOffset(uint index) {
 #endif
 }
 
+// Offset inside an amortization block of the reconstruct texel rendered for index
+ivec2 BlockIndexToOffset(uint index) {
+	return uAmortizationBlockSize == 2u ? IndexToOffset(index) : ivec2(index & 3u, index >> 2);
+}
+
 vec4 texelFetchClamp(sampler2D s, ivec2 p, int lod) {
 	return texelFetch(s, clamp(p, ivec2(0), textureSize(s, lod) - 1), lod);
 }
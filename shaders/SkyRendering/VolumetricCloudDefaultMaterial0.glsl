@@ -29,4 +29,20 @@ float SampleSigmaT(vec3 pos, float height01) {
     float detail = textureLod(detail_texture, uvwlod.xyz, uvwlod.a).r;
     detail = detail * uDetailParam.x + uDetailParam.y;
     return Remap01(cloud_type.r * CalHeightMask(cloud_type.g, height01), detail, 1.0) * height01 * uDensity;
+}
+
+float EmptySpaceDistance(vec3 pos, vec3 dir) {
+    // Remap01 is zero wherever the masked cloud map value does not exceed the smallest detail
+    float min_detail = min(uDetailParam.y, uDetailParam.x + uDetailParam.y);
+    float max_detail = max(uDetailParam.y, uDetailParam.x + uDetailParam.y);
+    if (max_detail >= 1.0)
+        return 0.0;
+    return CloudMapEmptyDistance(pos, dir, min_detail);
+}
+
+float SigmaTMajorant(vec3 box_min, vec3 box_max, vec2 height01_range) {
+    // The height mask is at most 1 and Remap01 grows with the cloud map and falls with the detail
+    float min_detail = min(uDetailParam.y, uDetailParam.x + uDetailParam.y);
+    float density = min_detail < 1.0 ? Remap01(CloudMapMaxValue(box_min, box_max), min_detail, 1.0) : 1.0;
+    return density * height01_range.y * uDensity;
 }
\ No newline at end of file
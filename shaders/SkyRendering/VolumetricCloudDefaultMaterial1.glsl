@@ -26,4 +26,21 @@ float SampleSigmaT(vec3 pos, float height01) {
     detail *= max(clamp(height01 - uHeightCut, 0, 1), clamp(uEdgeCur - cloud_type.r, 0, 1));
     density = clamp(density - detail, 0, 1) * uDensity * height01;
     return density;
+}
+
+float EmptySpaceDistance(vec3 pos, vec3 dir) {
+    if (uBaseEdgeHardness < 0.0)
+        return 0.0;
+    return CloudMapEmptyDistance(pos, dir, uBaseDensityThreshold);
+}
+
+float SigmaTMajorant(vec3 box_min, vec3 box_max, vec2 height01_range) {
+    // Both base factors are linear before clamping, so they peak at an end of their input range
+    vec2 edge = (vec2(0.0, CloudMapMaxValue(box_min, box_max)) - uBaseDensityThreshold) * uBaseEdgeHardness;
+    vec2 height = (1 - height01_range) * uBaseHeightHardness;
+    float density = clamp(max(edge.x, edge.y), 0, 1) * clamp(max(height.x, height.y), 0, 1);
+    // The detail only erodes, unless uDetailBase lets it go negative
+    if (density > 0.0 && min(uDetailBase * uDetailScale, (1.0 + uDetailBase) * uDetailScale) < 0.0)
+        density = 1.0;
+    return density * uDensity * height01_range.y;
 }
\ No newline at end of file
@@ -1,6 +1,9 @@
 layout(binding = MATERIAL_TEXTURE_UNIT_BEGIN + 0) uniform sampler2D cloud_map;
 layout(binding = MATERIAL_TEXTURE_UNIT_BEGIN + 1) uniform sampler3D detail_texture;
 layout(binding = MATERIAL_TEXTURE_UNIT_BEGIN + 2) uniform sampler2D displacement_texture;
+layout(binding = MATERIAL_TEXTURE_UNIT_BEGIN + 3) uniform sampler2D cloud_map_skip_grid;
+
+#include "VolumetricCloudSkipGrid.glsl"
 
 struct SampleInfo {
 	vec2 bias;
@@ -21,4 +24,24 @@ vec4 GetUVWLod(vec3 pos, SampleInfo sample_info) {
 	vec3 uvw = pos * sample_info.frequency + vec3(sample_info.bias, 0.0);
 	float lod = log2(sample_info.k_lod * distance(pos, uCameraPos)) + uLodBias;
 	return vec4(uvw, lod);
-}
\ No newline at end of file
+}
+
+// Empty distance along dir from pos, given the largest cloud map density that still yields zero
+float CloudMapEmptyDistance(vec3 pos, vec3 dir, float zero_density_threshold) {
+	vec4 uvwlod = GetUVWLod(pos, uCloudMapSampleInfo);
+	float empty_distance = SkipGridEmptyDistance(cloud_map_skip_grid, uvwlod.xy,
+		dir.xy * uCloudMapSampleInfo.frequency, uvwlod.a, vec2(textureSize(cloud_map, 0)),
+		true, zero_density_threshold);
+	// Keep the lod from growing by more than one over the skipped distance
+	return min(empty_distance, distance(pos, uCameraPos));
+}
+
+// Upper bound of the cloud map density (red) sampled anywhere in the box
+float CloudMapMaxValue(vec3 box_min, vec3 box_max) {
+	vec3 far_offset = max(abs(box_min - uCameraPos), abs(box_max - uCameraPos));
+	float max_lod = log2(uCloudMapSampleInfo.k_lod * length(far_offset)) + uLodBias;
+	vec2 uv0 = box_min.xy * uCloudMapSampleInfo.frequency + uCloudMapSampleInfo.bias;
+	vec2 uv1 = box_max.xy * uCloudMapSampleInfo.frequency + uCloudMapSampleInfo.bias;
+	return SkipGridMaxValue(cloud_map_skip_grid, min(uv0, uv1), max(uv0, uv1), max_lod,
+		vec2(textureSize(cloud_map, 0)), true);
+}
@@ -0,0 +1,65 @@
+#ifndef _VOLUMETRIC_CLOUD_LIGHTING_GLSL
+#define _VOLUMETRIC_CLOUD_LIGHTING_GLSL
+
+#include "VolumetricCloudCommon.glsl"
+
+layout(std140, binding = 2) uniform VolumetricCloudBufferData {
+	float uSunIlluminanceScale;
+	float uMaxRaymarchDistance;
+	float uMaxRaymarchSteps;
+    float uMaxVisibleDistance;
+
+	vec3 uEnvColorScale;
+	float uShadowSteps;
+    
+    float uSunMultiscatteringSigmaScale;
+    float uEnvMultiscatteringSigmaScale;
+	float uShadowDistance;
+	float uEnvBottomVisibility;
+	float uEmptySpaceSkipping;
+	float uLightVolumeEnable;
+	float uLightVolumeHalfWidth;
+	float uEnvSunHeightCurveExp;
+
+	vec2 uLightVolumeOffset;
+	vec2 uLightVolumeBuildOffset;
+	float uLightVolumeBuildSliceBegin;
+};
+
+// Should be defined in material shader
+float SampleSigmaT(vec3 pos, float height01);
+
+float SampleShadow(vec3 pos) {
+    float optical_depth = 0.0;
+    float inv_shadow_steps = 1.0 / uShadowSteps;
+    vec3 sample_vector = uShadowDistance * uSunDirection;
+    float previous_t = 0.0;
+    // UE4 Non-linear shadow sample distribution
+    for (float t = inv_shadow_steps; t <= 1.0; t += inv_shadow_steps) {
+        float current_t = t * t;
+        float delta_t = current_t - previous_t;
+        vec3 sample_pos = pos + sample_vector * (previous_t + 0.5 * delta_t);
+        float sample_height01 = CalHeight01(sample_pos);
+        optical_depth += SampleSigmaT(sample_pos, sample_height01) * uShadowDistance * delta_t;
+        previous_t = current_t;
+    }
+    float transmittance = exp(-optical_depth);
+    return transmittance;
+}
+
+// The light volume caches SampleShadow around where the camera was when it was built. xy spans a
+// horizontal square of half width uLightVolumeHalfWidth that stays fixed in cloud space, offset
+// from the local frame (recentred under the camera every frame) by uLightVolumeOffset. z is
+// height01 so the layers follow the curvature of the cloud shell.
+vec3 LightVolumeUvw(vec3 pos, float height01) {
+    return vec3((pos.xy + uLightVolumeOffset) / (2.0 * uLightVolumeHalfWidth) + 0.5, height01);
+}
+
+// Position in the local frame of the texel at uvw of the volume being built
+vec3 LightVolumePosition(vec3 uvw) {
+    vec2 xy = (uvw.xy * 2.0 - 1.0) * uLightVolumeHalfWidth - uLightVolumeBuildOffset;
+    float r = uEarthRadius + mix(uBottomAltitude, uTopAltitude, uvw.z);
+    return vec3(xy, sqrt(max(r * r - dot(xy, xy), 0.0)) - uEarthRadius);
+}
+
+#endif
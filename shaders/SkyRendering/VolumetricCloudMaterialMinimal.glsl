@@ -5,4 +5,12 @@ layout(std140, binding = 3) uniform VolumetricCloudMaterialBufferData {
 
 float SampleSigmaT(vec3 pos, float height01) {
     return uDensity;
+}
+
+float EmptySpaceDistance(vec3 pos, vec3 dir) {
+    return 0.0;
+}
+
+float SigmaTMajorant(vec3 box_min, vec3 box_max, vec2 height01_range) {
+    return uDensity;
 }
\ No newline at end of file
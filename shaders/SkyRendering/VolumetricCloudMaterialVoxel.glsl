@@ -1,4 +1,7 @@
-layout(binding = MATERIAL_TEXTURE_UNIT_BEGIN + 0) uniform sampler3D voxel;
+layout(binding = MATERIAL_TEXTURE_UNIT_BEGIN + 0) uniform sampler3D voxel_brick_atlas;
+layout(binding = MATERIAL_TEXTURE_UNIT_BEGIN + 1) uniform usampler3D voxel_brick_indirection;
+
+#include "VolumetricCloudBrickPool.glsl"
 
 layout(std140, binding = 3) uniform VolumetricCloudMaterialBufferData{
 	vec2 uSampleFrequency;
@@ -6,12 +9,102 @@ layout(std140, binding = 3) uniform VolumetricCloudMaterialBufferData{
 	float uDensity;
 	vec2 uSampleBias;
 	float uSampleLodK;
+	int uBrickLevelCount;
+	vec3 uVoxelSize;
 	float voxel_material_padding;
+	ivec4 uBrickLevels[16]; // VolumetricCloudBrickPool::kMaxLevels
 };
 
+// Rounded like GL_NEAREST_MIPMAP_NEAREST
+int GetVoxelLevel(float camera_distance) {
+    float lod = log2(uSampleLodK * camera_distance) + uLodBias;
+    return int(clamp(floor(lod + 0.5), 0.0, float(uBrickLevelCount - 1)));
+}
+
+int GetVoxelLevel(vec3 pos) {
+    return GetVoxelLevel(distance(pos, uCameraPos));
+}
+
 float SampleSigmaT(vec3 pos, float height01) {
-    vec2 uv = pos.xy * uSampleFrequency + uSampleBias;
-    float lod = log2(uSampleLodK * distance(pos, uCameraPos)) + uLodBias;
-    float density = textureLod(voxel, vec3(uv, height01), lod).r;
+    vec3 uvw = vec3(pos.xy * uSampleFrequency + uSampleBias, height01);
+    int level = GetVoxelLevel(pos);
+    float density = SampleBricks(voxel_brick_atlas, voxel_brick_indirection, uBrickLevels[level],
+        uvw * uVoxelSize / float(1 << level));
 	return density * uDensity;
-}
\ No newline at end of file
+}
+
+// Distance along the ray until it leaves the empty brick of the lod at uvw, 0 if the brick is
+// not empty. The altitude grows at most as fast as the ray, and above a sphere it never falls
+// faster than along the initial direction, which bounds the height01 exit.
+float EmptyBrickDistance(int level_index, vec3 uvw, vec2 uv_direction, float height_rate) {
+    float texel_scale = float(1 << level_index);
+    vec3 corner = uvw * uVoxelSize / texel_scale - 0.5;
+    ivec3 brick = ivec3(floor(corner / float(kBrickSize)));
+    if (!IsBrickEmpty(voxel_brick_indirection, uBrickLevels[level_index], brick))
+        return 0.0;
+
+    vec3 box_min = (vec3(brick * kBrickSize) + 0.5) * texel_scale / uVoxelSize;
+    vec3 box_max = (vec3((brick + 1) * kBrickSize) + 0.5) * texel_scale / uVoxelSize;
+    float t = 1e20;
+    for (int i = 0; i < 2; ++i) {
+        if (uv_direction[i] > 0.0)
+            t = min(t, (box_max[i] - uvw[i]) / uv_direction[i]);
+        else if (uv_direction[i] < 0.0)
+            t = min(t, (box_min[i] - uvw[i]) / uv_direction[i]);
+    }
+    float thickness = uTopAltitude - uBottomAltitude;
+    if (box_max.z < 1.0)
+        t = min(t, (box_max.z - uvw.z) * thickness);
+    if (box_min.z > 0.0 && height_rate < 0.0)
+        t = min(t, (uvw.z - box_min.z) * thickness / -height_rate);
+    return max(t, 0.0);
+}
+
+float EmptySpaceDistance(vec3 pos, vec3 dir) {
+    vec3 uvw = vec3(pos.xy * uSampleFrequency + uSampleBias, CalHeight01(pos));
+    vec2 uv_direction = dir.xy * uSampleFrequency;
+    float height_rate = dot(dir, normalize(vec3(pos.xy, pos.z + uEarthRadius)));
+    int level = GetVoxelLevel(pos);
+    float empty_distance = EmptyBrickDistance(level, uvw, uv_direction, height_rate);
+    // Samples further along the ray may round to the next coarser lod
+    if (empty_distance > 0.0 && level + 1 < uBrickLevelCount)
+        empty_distance = min(empty_distance, EmptyBrickDistance(level + 1, uvw, uv_direction, height_rate));
+    return min(empty_distance, distance(pos, uCameraPos));
+}
+
+// Constant bricks are bounded by their value and stored ones by 1, over every lod the box can
+// be sampled at
+float SigmaTMajorant(vec3 box_min, vec3 box_max, vec2 height01_range) {
+    const int kMaxBricks = 512;
+    vec3 far_offset = max(abs(box_min - uCameraPos), abs(box_max - uCameraPos));
+    int level_min = GetVoxelLevel(distance(clamp(uCameraPos, box_min, box_max), uCameraPos));
+    int level_max = GetVoxelLevel(length(far_offset));
+    vec2 uv0 = box_min.xy * uSampleFrequency + uSampleBias;
+    vec2 uv1 = box_max.xy * uSampleFrequency + uSampleBias;
+    vec3 uvw_min = vec3(min(uv0, uv1), height01_range.x);
+    vec3 uvw_max = vec3(max(uv0, uv1), height01_range.y);
+    float majorant = 0.0;
+    for (int level_index = level_min; level_index <= level_max; ++level_index) {
+        ivec4 level = uBrickLevels[level_index];
+        vec3 texel_scale = uVoxelSize / float(1 << level_index);
+        // Bricks of the lower filter corners, those outside the grid are constant zero
+        ivec3 brick_min = max(ivec3(floor((uvw_min * texel_scale - 0.5) / float(kBrickSize))), ivec3(-1));
+        ivec3 brick_max = min(ivec3(floor((uvw_max * texel_scale - 0.5) / float(kBrickSize))), level.xyz - 2);
+        ivec3 count = brick_max - brick_min + 1;
+        if (any(lessThan(count, ivec3(1))))
+            continue;
+        if (count.x * count.y * count.z > kMaxBricks)
+            return uDensity;
+        for (int z = brick_min.z; z <= brick_max.z; ++z) {
+            for (int y = brick_min.y; y <= brick_max.y; ++y) {
+                for (int x = brick_min.x; x <= brick_max.x; ++x) {
+                    uint entry = FetchBrickEntry(voxel_brick_indirection, level, ivec3(x, y, z));
+                    if ((entry & kBrickConstant) == 0u)
+                        return uDensity;
+                    majorant = max(majorant, float(entry & 0xffu) / 255.0);
+                }
+            }
+        }
+    }
+    return majorant * uDensity;
+}
@@ -0,0 +1,58 @@
+// Two frames of a voxel sequence, see VoxelSequenceStreamer.h
+layout(binding = MATERIAL_TEXTURE_UNIT_BEGIN + 0) uniform sampler3D voxel_frame0;
+layout(binding = MATERIAL_TEXTURE_UNIT_BEGIN + 1) uniform sampler3D voxel_frame1;
+layout(binding = MATERIAL_TEXTURE_UNIT_BEGIN + 2) uniform sampler2D voxel_skip_grid0;
+layout(binding = MATERIAL_TEXTURE_UNIT_BEGIN + 3) uniform sampler2D voxel_skip_grid1;
+
+#include "VolumetricCloudSkipGrid.glsl"
+
+layout(std140, binding = 3) uniform VolumetricCloudMaterialBufferData{
+	vec2 uSampleFrequency;
+	float uLodBias;
+	float uDensity;
+	vec2 uSampleBias;
+	float uSampleLodK;
+	float voxel_material_padding;
+	vec2 uFrameWeights;
+	vec2 voxel_sequence_padding;
+};
+
+float SampleSigmaT(vec3 pos, float height01) {
+    vec3 uvw = vec3(pos.xy * uSampleFrequency + uSampleBias, height01);
+    float lod = log2(uSampleLodK * distance(pos, uCameraPos)) + uLodBias;
+    float density = 0.0;
+    if (uFrameWeights.x > 0.0)
+        density += uFrameWeights.x * textureLod(voxel_frame0, uvw, lod).r;
+    if (uFrameWeights.y > 0.0)
+        density += uFrameWeights.y * textureLod(voxel_frame1, uvw, lod).r;
+	return density * uDensity;
+}
+
+// Space is empty where it is empty in every frame that is blended in
+float EmptySpaceDistance(vec3 pos, vec3 dir) {
+    vec2 uv = pos.xy * uSampleFrequency + uSampleBias;
+    vec2 uv_direction = dir.xy * uSampleFrequency;
+    float camera_distance = distance(pos, uCameraPos);
+    float lod = log2(uSampleLodK * camera_distance) + uLodBias;
+    vec2 source_size = vec2(textureSize(voxel_frame0, 0).xy);
+    float empty_distance = camera_distance;
+    if (uFrameWeights.x > 0.0)
+        empty_distance = min(empty_distance, SkipGridEmptyDistance(voxel_skip_grid0, uv, uv_direction, lod, source_size, false, 0.0));
+    if (uFrameWeights.y > 0.0)
+        empty_distance = min(empty_distance, SkipGridEmptyDistance(voxel_skip_grid1, uv, uv_direction, lod, source_size, false, 0.0));
+    return empty_distance;
+}
+
+float SigmaTMajorant(vec3 box_min, vec3 box_max, vec2 height01_range) {
+    vec3 far_offset = max(abs(box_min - uCameraPos), abs(box_max - uCameraPos));
+    float max_lod = log2(uSampleLodK * length(far_offset)) + uLodBias;
+    vec2 uv0 = box_min.xy * uSampleFrequency + uSampleBias;
+    vec2 uv1 = box_max.xy * uSampleFrequency + uSampleBias;
+    vec2 source_size = vec2(textureSize(voxel_frame0, 0).xy);
+    float majorant = 0.0;
+    if (uFrameWeights.x > 0.0)
+        majorant += uFrameWeights.x * SkipGridMaxValue(voxel_skip_grid0, min(uv0, uv1), max(uv0, uv1), max_lod, source_size, false);
+    if (uFrameWeights.y > 0.0)
+        majorant += uFrameWeights.y * SkipGridMaxValue(voxel_skip_grid1, min(uv0, uv1), max(uv0, uv1), max_lod, source_size, false);
+    return majorant * uDensity;
+}
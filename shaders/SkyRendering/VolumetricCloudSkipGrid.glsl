@@ -0,0 +1,87 @@
+#ifndef _VOLUMETRIC_CLOUD_SKIP_GRID_GLSL
+#define _VOLUMETRIC_CLOUD_SKIP_GRID_GLSL
+
+// Coarse 2D grid over a material density texture (see VolumetricCloudSkipGrid.h). Each cell
+// holds the maximum red value of its column of source texels, dilated by one cell, with a max
+// mip chain for coarser source lods.
+
+// Source texels per cell edge at level 0, must match VolumetricCloudSkipGrid::kCellTexels
+const int kSkipGridCellTexels = 8;
+const int kSkipGridCellTexelsLog2 = 3;
+
+// Distance along the ray, in units of uv / uv_direction, over which every source sample
+// (at lod source_lod and up to one lod coarser) is at most threshold. Returns 0 if the current
+// cell may contain more. wrap selects repeat instead of clamp-to-border addressing.
+float SkipGridEmptyDistance(sampler2D skip_grid, vec2 uv, vec2 uv_direction, float source_lod,
+        vec2 source_size, bool wrap, float threshold) {
+    // A bilinear or trilinear sample at lod L reads texels of level ceil(L) + 1 at most, whose
+    // footprint stays inside the cell and its neighbours once cells are at least that large
+    int level = max(int(ceil(source_lod)) + 2 - kSkipGridCellTexelsLog2, 0);
+    if (level >= textureQueryLevels(skip_grid))
+        return 0.0;
+
+    vec2 cell_uv = float(kSkipGridCellTexels << level) / source_size;
+    vec2 cell = floor(uv / cell_uv);
+    ivec2 size = textureSize(skip_grid, level);
+    float value;
+    if (wrap) {
+        value = texelFetch(skip_grid, ivec2(mod(cell, vec2(size))), level).r;
+    } else {
+        // Outside the texture only the cells next to it can see the edge texels
+        ivec2 index = ivec2(cell);
+        if (any(lessThan(index, ivec2(-1))) || any(greaterThan(index, size)))
+            value = 0.0;
+        else
+            value = texelFetch(skip_grid, clamp(index, ivec2(0), size - 1), level).r;
+    }
+    if (value > threshold)
+        return 0.0;
+
+    vec2 cell_min = cell * cell_uv;
+    vec2 cell_max = cell_min + cell_uv;
+    vec2 t = vec2(1e20);
+    for (int i = 0; i < 2; ++i) {
+        if (uv_direction[i] > 0.0)
+            t[i] = (cell_max[i] - uv[i]) / uv_direction[i];
+        else if (uv_direction[i] < 0.0)
+            t[i] = (cell_min[i] - uv[i]) / uv_direction[i];
+    }
+    return min(t.x, t.y);
+}
+
+// Upper bound of the source samples (at lods up to max_lod) with uv in [uv_min, uv_max]. Cells
+// are read at the level SkipGridEmptyDistance would use, or a coarser one so that at most 4 x 4
+// cells cover the range.
+float SkipGridMaxValue(sampler2D skip_grid, vec2 uv_min, vec2 uv_max, float max_lod,
+        vec2 source_size, bool wrap) {
+    int level_count = textureQueryLevels(skip_grid);
+    int level = min(max(int(ceil(clamp(max_lod, 0.0, 32.0))) + 2 - kSkipGridCellTexelsLog2, 0), level_count - 1);
+    ivec2 cell_min, cell_max, size;
+    while (true) {
+        vec2 cell_uv = float(kSkipGridCellTexels << level) / source_size;
+        cell_min = ivec2(floor(uv_min / cell_uv));
+        cell_max = ivec2(floor(uv_max / cell_uv));
+        size = textureSize(skip_grid, level);
+        if (wrap) {
+            cell_max = min(cell_max, cell_min + size - 1);
+        } else {
+            // Outside the texture only the cells next to it can see the edge texels
+            cell_min = max(cell_min, ivec2(-1));
+            cell_max = min(cell_max, size);
+        }
+        if (all(lessThan(cell_max - cell_min, ivec2(4))) || level == level_count - 1)
+            break;
+        ++level;
+    }
+
+    float value = 0.0;
+    for (int y = cell_min.y; y <= cell_max.y; ++y) {
+        for (int x = cell_min.x; x <= cell_max.x; ++x) {
+            ivec2 index = wrap ? ivec2(mod(vec2(x, y), vec2(size))) : clamp(ivec2(x, y), ivec2(0), size - 1);
+            value = max(value, texelFetch(skip_grid, index, level).r);
+        }
+    }
+    return value;
+}
+
+#endif
@@ -0,0 +1,121 @@
+#ifndef _VOLUMETRIC_CLOUD_TILES_GLSL
+#define _VOLUMETRIC_CLOUD_TILES_GLSL
+
+#include "VolumetricCloudCommon.glsl"
+
+// Render texels per tile edge, must match VolumetricCloud::kTileSize. A tile covers
+// kTileSize * uAmortizationBlockSize reconstruct texels and the window pixels upscaled from them.
+const int kTileSize = 8;
+
+int GetReconstructTileSize() {
+    return kTileSize * int(uAmortizationBlockSize);
+}
+
+// Lists of tiles written by VolumetricCloudTileClassify.comp, each with room for every tile.
+// Tiles that need the full pass are stored from the front of a list, the others from its back.
+const int kTileListRender = 0;
+const int kTileListReconstruct = 1;
+const int kTileListUpscale = 2;
+
+layout(std430, binding = 0) buffer VolumetricCloudTileBuffer {
+    // Indirect dispatch commands (xyz) in the order of VolumetricCloud::TileCommand:
+    // render, render fill, reconstruct, reconstruct fill, upscale
+    uvec4 uTileCommands[5];
+    uint uTiles[];
+};
+
+ivec2 GetTileGridSize(ivec2 render_size) {
+    return (render_size + kTileSize - 1) / kTileSize;
+}
+
+void AppendTile(int list, bool active, ivec2 tile, int tile_count) {
+    int command = list * 2 + (active ? 0 : 1);
+    uint index = atomicAdd(uTileCommands[command].x, 1u);
+    uint offset = uint(list * tile_count) + (active ? index : uint(tile_count - 1) - index);
+    uTiles[offset] = uint(tile.x) | (uint(tile.y) << 16);
+}
+
+// Tile of the current work group, dispatched with the active or the fill command of list
+ivec2 GetWorkGroupTile(int list, bool active, int tile_count) {
+    uint index = gl_WorkGroupID.x;
+    uint packed_tile = uTiles[uint(list * tile_count) + (active ? index : uint(tile_count - 1) - index)];
+    return ivec2(packed_tile & 0xffffu, packed_tile >> 16);
+}
+
+struct Intersect {
+    float t1;
+    float t2;
+};
+
+Intersect[2] RayShellIntersect(float r, float mu) {
+    Intersect[2] res;
+    res[0].t1 = res[0].t2 = res[1].t1 = res[1].t2 = 0.0;
+    float bottom_radius = uEarthRadius + uBottomAltitude;
+    float top_radius = uEarthRadius + uTopAltitude;
+    float discriminant_bottom = r * r * (mu * mu - 1.0) + bottom_radius * bottom_radius;
+    float discriminant_top = r * r * (mu * mu - 1.0) + top_radius * top_radius;
+    float sqrt_discriminant_bottom = sqrt(discriminant_bottom);
+    float sqrt_discriminant_top = sqrt(discriminant_top);
+    if (uCameraPos.z < uBottomAltitude) {
+        res[0].t1 = -r * mu + sqrt_discriminant_bottom;
+        res[0].t2 = -r * mu + sqrt_discriminant_top;
+    } else if (uCameraPos.z < uTopAltitude) {
+        if (discriminant_bottom >= 0.0 && mu < 0.0) {
+            res[0].t2 = -r * mu - sqrt_discriminant_bottom;
+            res[1].t1 = -r * mu + sqrt_discriminant_bottom;
+            res[1].t2 = -r * mu + sqrt_discriminant_top;
+        } else {
+            res[0].t2 = -r * mu + sqrt_discriminant_top;
+        }
+    } else /*if (uCameraPos.z >= uTopAltitude)*/{
+        if (discriminant_bottom >= 0.0 && mu < 0.0) {
+            res[0].t1 = -r * mu - sqrt_discriminant_top;
+            res[0].t2 = -r * mu - sqrt_discriminant_bottom;
+            res[1].t1 = -r * mu + sqrt_discriminant_bottom;
+            res[1].t2 = -r * mu + sqrt_discriminant_top;
+        } else if (discriminant_top >= 0.0 && mu < 0.0) {
+            res[0].t1 = -r * mu - sqrt_discriminant_top;
+            res[0].t2 = -r * mu + sqrt_discriminant_top;
+        }
+    }
+    return res;
+}
+
+struct CloudRay {
+    vec2 uv;
+    vec3 view_dir;
+    float frag_dist;
+    float r;
+    float mu;
+    Intersect intersect[2]; // clamped to the scene depth and max_visible_distance
+};
+
+// Primary ray of render texel pos, through the checkerboard texel chosen by the index pass
+CloudRay GetCloudRay(sampler2D checkerboard_depth, sampler2D index_linear_depth_texture, ivec2 pos,
+        float max_visible_distance) {
+    uint index = uint(texelFetch(index_linear_depth_texture, pos, 0).r);
+    ivec2 pos_in_checkerboard = pos * int(uAmortizationBlockSize) + BlockIndexToOffset(index);
+
+    CloudRay ray;
+    ivec2 image_size = textureSize(checkerboard_depth, 0);
+    ray.uv = (vec2(pos_in_checkerboard) + 0.5) / image_size;
+    float depth = texelFetch(checkerboard_depth, pos_in_checkerboard, 0).x;
+    vec3 frag_pos = ProjectiveMul(uInvMVP, vec3(ray.uv, depth) * 2.0 - 1.0);
+    ray.view_dir = normalize(frag_pos - uCameraPos);
+
+    ray.r = uCameraPos.z + uEarthRadius;
+    ray.mu = ray.view_dir.z;
+    ray.intersect = RayShellIntersect(ray.r, ray.mu);
+    ray.frag_dist = distance(frag_pos, uCameraPos);
+    for (int i = 0; i < 2; ++i) {
+        ray.intersect[i].t2 = clamp(min(ray.frag_dist, max_visible_distance), ray.intersect[i].t1, ray.intersect[i].t2);
+    }
+    return ray;
+}
+
+// Nothing to march: both shell segments are hidden by the scene or beyond the visible distance
+bool IsCloudRayEmpty(CloudRay ray) {
+    return ray.intersect[0].t2 <= ray.intersect[0].t1 && ray.intersect[1].t2 <= ray.intersect[1].t1;
+}
+
+#endif
@@ -35,6 +35,12 @@ public:
 
 	void Rotate(float dPitch, float dYaw);
 
+	float yaw() const { return yaw_; }
+
+	float pitch() const { return pitch_; }
+
+	void SetYawPitch(float yaw, float pitch);
+
 	float fovy = 45.f;
 	float zNear = 1e-1f;
 	float zFar = 1e3f;
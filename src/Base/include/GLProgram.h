@@ -1,12 +1,26 @@
 #pragma once
 
 #include <string>
+#include <vector>
+#include <memory>
+#include <utility>
+#include <initializer_list>
 
 #include <glad/glad.h>
 
 class GLProgram {
 public:
-	GLProgram() = default;
+	// While alive, programs constructed on this thread are linked in the background
+	// (GL_KHR_parallel_shader_compile) and errors are reported by Finish() instead of the constructor
+	class DeferredLinkScope {
+	public:
+		DeferredLinkScope();
+		~DeferredLinkScope();
+		DeferredLinkScope(const DeferredLinkScope&) = delete;
+		DeferredLinkScope& operator=(const DeferredLinkScope&) = delete;
+	};
+
+	GLProgram();
 	GLProgram(const char* vertex_src, const char* fragment_src, GLuint external_fragment_shader = 0);
 	GLProgram(const char* compute_src, GLuint external_compute_shader = 0);
 	~GLProgram();
@@ -23,13 +37,29 @@ public:
 
 	GLuint id() const noexcept { return id_; }
 
+	// Whether a deferred link has completed, polled without waiting. Without the extension this is
+	// always true: nothing can tell whether the driver is done, so Finish blocks until it is.
+	bool Ready() const;
+
+	// Wait for a deferred link and throw std::runtime_error if compiling or linking failed
+	void Finish();
+
 	void swap(GLProgram& rhs) noexcept {
 		using std::swap;
 		swap(id_, rhs.id_);
+		swap(pending_, rhs.pending_);
 	}
 
+	// Enable GL_KHR/ARB_parallel_shader_compile if supported. Call once after loading GL functions.
+	static void EnableParallelCompile(GLADloadproc load);
+
 private:
+	struct Pending;
+
+	void Build(std::initializer_list<std::pair<GLenum, const char*>> stages, GLuint external_shader);
+
 	GLuint id_ = 0;
+	std::unique_ptr<Pending> pending_;
 };
 
 constexpr auto kCommonVertexSrc = R"(
@@ -45,3 +75,15 @@ void main() {
 std::string Replace(std::string src, const std::string& from, const std::string& to);
 
 std::string ReadWithPreprocessor(const char* filepath);
+
+// Records (normalized paths of) all files read by ReadWithPreprocessor on this thread while alive
+class ScopedIncludeRecorder {
+public:
+	explicit ScopedIncludeRecorder(std::vector<std::string>& files);
+	~ScopedIncludeRecorder();
+	ScopedIncludeRecorder(const ScopedIncludeRecorder&) = delete;
+	ScopedIncludeRecorder& operator=(const ScopedIncludeRecorder&) = delete;
+
+private:
+	std::vector<std::string>* previous_;
+};
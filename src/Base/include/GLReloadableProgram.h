@@ -1,10 +1,15 @@
 #pragma once
 
+#include <array>
+#include <chrono>
 #include <functional>
+#include <memory>
 #include <type_traits>
+#include <unordered_set>
 
 #include <glm/glm.hpp>
 
+#include "gl.hpp"
 #include "GLProgram.h"
 #include "ObjectsSet.h"
 
@@ -25,13 +30,32 @@ public:
 
 	GLuint id() const noexcept { return program_.id(); }
 
-	void Reload();
+	// With async, the current program keeps being used until the new one has linked (see UpdateAll)
+	void Reload(bool async = false);
 
-	static void ReloadAll();
+	bool reloading() const noexcept { return pending_program_.id() != 0; }
+
+	static void ReloadAll(bool async = false);
+
+	// Call at frame start: asynchronously reloads programs that include a modified shader file
+	// and swaps in finished links. With GL_KHR/ARB_parallel_shader_compile no link is waited for;
+	// without it, compiles run inside Reload and each link blocks here. Programs reloaded together (by one
+	// ReloadAll or one file change, e.g. the render and display passes of a shader) are swapped
+	// in the same frame once all of them have linked, or not at all if one of them fails.
+	static void UpdateAll();
+
+	static inline bool watch_enable = true;
 	
 private:
+	void Reload(bool async, uint64_t batch);
+
 	std::function<GLProgram()> loader_;
 	GLProgram program_;
+	GLProgram pending_program_;
+	uint64_t reload_batch_ = 0; // of pending_program_
+	static inline uint64_t last_reload_batch_ = 0;
+	static inline std::unordered_set<uint64_t> failed_reload_batches_; // some program did not compile
+	std::vector<std::string> dependencies_; // files read by the last load
 };
 
 class GLReloadableComputeProgram : private ObjectsSet<GLReloadableComputeProgram> {
@@ -55,7 +79,19 @@ public:
 	void Dispatch(const glm::ivec3& globalsize) {
 		const auto& localsize = data_->localsizes[data_->index];
 		auto groupsize = (globalsize + localsize - 1) / localsize;
-		glDispatchCompute(groupsize.x, groupsize.y, groupsize.z);
+		if (data_->autotune.recording)
+			DispatchTimed(groupsize);
+		else
+			glDispatchCompute(groupsize.x, groupsize.y, groupsize.z);
+	}
+
+	// Group counts come from the buffer bound to GL_DISPATCH_INDIRECT_BUFFER, so the shader has to
+	// cover a fixed amount of work per group whatever local size is selected
+	void DispatchIndirect(GLintptr offset) {
+		if (data_->autotune.recording)
+			DispatchIndirectTimed(offset);
+		else
+			glDispatchComputeIndirect(offset);
 	}
 
 	GLuint id() { return data_->programs[data_->index].id(); }
@@ -64,11 +100,51 @@ public:
 
 	static void DrawGUIAll();
 
+	// Time every candidate local size on real dispatches and keep the one with the lowest time per
+	// dispatch. Each candidate gets kAutotuneMeasureFrames frames or kAutotuneCandidateTimeout.
+	// Programs without an entry in the local size cache start tuning on construction unless
+	// autotune_on_construction is off.
+	void Autotune();
+
+	// Off in headless runs, whose frame times would otherwise include the candidate compiles
+	static inline bool autotune_on_construction = true;
+
+	bool autotuning() const { return data_ && data_->autotune.active; }
+
+	static void AutotuneAll();
+
+	// Call once per frame, outside of any dispatch sequence (candidates are switched here)
+	static void UpdateAutotuneAll();
+
 private:
+	static constexpr int kAutotuneWarmupFrames = 4;
+	static constexpr int kAutotuneMeasureFrames = 16;
+	static constexpr int kAutotuneLatency = 3; // frames of timestamps in flight, as in Profiler
+	// A candidate of a rarely dispatched program moves on after this long with the frames it got
+	static constexpr auto kAutotuneCandidateTimeout = std::chrono::seconds(2);
+
 	void Construct(int i);
 
+	bool TryConstruct(int i);
+
+	void DispatchTimed(const glm::ivec3& groupsize);
+
+	void DispatchIndirectTimed(GLintptr offset);
+
+	void PushAutotuneTimestamp();
+
+	void UpdateAutotune();
+
+	void AdvanceAutotuneCandidate();
+
+	void FinishAutotune();
+
 	static std::vector<glm::ivec3> ToVec3(const std::vector<glm::ivec2>& in);
 
+	// Tag, path and a hash of the post-processed source, so that variants of one file built with
+	// different defines are tuned separately
+	std::string LocalSizeCacheKey() const;
+
 	struct Data {
 		std::string path;
 		std::string display_text;
@@ -77,6 +153,25 @@ private:
 		std::vector<glm::ivec3> localsizes;
 		std::vector<std::string> localsizes_str;
 		int index = 0;
+
+		struct Autotune {
+			// Timestamps of one frame's dispatches, the queries are kept and reused once resolved
+			struct FrameQueries {
+				int candidate = -1; // measured candidate, -1 while free
+				std::vector<GLQuery> query_pool; // begin/end timestamp pairs
+				size_t used_queries = 0;
+			};
+			bool active = false;
+			bool recording = false; // dispatches of this frame are timed
+			int previous_index = 0;
+			int candidate = 0;
+			int frames = 0; // frames dispatched with the current candidate
+			std::chrono::steady_clock::time_point candidate_begin;
+			std::array<FrameQueries, kAutotuneLatency> frame_queries;
+			int frame_index = 0;
+			std::vector<double> total_ms;
+			std::vector<int> dispatches; // a frame may dispatch the program several times
+		} autotune;
 	};
 	std::unique_ptr<Data> data_;
 };
@@ -7,19 +7,30 @@
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
 
+#include "gl.hpp"
+
 class GLWindow {
 public:
-	GLWindow(const char* name, int width, int height, bool vsync);
+	// In headless mode there is no visible window and no ImGui backend; frames are rendered
+	// into an offscreen framebuffer (EGL surfaceless context when available)
+	GLWindow(const char* name, int width, int height, bool vsync, bool headless = false);
 	virtual ~GLWindow();
 
 	void MainLoop();
 
+	bool headless() const { return headless_; }
+
+	// 0 for the window, the offscreen framebuffer in headless mode
+	GLuint default_framebuffer() const { return offscreen_framebuffer_.id(); }
+
 	std::tuple<int, int> GetWindowSize();
 
 	void ResizeWindow(int width, int height);
 
 	void SetFullScreen(bool is_full_screen);
 
+	void SetVSync(bool vsync);
+
 	void Close();
 
 	void Error(const std::string& msg);
@@ -27,7 +38,11 @@ public:
 	void ScreenShot(const char* path);
 
 protected:
-	GLFWwindow* window;
+	// Profiler frame, local size tuning and shader reloads; every frame loop calls it before
+	// HandleDisplayEvent
+	void BeginFrame();
+
+	GLFWwindow* window = nullptr;
 
 	// ȫʹлʱʱϢ
 	int xpos_{};
@@ -52,6 +67,20 @@ private:
 
 	void CheckError();
 
+	// Returns the GL function loader of the context
+	GLADloadproc CreateHeadlessContext();
+
+	void CreateOffscreenFramebuffer(int width, int height);
+
+	bool headless_;
+	void* egl_display_ = nullptr;
+	void* egl_context_ = nullptr;
+	int offscreen_width_{};
+	int offscreen_height_{};
+	GLFramebuffer offscreen_framebuffer_;
+	GLTexture offscreen_color_;
+	GLTexture offscreen_depth_;
+
 	std::deque<std::string> err_msgs_;
 	bool b_current_frame_error_ = false;
 };
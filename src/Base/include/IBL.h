@@ -13,19 +13,30 @@ public:
 
 	void Precompute(GLuint environment_radiance_texture);
 
+	// Precompute split into steps that can be spread over frames (the environment texture needs its mipmaps).
+	// They write the back SH buffer and prefiltered texture, which become visible on Swap.
+	void ComputeSH(GLuint environment_radiance_texture);
+
+	void Prefilter(GLuint environment_radiance_texture, int first_level, int level_count);
+
+	void Swap() {
+		front_ ^= 1;
+	}
+
 	GLuint env_radiance_sh_buffer() const {
-		return env_radiance_sh_buffer_.id();
+		return env_radiance_sh_buffer_[front_].id();
 	}
 
 	GLuint prefiltered_radiance() const {
-		return prefiltered_radiance_.id();
+		return prefiltered_radiance_[front_].id();
 	}
 
 private:
-	GLBuffer env_radiance_sh_buffer_;
+	int front_ = 0;
+	GLBuffer env_radiance_sh_buffer_[2];
 	GLReloadableProgram env_radiance_sh_program_;
 
 	static constexpr GLenum kPrefilteredRadianceFormat = GL_RGBA16F;
-	GLTexture prefiltered_radiance_;
+	GLTexture prefiltered_radiance_[2];
 	GLReloadableComputeProgram prefilter_radiance_program_;
 };
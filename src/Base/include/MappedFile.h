@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstddef>
+
+// Read-only mapping of a whole file. The mapping is empty if the file can not be opened or mapped.
+class MappedFile {
+public:
+	explicit MappedFile(const char* path);
+	~MappedFile();
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	const void* data() const { return data_; }
+	size_t size() const { return size_; }
+	explicit operator bool() const { return data_ != nullptr; }
+
+private:
+	const void* data_ = nullptr;
+	size_t size_ = 0;
+#ifdef _WIN32
+	void* file_ = nullptr;
+	void* mapping_ = nullptr;
+#endif
+};
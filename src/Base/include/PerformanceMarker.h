@@ -2,6 +2,8 @@
 
 #include <glad/glad.h>
 
+#include "Profiler.h"
+
 #define CONCAT(a, b) CONCAT_INNER(a, b)
 #define CONCAT_INNER(a, b) a ## b
 
@@ -11,8 +13,10 @@ class DebugGroup {
 public:
 	DebugGroup(const char* message) {
 		glPushDebugGroup(GL_DEBUG_SOURCE_APPLICATION, 0, -1, message);
+		Profiler::Instance().Begin(message);
 	}
 	~DebugGroup() {
+		Profiler::Instance().End();
 		glPopDebugGroup();
 	}
 };
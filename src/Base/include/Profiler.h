@@ -0,0 +1,112 @@
+#pragma once
+
+#include <array>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <unordered_map>
+
+#include <glad/glad.h>
+
+#include "Singleton.h"
+
+// Hierarchical GPU/CPU profiler fed by PERF_MARKER scopes.
+// GPU time is measured with GL_TIMESTAMP queries (which, unlike GL_TIME_ELAPSED, can be nested)
+// and read back kFrameLatency frames later, or later still if the GPU has not reached them yet,
+// to avoid stalling the pipeline.
+class Profiler : public Singleton<Profiler> {
+public:
+	friend Singleton<Profiler>;
+
+	static constexpr int kHistorySize = 128;
+
+	struct Stats {
+		float last = 0.0f;
+		float min = 0.0f;
+		float avg = 0.0f;
+		float p99 = 0.0f;
+	};
+
+	struct Scope {
+		std::string path;
+		std::string name;
+		int depth = 0;
+		std::array<float, kHistorySize> gpu_ms{};
+		std::array<float, kHistorySize> cpu_ms{};
+		int count = 0; // valid samples in history
+		int head = 0; // next write position
+
+		Stats GpuStats() const { return ComputeStats(gpu_ms); }
+		Stats CpuStats() const { return ComputeStats(cpu_ms); }
+
+	private:
+		Stats ComputeStats(const std::array<float, kHistorySize>& history) const;
+	};
+
+	bool enable = true;
+
+	// Call once per frame, outside of any scope
+	void NewFrame();
+
+	void Begin(const char* name);
+
+	void End();
+
+	const std::vector<Scope>& scopes() const { return scopes_; }
+
+	// Scope by full path ("Frame/Render/..."), nullptr if it has never been recorded
+	const Scope* FindScope(const std::string& path) const;
+
+	// Path of the innermost open scope, empty outside of any scope or while disabled
+	const std::string& current_path() const { return current_path_; }
+
+	// Frame total GPU time of the outermost scopes
+	float frame_gpu_ms() const { return frame_gpu_ms_; }
+
+	void Reset();
+
+	// Deletes the queries, call before the GL context is destroyed
+	void Shutdown();
+
+	bool WriteCSV(const char* path) const;
+
+	bool WriteJSON(const char* path) const;
+
+	void DrawGUI();
+
+private:
+	Profiler() = default;
+
+	static constexpr int kFrameLatency = 3;
+
+	using Clock = std::chrono::steady_clock;
+
+	struct PendingScope {
+		int scope_index;
+		GLuint begin_query;
+		GLuint end_query;
+		Clock::time_point cpu_begin;
+		float cpu_ms;
+	};
+
+	struct FrameQueries {
+		std::vector<PendingScope> scopes;
+		std::vector<GLuint> query_pool;
+		size_t used_queries = 0;
+
+		GLuint AcquireQuery();
+	};
+
+	// False, leaving frame as it is, if some of its queries are not available yet
+	bool Resolve(FrameQueries& frame);
+
+	std::array<FrameQueries, kFrameLatency> frames_;
+	int frame_index_ = 0;
+	bool frame_enabled_ = true;
+
+	std::vector<Scope> scopes_; // in order of first appearance
+	std::unordered_map<std::string, int> scope_indices_;
+	std::vector<size_t> stack_; // pending scope indices of the current frame
+	std::string current_path_;
+	float frame_gpu_ms_ = 0.0f;
+};
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <filesystem>
+#include <unordered_map>
+
+#include "Singleton.h"
+
+// Expands #include "..." directives (relative to the including file).
+// Every file is parsed once and kept with its expanded text until its modification time changes;
+// an expansion is only rebuilt when the file itself or one of its includes changed.
+// #line directives with a per-file source string number are emitted around every include.
+class ShaderPreprocessor : public Singleton<ShaderPreprocessor> {
+public:
+	friend Singleton<ShaderPreprocessor>;
+
+	// Appends every file involved (normalized, once) to files if not null
+	std::string Expand(const char* path, std::vector<std::string>* files = nullptr);
+
+	// "N: path" lines for the source string numbers referenced by #line directives in src
+	std::string DescribeSourceStrings(const std::string& src);
+
+	// Drops #line directives and blank lines, leaving text that does not depend on source string numbers
+	static std::string StripLineDirectives(const std::string& src);
+
+	void Clear();
+
+	// Compare against the former regex based implementation on every .vert/.frag/.comp under dir
+	void Benchmark(const char* dir, int iterations);
+
+private:
+	ShaderPreprocessor() = default;
+
+	struct File;
+
+	struct Directive {
+		size_t begin; // offset of the #include line
+		size_t end; // offset after the line break
+		int next_line; // line number following the directive
+		std::string path;
+	};
+
+	struct File {
+		std::string path;
+		int id = 0; // source string number
+		std::filesystem::file_time_type mtime{};
+		uint64_t generation = 0; // Expand call in which mtime was last checked
+		std::string content;
+		std::vector<Directive> directives;
+		size_t version_end = 0; // end of a leading #version line, which must stay first
+
+		bool expanded_valid = false;
+		bool visiting = false;
+		uint64_t version = 0; // incremented whenever expanded changes
+		std::string expanded;
+		std::vector<std::pair<File*, uint64_t>> children;
+	};
+
+	File& Update(const std::string& path);
+
+	void Parse(File& file);
+
+	const std::string& ExpandFile(File& file, std::vector<std::string>* files);
+
+	std::mutex mutex_;
+	std::unordered_map<std::string, std::unique_ptr<File>> files_;
+	std::vector<File*> files_by_id_;
+	uint64_t generation_ = 0;
+};
@@ -1,10 +1,116 @@
 #pragma once
 
 #include <string>
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <functional>
+#include <iosfwd>
+#include <thread>
+#include <vector>
 
 void SetCurrentDirToExe();
 
 std::string ReadFile(const char* path);
 
+// Creates the parent directory, lets write fill a temporary file and renames it to path, so that
+// readers (mapping it, or a running instance) and an interrupted write never see a partial file.
+// Returns false, keeping any previous file, if the stream failed.
+bool WriteFileAtomically(const std::filesystem::path& path, const std::function<void(std::ostream&)>& write);
+
+constexpr uint64_t kFnv1aOffsetBasis = 0xcbf29ce484222325ull;
+
+// 64-bit FNV-1a, chainable by passing the previous result as hash
+uint64_t Fnv1a(uint64_t hash, const void* data, size_t size);
+
+// Calls function(i) for i in [0, count) on thread_count threads (0: one per hardware thread),
+// the calling thread included. Indices are handed out one at a time, so the cost may vary.
+template<class Function>
+void ParallelFor(int count, unsigned thread_count, Function function) {
+	if (thread_count == 0)
+		thread_count = std::max(std::thread::hardware_concurrency(), 1u);
+	thread_count = std::min(thread_count, static_cast<unsigned>(std::max(count, 1)));
+
+	std::atomic<int> next{ 0 };
+	auto worker = [&]() {
+		for (int i = next++; i < count; i = next++)
+			function(i);
+	};
+	std::vector<std::thread> threads;
+	for (unsigned i = 1; i < thread_count; ++i)
+		threads.emplace_back(worker);
+	worker();
+	for (auto& thread : threads)
+		thread.join();
+}
+
+// Like ParallelFor, but each thread starts on its own contiguous block of indices and, when that
+// runs out, steals the back half of the largest block left. Neighbouring indices mostly stay on
+// one thread, which suits work with spatial locality such as image tiles. function(i, thread)
+// also gets the index of the calling thread in [0, thread_count).
+template<class Function>
+void ParallelForStealing(int count, unsigned thread_count, Function function) {
+	if (thread_count == 0)
+		thread_count = std::max(std::thread::hardware_concurrency(), 1u);
+	thread_count = std::min(thread_count, static_cast<unsigned>(std::max(count, 1)));
+
+	// [begin, end) packed as end << 32 | begin, so that the owner taking from the front and a
+	// thief taking from the back contend on one compare-exchange
+	struct alignas(64) Block {
+		std::atomic<uint64_t> range;
+	};
+	auto pack = [](uint32_t begin, uint32_t end) { return static_cast<uint64_t>(end) << 32 | begin; };
+	auto begin_of = [](uint64_t range) { return static_cast<uint32_t>(range); };
+	auto end_of = [](uint64_t range) { return static_cast<uint32_t>(range >> 32); };
+
+	std::vector<Block> blocks(thread_count);
+	for (unsigned i = 0; i < thread_count; ++i) {
+		blocks[i].range = pack(static_cast<uint32_t>(static_cast<uint64_t>(count) * i / thread_count),
+			static_cast<uint32_t>(static_cast<uint64_t>(count) * (i + 1) / thread_count));
+	}
+
+	auto worker = [&](unsigned self) {
+		auto& own = blocks[self].range;
+		for (;;) {
+			auto range = own.load();
+			while (begin_of(range) < end_of(range)) {
+				if (own.compare_exchange_weak(range, pack(begin_of(range) + 1, end_of(range)))) {
+					function(static_cast<int>(begin_of(range)), self);
+					range = own.load();
+				}
+			}
+
+			unsigned victim = self;
+			uint32_t largest = 0;
+			for (unsigned i = 0; i < thread_count; ++i) {
+				auto r = blocks[i].range.load();
+				if (end_of(r) > begin_of(r) && end_of(r) - begin_of(r) > largest) {
+					largest = end_of(r) - begin_of(r);
+					victim = i;
+				}
+			}
+			// Only a thief refills its own block, with work it took from a non-empty one, so work
+			// that is not visible here is already owned by a running thread
+			if (largest == 0)
+				return;
+			auto r = blocks[victim].range.load();
+			auto begin = begin_of(r), end = end_of(r);
+			if (begin >= end)
+				continue;
+			auto middle = begin + (end - begin) / 2;
+			if (blocks[victim].range.compare_exchange_strong(r, pack(begin, middle)))
+				own = pack(middle, end);
+		}
+	};
+	std::vector<std::thread> threads;
+	for (unsigned i = 1; i < thread_count; ++i)
+		threads.emplace_back(worker, i);
+	worker(0);
+	for (auto& thread : threads)
+		thread.join();
+}
+
 // 춥thetaͷλphi()㷽YΪϷ
 void FromThetaPhiToDirection(float theta, float phi, float direction[3]);
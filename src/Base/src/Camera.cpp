@@ -19,8 +19,12 @@ glm::mat4 Camera::ProjectionMatrix() const {
 }
 
 void Camera::Rotate(float dPitch, float dYaw) {
-	pitch_ += dPitch;
-	yaw_ += dYaw;
+	SetYawPitch(yaw_ + dYaw, pitch_ + dPitch);
+}
+
+void Camera::SetYawPitch(float yaw, float pitch) {
+	pitch_ = pitch;
+	yaw_ = yaw;
 
 	if (pitch_ > 89.0f)
 		pitch_ = 89.0f;
@@ -1,82 +1,245 @@
 #include "GLProgram.h"
 
 #include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
 #include <array>
 #include <stdexcept>
 #include <vector>
 #include <filesystem>
-#include <regex>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
 
+#include "ShaderPreprocessor.h"
 #include "Utils.h"
 
 namespace {
 
-class Shader {
+// Not exposed by the generated glad loader
+constexpr GLenum kCompletionStatus = 0x91B1; // GL_COMPLETION_STATUS_KHR/ARB
+using PFNMaxShaderCompilerThreads = void (APIENTRYP)(GLuint count);
+
+bool parallel_compile_enable = false;
+thread_local int deferred_link_depth = 0;
+thread_local std::vector<std::string>* include_recorder = nullptr;
+
+const char* ShaderTypeString(GLenum type) {
+#define CASE(NAME) case NAME: return #NAME;
+	switch (type) {
+	CASE(GL_VERTEX_SHADER)
+	CASE(GL_FRAGMENT_SHADER)
+	CASE(GL_COMPUTE_SHADER)
+	default: return "shader";
+	}
+#undef CASE
+}
+
+GLuint CompileShader(GLenum type, const char* src) {
+	auto id = glCreateShader(type);
+	glShaderSource(id, 1, &src, nullptr);
+	glCompileShader(id);
+	return id;
+}
+
+void CheckShader(GLuint id, GLenum type) {
+	GLint success;
+	std::array<char, 1024> info{};
+	glGetShaderiv(id, GL_COMPILE_STATUS, &success);
+	if (!success) {
+		glGetShaderInfoLog(id, static_cast<GLsizei>(info.size()), nullptr, info.data());
+		GLint length = 0;
+		glGetShaderiv(id, GL_SHADER_SOURCE_LENGTH, &length);
+		std::string src(std::max(length, 1), '\0');
+		glGetShaderSource(id, length, nullptr, src.data());
+		auto source_strings = ShaderPreprocessor::Instance().DescribeSourceStrings(src);
+		throw std::runtime_error(std::string("Error while compiling ")
+			+ ShaderTypeString(type) + ":\n" + info.data()
+			+ (source_strings.empty() ? "" : "Source strings:\n" + source_strings));
+	}
+}
+
+void CheckProgram(GLuint program) {
+	GLint success;
+	std::array<char, 1024> info{};
+	glGetProgramiv(program, GL_LINK_STATUS, &success);
+	if (!success) {
+		glGetProgramInfoLog(program, static_cast<GLsizei>(info.size()), NULL, info.data());
+		throw std::runtime_error(std::string("Error while linking program:\n") + info.data());
+	}
+}
+
+// Linked program binaries stored under shader_cache/, keyed by the complete sources
+// (#define header included) and the driver. Stale or foreign binaries are rejected by
+// glProgramBinary and simply recompiled. Every shader edit adds a binary, so only the
+// kMaxEntries most recently used ones are kept.
+class ProgramBinaryCache {
 public:
-	Shader(GLenum type, const char* src, const char* identifier) {
-		id_ = glCreateShader(type);
-		glShaderSource(id_, 1, &src, nullptr);
-		glCompileShader(id_);
+	ProgramBinaryCache(const std::vector<const char*>& sources, bool enable) {
+		enabled_ = enable && Supported();
+		if (!enabled_)
+			return;
+		const auto& driver = DriverString();
+		uint64_t key = Fnv1a(kFnv1aOffsetBasis, driver.data(), driver.size());
+		// Hashed without the driver, so it is an independent check of the sources behind key
+		source_hash_ = kFnv1aOffsetBasis;
+		for (auto src : sources) {
+			auto size = strlen(src);
+			key = Fnv1a(Fnv1a(key, &size, sizeof(size)), src, size);
+			source_hash_ = Fnv1a(Fnv1a(source_hash_, &size, sizeof(size)), src, size);
+		}
+		std::stringstream ss;
+		ss << std::hex << std::setw(16) << std::setfill('0') << key << ".bin";
+		path_ = std::filesystem::path(kDirectory) / ss.str();
+	}
+
+	bool enabled() const { return enabled_; }
 
+	GLuint Load() const {
+		if (!enabled_)
+			return 0;
+		std::ifstream fin(path_, std::ios::binary);
+		if (!fin)
+			return 0;
+		Header header{};
+		fin.read(reinterpret_cast<char*>(&header), sizeof(header));
+		if (!fin || header.magic != kMagic || header.source_hash != source_hash_)
+			return 0;
+		std::string driver(header.driver_length, '\0');
+		std::vector<char> binary(header.binary_length);
+		fin.read(driver.data(), driver.size());
+		fin.read(binary.data(), binary.size());
+		if (!fin || driver != DriverString())
+			return 0;
+
+		auto program = glCreateProgram();
+		glProgramBinary(program, header.format, binary.data(), static_cast<GLsizei>(binary.size()));
 		GLint success;
-		std::array<char, 1024> info{};
-		glGetShaderiv(id_, GL_COMPILE_STATUS, &success);
+		glGetProgramiv(program, GL_LINK_STATUS, &success);
 		if (!success) {
-			glGetShaderInfoLog(id_, static_cast<GLsizei>(info.size()), nullptr, info.data());
-			glDeleteShader(id_);
-			throw std::runtime_error(std::string("Error while compiling ") 
-				+ identifier + ":\n" + info.data());
+			glDeleteProgram(program);
+			return 0;
 		}
+		// Loading bumps the write time, so the oldest binaries are the least recently used
+		fin.close();
+		std::error_code ec;
+		std::filesystem::last_write_time(path_, std::filesystem::file_time_type::clock::now(), ec);
+		return program;
 	}
 
-	~Shader() {
-		if (id_ != 0)
-			glDeleteShader(id_);
-	}
+	void Save(GLuint program) const {
+		if (!enabled_)
+			return;
+		GLint length = 0;
+		glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+		if (length <= 0)
+			return;
+		std::vector<char> binary(length);
+		Header header{};
+		glGetProgramBinary(program, length, &length, &header.format, binary.data());
+		const auto& driver = DriverString();
+		header.magic = kMagic;
+		header.source_hash = source_hash_;
+		header.driver_length = static_cast<uint32_t>(driver.size());
+		header.binary_length = static_cast<uint32_t>(length);
 
-	GLuint Id()const { return id_; }
+		auto written = WriteFileAtomically(path_, [&](std::ostream& fout) {
+			fout.write(reinterpret_cast<const char*>(&header), sizeof(header));
+			fout.write(driver.data(), driver.size());
+			fout.write(binary.data(), length);
+		});
+		if (written)
+			Evict();
+	}
 
 private:
-	GLuint id_ = 0;
+	static constexpr char kDirectory[] = "shader_cache";
+	static constexpr size_t kMaxEntries = 512;
+	static constexpr uint32_t kMagic = 0x31425053; // "SPB1"
+
+	struct Header {
+		uint32_t magic;
+		GLenum format;
+		uint64_t source_hash;
+		uint32_t driver_length;
+		uint32_t binary_length;
+	};
+
+	void Evict() const {
+		namespace fs = std::filesystem;
+		std::vector<std::pair<fs::file_time_type, fs::path>> entries;
+		std::error_code ec;
+		for (fs::directory_iterator itr(kDirectory, ec), end; !ec && itr != end; itr.increment(ec)) {
+			if (itr->path().extension() != ".bin")
+				continue;
+			auto time = itr->last_write_time(ec);
+			if (ec)
+				return;
+			entries.emplace_back(time, itr->path());
+		}
+		if (entries.size() <= kMaxEntries)
+			return;
+		auto excess = entries.size() - kMaxEntries;
+		std::partial_sort(entries.begin(), entries.begin() + excess, entries.end(),
+			[](const auto& a, const auto& b) { return a.first < b.first; });
+		for (size_t i = 0; i < excess; ++i) {
+			if (entries[i].second != path_)
+				fs::remove(entries[i].second, ec);
+		}
+	}
+
+	static bool Supported() {
+		static const bool supported = [] {
+			GLint formats = 0;
+			glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+			return formats > 0;
+		}();
+		return supported;
+	}
+
+	static const std::string& DriverString() {
+		static const std::string driver = [] {
+			std::stringstream ss;
+			ss << glGetString(GL_VENDOR) << " | " << glGetString(GL_RENDERER) << " | " << glGetString(GL_VERSION);
+			return ss.str();
+		}();
+		return driver;
+	}
+
+	bool enabled_ = false;
+	uint64_t source_hash_ = 0;
+	std::filesystem::path path_;
 };
 
-GLuint CreateProgram(const std::vector<GLuint>& shaders) {
-	auto program = glCreateProgram();
-	for (auto shader : shaders)
-		glAttachShader(program, shader);
-	glLinkProgram(program);
+}
 
-	GLint success;
-	std::array<char, 1024> info{};
-	glGetProgramiv(program, GL_LINK_STATUS, &success);
-	if (!success) {
-		glGetProgramInfoLog(program, static_cast<GLsizei>(info.size()), NULL, info.data());
-		glDeleteProgram(program);
-		throw std::runtime_error(std::string("Error while linking program:\n") + info.data());
+struct GLProgram::Pending {
+	std::vector<std::pair<GLenum, GLuint>> shaders;
+	ProgramBinaryCache cache;
+
+	~Pending() {
+		for (auto [type, id] : shaders)
+			glDeleteShader(id);
 	}
-	return program;
+};
+
+GLProgram::DeferredLinkScope::DeferredLinkScope() {
+	++deferred_link_depth;
 }
 
+GLProgram::DeferredLinkScope::~DeferredLinkScope() {
+	--deferred_link_depth;
 }
 
+GLProgram::GLProgram() = default;
+
 GLProgram::GLProgram(const char* vertex_src, const char* fragment_src, GLuint external_fragment_shader) {
-#define STR(NAME) #NAME
-	Shader vertex(GL_VERTEX_SHADER, vertex_src, STR(GL_VERTEX_SHADER));
-	Shader fragment(GL_FRAGMENT_SHADER, fragment_src, STR(GL_FRAGMENT_SHADER));
-	
-	std::vector shaders{ vertex.Id(), fragment.Id() };
-	if (external_fragment_shader != 0)
-		shaders.push_back(external_fragment_shader);
-	id_ = CreateProgram(shaders);
+	Build({ { GL_VERTEX_SHADER, vertex_src }, { GL_FRAGMENT_SHADER, fragment_src } }, external_fragment_shader);
 }
 
 GLProgram::GLProgram(const char* compute_src, GLuint external_compute_shader) {
-	Shader compute(GL_COMPUTE_SHADER, compute_src, STR(GL_COMPUTE_SHADER));
-
-	std::vector shaders{ compute.Id() };
-	if (external_compute_shader != 0)
-		shaders.push_back(external_compute_shader);
-	id_ = CreateProgram(shaders);
+	Build({ { GL_COMPUTE_SHADER, compute_src } }, external_compute_shader);
 }
 
 GLProgram::~GLProgram() {
@@ -84,6 +247,79 @@ GLProgram::~GLProgram() {
 		glDeleteProgram(id_);
 }
 
+void GLProgram::Build(std::initializer_list<std::pair<GLenum, const char*>> stages, GLuint external_shader) {
+	std::vector<const char*> sources;
+	for (const auto& [type, src] : stages)
+		sources.push_back(src);
+	ProgramBinaryCache cache(sources, external_shader == 0);
+	if ((id_ = cache.Load()) != 0)
+		return;
+
+	// Compile and link without querying any status so that the driver can work in parallel
+	auto pending = std::make_unique<Pending>(Pending{ {}, std::move(cache) });
+	id_ = glCreateProgram();
+	for (const auto& [type, src] : stages) {
+		auto shader = CompileShader(type, src);
+		pending->shaders.emplace_back(type, shader);
+		glAttachShader(id_, shader);
+	}
+	if (external_shader != 0)
+		glAttachShader(id_, external_shader);
+	if (pending->cache.enabled())
+		glProgramParameteri(id_, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+	glLinkProgram(id_);
+	pending_ = std::move(pending);
+
+	if (deferred_link_depth == 0)
+		Finish();
+}
+
+bool GLProgram::Ready() const {
+	if (!pending_ || !parallel_compile_enable)
+		return true;
+	GLint completed = GL_FALSE;
+	glGetProgramiv(id_, kCompletionStatus, &completed);
+	return completed == GL_TRUE;
+}
+
+void GLProgram::Finish() {
+	if (!pending_)
+		return;
+	auto pending = std::move(pending_);
+	try {
+		for (auto [type, id] : pending->shaders)
+			CheckShader(id, type);
+		CheckProgram(id_);
+	}
+	catch (...) {
+		glDeleteProgram(id_);
+		id_ = 0;
+		throw;
+	}
+	pending->cache.Save(id_);
+}
+
+void GLProgram::EnableParallelCompile(GLADloadproc load) {
+	GLint count = 0;
+	glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+	for (GLint i = 0; i < count; ++i) {
+		auto name = reinterpret_cast<const char*>(glGetStringi(GL_EXTENSIONS, i));
+		const char* function = nullptr;
+		if (strcmp(name, "GL_KHR_parallel_shader_compile") == 0)
+			function = "glMaxShaderCompilerThreadsKHR";
+		else if (strcmp(name, "GL_ARB_parallel_shader_compile") == 0)
+			function = "glMaxShaderCompilerThreadsARB";
+		if (function == nullptr)
+			continue;
+		auto max_shader_compiler_threads = reinterpret_cast<PFNMaxShaderCompilerThreads>(load(function));
+		if (max_shader_compiler_threads == nullptr)
+			continue;
+		max_shader_compiler_threads(0xFFFFFFFF); // Implementation chosen
+		parallel_compile_enable = true;
+		return;
+	}
+}
+
 std::string Replace(std::string src, const std::string& from, const std::string& to) {
 	for (;;) {
 		auto index = src.find(from);
@@ -95,17 +331,14 @@ std::string Replace(std::string src, const std::string& from, const std::string&
 }
 
 std::string ReadWithPreprocessor(const char* filepath) {
-	namespace fs = std::filesystem;
-	fs::path fpath = filepath;
-	auto dir = fpath.parent_path();
-	auto src = ReadFile(filepath);
-	std::regex pattern("#include[ \t]*\"(.+)\"");
-	std::smatch match;
-	while (std::regex_search(src, match, pattern)) {
-		auto header_path = dir / match.str(1);
-		auto header = ReadWithPreprocessor(header_path.string().c_str());
-		src = src.substr(0, match.position()) + header 
-			+ src.substr(match.position() + match.length(), src.size() - match.position() - match.length());
-	}
-	return src;
+	return ShaderPreprocessor::Instance().Expand(filepath, include_recorder);
+}
+
+ScopedIncludeRecorder::ScopedIncludeRecorder(std::vector<std::string>& files)
+	: previous_(include_recorder) {
+	include_recorder = &files;
+}
+
+ScopedIncludeRecorder::~ScopedIncludeRecorder() {
+	include_recorder = previous_;
 }
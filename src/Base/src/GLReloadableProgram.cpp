@@ -1,25 +1,243 @@
 #include "GLReloadableProgram.h"
 
 #include <iostream>
+#include <fstream>
 #include <sstream>
 #include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <iomanip>
+#include <unordered_map>
+#include <unordered_set>
 
 #include <imgui.h>
+#include <rapidjson/document.h>
+#include <rapidjson/prettywriter.h>
 
-void GLReloadableProgram::Reload() {
+#include "Utils.h"
+
+namespace {
+
+// Modification times of every shader file read by a GLReloadableProgram
+class ShaderFileWatcher {
+public:
+	void Watch(const std::vector<std::string>& files) {
+		for (const auto& file : files) {
+			if (mtimes_.find(file) == mtimes_.end())
+				mtimes_[file] = LastWriteTime(file);
+		}
+	}
+
+	// Files modified since the last poll (polled at most every kPollInterval)
+	std::unordered_set<std::string> Poll() {
+		std::unordered_set<std::string> changed;
+		auto now = Clock::now();
+		if (now - last_poll_ < kPollInterval)
+			return changed;
+		last_poll_ = now;
+		for (auto& [file, mtime] : mtimes_) {
+			auto current = LastWriteTime(file);
+			if (current != mtime) {
+				mtime = current;
+				changed.insert(file);
+			}
+		}
+		return changed;
+	}
+
+private:
+	using Clock = std::chrono::steady_clock;
+	static constexpr auto kPollInterval = std::chrono::milliseconds(500);
+
+	static std::filesystem::file_time_type LastWriteTime(const std::string& file) {
+		std::error_code ec;
+		auto time = std::filesystem::last_write_time(file, ec);
+		return ec ? std::filesystem::file_time_type::min() : time;
+	}
+
+	std::unordered_map<std::string, std::filesystem::file_time_type> mtimes_;
+	Clock::time_point last_poll_{};
+};
+
+ShaderFileWatcher shader_file_watcher;
+
+// Autotuned local sizes, one object per GPU/driver so that a shared bin folder stays valid on every machine
+constexpr char kLocalSizeCachePath[] = "local_size_cache.json";
+
+std::string DeviceKey() {
+	std::stringstream ss;
+	ss << glGetString(GL_VENDOR) << " | " << glGetString(GL_RENDERER) << " | " << glGetString(GL_VERSION);
+	return ss.str();
+}
+
+rapidjson::Document ReadLocalSizeCache() {
+	rapidjson::Document d;
+	std::ifstream fin(kLocalSizeCachePath);
+	if (fin) {
+		auto str = std::string(std::istreambuf_iterator<char>{fin}, {});
+		d.Parse(str.c_str());
+	}
+	if (d.HasParseError() || !d.IsObject())
+		d.SetObject();
+	return d;
+}
+
+std::unordered_map<std::string, glm::ivec3>& DeviceLocalSizeCache() {
+	static auto cache = [] {
+		std::unordered_map<std::string, glm::ivec3> cache;
+		auto d = ReadLocalSizeCache();
+		auto device = d.FindMember(DeviceKey().c_str());
+		if (device != d.MemberEnd() && device->value.IsObject()) {
+			for (const auto& entry : device->value.GetObject()) {
+				const auto& v = entry.value;
+				if (v.IsArray() && v.Size() == 3 && v[0].IsInt() && v[1].IsInt() && v[2].IsInt())
+					cache[entry.name.GetString()] = glm::ivec3(v[0].GetInt(), v[1].GetInt(), v[2].GetInt());
+			}
+		}
+		return cache;
+	}();
+	return cache;
+}
+
+// Program part of a local size cache key, without the source hash
+std::string LocalSizeCacheProgram(const std::string& key) {
+	return key.substr(0, key.rfind(" | "));
+}
+
+// live_keys are the keys of every existing program. Other keys of these programs were left by
+// older versions of their sources and are dropped; programs not loaded in this run are kept.
+void StoreLocalSize(const std::string& key, const glm::ivec3& localsize, const std::unordered_set<std::string>& live_keys) {
+	std::unordered_set<std::string> live_programs;
+	for (const auto& live_key : live_keys)
+		live_programs.insert(LocalSizeCacheProgram(live_key));
+	auto stale = [&](const std::string& name) {
+		return live_keys.count(name) == 0 && live_programs.count(LocalSizeCacheProgram(name)) != 0;
+	};
+
+	auto& cache = DeviceLocalSizeCache();
+	for (auto itr = cache.begin(); itr != cache.end();) {
+		if (stale(itr->first))
+			itr = cache.erase(itr);
+		else
+			++itr;
+	}
+	cache[key] = localsize;
+
+	// Re-read the file so that entries of other devices are preserved
+	auto d = ReadLocalSizeCache();
+	auto& allocator = d.GetAllocator();
+	auto device_key = DeviceKey();
+	auto device = d.FindMember(device_key.c_str());
+	if (device == d.MemberEnd() || !device->value.IsObject()) {
+		d.RemoveMember(device_key.c_str());
+		d.AddMember(rapidjson::Value(device_key.c_str(), allocator), rapidjson::Value(rapidjson::kObjectType), allocator);
+		device = d.FindMember(device_key.c_str());
+	}
+	for (auto itr = device->value.MemberBegin(); itr != device->value.MemberEnd();) {
+		std::string name = itr->name.GetString();
+		if (name == key || stale(name))
+			itr = device->value.EraseMember(itr);
+		else
+			++itr;
+	}
+	rapidjson::Value value(rapidjson::kArrayType);
+	value.PushBack(localsize.x, allocator).PushBack(localsize.y, allocator).PushBack(localsize.z, allocator);
+	device->value.AddMember(rapidjson::Value(key.c_str(), allocator), value, allocator);
+
+	rapidjson::StringBuffer sb;
+	rapidjson::PrettyWriter<rapidjson::StringBuffer> writer(sb);
+	d.Accept(writer);
+	std::ofstream fout(kLocalSizeCachePath);
+	if (fout)
+		fout << sb.GetString();
+}
+
+}
+
+void GLReloadableProgram::Reload(bool async) {
+	Reload(async, ++last_reload_batch_);
+}
+
+void GLReloadableProgram::Reload(bool async, uint64_t batch) {
 	if (loader_) {
+		reload_batch_ = batch;
+		// Recorded even if compiling fails, so that fixing the file triggers a reload
+		dependencies_.clear();
+		ScopedIncludeRecorder recorder(dependencies_);
 		try {
-			program_ = loader_();
+			if (async) {
+				GLProgram::DeferredLinkScope deferred;
+				pending_program_ = loader_();
+			}
+			else {
+				program_ = loader_();
+				pending_program_ = GLProgram();
+			}
 		}
 		catch (std::exception& e) {
 			std::cout << e.what() << std::endl;
+			if (async) {
+				pending_program_ = GLProgram();
+				failed_reload_batches_.insert(batch);
+			}
 		}
+		shader_file_watcher.Watch(dependencies_);
+	}
+}
+
+void GLReloadableProgram::ReloadAll(bool async) {
+	auto batch = ++last_reload_batch_;
+	for (auto p : GetObjects()) {
+		p->Reload(async, batch);
 	}
 }
 
-void GLReloadableProgram::ReloadAll() {
+void GLReloadableProgram::UpdateAll() {
+	std::unordered_map<uint64_t, std::vector<GLReloadableProgram*>> batches;
+	for (auto p : GetObjects()) {
+		if (p->reloading())
+			batches[p->reload_batch_].push_back(p);
+	}
+	for (auto& [batch, programs] : batches) {
+		auto ready = std::all_of(programs.begin(), programs.end(),
+			[](const GLReloadableProgram* p) { return p->pending_program_.Ready(); });
+		if (!ready)
+			continue;
+		bool succeeded = failed_reload_batches_.count(batch) == 0;
+		for (auto p : programs) {
+			try {
+				p->pending_program_.Finish();
+			}
+			catch (std::exception& e) {
+				std::cout << e.what() << std::endl;
+				succeeded = false;
+			}
+		}
+		for (auto p : programs) {
+			if (succeeded)
+				p->program_ = std::move(p->pending_program_);
+			p->pending_program_ = GLProgram();
+		}
+	}
+	for (auto itr = failed_reload_batches_.begin(); itr != failed_reload_batches_.end();) {
+		auto pending = batches.find(*itr);
+		if (pending == batches.end() || !pending->second.front()->reloading())
+			itr = failed_reload_batches_.erase(itr);
+		else
+			++itr;
+	}
+
+	if (!watch_enable)
+		return;
+	auto changed = shader_file_watcher.Poll();
+	if (changed.empty())
+		return;
+	auto batch = ++last_reload_batch_;
 	for (auto p : GetObjects()) {
-		p->Reload();
+		auto depends = std::any_of(p->dependencies_.begin(), p->dependencies_.end(),
+			[&changed](const std::string& file) { return changed.count(file) != 0; });
+		if (depends)
+			p->Reload(true, batch);
 	}
 }
 
@@ -37,7 +255,32 @@ GLReloadableComputeProgram::GLReloadableComputeProgram(std::string path, std::ve
 	}
 	data_->programs.resize(localsizes.size());
 	data_->localsizes = std::move(localsizes);
-	Construct(0);
+
+	const auto& cache = DeviceLocalSizeCache();
+	auto cached = cache.find(LocalSizeCacheKey());
+	if (cached != cache.end()) {
+		auto itr = std::find(data_->localsizes.begin(), data_->localsizes.end(), cached->second);
+		if (itr != data_->localsizes.end())
+			data_->index = static_cast<int>(itr - data_->localsizes.begin());
+	}
+	Construct(data_->index);
+
+	if (cached == cache.end() && data_->localsizes.size() > 1 && autotune_on_construction)
+		Autotune();
+}
+
+std::string GLReloadableComputeProgram::LocalSizeCacheKey() const {
+	// Without the LOCAL_SIZE defines, which are the same for every variant
+	std::string source;
+	try {
+		source = data_->post_process(ReadWithPreprocessor(data_->path.c_str()));
+	}
+	catch (std::exception&) {
+	}
+	std::stringstream ss;
+	ss << data_->display_text << " | " << std::hex << std::setw(16) << std::setfill('0')
+		<< Fnv1a(kFnv1aOffsetBasis, source.data(), source.size());
+	return ss.str();
 }
 
 void GLReloadableComputeProgram::DrawGUI() {
@@ -56,6 +299,13 @@ void GLReloadableComputeProgram::DrawGUI() {
 		ImGui::EndCombo();
 	}
 	ImGui::PopItemWidth();
+	ImGui::SameLine();
+	ImGui::PushID(this);
+	if (data_->autotune.active)
+		ImGui::TextDisabled("Tuning %d/%d", data_->autotune.candidate + 1, static_cast<int>(data_->localsizes.size()));
+	else if (ImGui::SmallButton("Tune"))
+		Autotune();
+	ImGui::PopID();
 	if (data_->programs[data_->index].id() == 0) {
 		Construct(data_->index);
 	}
@@ -72,11 +322,42 @@ void GLReloadableComputeProgram::DrawGUIAll() {
 		[](const GLReloadableComputeProgram* lhs, const GLReloadableComputeProgram* rhs) {
 			return lhs->data_->display_text < rhs->data_->display_text;
 		});
+	if (ImGui::Button("Autotune All"))
+		AutotuneAll();
 	for (auto p : objects) {
 		p->DrawGUI();
 	}
 }
 
+void GLReloadableComputeProgram::Autotune() {
+	if (!data_ || data_->autotune.active) return;
+	auto& tune = data_->autotune;
+	tune.active = true;
+	tune.previous_index = data_->index;
+	tune.candidate = -1;
+	for (auto& frame : tune.frame_queries) {
+		frame.candidate = -1;
+		frame.used_queries = 0;
+	}
+	tune.frame_index = 0;
+	tune.total_ms.assign(data_->localsizes.size(), 0.0);
+	tune.dispatches.assign(data_->localsizes.size(), 0);
+	AdvanceAutotuneCandidate();
+	tune.recording = tune.candidate < static_cast<int>(data_->localsizes.size());
+}
+
+void GLReloadableComputeProgram::AutotuneAll() {
+	for (auto p : GetObjects()) {
+		p->Autotune();
+	}
+}
+
+void GLReloadableComputeProgram::UpdateAutotuneAll() {
+	for (auto p : GetObjects()) {
+		p->UpdateAutotune();
+	}
+}
+
 void GLReloadableComputeProgram::Construct(int i) {
 	data_->programs[i] = ([p = data_.get(), i]{
 		const auto & localsize = p->localsizes[i];
@@ -89,6 +370,123 @@ void GLReloadableComputeProgram::Construct(int i) {
 	});
 }
 
+bool GLReloadableComputeProgram::TryConstruct(int i) {
+	if (data_->programs[i].id() == 0)
+		Construct(i);
+	return data_->programs[i].id() != 0;
+}
+
+void GLReloadableComputeProgram::DispatchTimed(const glm::ivec3& groupsize) {
+	PushAutotuneTimestamp();
+	glDispatchCompute(groupsize.x, groupsize.y, groupsize.z);
+	PushAutotuneTimestamp();
+}
+
+void GLReloadableComputeProgram::DispatchIndirectTimed(GLintptr offset) {
+	PushAutotuneTimestamp();
+	glDispatchComputeIndirect(offset);
+	PushAutotuneTimestamp();
+}
+
+void GLReloadableComputeProgram::PushAutotuneTimestamp() {
+	auto& tune = data_->autotune;
+	auto& frame = tune.frame_queries[tune.frame_index];
+	if (frame.used_queries == frame.query_pool.size())
+		frame.query_pool.emplace_back().Create(GL_TIMESTAMP);
+	glQueryCounter(frame.query_pool[frame.used_queries++].id(), GL_TIMESTAMP);
+}
+
+void GLReloadableComputeProgram::UpdateAutotune() {
+	if (!data_ || !data_->autotune.active) return;
+	auto& tune = data_->autotune;
+	auto candidate_count = static_cast<int>(data_->localsizes.size());
+
+	// Frames in which the program was not dispatched are not counted and keep their slot
+	auto& current = tune.frame_queries[tune.frame_index];
+	if (tune.recording && current.used_queries != 0) {
+		if (tune.frames >= kAutotuneWarmupFrames) {
+			current.candidate = tune.candidate;
+			tune.frame_index = (tune.frame_index + 1) % kAutotuneLatency;
+		}
+		else {
+			current.used_queries = 0;
+		}
+		if (++tune.frames == kAutotuneWarmupFrames + kAutotuneMeasureFrames)
+			AdvanceAutotuneCandidate();
+	}
+	if (tune.candidate < candidate_count && std::chrono::steady_clock::now() - tune.candidate_begin > kAutotuneCandidateTimeout)
+		AdvanceAutotuneCandidate();
+
+	bool in_flight = false;
+	for (auto& frame : tune.frame_queries) {
+		if (frame.candidate == -1)
+			continue;
+		GLint available = GL_FALSE;
+		glGetQueryObjectiv(frame.query_pool[frame.used_queries - 1].id(), GL_QUERY_RESULT_AVAILABLE, &available);
+		if (!available) {
+			in_flight = true;
+			continue;
+		}
+		double ms = 0.0;
+		for (size_t i = 0; i < frame.used_queries; i += 2) {
+			GLuint64 begin, end;
+			glGetQueryObjectui64v(frame.query_pool[i].id(), GL_QUERY_RESULT, &begin);
+			glGetQueryObjectui64v(frame.query_pool[i + 1].id(), GL_QUERY_RESULT, &end);
+			ms += static_cast<double>(end - begin) * 1e-6;
+		}
+		tune.total_ms[frame.candidate] += ms;
+		tune.dispatches[frame.candidate] += static_cast<int>(frame.used_queries / 2);
+		frame.candidate = -1;
+		frame.used_queries = 0;
+	}
+
+	// A slot still in flight leaves this frame untimed rather than stalling on its results
+	tune.recording = tune.candidate < candidate_count && tune.frame_queries[tune.frame_index].candidate == -1;
+	if (tune.candidate == candidate_count && !in_flight)
+		FinishAutotune();
+}
+
+void GLReloadableComputeProgram::AdvanceAutotuneCandidate() {
+	auto& tune = data_->autotune;
+	auto candidate_count = static_cast<int>(data_->localsizes.size());
+	tune.frames = 0;
+	// Candidates are compiled lazily; those that fail (e.g. exceeding the invocation limit) are skipped
+	do {
+		++tune.candidate;
+	} while (tune.candidate < candidate_count && !TryConstruct(tune.candidate));
+	tune.candidate_begin = std::chrono::steady_clock::now(); // after the compile
+	if (tune.candidate < candidate_count)
+		data_->index = tune.candidate;
+	else
+		data_->index = tune.previous_index;
+}
+
+void GLReloadableComputeProgram::FinishAutotune() {
+	auto& tune = data_->autotune;
+	tune.active = false;
+	tune.recording = false;
+	int best = -1;
+	double best_ms = 0.0;
+	for (int i = 0; i < static_cast<int>(data_->localsizes.size()); ++i) {
+		if (tune.dispatches[i] == 0)
+			continue;
+		// Per dispatch, so that frames dispatching the program more often do not weigh more
+		auto ms = tune.total_ms[i] / tune.dispatches[i];
+		if (best == -1 || ms < best_ms) {
+			best = i;
+			best_ms = ms;
+		}
+	}
+	if (best == -1)
+		return;
+	data_->index = best;
+	std::unordered_set<std::string> live_keys;
+	for (auto p : GetObjects())
+		live_keys.insert(p->LocalSizeCacheKey());
+	StoreLocalSize(LocalSizeCacheKey(), data_->localsizes[best], live_keys);
+	std::cout << data_->display_text << ": local size " << data_->localsizes_str[best] << " (" << best_ms << " ms per dispatch)" << std::endl;
+}
+
 std::vector<glm::ivec3> GLReloadableComputeProgram::ToVec3(const std::vector<glm::ivec2>& in) {
 	std::vector<glm::ivec3> out;
 	out.reserve(in.size());
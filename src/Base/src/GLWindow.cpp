@@ -5,39 +5,60 @@
 #include <stdexcept>
 #include <memory>
 
+#if __has_include(<EGL/egl.h>)
+#define HAS_INCLUDE_EGL 1
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#else
+#define HAS_INCLUDE_EGL 0
+#endif
+
 #include <imgui.h>
 #include <imgui_impl_glfw.h>
 #include <imgui_impl_opengl3.h>
 
 #include "PerformanceMarker.h"
+#include "GLReloadableProgram.h"
 #include "Utils.h"
 #include "ImageWriter.h"
 
-GLWindow::GLWindow(const char* name, int width, int height, bool vsync) {
+GLWindow::GLWindow(const char* name, int width, int height, bool vsync, bool headless)
+    : headless_(headless) {
     SetCurrentDirToExe(); // лexeĿ¼
 
-    glfwInit();
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 6);
-    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+    GLADloadproc loader = nullptr;
+    if (headless_ && HAS_INCLUDE_EGL) {
+        loader = CreateHeadlessContext();
+    }
+    else {
+        glfwInit();
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 6);
+        glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
 #if _DEBUG
-    glfwWindowHint(GLFW_OPENGL_DEBUG_CONTEXT, GLFW_TRUE);
+        glfwWindowHint(GLFW_OPENGL_DEBUG_CONTEXT, GLFW_TRUE);
 #endif
+        // Without EGL, headless mode falls back to a hidden window
+        if (headless_)
+            glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
 
-    window = glfwCreateWindow(width, height, name, NULL, NULL);
-    if (window == NULL)
-    {
-        throw std::runtime_error("Failed to create GLFW window");
-        glfwTerminate();
+        window = glfwCreateWindow(width, height, name, NULL, NULL);
+        if (window == NULL)
+        {
+            glfwTerminate();
+            throw std::runtime_error("Failed to create GLFW window");
+        }
+        glfwMakeContextCurrent(window);
+        if (!vsync || headless_)
+            glfwSwapInterval(0);
+        loader = (GLADloadproc)glfwGetProcAddress;
     }
-    glfwMakeContextCurrent(window);
-    if (!vsync)
-        glfwSwapInterval(0);
 
-    if (!gladLoadGLLoader((GLADloadproc)glfwGetProcAddress))
+    if (!gladLoadGLLoader(loader))
     {
         throw std::runtime_error("Failed to initialize GLAD");
     }
+    GLProgram::EnableParallelCompile(loader);
 
 #if _DEBUG
     // https://learnopengl.com/In-Practice/Debugging
@@ -123,6 +144,17 @@ GLWindow::GLWindow(const char* name, int width, int height, bool vsync) {
     }
 #endif
 
+    if (headless_) {
+        // Cached local sizes are still used, but nothing is tuned behind the measured frames
+        GLReloadableComputeProgram::autotune_on_construction = false;
+        // ImGui is not drawn, but some code still reads ImGui::GetIO() (e.g. DeltaTime)
+        IMGUI_CHECKVERSION();
+        ImGui::CreateContext();
+        ImGui::GetIO().DisplaySize = ImVec2(static_cast<float>(width), static_cast<float>(height));
+        CreateOffscreenFramebuffer(width, height);
+        return;
+    }
+
     glfwSetWindowUserPointer(window, this);
     glfwSetFramebufferSizeCallback(window,
         [](GLFWwindow* window, int width, int height) {
@@ -173,15 +205,104 @@ GLWindow::GLWindow(const char* name, int width, int height, bool vsync) {
 }
 
 GLWindow::~GLWindow() {
-    ImGui_ImplOpenGL3_Shutdown();
-    ImGui_ImplGlfw_Shutdown();
-    ImGui::DestroyContext();
+    Profiler::Instance().Shutdown();
+    if (headless_) {
+        ImGui::DestroyContext();
+        offscreen_framebuffer_ = GLFramebuffer();
+        offscreen_color_ = GLTexture();
+        offscreen_depth_ = GLTexture();
+#if HAS_INCLUDE_EGL
+        auto display = static_cast<EGLDisplay>(egl_display_);
+        eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+        eglDestroyContext(display, static_cast<EGLContext>(egl_context_));
+        eglTerminate(display);
+        return;
+#endif
+    }
+    else {
+        ImGui_ImplOpenGL3_Shutdown();
+        ImGui_ImplGlfw_Shutdown();
+        ImGui::DestroyContext();
+    }
 
     glfwTerminate();
 }
 
+GLADloadproc GLWindow::CreateHeadlessContext() {
+#if HAS_INCLUDE_EGL
+    // Prefer Mesa's surfaceless platform so that no X/Wayland display is required
+    EGLDisplay display = EGL_NO_DISPLAY;
+    auto get_platform_display = reinterpret_cast<PFNEGLGETPLATFORMDISPLAYEXTPROC>(
+        eglGetProcAddress("eglGetPlatformDisplayEXT"));
+    if (get_platform_display)
+        display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+    if (display == EGL_NO_DISPLAY)
+        display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    if (display == EGL_NO_DISPLAY || !eglInitialize(display, nullptr, nullptr))
+        throw std::runtime_error("Failed to initialize EGL display");
+    if (!eglBindAPI(EGL_OPENGL_API))
+        throw std::runtime_error("Failed to bind OpenGL API");
+
+    const EGLint config_attribs[] = {
+        EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_NONE
+    };
+    EGLConfig config;
+    EGLint num_configs = 0;
+    if (!eglChooseConfig(display, config_attribs, &config, 1, &num_configs) || num_configs == 0)
+        throw std::runtime_error("Failed to choose EGL config");
+
+    const EGLint context_attribs[] = {
+        EGL_CONTEXT_MAJOR_VERSION, 4,
+        EGL_CONTEXT_MINOR_VERSION, 6,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+#if _DEBUG
+        EGL_CONTEXT_OPENGL_DEBUG, EGL_TRUE,
+#endif
+        EGL_NONE
+    };
+    auto context = eglCreateContext(display, config, EGL_NO_CONTEXT, context_attribs);
+    if (context == EGL_NO_CONTEXT)
+        throw std::runtime_error("Failed to create EGL context (OpenGL 4.6 core)");
+    if (!eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context))
+        throw std::runtime_error("Failed to make EGL context current");
+    egl_display_ = display;
+    egl_context_ = context;
+    return (GLADloadproc)eglGetProcAddress;
+#else
+    return nullptr;
+#endif
+}
+
+void GLWindow::CreateOffscreenFramebuffer(int width, int height) {
+    offscreen_width_ = width;
+    offscreen_height_ = height;
+
+    offscreen_color_ = GLTexture();
+    offscreen_color_.Create(GL_TEXTURE_2D);
+    glTextureStorage2D(offscreen_color_.id(), 1, GL_RGBA8, width, height);
+    offscreen_depth_ = GLTexture();
+    offscreen_depth_.Create(GL_TEXTURE_2D);
+    glTextureStorage2D(offscreen_depth_.id(), 1, GL_DEPTH24_STENCIL8, width, height);
+
+    offscreen_framebuffer_ = GLFramebuffer();
+    offscreen_framebuffer_.Create();
+    glNamedFramebufferTexture(offscreen_framebuffer_.id(), GL_COLOR_ATTACHMENT0, offscreen_color_.id(), 0);
+    glNamedFramebufferTexture(offscreen_framebuffer_.id(), GL_DEPTH_STENCIL_ATTACHMENT, offscreen_depth_.id(), 0);
+    if (glCheckNamedFramebufferStatus(offscreen_framebuffer_.id(), GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        throw std::runtime_error("Offscreen framebuffer is not complete");
+}
+
+void GLWindow::BeginFrame() {
+    Profiler::Instance().NewFrame();
+    GLReloadableComputeProgram::UpdateAutotuneAll();
+    GLReloadableProgram::UpdateAll();
+}
+
 void GLWindow::MainLoop() {
     while (!glfwWindowShouldClose(window)) {
+        BeginFrame();
         {
             PERF_MARKER("Frame")
             HandleDisplayEvent();
@@ -210,16 +331,26 @@ void GLWindow::MainLoop() {
 }
 
 std::tuple<int, int>  GLWindow::GetWindowSize() {
+    if (headless_)
+        return { offscreen_width_, offscreen_height_ };
     int width, height;
     glfwGetWindowSize(window, &width, &height);
     return { width, height };
 }
 
 void GLWindow::ResizeWindow(int width, int height) {
+    if (headless_) {
+        CreateOffscreenFramebuffer(width, height);
+        ImGui::GetIO().DisplaySize = ImVec2(static_cast<float>(width), static_cast<float>(height));
+        HandleReshapeEvent(width, height);
+        return;
+    }
     glfwSetWindowSize(window, width, height);
 }
 
 void GLWindow::SetFullScreen(bool is_full_screen) {
+    if (headless_)
+        return;
     if (is_full_screen) {
         glfwGetWindowPos(window, &xpos_, &ypos_);
         glfwGetWindowSize(window, &width_, &height_);
@@ -232,8 +363,14 @@ void GLWindow::SetFullScreen(bool is_full_screen) {
     }
 }
 
+void GLWindow::SetVSync(bool vsync) {
+    if (window)
+        glfwSwapInterval(vsync && !headless_ ? 1 : 0);
+}
+
 void GLWindow::Close() {
-    glfwSetWindowShouldClose(window, true);
+    if (window)
+        glfwSetWindowShouldClose(window, true);
 }
 
 void GLWindow::Error(const std::string& msg) {
@@ -247,6 +384,8 @@ void GLWindow::Error(const std::string& msg) {
 void GLWindow::ScreenShot(const char* path) {
     auto [width, height] = GetWindowSize();
     auto pixels = std::make_unique<std::byte[]>(static_cast<size_t>(width) * height * 3);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, default_framebuffer());
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
     glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, pixels.get());
     stbi_write_png(path, width, height, 3, pixels.get(), width * 3);
 }
@@ -1,5 +1,7 @@
 #include "IBL.h"
 
+#include <algorithm>
+
 #include "Samplers.h"
 #include "PerformanceMarker.h"
 
@@ -9,8 +11,10 @@ IBL::IBL() {
         return GLProgram(src.c_str());
     };
 
-    env_radiance_sh_buffer_.Create();
-    glNamedBufferStorage(env_radiance_sh_buffer_.id(), sizeof(glm::vec4) * 9, NULL, GL_DYNAMIC_STORAGE_BIT);
+    for (auto& buffer : env_radiance_sh_buffer_) {
+        buffer.Create();
+        glNamedBufferStorage(buffer.id(), sizeof(glm::vec4) * 9, NULL, GL_DYNAMIC_STORAGE_BIT);
+    }
 
     prefilter_radiance_program_ = {
         "../shaders/Base/PrefilterRadiance.comp",
@@ -18,28 +22,38 @@ IBL::IBL() {
         [](const std::string& src) { return std::string("#version 460\n") + src; }
     };
 
-    prefiltered_radiance_.Create(GL_TEXTURE_CUBE_MAP);
-    glTextureStorage2D(prefiltered_radiance_.id(), kRoughnessCount, kPrefilteredRadianceFormat, kPrefilteredRadianceResolution, kPrefilteredRadianceResolution);
+    for (auto& texture : prefiltered_radiance_) {
+        texture.Create(GL_TEXTURE_CUBE_MAP);
+        glTextureStorage2D(texture.id(), kRoughnessCount, kPrefilteredRadianceFormat, kPrefilteredRadianceResolution, kPrefilteredRadianceResolution);
+    }
 }
 
 void IBL::Precompute(GLuint environment_radiance_texture) {
+    ComputeSH(environment_radiance_texture);
+    Prefilter(environment_radiance_texture, 0, kRoughnessCount);
+    Swap();
+}
+
+void IBL::ComputeSH(GLuint environment_radiance_texture) {
+    PERF_MARKER("Environment Radiance SH")
     GLBindTextures({ environment_radiance_texture });
     GLBindSamplers({ Samplers::GetAnisotropySampler(Samplers::Wrap::CLAMP_TO_EDGE) });
-    {
-        PERF_MARKER("Environment Radiance SH")
-        glUseProgram(env_radiance_sh_program_.id());
-        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, env_radiance_sh_buffer_.id());
-        glDispatchCompute(9, 1, 1);
-    }
-    {
-        PERF_MARKER("Prefilter Radiance")
-        glUseProgram(prefilter_radiance_program_.id());
-        for (int i = 0, w = kPrefilteredRadianceResolution; i < kRoughnessCount; ++i, w >>= 1) {
-            glBindImageTexture(0, prefiltered_radiance_.id(), i, GL_TRUE, 0, GL_WRITE_ONLY, kPrefilteredRadianceFormat);
-            glUniform1f(0, float(i) / float(kRoughnessCount - 1));
-            prefilter_radiance_program_.Dispatch({ w, w, 6 });
-        }
-    }
+    glUseProgram(env_radiance_sh_program_.id());
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, env_radiance_sh_buffer_[front_ ^ 1].id());
+    glDispatchCompute(9, 1, 1);
+    glMemoryBarrier(GL_UNIFORM_BARRIER_BIT);
+}
 
-    glMemoryBarrier(GL_UNIFORM_BARRIER_BIT | GL_TEXTURE_FETCH_BARRIER_BIT);
+void IBL::Prefilter(GLuint environment_radiance_texture, int first_level, int level_count) {
+    PERF_MARKER("Prefilter Radiance")
+    GLBindTextures({ environment_radiance_texture });
+    GLBindSamplers({ Samplers::GetAnisotropySampler(Samplers::Wrap::CLAMP_TO_EDGE) });
+    glUseProgram(prefilter_radiance_program_.id());
+    auto end_level = std::min(first_level + level_count, kRoughnessCount);
+    for (int i = first_level; i < end_level; ++i) {
+        glBindImageTexture(0, prefiltered_radiance_[front_ ^ 1].id(), i, GL_TRUE, 0, GL_WRITE_ONLY, kPrefilteredRadianceFormat);
+        glUniform1f(0, float(i) / float(kRoughnessCount - 1));
+        prefilter_radiance_program_.Dispatch({ kPrefilteredRadianceResolution >> i, kPrefilteredRadianceResolution >> i, 6 });
+    }
+    glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
 }
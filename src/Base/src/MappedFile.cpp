@@ -0,0 +1,63 @@
+#include "MappedFile.h"
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+
+MappedFile::MappedFile(const char* path) {
+	file_ = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file_ == INVALID_HANDLE_VALUE) {
+		file_ = nullptr;
+		return;
+	}
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file_, &size) || size.QuadPart == 0)
+		return;
+	mapping_ = CreateFileMappingA(file_, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (mapping_ == nullptr)
+		return;
+	data_ = MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0);
+	if (data_ != nullptr)
+		size_ = static_cast<size_t>(size.QuadPart);
+}
+
+MappedFile::~MappedFile() {
+	if (data_ != nullptr)
+		UnmapViewOfFile(data_);
+	if (mapping_ != nullptr)
+		CloseHandle(mapping_);
+	if (file_ != nullptr)
+		CloseHandle(file_);
+}
+
+#else
+
+MappedFile::MappedFile(const char* path) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return;
+	struct stat st;
+	if (fstat(fd, &st) == 0 && st.st_size > 0) {
+		void* data = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data != MAP_FAILED) {
+			data_ = data;
+			size_ = static_cast<size_t>(st.st_size);
+		}
+	}
+	// The mapping stays valid after the descriptor is closed
+	close(fd);
+}
+
+MappedFile::~MappedFile() {
+	if (data_ != nullptr)
+		munmap(const_cast<void*>(data_), size_);
+}
+
+#endif
@@ -0,0 +1,226 @@
+#include "Profiler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+
+#include <imgui.h>
+#include <rapidjson/prettywriter.h>
+
+Profiler::Stats Profiler::Scope::ComputeStats(const std::array<float, kHistorySize>& history) const {
+	Stats stats;
+	if (count == 0)
+		return stats;
+	std::array<float, kHistorySize> sorted;
+	std::copy(history.begin(), history.begin() + count, sorted.begin());
+	std::sort(sorted.begin(), sorted.begin() + count);
+	float sum = 0.0f;
+	for (int i = 0; i < count; ++i)
+		sum += sorted[i];
+	stats.last = history[(head + kHistorySize - 1) % kHistorySize];
+	stats.min = sorted[0];
+	stats.avg = sum / static_cast<float>(count);
+	stats.p99 = sorted[std::max(0, static_cast<int>(std::ceil(0.99f * static_cast<float>(count))) - 1)];
+	return stats;
+}
+
+GLuint Profiler::FrameQueries::AcquireQuery() {
+	if (used_queries == query_pool.size()) {
+		GLuint id;
+		glCreateQueries(GL_TIMESTAMP, 1, &id);
+		query_pool.push_back(id);
+	}
+	return query_pool[used_queries++];
+}
+
+void Profiler::NewFrame() {
+	if (!stack_.empty())
+		return;
+	frame_index_ = (frame_index_ + 1) % kFrameLatency;
+	// A frame still in flight keeps its queries and this one goes unrecorded
+	frame_enabled_ = Resolve(frames_[frame_index_]) && enable;
+}
+
+void Profiler::Begin(const char* name) {
+	if (!frame_enabled_)
+		return;
+	auto path = current_path_.empty() ? std::string(name) : current_path_ + "/" + name;
+	auto [itr, inserted] = scope_indices_.try_emplace(path, static_cast<int>(scopes_.size()));
+	if (inserted) {
+		Scope scope;
+		scope.path = path;
+		scope.name = name;
+		scope.depth = static_cast<int>(stack_.size());
+		scopes_.push_back(std::move(scope));
+	}
+
+	auto& frame = frames_[frame_index_];
+	PendingScope pending{ itr->second, frame.AcquireQuery(), 0, Clock::now(), 0.0f };
+	glQueryCounter(pending.begin_query, GL_TIMESTAMP);
+	stack_.push_back(frame.scopes.size());
+	frame.scopes.push_back(pending);
+	current_path_ = std::move(path);
+}
+
+void Profiler::End() {
+	if (!frame_enabled_ || stack_.empty())
+		return;
+	auto& frame = frames_[frame_index_];
+	auto& pending = frame.scopes[stack_.back()];
+	pending.end_query = frame.AcquireQuery();
+	glQueryCounter(pending.end_query, GL_TIMESTAMP);
+	pending.cpu_ms = std::chrono::duration<float, std::milli>(Clock::now() - pending.cpu_begin).count();
+
+	stack_.pop_back();
+	current_path_ = stack_.empty() ? std::string() : scopes_[frame.scopes[stack_.back()].scope_index].path;
+}
+
+bool Profiler::Resolve(FrameQueries& frame) {
+	for (const auto& pending : frame.scopes) {
+		if (pending.end_query == 0)
+			continue;
+		GLuint available = GL_FALSE;
+		glGetQueryObjectuiv(pending.end_query, GL_QUERY_RESULT_AVAILABLE, &available);
+		if (!available)
+			return false;
+	}
+
+	float frame_gpu_ms = 0.0f;
+	for (const auto& pending : frame.scopes) {
+		if (pending.end_query == 0)
+			continue;
+		GLuint64 begin, end;
+		// The end timestamp is available, so is the begin one before it
+		glGetQueryObjectui64v(pending.begin_query, GL_QUERY_RESULT, &begin);
+		glGetQueryObjectui64v(pending.end_query, GL_QUERY_RESULT, &end);
+		auto gpu_ms = static_cast<float>(static_cast<double>(end - begin) * 1e-6);
+
+		auto& scope = scopes_[pending.scope_index];
+		scope.gpu_ms[scope.head] = gpu_ms;
+		scope.cpu_ms[scope.head] = pending.cpu_ms;
+		scope.head = (scope.head + 1) % kHistorySize;
+		scope.count = std::min(scope.count + 1, kHistorySize);
+		if (scope.depth == 0)
+			frame_gpu_ms += gpu_ms;
+	}
+	if (!frame.scopes.empty())
+		frame_gpu_ms_ = frame_gpu_ms;
+	frame.scopes.clear();
+	frame.used_queries = 0;
+	return true;
+}
+
+const Profiler::Scope* Profiler::FindScope(const std::string& path) const {
+	auto itr = scope_indices_.find(path);
+	return itr == scope_indices_.end() ? nullptr : &scopes_[itr->second];
+}
+
+void Profiler::Reset() {
+	for (auto& scope : scopes_) {
+		scope.count = 0;
+		scope.head = 0;
+	}
+}
+
+void Profiler::Shutdown() {
+	for (auto& frame : frames_) {
+		if (!frame.query_pool.empty())
+			glDeleteQueries(static_cast<GLsizei>(frame.query_pool.size()), frame.query_pool.data());
+		frame.query_pool.clear();
+		frame.scopes.clear();
+		frame.used_queries = 0;
+	}
+	stack_.clear();
+	current_path_.clear();
+	frame_enabled_ = false;
+}
+
+bool Profiler::WriteCSV(const char* path) const {
+	std::ofstream fout(path);
+	if (!fout)
+		return false;
+	fout << "scope,depth,samples,gpu_last_ms,gpu_min_ms,gpu_avg_ms,gpu_p99_ms,cpu_last_ms,cpu_min_ms,cpu_avg_ms,cpu_p99_ms\n";
+	fout << std::fixed << std::setprecision(4);
+	for (const auto& scope : scopes_) {
+		auto gpu = scope.GpuStats();
+		auto cpu = scope.CpuStats();
+		fout << "\"" << scope.path << "\"," << scope.depth << "," << scope.count << ","
+			<< gpu.last << "," << gpu.min << "," << gpu.avg << "," << gpu.p99 << ","
+			<< cpu.last << "," << cpu.min << "," << cpu.avg << "," << cpu.p99 << "\n";
+	}
+	return static_cast<bool>(fout);
+}
+
+bool Profiler::WriteJSON(const char* path) const {
+	rapidjson::StringBuffer sb;
+	rapidjson::PrettyWriter<rapidjson::StringBuffer> writer(sb);
+	auto write_stats = [&writer](const char* key, const Stats& stats) {
+		writer.String(key);
+		writer.StartObject();
+		writer.String("last"); writer.Double(stats.last);
+		writer.String("min"); writer.Double(stats.min);
+		writer.String("avg"); writer.Double(stats.avg);
+		writer.String("p99"); writer.Double(stats.p99);
+		writer.EndObject();
+	};
+	writer.StartArray();
+	for (const auto& scope : scopes_) {
+		writer.StartObject();
+		writer.String("scope"); writer.String(scope.path.c_str());
+		writer.String("depth"); writer.Int(scope.depth);
+		writer.String("samples"); writer.Int(scope.count);
+		write_stats("gpu_ms", scope.GpuStats());
+		write_stats("cpu_ms", scope.CpuStats());
+		writer.EndObject();
+	}
+	writer.EndArray();
+	std::ofstream fout(path);
+	if (!fout)
+		return false;
+	fout << sb.GetString();
+	return static_cast<bool>(fout);
+}
+
+void Profiler::DrawGUI() {
+	ImGui::Checkbox("Enable", &enable);
+	ImGui::SameLine();
+	if (ImGui::Button("Reset"))
+		Reset();
+	ImGui::SameLine();
+	if (ImGui::Button("Dump CSV"))
+		WriteCSV("profiler.csv");
+	ImGui::SameLine();
+	if (ImGui::Button("Dump JSON"))
+		WriteJSON("profiler.json");
+	ImGui::Text("GPU Frame: %.3f ms", frame_gpu_ms_);
+
+	auto flags = ImGuiTableFlags_Borders | ImGuiTableFlags_RowBg | ImGuiTableFlags_Resizable | ImGuiTableFlags_ScrollY;
+	if (ImGui::BeginTable("Scopes", 6, flags)) {
+		ImGui::TableSetupScrollFreeze(0, 1);
+		ImGui::TableSetupColumn("Scope");
+		ImGui::TableSetupColumn("GPU Avg");
+		ImGui::TableSetupColumn("GPU Min");
+		ImGui::TableSetupColumn("GPU P99");
+		ImGui::TableSetupColumn("CPU Avg");
+		ImGui::TableSetupColumn("CPU P99");
+		ImGui::TableHeadersRow();
+		for (const auto& scope : scopes_) {
+			auto gpu = scope.GpuStats();
+			auto cpu = scope.CpuStats();
+			ImGui::TableNextRow();
+			ImGui::TableNextColumn();
+			ImGui::Indent(10.0f * scope.depth + 1.0f);
+			ImGui::TextUnformatted(scope.name.c_str());
+			if (ImGui::IsItemHovered())
+				ImGui::SetTooltip("%s", scope.path.c_str());
+			ImGui::Unindent(10.0f * scope.depth + 1.0f);
+			ImGui::TableNextColumn(); ImGui::Text("%.3f", gpu.avg);
+			ImGui::TableNextColumn(); ImGui::Text("%.3f", gpu.min);
+			ImGui::TableNextColumn(); ImGui::Text("%.3f", gpu.p99);
+			ImGui::TableNextColumn(); ImGui::Text("%.3f", cpu.avg);
+			ImGui::TableNextColumn(); ImGui::Text("%.3f", cpu.p99);
+		}
+		ImGui::EndTable();
+	}
+}
@@ -0,0 +1,238 @@
+#include "ShaderPreprocessor.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <iostream>
+#include <regex>
+
+#include "Utils.h"
+
+namespace {
+
+bool IsBlank(char c) {
+	return c == ' ' || c == '\t';
+}
+
+bool StartsWith(const std::string& str, size_t pos, const char* prefix) {
+	return str.compare(pos, strlen(prefix), prefix) == 0;
+}
+
+std::string Normalize(const std::filesystem::path& path) {
+	return path.lexically_normal().generic_string();
+}
+
+// Former implementation, kept as a baseline for Benchmark
+std::string ExpandWithRegex(const char* filepath) {
+	namespace fs = std::filesystem;
+	fs::path fpath = filepath;
+	auto dir = fpath.parent_path();
+	auto src = ReadFile(filepath);
+	std::regex pattern("#include[ \t]*\"(.+)\"");
+	std::smatch match;
+	while (std::regex_search(src, match, pattern)) {
+		auto header_path = dir / match.str(1);
+		auto header = ExpandWithRegex(header_path.string().c_str());
+		src = src.substr(0, match.position()) + header
+			+ src.substr(match.position() + match.length(), src.size() - match.position() - match.length());
+	}
+	return src;
+}
+
+}
+
+std::string ShaderPreprocessor::Expand(const char* path, std::vector<std::string>* files) {
+	std::lock_guard lock(mutex_);
+	++generation_;
+	return ExpandFile(Update(Normalize(path)), files);
+}
+
+std::string ShaderPreprocessor::StripLineDirectives(const std::string& src) {
+	std::string out;
+	out.reserve(src.size());
+	for (size_t begin = 0; begin < src.size();) {
+		auto end = src.find('\n', begin);
+		end = end == std::string::npos ? src.size() : end + 1;
+		auto blank = src.find_first_not_of(" \t\r\n", begin) >= end;
+		if (!blank && !StartsWith(src, begin, "#line "))
+			out.append(src, begin, end - begin);
+		begin = end;
+	}
+	if (!out.empty() && out.back() != '\n')
+		out += '\n';
+	return out;
+}
+
+std::string ShaderPreprocessor::DescribeSourceStrings(const std::string& src) {
+	std::lock_guard lock(mutex_);
+	std::vector<int> ids;
+	for (auto pos = src.find("#line "); pos != std::string::npos; pos = src.find("#line ", pos + 1)) {
+		auto space = src.find(' ', pos + 6);
+		if (space == std::string::npos)
+			break;
+		auto id = atoi(src.c_str() + space + 1);
+		if (std::find(ids.begin(), ids.end(), id) == ids.end())
+			ids.push_back(id);
+	}
+	std::sort(ids.begin(), ids.end());
+	std::string description;
+	for (auto id : ids) {
+		if (id <= 0 || id > static_cast<int>(files_by_id_.size()))
+			continue;
+		description += std::to_string(id) + ": " + files_by_id_[id - 1]->path + "\n";
+	}
+	return description;
+}
+
+void ShaderPreprocessor::Clear() {
+	std::lock_guard lock(mutex_);
+	// Ids stay assigned so that sources expanded before remain describable
+	for (auto& [path, file] : files_) {
+		file->generation = 0;
+		file->mtime = {};
+		file->expanded_valid = false;
+	}
+}
+
+void ShaderPreprocessor::Benchmark(const char* dir, int iterations) {
+	namespace fs = std::filesystem;
+	using Clock = std::chrono::steady_clock;
+	iterations = std::max(iterations, 1);
+	std::vector<std::string> roots;
+	for (const auto& entry : fs::recursive_directory_iterator(dir)) {
+		auto ext = entry.path().extension();
+		if (ext == ".vert" || ext == ".frag" || ext == ".comp")
+			roots.push_back(entry.path().generic_string());
+	}
+	auto time_ms = [&roots](int n, auto&& expand) {
+		auto begin = Clock::now();
+		size_t bytes = 0;
+		for (int i = 0; i < n; ++i)
+			for (const auto& root : roots)
+				bytes += expand(root.c_str()).size();
+		auto ms = std::chrono::duration<double, std::milli>(Clock::now() - begin).count();
+		return std::make_pair(ms / n, bytes / n);
+	};
+
+	size_t mismatches = 0;
+	for (const auto& root : roots) {
+		if (StripLineDirectives(ExpandWithRegex(root.c_str())) != StripLineDirectives(Expand(root.c_str()))) {
+			std::cout << "Output differs: " << root << std::endl;
+			++mismatches;
+		}
+	}
+
+	auto [regex_ms, regex_bytes] = time_ms(iterations, ExpandWithRegex);
+	Clear();
+	auto [cold_ms, cold_bytes] = time_ms(1, [this](const char* path) { return Expand(path); });
+	auto [warm_ms, warm_bytes] = time_ms(iterations, [this](const char* path) { return Expand(path); });
+	std::cout << roots.size() << " shaders, " << mismatches << " mismatches\n"
+		<< "regex:       " << regex_ms << " ms (" << regex_bytes << " bytes)\n"
+		<< "incremental: " << cold_ms << " ms cold, " << warm_ms << " ms warm (" << warm_bytes << " bytes)" << std::endl;
+}
+
+ShaderPreprocessor::File& ShaderPreprocessor::Update(const std::string& path) {
+	auto& file = files_[path];
+	if (!file) {
+		file = std::make_unique<File>();
+		file->path = path;
+		files_by_id_.push_back(file.get());
+		file->id = static_cast<int>(files_by_id_.size()); // 0 is left for text before the first #line
+	}
+	if (file->generation == generation_)
+		return *file;
+
+	std::error_code ec;
+	auto mtime = std::filesystem::last_write_time(path, ec);
+	if (ec || mtime != file->mtime || file->generation == 0) {
+		file->content = ReadFile(path.c_str());
+		file->mtime = ec ? std::filesystem::file_time_type{} : mtime;
+		file->expanded_valid = false;
+		Parse(*file);
+	}
+	file->generation = generation_;
+	return *file;
+}
+
+void ShaderPreprocessor::Parse(File& file) {
+	const auto& src = file.content;
+	auto dir = std::filesystem::path(file.path).parent_path();
+	file.directives.clear();
+	file.version_end = 0;
+
+	int line = 1;
+	for (size_t line_begin = 0; line_begin < src.size(); ++line) {
+		auto line_end = src.find('\n', line_begin);
+		auto next = line_end == std::string::npos ? src.size() : line_end + 1;
+		auto pos = line_begin;
+		while (pos < next && IsBlank(src[pos]))
+			++pos;
+
+		if (line == 1 && StartsWith(src, pos, "#version")) {
+			file.version_end = next;
+		}
+		else if (StartsWith(src, pos, "#include")) {
+			pos += 8;
+			while (pos < next && IsBlank(src[pos]))
+				++pos;
+			auto close = pos < next && src[pos] == '"' ? src.find('"', pos + 1) : std::string::npos;
+			if (close == std::string::npos || close >= next)
+				throw std::runtime_error(file.path + "(" + std::to_string(line) + "): invalid #include");
+			auto name = src.substr(pos + 1, close - pos - 1);
+			file.directives.push_back({ line_begin, next, line + 1, Normalize(dir / name) });
+		}
+		line_begin = next;
+	}
+}
+
+const std::string& ShaderPreprocessor::ExpandFile(File& file, std::vector<std::string>* files) {
+	if (files && std::find(files->begin(), files->end(), file.path) == files->end())
+		files->push_back(file.path);
+	if (file.visiting)
+		throw std::runtime_error("Recursive #include of \"" + file.path + "\"");
+
+	struct VisitGuard {
+		File& file;
+		VisitGuard(File& f) : file(f) { file.visiting = true; }
+		~VisitGuard() { file.visiting = false; }
+	} guard(file);
+
+	std::vector<std::pair<File*, uint64_t>> children;
+	children.reserve(file.directives.size());
+	for (const auto& directive : file.directives) {
+		auto& child = Update(directive.path);
+		ExpandFile(child, files);
+		children.emplace_back(&child, child.version);
+	}
+	if (file.expanded_valid && children == file.children)
+		return file.expanded;
+
+	const auto& src = file.content;
+	auto id = std::to_string(file.id);
+	size_t size = src.size() + 32;
+	for (const auto& [child, version] : children)
+		size += child->expanded.size() + 32;
+	std::string out;
+	out.reserve(size);
+	out.append(src, 0, file.version_end);
+	out += "#line " + std::to_string(file.version_end == 0 ? 1 : 2) + " " + id + "\n";
+	auto pos = file.version_end;
+	for (size_t i = 0; i < file.directives.size(); ++i) {
+		const auto& directive = file.directives[i];
+		out.append(src, pos, directive.begin - pos);
+		out += children[i].first->expanded;
+		out += "#line " + std::to_string(directive.next_line) + " " + id + "\n";
+		pos = directive.end;
+	}
+	out.append(src, pos, std::string::npos);
+	if (!out.empty() && out.back() != '\n')
+		out += '\n';
+
+	file.expanded = std::move(out);
+	file.children = std::move(children);
+	file.expanded_valid = true;
+	++file.version;
+	return file.expanded;
+}
@@ -1,15 +1,22 @@
 #include "Utils.h"
 #include <iostream>
 #include <fstream>
-#include <Windows.h>
 #include <filesystem>
+#include <cmath>
+#ifdef _WIN32
+#include <Windows.h>
+#endif
 
 // Ŀ¼ΪexeĿ¼VSʱĬĿ¼ProjectĿ¼
 void SetCurrentDirToExe() {
+#ifdef _WIN32
 	static TCHAR buffer[MAX_PATH];
 	memset(buffer, 0, sizeof(buffer));
 	GetModuleFileName(0, buffer, MAX_PATH);
 	auto path = std::filesystem::path(buffer).parent_path();
+#else
+	auto path = std::filesystem::read_symlink("/proc/self/exe").parent_path();
+#endif
 	std::filesystem::current_path(path);
 }
 
@@ -20,6 +27,40 @@ std::string ReadFile(const char* path) {
 	return std::string(std::istreambuf_iterator<char>{fin}, {});
 }
 
+bool WriteFileAtomically(const std::filesystem::path& path, const std::function<void(std::ostream&)>& write) {
+	std::error_code ec;
+	auto directory = path.parent_path();
+	if (!directory.empty())
+		std::filesystem::create_directories(directory, ec);
+	auto temp_path = path;
+	temp_path += ".tmp";
+	bool written;
+	{
+		std::ofstream fout(temp_path, std::ios::binary);
+		if (!fout)
+			return false;
+		write(fout);
+		fout.close();
+		written = !fout.fail();
+	}
+	if (written)
+		std::filesystem::rename(temp_path, path, ec);
+	if (!written || ec) {
+		std::filesystem::remove(temp_path, ec);
+		return false;
+	}
+	return true;
+}
+
+uint64_t Fnv1a(uint64_t hash, const void* data, size_t size) {
+	auto bytes = static_cast<const unsigned char*>(data);
+	for (size_t i = 0; i < size; ++i) {
+		hash ^= bytes[i];
+		hash *= 0x100000001b3ull;
+	}
+	return hash;
+}
+
 void FromThetaPhiToDirection(float theta, float phi, float direction[3]) {
 	float cos_theta = cos(theta);
 	float sin_theta = sin(theta);
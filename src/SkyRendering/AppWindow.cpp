@@ -1,9 +1,11 @@
 #include "AppWindow.h"
 
+#include <algorithm>
 #include <iostream>
 #include <fstream>
 #include <sstream>
 #include <filesystem>
+#include <chrono>
 
 #include <magic_enum.hpp>
 #include <imgui.h>
@@ -14,9 +16,13 @@
 #include "ImGuiExt.h"
 #include "PerformanceMarker.h"
 #include "ScreenRectangle.h"
+#include "CameraTrack.h"
+#include "AtmosphereReference.h"
+#include "CloudPathTracerReference.h"
+#include "PathTracingCheckpoint.h"
 
-AppWindow::AppWindow(const char* config_path, int width, int height)
-    : GLWindow((std::string("SkyRendering (") + config_path + ")").c_str(), width, height, false) {
+AppWindow::AppWindow(const char* config_path, int width, int height, bool headless)
+    : GLWindow((std::string("SkyRendering (") + config_path + ")").c_str(), width, height, false, headless) {
     auto aspect = static_cast<float>(width) / height;
     camera_ = Camera(glm::vec3(0.0f, 1.0f, -1.0f), 180.0f, 0.0f, aspect);
     camera_.zNear = 3e-1f;
@@ -49,7 +55,7 @@ void AppWindow::Init(const char* config_path) {
 
     SetFullScreen(full_screen_);
     Samplers::SetAnisotropyEnable(anisotropy_enable_);
-    glfwSwapInterval(vsync_enable_ ? 1 : 0);
+    SetVSync(vsync_enable_);
     atmosphere_renderer_ = std::make_unique<AtmosphereRenderer>(atmosphere_render_init_parameters_);
 
     mesh_objects_.clear();
@@ -141,7 +147,159 @@ void AppWindow::HandleDisplayEvent() {
     volumetric_cloud_.Update(camera_, earth_, *atmosphere_renderer_);
     moon_->set_model(earth_.moon_model());
     Render();
-    ProcessInput();
+    if (!headless())
+        ProcessInput();
+}
+
+void AppWindow::RenderSequence(const char* track_path, int frame_count, const char* output_dir) {
+    CameraTrack track;
+    track.Load(track_path);
+    if (frame_count <= 0)
+        frame_count = static_cast<int>(std::floor(track.duration() * track.frame_rate)) + 1;
+
+    namespace fs = std::filesystem;
+    bool write_frames = output_dir != nullptr && output_dir[0] != '\0';
+    if (write_frames)
+        fs::create_directories(output_dir);
+
+    auto [width, height] = GetWindowSize();
+    camera_.set_aspect(static_cast<float>(width) / height);
+    auto dt = 1.0f / track.frame_rate;
+    ImGui::GetIO().DeltaTime = dt;
+
+    using Clock = std::chrono::steady_clock;
+    Clock::duration render_time{};
+    for (int i = 0; i < frame_count; ++i) {
+        auto keyframe = track.Sample(track.keyframes.front().time + i * dt);
+        camera_.set_position(keyframe.camera_position);
+        camera_.SetYawPitch(keyframe.camera_yaw, keyframe.camera_pitch);
+        atmosphere_render_parameters_.sun_direction_theta = keyframe.sun_direction_theta;
+        atmosphere_render_parameters_.sun_direction_phi = keyframe.sun_direction_phi;
+
+        auto begin = Clock::now();
+        BeginFrame();
+        HandleDisplayEvent();
+        glFinish();
+        render_time += Clock::now() - begin;
+
+        if (write_frames) {
+            char filename[32];
+            snprintf(filename, std::size(filename), "frame_%05d.png", i);
+            ScreenShot((fs::path(output_dir) / filename).string().c_str());
+        }
+    }
+    auto total_ms = std::chrono::duration<double, std::milli>(render_time).count();
+    std::cout << frame_count << " frames (" << width << "x" << height << ") rendered in " << total_ms << " ms, "
+        << total_ms / frame_count << " ms/frame" << std::endl;
+
+    if (write_frames) {
+        Profiler::Instance().WriteCSV((fs::path(output_dir) / "profiler.csv").string().c_str());
+        Profiler::Instance().WriteJSON((fs::path(output_dir) / "profiler.json").string().c_str());
+    }
+}
+
+bool AppWindow::ValidateAtmosphereLuts(std::ostream& os) {
+    // Transmittance only differs by transcendental function precision. Multiscattering also
+    // samples the transmittance LUT, where the hardware filter weights are low precision.
+    constexpr float kTransmittanceTolerance = 1e-3f;
+    constexpr float kMultiscatteringTolerance = 1e-2f;
+
+    earth_.Update();
+    auto data = ComputeAtmosphereBufferData(earth_.parameters);
+    auto gpu_transmittance = ReadAtmosphereLut(earth_.atmosphere().transmittance_texture());
+    auto gpu_multiscattering = ReadAtmosphereLut(earth_.atmosphere().multiscattering_texture());
+
+    using Clock = std::chrono::steady_clock;
+    auto begin = Clock::now();
+    auto cpu_transmittance = ComputeTransmittanceLutReference(data);
+    auto middle = Clock::now();
+    auto cpu_multiscattering = ComputeMultiscatteringLutReference(data, gpu_transmittance);
+    auto end = Clock::now();
+
+    auto transmittance = CompareAtmosphereLuts(gpu_transmittance, cpu_transmittance);
+    auto multiscattering = CompareAtmosphereLuts(gpu_multiscattering, cpu_multiscattering);
+    bool passed = transmittance.max_rel_error <= kTransmittanceTolerance
+        && multiscattering.max_rel_error <= kMultiscatteringTolerance;
+
+    os << "Transmittance: max abs " << transmittance.max_abs_error << ", max rel " << transmittance.max_rel_error
+        << " (CPU " << std::chrono::duration<double, std::milli>(middle - begin).count() << " ms)\n"
+        << "Multiscattering: max abs " << multiscattering.max_abs_error << ", max rel " << multiscattering.max_rel_error
+        << " (CPU " << std::chrono::duration<double, std::milli>(end - middle).count() << " ms)\n"
+        << (passed ? "PASSED" : "FAILED") << std::endl;
+    return passed;
+}
+
+void AppWindow::WarmUpEnvironment() {
+    // The environment map is refreshed over several frames
+    constexpr int kMaxWarmupFrames = 256;
+    auto [width, height] = GetWindowSize();
+    camera_.set_aspect(static_cast<float>(width) / height);
+    for (int i = 0; i < kMaxWarmupFrames; ++i) {
+        BeginFrame();
+        HandleDisplayEvent();
+        if (!atmosphere_renderer_->environment_updating())
+            break;
+    }
+    glFinish();
+}
+
+void AppWindow::RenderPathTracing(const PathTracingJob& job) {
+    WarmUpEnvironment();
+    if (job.resume) {
+        auto checkpoint = PathTracingCheckpoint::Load(job.resume);
+        if (job.max_samples > 0)
+            checkpoint.init.sample_cap = job.max_samples;
+        volumetric_cloud_.ResumePathTracing(checkpoint);
+    }
+    else {
+        auto init = volumetric_cloud_.path_tracing_init_param();
+        if (job.sqrt_tile_count > 0)
+            init.sqrt_tile_count = job.sqrt_tile_count;
+        init.tile_begin = job.tile_begin;
+        init.tile_end = job.tile_end;
+        init.first_sample = job.first_sample;
+        init.sample_cap = job.max_samples;
+        volumetric_cloud_.set_path_tracing_init_param(init);
+        volumetric_cloud_.StartPathTracing();
+    }
+    const auto& path_tracing = *volumetric_cloud_.path_tracing();
+    auto first_frame = path_tracing.frame_cnt();
+
+    using Clock = std::chrono::steady_clock;
+    auto begin = Clock::now();
+    auto renders = std::max(job.frame_count, 1) * path_tracing.tile_count();
+    for (int i = 0; i < renders && !path_tracing.converged(); ++i) {
+        BeginFrame();
+        HandleDisplayEvent();
+        if (job.checkpoint_interval > 0 && (i + 1) % (job.checkpoint_interval * path_tracing.tile_count()) == 0 && i + 1 < renders)
+            path_tracing.Checkpoint().Save(job.output);
+    }
+    auto checkpoint = path_tracing.Checkpoint();
+    auto total_ms = std::chrono::duration<double, std::milli>(Clock::now() - begin).count();
+    checkpoint.Save(job.output);
+
+    double sample_count = 0.0;
+    for (const auto& statistics : checkpoint.statistics)
+        sample_count += statistics.z;
+    std::cout << checkpoint.frame_cnt - first_frame << " frames (tiles " << checkpoint.init.tile_begin << "-"
+        << (checkpoint.init.tile_end > 0 ? checkpoint.init.tile_end : checkpoint.init.sqrt_tile_count * checkpoint.init.sqrt_tile_count)
+        << ") traced in " << total_ms << " ms, " << sample_count / checkpoint.statistics.size() << " samples/pixel"
+        << (path_tracing.converged() ? ", converged" : "") << std::endl;
+    volumetric_cloud_.StopPathTracing();
+}
+
+void AppWindow::RenderCloudReference(const char* output, int frame_count, unsigned thread_count) {
+    WarmUpEnvironment();
+    auto [width, height] = GetWindowSize();
+
+    CloudPathTracerReference reference(volumetric_cloud_.CaptureReferenceScene(), volumetric_cloud_.path_tracing_init_param());
+    using Clock = std::chrono::steady_clock;
+    auto begin = Clock::now();
+    reference.Render(std::max(frame_count, 1), thread_count);
+    auto total_ms = std::chrono::duration<double, std::milli>(Clock::now() - begin).count();
+    reference.WriteHdr(output);
+    std::cout << reference.frame_cnt() << " frames (" << width << "x" << height << ") traced in " << total_ms << " ms, "
+        << reference.samples_per_second() << " samples/s" << std::endl;
 }
 
 void AppWindow::Render() {
@@ -176,7 +334,7 @@ void AppWindow::Render() {
 
     hdrbuffer_->DoPostProcessAndBindSdrFramebuffer(post_process_parameters_);
     smaa_->DoSMAA(hdrbuffer_->sdr_texture());
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, default_framebuffer());
     TextureVisualizer::Instance().VisualizeTexture(smaa_->output_tex());
 }
 
@@ -306,13 +464,15 @@ void AppWindow::HandleDrawGuiEvent() {
 
     if (ImGui::Button("Reload Shader")) {
         try {
-            GLReloadableProgram::ReloadAll();
+            GLReloadableProgram::ReloadAll(true);
         }
         catch (std::exception& e) {
             std::cout << e.what() << std::endl;
         }
     }
     ImGui::SameLine();
+    ImGui::Checkbox("Watch Shaders", &GLReloadableProgram::watch_enable);
+    ImGui::SameLine();
     {
         static std::vector<std::string> config_paths;
         static std::vector<const char*> config_paths_cstr;
@@ -392,6 +552,8 @@ void AppWindow::HandleDrawGuiEvent() {
     ImGui::Checkbox("Show Debug Textures", &draw_debug_textures_enable_);
     ImGui::SameLine();
     ImGui::Checkbox("Show Help", &draw_help_enable_);
+    ImGui::SameLine();
+    ImGui::Checkbox("Show Profiler", &draw_profiler_enable_);
 
     bool previous_full_screen = full_screen_;
     bool previous_anisotropy_enable = anisotropy_enable_;
@@ -433,6 +595,14 @@ void AppWindow::HandleDrawGuiEvent() {
 
         ImGui::Checkbox("Raymarching Dither Sample Point Enable", &atmosphere_render_init_parameters_.raymarching_dither_sample_point_enable);
         SliderFloat("Raymarching Steps", &atmosphere_render_parameters_.raymarching_steps, 0, 100.0);
+        ImGui::Separator();
+
+        ImGui::Checkbox("LUT Update Scheduler", &atmosphere_render_init_parameters_.update_scheduler_enable);
+        SliderFloat("Update Sun Angle Threshold", &atmosphere_render_init_parameters_.update_sun_angle_threshold, 0, 1.0);
+        ImGui::SliderFloat("Update Altitude Threshold", &atmosphere_render_init_parameters_.update_altitude_threshold, 0, 0.1f, "%.4f");
+        ImGui::SliderInt("Update Max Interval", &atmosphere_render_init_parameters_.update_max_interval, 0, 600);
+        ImGui::SliderInt("Environment Faces Per Frame", &atmosphere_render_init_parameters_.environment_faces_per_frame, 1, 6);
+        ImGui::SliderInt("Prefilter Levels Per Frame", &atmosphere_render_init_parameters_.prefilter_levels_per_frame, 1, IBL::kRoughnessCount);
         ImGui::TreePop();
     }
 
@@ -486,6 +656,19 @@ void AppWindow::HandleDrawGuiEvent() {
         ColorEdit("Ozone Absorption", earth_.parameters.ozone_absorption);
         ImGui::Separator();
 
+        if (ImGui::Button("Validate LUTs")) {
+            std::ostringstream ss;
+            ValidateAtmosphereLuts(ss);
+            lut_validation_result_ = ss.str();
+        }
+        ImGui::SameLine();
+        if (ImGui::Button("Bake LUTs"))
+            lut_validation_result_ = earth_.atmosphere().SaveLutAsset() ? "LUT asset written" : "Failed to write LUT asset";
+        ImGui::SameLine();
+        ImGui::TextUnformatted(earth_.atmosphere().luts_from_asset() ? "(LUTs loaded from asset)" : "(LUTs computed)");
+        if (!lut_validation_result_.empty())
+            ImGui::TextUnformatted(lut_validation_result_.c_str());
+
         ImGui::TreePop();
     }
 
@@ -538,11 +721,17 @@ void AppWindow::HandleDrawGuiEvent() {
         ImGui::End();
     }
 
+    if (draw_profiler_enable_) {
+        ImGui::Begin("Profiler", &draw_profiler_enable_);
+        Profiler::Instance().DrawGUI();
+        ImGui::End();
+    }
+
     if (full_screen_ != previous_full_screen)
         SetFullScreen(full_screen_);
 
     if (vsync_enable_ != previous_vsync_enable)
-        glfwSwapInterval(vsync_enable_ ? 1 : 0);
+        SetVSync(vsync_enable_);
 
     if (anisotropy_enable_ != previous_anisotropy_enable)
         Samplers::SetAnisotropyEnable(anisotropy_enable_);
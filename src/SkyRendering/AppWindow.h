@@ -1,6 +1,8 @@
 #pragma once
 
 #include <memory>
+#include <ostream>
+#include <string>
 
 #include <glm/gtc/type_ptr.hpp>
 
@@ -18,9 +20,42 @@
 
 class AppWindow : public GLWindow, public ISerializable {
 public:
-    AppWindow(const char* config_path, int width, int height);
+    AppWindow(const char* config_path, int width, int height, bool headless = false);
+
+    // Render frames along a camera/sun keyframe track without GUI and input handling.
+    // frame_count <= 0 renders the whole track. Frames are written to output_dir if not empty.
+    void RenderSequence(const char* track_path, int frame_count, const char* output_dir);
+
+    // Compare the GPU transmittance and multiscattering LUTs with the CPU reference.
+    // Returns false if the error exceeds the tolerance.
+    bool ValidateAtmosphereLuts(std::ostream& os);
+
+    // Render the cloud path tracer image of the configured view on the CPU
+    // (CloudPathTracerReference) and write it to output as .hdr. thread_count == 0 uses all
+    // hardware threads.
+    void RenderCloudReference(const char* output, int frame_count, unsigned thread_count);
+
+    // Headless worker of a distributed path traced render, see PathTracingCheckpoint
+    struct PathTracingJob {
+        const char* output = nullptr; // checkpoint written at the end
+        const char* resume = nullptr; // checkpoint to continue, with its own settings
+        int frame_count = 64;
+        int checkpoint_interval = 0; // frames between intermediate checkpoints, 0: none
+        int sqrt_tile_count = 0; // 0: as configured
+        int tile_begin = 0;
+        int tile_end = 0;
+        int first_sample = 0;
+        int max_samples = 0; // per pixel of this worker, see InitParam::sample_cap, 0: no cap
+    };
+
+    // Path traces frame_count frames of the configured view on the GPU, or fewer if adaptive
+    // sampling converges first, and saves the checkpoint
+    void RenderPathTracing(const PathTracingJob& job);
 
 private:
+    // Renders until the environment map is complete, for the headless modes
+    void WarmUpEnvironment();
+
     virtual void HandleDisplayEvent() override;
     virtual void HandleDrawGuiEvent() override;
     virtual void HandleReshapeEvent(int viewport_width, int viewport_height) override;
@@ -61,9 +96,11 @@ private:
     bool draw_gui_enable_ = true;
     bool draw_debug_textures_enable_ = false;
     bool draw_help_enable_ = true;
+    bool draw_profiler_enable_ = false;
     bool full_screen_ = false;
     bool anisotropy_enable_ = true;
     bool vsync_enable_ = false;
+    std::string lut_validation_result_;
 
     FIELD_DECLARATION_BEGIN(ISerializable)
         FIELD_DECLARE(earth_)
@@ -77,6 +114,7 @@ private:
         FIELD_DECLARE(draw_gui_enable_)
         FIELD_DECLARE(draw_debug_textures_enable_)
         FIELD_DECLARE(draw_help_enable_)
+        FIELD_DECLARE(draw_profiler_enable_)
         FIELD_DECLARE(full_screen_)
         FIELD_DECLARE(anisotropy_enable_)
         FIELD_DECLARE(vsync_enable_)
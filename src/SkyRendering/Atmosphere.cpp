@@ -1,52 +1,23 @@
 #include "Atmosphere.h"
 
 #include <array>
+#include <vector>
 
+#include "AtmosphereLutAsset.h"
 #include "Utils.h"
 #include "Textures.h"
 #include "Samplers.h"
 
 constexpr GLuint kTransmittanceLocalSizeX = 16;
 constexpr GLuint kTransmittanceLocalSizeY = 8;
-constexpr GLsizei kTransmittanceTextureWidth = 256;
-constexpr GLsizei kTransmittanceTextureHeight = 64;
 constexpr GLenum kTransmittanceTextureInternalFormat = GL_RGBA32F;
-constexpr GLuint kTransmittanceProgramGlobalSizeX = kTransmittanceTextureWidth / kTransmittanceLocalSizeX;
-constexpr GLuint kTransmittanceProgramGlobalSizeY = kTransmittanceTextureHeight / kTransmittanceLocalSizeY;
+constexpr GLuint kTransmittanceProgramGlobalSizeX = Atmosphere::kTransmittanceTextureWidth / kTransmittanceLocalSizeX;
+constexpr GLuint kTransmittanceProgramGlobalSizeY = Atmosphere::kTransmittanceTextureHeight / kTransmittanceLocalSizeY;
 
-constexpr GLuint kMultiscatteringTextureWidth = 32;
-constexpr GLuint kMultiscatteringTextureHeight = 32;
 constexpr GLenum kMultiscatteringTextureInternalFormat = GL_RGBA32F;
 
-struct AtmosphereBufferData {
-    glm::vec3 solar_illuminance;
-    float sun_angular_radius;
-
-    glm::vec3 rayleigh_scattering;
-    float inv_rayleigh_exponential_distribution;
-
-    glm::vec3 mie_scattering;
-    float inv_mie_exponential_distribution;
-
-    glm::vec3 mie_absorption;
-    float ozone_center_altitude;
-
-    glm::vec3 ozone_absorption;
-    float inv_ozone_width;
-
-    glm::vec3 ground_albedo;
-    float mie_phase_g;
-
-    glm::vec3 _atmosphere_padding;
-    float multiscattering_mask;
-
-    float bottom_radius;
-    float top_radius;
-    float transmittance_steps;
-    float multiscattering_steps;
-};
-
-static void AssignBufferData(const AtmosphereParameters& parameters, AtmosphereBufferData& data) {
+AtmosphereBufferData ComputeAtmosphereBufferData(const AtmosphereParameters& parameters) {
+    AtmosphereBufferData data{};
     data.solar_illuminance = parameters.solar_illuminance;
     data.sun_angular_radius = glm::radians(parameters.sun_angular_radius);
 
@@ -67,6 +38,7 @@ static void AssignBufferData(const AtmosphereParameters& parameters, AtmosphereB
     data.transmittance_steps = parameters.transmittance_steps;
     data.multiscattering_steps = parameters.multiscattering_steps;
     data.multiscattering_mask = parameters.multiscattering_mask;
+    return data;
 }
 
 Atmosphere::Atmosphere() {
@@ -100,11 +72,28 @@ Atmosphere::Atmosphere() {
 
 void Atmosphere::UpdateLuts(const AtmosphereParameters& parameters) {
     PERF_MARKER("UpdateLuts")
-    AtmosphereBufferData atmosphere_buffer_data_;
-    AssignBufferData(parameters, atmosphere_buffer_data_);
+    // Other atmosphere shaders read the parameters from binding 0 as well
+    glBindBufferBase(GL_UNIFORM_BUFFER, 0, atmosphere_parameters_buffer_.id());
+
+    bool changed = luts_version_ == 0 || parameters != pre_parameters_
+        || transmittance_program_.id() != pre_transmittance_program_
+        || multiscattering_program_.id() != pre_multiscattering_program_;
+    if (!changed)
+        return;
+    pre_parameters_ = parameters;
+    pre_transmittance_program_ = transmittance_program_.id();
+    pre_multiscattering_program_ = multiscattering_program_.id();
+    ++luts_version_;
+
+    auto atmosphere_buffer_data_ = ComputeAtmosphereBufferData(parameters);
 
     glNamedBufferSubData(atmosphere_parameters_buffer_.id(), 0, sizeof(atmosphere_buffer_data_), &atmosphere_buffer_data_);
-    glBindBufferBase(GL_UNIFORM_BUFFER, 0, atmosphere_parameters_buffer_.id());
+
+    luts_hash_ = ComputeAtmosphereLutHash(atmosphere_buffer_data_);
+    luts_from_asset_ = LoadAtmosphereLutAsset(GetAtmosphereLutAssetPath(luts_hash_).c_str(), luts_hash_,
+        { transmittance_texture_.id(), multiscattering_texture_.id() });
+    if (luts_from_asset_)
+        return;
 
     GLBindImageTextures({ transmittance_texture_.id() });
     glUseProgram(transmittance_program_.id());
@@ -122,3 +111,12 @@ void Atmosphere::UpdateLuts(const AtmosphereParameters& parameters) {
     }
     glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
 }
+
+bool Atmosphere::SaveLutAsset() const {
+    if (luts_version_ == 0)
+        return false;
+    std::vector<AtmosphereLut> levels;
+    levels.push_back(ReadAtmosphereLut(transmittance_texture_.id()));
+    levels.push_back(ReadAtmosphereLut(multiscattering_texture_.id()));
+    return WriteAtmosphereLutAsset(GetAtmosphereLutAssetPath(luts_hash_).c_str(), luts_hash_, levels);
+}
@@ -67,12 +67,90 @@ struct AtmosphereParameters : public ISerializable {
     FIELD_DECLARATION_END()
 };
 
+inline bool operator==(const AtmosphereParameters& lhs, const AtmosphereParameters& rhs) {
+    return lhs.solar_illuminance == rhs.solar_illuminance
+        && lhs.sun_angular_radius == rhs.sun_angular_radius
+        && lhs.bottom_radius == rhs.bottom_radius
+        && lhs.thickness == rhs.thickness
+        && lhs.ground_albedo == rhs.ground_albedo
+        && lhs.rayleigh_exponential_distribution == rhs.rayleigh_exponential_distribution
+        && lhs.rayleigh_scattering_scale == rhs.rayleigh_scattering_scale
+        && lhs.rayleigh_scattering == rhs.rayleigh_scattering
+        && lhs.mie_exponential_distribution == rhs.mie_exponential_distribution
+        && lhs.mie_phase_g == rhs.mie_phase_g
+        && lhs.mie_scattering_scale == rhs.mie_scattering_scale
+        && lhs.mie_scattering == rhs.mie_scattering
+        && lhs.mie_absorption_scale == rhs.mie_absorption_scale
+        && lhs.mie_absorption == rhs.mie_absorption
+        && lhs.ozone_center_altitude == rhs.ozone_center_altitude
+        && lhs.ozone_width == rhs.ozone_width
+        && lhs.ozone_absorption_scale == rhs.ozone_absorption_scale
+        && lhs.ozone_absorption == rhs.ozone_absorption
+        && lhs.transmittance_steps == rhs.transmittance_steps
+        && lhs.multiscattering_steps == rhs.multiscattering_steps
+        && lhs.multiscattering_mask == rhs.multiscattering_mask;
+}
+
+inline bool operator!=(const AtmosphereParameters& lhs, const AtmosphereParameters& rhs) {
+    return !(lhs == rhs);
+}
+
+// std140 layout of the AtmosphereBufferData uniform block in Atmosphere.glsl
+struct AtmosphereBufferData {
+    glm::vec3 solar_illuminance;
+    float sun_angular_radius;
+
+    glm::vec3 rayleigh_scattering;
+    float inv_rayleigh_exponential_distribution;
+
+    glm::vec3 mie_scattering;
+    float inv_mie_exponential_distribution;
+
+    glm::vec3 mie_absorption;
+    float ozone_center_altitude;
+
+    glm::vec3 ozone_absorption;
+    float inv_ozone_width;
+
+    glm::vec3 ground_albedo;
+    float mie_phase_g;
+
+    glm::vec3 _atmosphere_padding;
+    float multiscattering_mask;
+
+    float bottom_radius;
+    float top_radius;
+    float transmittance_steps;
+    float multiscattering_steps;
+};
+
+AtmosphereBufferData ComputeAtmosphereBufferData(const AtmosphereParameters& parameters);
+
 class Atmosphere {
 public:
+    static constexpr GLsizei kTransmittanceTextureWidth = 256;
+    static constexpr GLsizei kTransmittanceTextureHeight = 64;
+    static constexpr GLsizei kMultiscatteringTextureWidth = 32;
+    static constexpr GLsizei kMultiscatteringTextureHeight = 32;
+
     Atmosphere();
 
+    // LUTs are only recomputed when parameters (or the programs, after a shader reload) changed
     void UpdateLuts(const AtmosphereParameters& parameters);
 
+    // Incremented whenever the LUTs are recomputed
+    uint64_t luts_version() const {
+        return luts_version_;
+    }
+
+    // True if the current LUTs were uploaded from a baked asset instead of computed
+    bool luts_from_asset() const {
+        return luts_from_asset_;
+    }
+
+    // Bake the current LUTs so that the next start with the same parameters skips the compute passes
+    bool SaveLutAsset() const;
+
     GLuint transmittance_texture() const {
         return transmittance_texture_.id();
     }
@@ -89,4 +167,11 @@ private:
 
     GLTexture multiscattering_texture_;
     GLReloadableProgram multiscattering_program_;
+
+    AtmosphereParameters pre_parameters_;
+    GLuint pre_transmittance_program_ = 0;
+    GLuint pre_multiscattering_program_ = 0;
+    uint64_t luts_version_ = 0;
+    uint64_t luts_hash_ = 0;
+    bool luts_from_asset_ = false;
 };
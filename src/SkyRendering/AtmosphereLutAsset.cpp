@@ -0,0 +1,125 @@
+#include "AtmosphereLutAsset.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <filesystem>
+#include <stdexcept>
+#include <cstring>
+
+#include <glm/gtc/packing.hpp>
+#include <rapidjson/document.h>
+#include <rapidjson/error/en.h>
+
+#include "GLProgram.h"
+#include "MappedFile.h"
+#include "ShaderPreprocessor.h"
+#include "Utils.h"
+
+constexpr char kAtmosphereLutDirectory[] = "atmosphere_luts";
+constexpr uint32_t kAtmosphereLutMagic = 0x31544c41; // "ALT1"
+
+struct AtmosphereLutAssetHeader {
+    uint32_t magic;
+    uint32_t level_count;
+    uint64_t parameter_hash;
+};
+
+struct AtmosphereLutAssetLevel {
+    uint32_t width;
+    uint32_t height;
+    uint64_t offset; // From the start of the file, width * height RGBA float16 texels
+};
+
+uint64_t ComputeAtmosphereLutHash(const AtmosphereBufferData& data) {
+    // Source string numbers depend on which files were expanded first, so #line directives are not hashed
+    auto source = ShaderPreprocessor::StripLineDirectives(ReadWithPreprocessor("../shaders/SkyRendering/Atmosphere.glsl"));
+    auto hash = Fnv1a(kFnv1aOffsetBasis, &data, sizeof(data));
+    return Fnv1a(hash, source.data(), source.size());
+}
+
+std::string GetAtmosphereLutAssetPath(uint64_t hash) {
+    std::stringstream ss;
+    ss << std::hex << std::setw(16) << std::setfill('0') << hash << ".lut";
+    return (std::filesystem::path(kAtmosphereLutDirectory) / ss.str()).string();
+}
+
+bool WriteAtmosphereLutAsset(const char* path, uint64_t hash, const std::vector<AtmosphereLut>& levels) {
+    AtmosphereLutAssetHeader header{ kAtmosphereLutMagic, static_cast<uint32_t>(levels.size()), hash };
+    std::vector<AtmosphereLutAssetLevel> table;
+    uint64_t offset = sizeof(header) + sizeof(AtmosphereLutAssetLevel) * levels.size();
+    for (const auto& level : levels) {
+        table.push_back({ static_cast<uint32_t>(level.width), static_cast<uint32_t>(level.height), offset });
+        offset += level.texels.size() * sizeof(uint16_t);
+    }
+
+    return WriteFileAtomically(path, [&](std::ostream& fout) {
+        fout.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        fout.write(reinterpret_cast<const char*>(table.data()), sizeof(AtmosphereLutAssetLevel) * table.size());
+        for (const auto& level : levels) {
+            std::vector<uint16_t> halfs(level.texels.size());
+            for (size_t i = 0; i < halfs.size(); ++i)
+                halfs[i] = glm::packHalf1x16(level.texels[i]);
+            fout.write(reinterpret_cast<const char*>(halfs.data()), halfs.size() * sizeof(uint16_t));
+        }
+    });
+}
+
+bool LoadAtmosphereLutAsset(const char* path, uint64_t hash, const std::vector<GLuint>& textures) {
+    MappedFile file(path);
+    if (!file || file.size() < sizeof(AtmosphereLutAssetHeader))
+        return false;
+    auto bytes = static_cast<const char*>(file.data());
+    AtmosphereLutAssetHeader header;
+    memcpy(&header, bytes, sizeof(header));
+    if (header.magic != kAtmosphereLutMagic || header.parameter_hash != hash || header.level_count != textures.size())
+        return false;
+    if (file.size() < sizeof(header) + sizeof(AtmosphereLutAssetLevel) * textures.size())
+        return false;
+
+    std::vector<AtmosphereLutAssetLevel> table(textures.size());
+    memcpy(table.data(), bytes + sizeof(header), sizeof(AtmosphereLutAssetLevel) * table.size());
+    for (size_t i = 0; i < textures.size(); ++i) {
+        GLint width = 0, height = 0;
+        glGetTextureLevelParameteriv(textures[i], 0, GL_TEXTURE_WIDTH, &width);
+        glGetTextureLevelParameteriv(textures[i], 0, GL_TEXTURE_HEIGHT, &height);
+        const auto& level = table[i];
+        uint64_t level_size = uint64_t(level.width) * level.height * 4 * sizeof(uint16_t);
+        if (level.width != static_cast<uint32_t>(width) || level.height != static_cast<uint32_t>(height)
+                || level.offset + level_size > file.size())
+            return false;
+    }
+    for (size_t i = 0; i < textures.size(); ++i) {
+        const auto& level = table[i];
+        glTextureSubImage2D(textures[i], 0, 0, 0, level.width, level.height, GL_RGBA, GL_HALF_FLOAT, bytes + level.offset);
+    }
+    return true;
+}
+
+void BakeAtmosphereLutAssets(const std::vector<const char*>& config_paths) {
+    for (auto config_path : config_paths) {
+        using namespace rapidjson;
+        auto str = ReadFile(config_path);
+        Document d;
+        if (d.Parse<kParseCommentsFlag | kParseTrailingCommasFlag>(str.c_str()).HasParseError()) {
+            std::ostringstream msg;
+            msg << "Failed to parse \"" << config_path << "\" (" << "offset " << d.GetErrorOffset() << "): " << GetParseError_En(d.GetParseError());
+            throw std::runtime_error(msg.str());
+        }
+        if (!d.IsObject() || !d.HasMember("earth_") || !d["earth_"].HasMember("parameters"))
+            throw std::runtime_error(std::string("No earth_.parameters in ") + config_path);
+        AtmosphereParameters parameters;
+        parameters.Deserialize(d["earth_"]["parameters"]);
+
+        auto data = ComputeAtmosphereBufferData(parameters);
+        auto hash = ComputeAtmosphereLutHash(data);
+        std::vector<AtmosphereLut> levels;
+        levels.push_back(ComputeTransmittanceLutReference(data));
+        levels.push_back(ComputeMultiscatteringLutReference(data, levels[0]));
+        auto path = GetAtmosphereLutAssetPath(hash);
+        if (!WriteAtmosphereLutAsset(path.c_str(), hash, levels))
+            throw std::runtime_error("Write file failed: " + path);
+        std::cout << "\"" << config_path << "\" -> " << path << std::endl;
+    }
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "gl.hpp"
+#include "Atmosphere.h"
+#include "AtmosphereReference.h"
+
+// Baked transmittance and multiscattering LUTs, stored as atmosphere_luts/<hash>.lut:
+// header with the parameter hash, level table, then one float16 RGBA payload per level.
+
+// Covers AtmosphereBufferData and the preprocessed Atmosphere.glsl, so editing either one
+// invalidates existing assets
+uint64_t ComputeAtmosphereLutHash(const AtmosphereBufferData& data);
+
+std::string GetAtmosphereLutAssetPath(uint64_t hash);
+
+bool WriteAtmosphereLutAsset(const char* path, uint64_t hash, const std::vector<AtmosphereLut>& levels);
+
+// Maps the file and uploads level i to textures[i]. Returns false without touching the textures
+// if the file is missing, the hash differs or a level does not match its texture size.
+bool LoadAtmosphereLutAsset(const char* path, uint64_t hash, const std::vector<GLuint>& textures);
+
+// Bakes the atmosphere of each config with the CPU reference, no GL context needed
+void BakeAtmosphereLutAssets(const std::vector<const char*>& config_paths);
@@ -0,0 +1,346 @@
+#include "AtmosphereReference.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+#include "Utils.h"
+
+// Texels are processed in batches of kLanes, one array per quantity, which shares the per-step
+// setup of a batch. The loops are plain scalar code: GetSunVisibility and AtmosphereLut::Sample
+// are called per lane, so no vectorization is assumed. All arithmetic stays in float and
+// follows the operation order of Atmosphere.glsl.
+constexpr int kLanes = 8;
+constexpr int kMultiscatteringDirections = 64;
+constexpr float kPi = 3.1415926535897932384626433832795f;
+constexpr float kInvPi = 1.0f / kPi;
+
+static float ClampCosine(float mu) {
+    return std::clamp(mu, -1.0f, 1.0f);
+}
+
+static float ClampDistance(float d) {
+    return std::max(d, 0.0f);
+}
+
+static float SafeSqrt(float a) {
+    return std::sqrt(std::max(a, 0.0f));
+}
+
+static float Smoothstep(float edge0, float edge1, float x) {
+    float t = std::clamp((x - edge0) / (edge1 - edge0), 0.0f, 1.0f);
+    return t * t * (3.0f - 2.0f * t);
+}
+
+static bool RayIntersectsGround(const AtmosphereBufferData& a, float r, float mu) {
+    return mu < 0.0f && r * r * (mu * mu - 1.0f) + a.bottom_radius * a.bottom_radius >= 0.0f;
+}
+
+static float DistanceToTopAtmosphereBoundary(const AtmosphereBufferData& a, float r, float mu) {
+    float discriminant = r * r * (mu * mu - 1.0f) + a.top_radius * a.top_radius;
+    return ClampDistance(-r * mu + SafeSqrt(discriminant));
+}
+
+static float DistanceToBottomAtmosphereBoundary(const AtmosphereBufferData& a, float r, float mu) {
+    float discriminant = r * r * (mu * mu - 1.0f) + a.bottom_radius * a.bottom_radius;
+    return ClampDistance(-r * mu - SafeSqrt(discriminant));
+}
+
+static void GetRMuFromTransmittanceTextureIndex(const AtmosphereBufferData& a,
+        glm::ivec2 index, glm::ivec2 size, float& r, float& mu) {
+    glm::vec2 uv = glm::vec2(index) / glm::vec2(size - 1);
+    float x_mu = uv.x;
+    float x_r = uv.y;
+    float H = std::sqrt(a.top_radius * a.top_radius - a.bottom_radius * a.bottom_radius);
+    float rho = H * x_r;
+    r = std::sqrt(rho * rho + a.bottom_radius * a.bottom_radius);
+    float d_min = a.top_radius - r;
+    float d_max = rho + H;
+    float d = d_min + x_mu * (d_max - d_min);
+    mu = d == 0.0f ? 1.0f : (H * H - rho * rho - d * d) / (2.0f * r * d);
+    mu = ClampCosine(mu);
+}
+
+static glm::vec2 GetTransmittanceTextureUvFromRMu(const AtmosphereBufferData& a,
+        glm::ivec2 size, float r, float mu) {
+    float H = std::sqrt(a.top_radius * a.top_radius - a.bottom_radius * a.bottom_radius);
+    float rho = SafeSqrt(r * r - a.bottom_radius * a.bottom_radius);
+    float d = DistanceToTopAtmosphereBoundary(a, r, mu);
+    float d_min = a.top_radius - r;
+    float d_max = rho + H;
+    float x_mu = (d - d_min) / (d_max - d_min);
+    float x_r = rho / H;
+    return 0.5f / glm::vec2(size) + glm::vec2(x_mu, x_r) * (1.0f - 1.0f / glm::vec2(size));
+}
+
+glm::vec3 GetSunVisibility(const AtmosphereBufferData& a,
+        const AtmosphereLut& transmittance, float r, float mu_s) {
+    float sin_theta_h = a.bottom_radius / r;
+    float cos_theta_h = -std::sqrt(std::max(1.0f - sin_theta_h * sin_theta_h, 0.0f));
+    auto uv = GetTransmittanceTextureUvFromRMu(a, { transmittance.width, transmittance.height }, r, mu_s);
+    return transmittance.Sample(uv) *
+        Smoothstep(-sin_theta_h * a.sun_angular_radius,
+            sin_theta_h * a.sun_angular_radius,
+            mu_s - cos_theta_h);
+}
+
+// Extinction of kLanes samples, one channel per array
+static void GetExtinction(const AtmosphereBufferData& a, const float* altitude,
+        float* extinction_r, float* extinction_g, float* extinction_b) {
+    for (int l = 0; l < kLanes; ++l) {
+        float rayleigh_density = std::clamp(std::exp(-altitude[l] * a.inv_rayleigh_exponential_distribution), 0.0f, 1.0f);
+        float mie_density = std::clamp(std::exp(-altitude[l] * a.inv_mie_exponential_distribution), 0.0f, 1.0f);
+        float ozone_density = std::max(0.0f, altitude[l] < a.ozone_center_altitude ?
+            1.0f + (altitude[l] - a.ozone_center_altitude) * a.inv_ozone_width :
+            1.0f - (altitude[l] - a.ozone_center_altitude) * a.inv_ozone_width);
+        extinction_r[l] = a.rayleigh_scattering.r * rayleigh_density
+            + (a.mie_scattering.r + a.mie_absorption.r) * mie_density
+            + a.ozone_absorption.r * ozone_density;
+        extinction_g[l] = a.rayleigh_scattering.g * rayleigh_density
+            + (a.mie_scattering.g + a.mie_absorption.g) * mie_density
+            + a.ozone_absorption.g * ozone_density;
+        extinction_b[l] = a.rayleigh_scattering.b * rayleigh_density
+            + (a.mie_scattering.b + a.mie_absorption.b) * mie_density
+            + a.ozone_absorption.b * ozone_density;
+    }
+}
+
+AtmosphereLut::AtmosphereLut(int width, int height)
+    : width(width), height(height), texels(static_cast<size_t>(width) * height * 4) {
+}
+
+glm::vec3 AtmosphereLut::Fetch(int x, int y) const {
+    const float* texel = &texels[(static_cast<size_t>(y) * width + x) * 4];
+    return { texel[0], texel[1], texel[2] };
+}
+
+glm::vec3 AtmosphereLut::Sample(glm::vec2 uv) const {
+    float x = uv.x * width - 0.5f;
+    float y = uv.y * height - 0.5f;
+    float x0 = std::floor(x);
+    float y0 = std::floor(y);
+    float fx = x - x0;
+    float fy = y - y0;
+    int ix0 = std::clamp(static_cast<int>(x0), 0, width - 1);
+    int ix1 = std::clamp(static_cast<int>(x0) + 1, 0, width - 1);
+    int iy0 = std::clamp(static_cast<int>(y0), 0, height - 1);
+    int iy1 = std::clamp(static_cast<int>(y0) + 1, 0, height - 1);
+    return glm::mix(glm::mix(Fetch(ix0, iy0), Fetch(ix1, iy0), fx),
+        glm::mix(Fetch(ix0, iy1), Fetch(ix1, iy1), fx), fy);
+}
+
+AtmosphereLut ComputeTransmittanceLutReference(const AtmosphereBufferData& data, unsigned thread_count) {
+    AtmosphereLut lut(Atmosphere::kTransmittanceTextureWidth, Atmosphere::kTransmittanceTextureHeight);
+    glm::ivec2 size{ lut.width, lut.height };
+    const float sample_count = data.transmittance_steps;
+
+    ParallelFor(lut.height, thread_count, [&](int y) {
+        for (int x = 0; x < lut.width; x += kLanes) {
+            float r[kLanes], mu[kLanes], dx[kLanes];
+            float optical_length_r[kLanes] = {}, optical_length_g[kLanes] = {}, optical_length_b[kLanes] = {};
+            for (int l = 0; l < kLanes; ++l) {
+                // Lanes past the last column repeat it and are not stored
+                GetRMuFromTransmittanceTextureIndex(data, { std::min(x + l, lut.width - 1), y }, size, r[l], mu[l]);
+                dx[l] = DistanceToTopAtmosphereBoundary(data, r[l], mu[l]) / sample_count;
+            }
+            for (float i = 0.5f; i < sample_count; ++i) {
+                float altitude[kLanes];
+                for (int l = 0; l < kLanes; ++l) {
+                    float d_i = i * dx[l];
+                    float r_i = std::sqrt(d_i * d_i + 2.0f * r[l] * mu[l] * d_i + r[l] * r[l]);
+                    altitude[l] = r_i - data.bottom_radius;
+                }
+                float extinction_r[kLanes], extinction_g[kLanes], extinction_b[kLanes];
+                GetExtinction(data, altitude, extinction_r, extinction_g, extinction_b);
+                for (int l = 0; l < kLanes; ++l) {
+                    optical_length_r[l] += extinction_r[l] * dx[l];
+                    optical_length_g[l] += extinction_g[l] * dx[l];
+                    optical_length_b[l] += extinction_b[l] * dx[l];
+                }
+            }
+            for (int l = 0; l < kLanes && x + l < lut.width; ++l) {
+                float* texel = &lut.texels[(static_cast<size_t>(y) * lut.width + x + l) * 4];
+                texel[0] = std::exp(-optical_length_r[l]);
+                texel[1] = std::exp(-optical_length_g[l]);
+                texel[2] = std::exp(-optical_length_b[l]);
+                texel[3] = 1.0f;
+            }
+        }
+    });
+    return lut;
+}
+
+static glm::vec3 GetDirectionFromLocalIndex(int index) {
+    float unit_theta = (0.5f + static_cast<float>(index / 8)) / 8.0f;
+    float unit_phi = (0.5f + static_cast<float>(index % 8)) / 8.0f;
+    float cos_theta = 1.0f - 2.0f * unit_theta;
+    float sin_theta = std::sqrt(std::clamp(1.0f - cos_theta * cos_theta, 0.0f, 1.0f));
+
+    float phi = 2.0f * kPi * unit_phi;
+    float cos_phi = std::cos(phi);
+    float sin_phi = std::sin(phi);
+    return { cos_phi * sin_theta, cos_theta, sin_phi * sin_theta };
+}
+
+// All 64 directions of one multiscattering texel, kLanes at a time
+struct MultiscatteringBatch {
+    glm::vec3 view_direction[kLanes];
+    float mu[kLanes];
+    float marching_distance[kLanes];
+    bool intersect_bottom[kLanes];
+    glm::vec3 luminance[kLanes];
+    glm::vec3 L_f[kLanes];
+};
+
+static void ComputeMultiscatteringBatch(const AtmosphereBufferData& a, const AtmosphereLut& transmittance,
+        float altitude, glm::vec3 sun_direction, MultiscatteringBatch& batch) {
+    const glm::vec3 earth_center{ 0.0f, -a.bottom_radius, 0.0f };
+    const glm::vec3 start_position{ 0.0f, altitude, 0.0f };
+    const float r = glm::length(start_position - earth_center);
+    const float sample_count = a.multiscattering_steps;
+    // Both phase functions are isotropic in the multiscattering program
+    const float phase = 1.0f / (4.0f * kPi);
+
+    float dx[kLanes];
+    float transmittance_r[kLanes], transmittance_g[kLanes], transmittance_b[kLanes];
+    for (int l = 0; l < kLanes; ++l) {
+        dx[l] = batch.marching_distance[l] / sample_count;
+        transmittance_r[l] = transmittance_g[l] = transmittance_b[l] = 1.0f;
+        batch.luminance[l] = glm::vec3(0.0f);
+        batch.L_f[l] = glm::vec3(0.0f);
+    }
+
+    for (float i = 0.5f; i < sample_count; ++i) {
+        float r_i[kLanes], altitude_i[kLanes], mu_s_i[kLanes];
+        for (int l = 0; l < kLanes; ++l) {
+            float d_i = i * dx[l];
+            r_i[l] = std::sqrt(d_i * d_i + 2.0f * r * batch.mu[l] * d_i + r * r);
+            altitude_i[l] = r_i[l] - a.bottom_radius;
+            glm::vec3 position_i = start_position + batch.view_direction[l] * d_i;
+            mu_s_i[l] = glm::dot(sun_direction, glm::normalize(position_i - earth_center));
+        }
+        float extinction_r[kLanes], extinction_g[kLanes], extinction_b[kLanes];
+        GetExtinction(a, altitude_i, extinction_r, extinction_g, extinction_b);
+
+        for (int l = 0; l < kLanes; ++l) {
+            glm::vec3 rayleigh_scattering_i = a.rayleigh_scattering *
+                std::clamp(std::exp(-altitude_i[l] * a.inv_rayleigh_exponential_distribution), 0.0f, 1.0f);
+            glm::vec3 mie_scattering_i = a.mie_scattering *
+                std::clamp(std::exp(-altitude_i[l] * a.inv_mie_exponential_distribution), 0.0f, 1.0f);
+            glm::vec3 scattering_i = rayleigh_scattering_i + mie_scattering_i;
+            glm::vec3 scattering_with_phase_i = rayleigh_scattering_i * phase + mie_scattering_i * phase;
+
+            glm::vec3 extinction_i{ extinction_r[l], extinction_g[l], extinction_b[l] };
+            glm::vec3 transmittance_i = glm::exp(-extinction_i * dx[l]);
+            glm::vec3 luminance_i = scattering_with_phase_i * GetSunVisibility(a, transmittance, r_i[l], mu_s_i[l]);
+
+            glm::vec3 transmittance_l{ transmittance_r[l], transmittance_g[l], transmittance_b[l] };
+            batch.luminance[l] += transmittance_l * (luminance_i - luminance_i * transmittance_i) / extinction_i;
+            batch.L_f[l] += transmittance_l * (scattering_i - scattering_i * transmittance_i) / extinction_i;
+            transmittance_r[l] *= transmittance_i.r;
+            transmittance_g[l] *= transmittance_i.g;
+            transmittance_b[l] *= transmittance_i.b;
+        }
+    }
+
+    for (int l = 0; l < kLanes; ++l) {
+        if (!batch.intersect_bottom[l])
+            continue;
+        glm::vec3 ground_position = start_position + batch.view_direction[l] * batch.marching_distance[l];
+        glm::vec3 normal = glm::normalize(ground_position - earth_center);
+        float mu_s = glm::dot(sun_direction, normal);
+        glm::vec3 solar_illuminance_at_ground = GetSunVisibility(a, transmittance, a.bottom_radius, mu_s);
+        glm::vec3 ground_luminance = kInvPi * std::clamp(glm::dot(normal, sun_direction), 0.0f, 1.0f)
+            * a.ground_albedo * solar_illuminance_at_ground;
+        batch.luminance[l] += glm::vec3(transmittance_r[l], transmittance_g[l], transmittance_b[l]) * ground_luminance;
+    }
+}
+
+AtmosphereLut ComputeMultiscatteringLutReference(const AtmosphereBufferData& data,
+        const AtmosphereLut& transmittance, unsigned thread_count) {
+    if (transmittance.texels.empty())
+        throw std::runtime_error("Multiscattering reference needs a transmittance LUT");
+
+    AtmosphereLut lut(Atmosphere::kMultiscatteringTextureWidth, Atmosphere::kMultiscatteringTextureHeight);
+    glm::vec3 directions[kMultiscatteringDirections];
+    for (int k = 0; k < kMultiscatteringDirections; ++k)
+        directions[k] = GetDirectionFromLocalIndex(k);
+
+    ParallelFor(lut.height, thread_count, [&](int y) {
+        for (int x = 0; x < lut.width; ++x) {
+            glm::vec2 uv = glm::vec2(x, y) / glm::vec2(lut.width - 1, lut.height - 1);
+            float altitude = uv.y * (data.top_radius - data.bottom_radius);
+            float mu_s = uv.x * 2.0f - 1.0f;
+            glm::vec3 sun_direction{ 0.0f, mu_s, std::sqrt(1.0f - mu_s * mu_s) };
+            float r = altitude + data.bottom_radius;
+
+            glm::vec3 L_2nd_order_shared[kMultiscatteringDirections];
+            glm::vec3 f_ms_shared[kMultiscatteringDirections];
+            for (int k = 0; k < kMultiscatteringDirections; k += kLanes) {
+                MultiscatteringBatch batch;
+                for (int l = 0; l < kLanes; ++l) {
+                    batch.view_direction[l] = directions[k + l];
+                    batch.mu[l] = directions[k + l].y;
+                    batch.intersect_bottom[l] = RayIntersectsGround(data, r, batch.mu[l]);
+                    batch.marching_distance[l] = batch.intersect_bottom[l] ?
+                        DistanceToBottomAtmosphereBoundary(data, r, batch.mu[l]) :
+                        DistanceToTopAtmosphereBoundary(data, r, batch.mu[l]);
+                }
+                ComputeMultiscatteringBatch(data, transmittance, altitude, sun_direction, batch);
+                for (int l = 0; l < kLanes; ++l) {
+                    L_2nd_order_shared[k + l] = batch.luminance[l];
+                    f_ms_shared[k + l] = batch.L_f[l];
+                }
+            }
+
+            // Same summation order as the shared memory reduction on the GPU
+            for (int stride = kMultiscatteringDirections / 2; stride > 0; stride /= 2) {
+                for (int k = 0; k < stride; ++k) {
+                    L_2nd_order_shared[k] += L_2nd_order_shared[k + stride];
+                    f_ms_shared[k] += f_ms_shared[k + stride];
+                }
+            }
+            glm::vec3 L_2nd_order = L_2nd_order_shared[0] / 64.0f;
+            glm::vec3 f_ms = f_ms_shared[0] / 64.0f;
+            glm::vec3 F_ms = 1.0f / (1.0f - f_ms);
+            glm::vec3 multiscattering_contribution = L_2nd_order * F_ms;
+
+            float* texel = &lut.texels[(static_cast<size_t>(y) * lut.width + x) * 4];
+            texel[0] = multiscattering_contribution.r;
+            texel[1] = multiscattering_contribution.g;
+            texel[2] = multiscattering_contribution.b;
+            texel[3] = 1.0f;
+        }
+    });
+    return lut;
+}
+
+AtmosphereLut ReadAtmosphereLut(GLuint texture) {
+    GLint width = 0, height = 0;
+    glGetTextureLevelParameteriv(texture, 0, GL_TEXTURE_WIDTH, &width);
+    glGetTextureLevelParameteriv(texture, 0, GL_TEXTURE_HEIGHT, &height);
+    AtmosphereLut lut(width, height);
+    // The LUTs are written with imageStore
+    glMemoryBarrier(GL_TEXTURE_UPDATE_BARRIER_BIT);
+    glGetTextureImage(texture, 0, GL_RGBA, GL_FLOAT,
+        static_cast<GLsizei>(lut.texels.size() * sizeof(float)), lut.texels.data());
+    return lut;
+}
+
+AtmosphereLutDifference CompareAtmosphereLuts(const AtmosphereLut& lut, const AtmosphereLut& reference) {
+    if (lut.width != reference.width || lut.height != reference.height)
+        throw std::runtime_error("Atmosphere LUT sizes differ");
+    AtmosphereLutDifference difference;
+    for (size_t i = 0; i < lut.texels.size(); ++i) {
+        if (i % 4 == 3)
+            continue;
+        float abs_error = std::abs(lut.texels[i] - reference.texels[i]);
+        // NaN must not pass as equal
+        if (std::isnan(abs_error))
+            abs_error = INFINITY;
+        difference.max_abs_error = std::max(difference.max_abs_error, abs_error);
+        if (std::abs(reference.texels[i]) >= 1e-4f)
+            difference.max_rel_error = std::max(difference.max_rel_error, abs_error / std::abs(reference.texels[i]));
+    }
+    return difference;
+}
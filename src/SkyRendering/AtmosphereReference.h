@@ -0,0 +1,46 @@
+#pragma once
+
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "gl.hpp"
+#include "Atmosphere.h"
+
+// CPU port of the TRANSMITTANCE_COMPUTE_PROGRAM and MULTISCATTERING_COMPUTE_PROGRAM paths of
+// Atmosphere.glsl, used to validate the GPU LUTs and to produce them without a GL context.
+// Texels are RGBA floats, row by row, in the same order glGetTextureImage returns them.
+struct AtmosphereLut {
+    int width = 0;
+    int height = 0;
+    std::vector<float> texels;
+
+    AtmosphereLut() = default;
+    AtmosphereLut(int width, int height);
+
+    glm::vec3 Fetch(int x, int y) const;
+    // Same as texture() with GL_LINEAR and GL_CLAMP_TO_EDGE
+    glm::vec3 Sample(glm::vec2 uv) const;
+};
+
+struct AtmosphereLutDifference {
+    float max_abs_error = 0.0f;
+    float max_rel_error = 0.0f;
+};
+
+// thread_count == 0 uses all hardware threads
+AtmosphereLut ComputeTransmittanceLutReference(const AtmosphereBufferData& data, unsigned thread_count = 0);
+
+// Multiscattering samples the given transmittance LUT, so passing the one read back from the GPU
+// isolates the multiscattering pass when comparing.
+AtmosphereLut ComputeMultiscatteringLutReference(const AtmosphereBufferData& data,
+    const AtmosphereLut& transmittance, unsigned thread_count = 0);
+
+// Transmittance to the sun times the fraction of its disc above the horizon, as
+// GetSunVisibility of Atmosphere.glsl
+glm::vec3 GetSunVisibility(const AtmosphereBufferData& data, const AtmosphereLut& transmittance, float r, float mu_s);
+
+AtmosphereLut ReadAtmosphereLut(GLuint texture);
+
+// Relative error is measured against reference and ignores rgb values below 1e-4
+AtmosphereLutDifference CompareAtmosphereLuts(const AtmosphereLut& lut, const AtmosphereLut& reference);
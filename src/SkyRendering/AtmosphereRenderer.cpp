@@ -2,6 +2,7 @@
 
 #include <array>
 #include <sstream>
+#include <algorithm>
 
 #include <glm/gtc/type_ptr.hpp>
 
@@ -84,7 +85,13 @@ static void AssignBufferData(const AtmosphereRenderParameters& parameters, const
 
 AtmosphereRenderer::AtmosphereRenderer(const AtmosphereRenderInitParameters& init_parameters)
     : use_sky_view_lut_(init_parameters.use_sky_view_lut), use_aerial_perspective_lut_(init_parameters.use_aerial_perspective_lut)
-    , aerial_perspective_lut_depth_(init_parameters.aerial_perspective_lut_depth){
+    , aerial_perspective_lut_depth_(init_parameters.aerial_perspective_lut_depth)
+    , update_scheduler_enable_(init_parameters.update_scheduler_enable)
+    , update_sun_angle_threshold_(init_parameters.update_sun_angle_threshold)
+    , update_altitude_threshold_(init_parameters.update_altitude_threshold)
+    , update_max_interval_(init_parameters.update_max_interval)
+    , environment_faces_per_frame_(std::max(init_parameters.environment_faces_per_frame, 1))
+    , prefilter_levels_per_frame_(std::max(init_parameters.prefilter_levels_per_frame, 1)) {
     atmosphere_render_buffer_.Create();
     glNamedBufferStorage(atmosphere_render_buffer_.id(), sizeof(AtmosphereRenderBufferData), NULL, GL_DYNAMIC_STORAGE_BIT);
 
@@ -149,9 +156,11 @@ AtmosphereRenderer::AtmosphereRenderer(const AtmosphereRenderInitParameters& ini
     };
 
     glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
-    environment_luminance_texture_.Create(GL_TEXTURE_CUBE_MAP);
     constexpr auto w = kEnvironmentLuminanceTextureWidth;
-    glTextureStorage2D(environment_luminance_texture_.id(), GetMipmapLevels(w, w), GL_RGBA16F, w, w);
+    for (auto& texture : environment_luminance_textures_) {
+        texture.Create(GL_TEXTURE_CUBE_MAP);
+        glTextureStorage2D(texture.id(), GetMipmapLevels(w, w), GL_RGBA16F, w, w);
+    }
 
     render_program_ = [generate_shader_header, dither = init_parameters.raymarching_dither_sample_point_enable]() {
         auto atmosphere_render_fragment_str = generate_shader_header(
@@ -218,34 +227,143 @@ void AtmosphereRenderer::Render(const Earth& earth, const VolumetricCloud& volum
     };
     bind_textures();
 
-    if (true) { // For environment luminance texture
+    const auto& data = atmosphere_render_buffer_data_;
+    SkyViewState sky_view_state;
+    sky_view_state.sun_direction = data.sun_direction;
+    sky_view_state.altitude = data.camera_earth_center_distance - earth.parameters.bottom_radius;
+    sky_view_state.up_direction = data.up_direction;
+    sky_view_state.inv_shadow_froxel_max_distance = data.uInvShadowFroxelMaxDistance;
+    sky_view_state.light_view_projection = data.light_view_projection;
+    sky_view_state.cloud_shadow_map_mat = data.uCloudShadowMapMat;
+    sky_view_state.cloud_shadow_map = cloud_shadow_map.shadow_map;
+    sky_view_state.cloud_shadow_froxel = cloud_shadow_froxel.shadow_froxel;
+    sky_view_state.moon_position = data.moon_position;
+    sky_view_state.moon_radius = data.moon_radius;
+    sky_view_state.sky_view_lut_steps = data.sky_view_lut_steps;
+    sky_view_state.atmosphere_luts_version = earth.atmosphere().luts_version();
+    sky_view_state.program = sky_view_program_.id();
+    ++frames_since_sky_view_update_;
+    bool sky_view_updated = NeedsSkyViewUpdate(sky_view_state);
+    if (sky_view_updated) { // For environment luminance texture
         PERF_MARKER("SkyViewLut")
         GLBindImageTextures({ sky_view_luminance_texture_.id(), sky_view_transmittance_texture_.id() });
         glUseProgram(sky_view_program_.id());
         sky_view_program_.Dispatch({kSkyViewTextureWidth, kSkyViewTextureHeight});
+
+        sky_view_state_ = sky_view_state;
+        sky_view_valid_ = true;
+        frames_since_sky_view_update_ = 0;
+        if (environment_stage_ == kEnvironmentStageIdle)
+            environment_stage_ = 0;
+        else
+            environment_dirty_ = true;
     }
 
-    if (true) { // For Volumetric Cloud
+    AerialPerspectiveState aerial_perspective_state;
+    aerial_perspective_state.inv_view_projection = data.inv_view_projection;
+    aerial_perspective_state.camera_position = data.camera_position;
+    aerial_perspective_state.sun_direction = data.sun_direction;
+    aerial_perspective_state.steps = data.aerial_perspective_lut_steps;
+    aerial_perspective_state.max_distance = data.aerial_perspective_lut_max_distance;
+    aerial_perspective_state.atmosphere_luts_version = earth.atmosphere().luts_version();
+    aerial_perspective_state.program = aerial_perspective_program_.id();
+    const auto& pre = aerial_perspective_state_;
+    // Froxels follow the camera, so any view change invalidates the LUT
+    bool aerial_perspective_changed = !update_scheduler_enable_ || !aerial_perspective_valid_ || sky_view_updated
+        || aerial_perspective_state.inv_view_projection != pre.inv_view_projection
+        || aerial_perspective_state.camera_position != pre.camera_position
+        || aerial_perspective_state.sun_direction != pre.sun_direction
+        || aerial_perspective_state.steps != pre.steps
+        || aerial_perspective_state.max_distance != pre.max_distance
+        || aerial_perspective_state.atmosphere_luts_version != pre.atmosphere_luts_version
+        || aerial_perspective_state.program != pre.program;
+    if (aerial_perspective_changed) { // For Volumetric Cloud
         PERF_MARKER("AerialPerspective")
         GLBindImageTextures({ aerial_perspective_luminance_texture_.id(), aerial_perspective_transmittance_texture_.id() });
         glUseProgram(aerial_perspective_program_.id());
         aerial_perspective_program_.Dispatch({ kAerialPerspectiveTextureWidth, kAerialPerspectiveTextureHeight, aerial_perspective_lut_depth_ });
+
+        aerial_perspective_state_ = aerial_perspective_state;
+        aerial_perspective_valid_ = true;
     }
     glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
-    {
-        PERF_MARKER("EnvironmentLuminance")
-        GLBindImageTextures({ environment_luminance_texture_.id() });
-        glUseProgram(environment_luminance_program_.id());
-        environment_luminance_program_.Dispatch({ kEnvironmentLuminanceTextureWidth, kEnvironmentLuminanceTextureWidth, 6 });
-    }
-    glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
-    glGenerateTextureMipmap(environment_luminance_texture_.id());
 
-    ibl_.Precompute(environment_luminance_texture_.id());
-    bind_textures();
+    UpdateEnvironment();
+    bind_textures(); // The environment may have been swapped
+    glBindBufferBase(GL_UNIFORM_BUFFER, 2, ibl_.env_radiance_sh_buffer());
     {
         PERF_MARKER("Render")
         glUseProgram(render_program_.id());
         ScreenRectangle::Instance().Draw();
     }
 }
+
+bool AtmosphereRenderer::NeedsSkyViewUpdate(const SkyViewState& state) const {
+    if (!update_scheduler_enable_ || !sky_view_valid_)
+        return true;
+    if (update_max_interval_ > 0 && frames_since_sky_view_update_ >= update_max_interval_)
+        return true;
+    const auto& pre = sky_view_state_;
+    if (state.atmosphere_luts_version != pre.atmosphere_luts_version
+        || state.program != pre.program
+        || state.moon_position != pre.moon_position
+        || state.moon_radius != pre.moon_radius
+        || state.sky_view_lut_steps != pre.sky_view_lut_steps
+        || state.up_direction != pre.up_direction
+        || state.light_view_projection != pre.light_view_projection
+        || state.cloud_shadow_map_mat != pre.cloud_shadow_map_mat
+        || state.inv_shadow_froxel_max_distance != pre.inv_shadow_froxel_max_distance
+        || state.cloud_shadow_map != pre.cloud_shadow_map
+        || state.cloud_shadow_froxel != pre.cloud_shadow_froxel)
+        return true;
+    auto cos_angle = glm::clamp(glm::dot(state.sun_direction, pre.sun_direction), -1.0f, 1.0f);
+    if (glm::degrees(std::acos(cos_angle)) > update_sun_angle_threshold_)
+        return true;
+    return std::abs(state.altitude - pre.altitude) > update_altitude_threshold_;
+}
+
+void AtmosphereRenderer::UpdateEnvironment() {
+    if (environment_stage_ == kEnvironmentStageIdle)
+        return;
+    // Without the scheduler, or with nothing to show yet, everything is done in one frame
+    auto time_sliced = update_scheduler_enable_ && environment_valid_;
+    auto face_budget = time_sliced ? environment_faces_per_frame_ : kEnvironmentStageMipmap;
+    auto level_budget = time_sliced ? prefilter_levels_per_frame_ : IBL::kRoughnessCount;
+    auto back_texture = environment_luminance_textures_[environment_front_ ^ 1].id();
+    while (environment_stage_ != kEnvironmentStageIdle) {
+        if (environment_stage_ < kEnvironmentStageMipmap) {
+            if (face_budget == 0)
+                break;
+            PERF_MARKER("EnvironmentLuminance")
+            auto count = std::min(face_budget, kEnvironmentStageMipmap - environment_stage_);
+            GLBindImageTextures({ back_texture });
+            glUseProgram(environment_luminance_program_.id());
+            glUniform1i(0, environment_stage_);
+            environment_luminance_program_.Dispatch({ kEnvironmentLuminanceTextureWidth, kEnvironmentLuminanceTextureWidth, count });
+            face_budget -= count;
+            environment_stage_ += count;
+        }
+        else if (environment_stage_ == kEnvironmentStageMipmap) {
+            glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+            glGenerateTextureMipmap(back_texture);
+            ibl_.ComputeSH(back_texture);
+            ++environment_stage_;
+        }
+        else {
+            if (level_budget == 0)
+                break;
+            auto count = std::min(level_budget, kEnvironmentStageCount - environment_stage_);
+            ibl_.Prefilter(back_texture, environment_stage_ - kEnvironmentStagePrefilter, count);
+            level_budget -= count;
+            environment_stage_ += count;
+            if (environment_stage_ == kEnvironmentStageCount) {
+                environment_front_ ^= 1;
+                ibl_.Swap();
+                environment_valid_ = true;
+                environment_stage_ = environment_dirty_ ? 0 : kEnvironmentStageIdle;
+                environment_dirty_ = false;
+                break;
+            }
+        }
+    }
+}
@@ -52,6 +52,16 @@ struct AtmosphereRenderInitParameters : public ISerializable {
     bool aerial_perspective_lut_dither_sample_point_enable = false;
     GLsizei aerial_perspective_lut_depth = 32;
 
+    // Sky view LUT, environment cubemap and IBL are only refreshed when the sun direction or the camera
+    // altitude moved more than the thresholds, or any other input changed (up direction, shadow
+    // matrices, cloud shadow, atmosphere...), and the refresh of the cubemap and IBL is spread over frames
+    bool update_scheduler_enable = true;
+    float update_sun_angle_threshold = 0.05f; // degree
+    float update_altitude_threshold = 0.001f; // km
+    int update_max_interval = 120; // frames before a forced refresh (moon, clouds...), 0 to disable
+    int environment_faces_per_frame = 2;
+    int prefilter_levels_per_frame = 2;
+
     FIELD_DECLARATION_BEGIN(ISerializable)
         FIELD_DECLARE(pcss_enable)
         FIELD_DECLARE(volumetric_light_enable)
@@ -62,6 +72,12 @@ struct AtmosphereRenderInitParameters : public ISerializable {
         FIELD_DECLARE(use_aerial_perspective_lut)
         FIELD_DECLARE(aerial_perspective_lut_dither_sample_point_enable)
         FIELD_DECLARE(aerial_perspective_lut_depth)
+        FIELD_DECLARE(update_scheduler_enable)
+        FIELD_DECLARE(update_sun_angle_threshold)
+        FIELD_DECLARE(update_altitude_threshold)
+        FIELD_DECLARE(update_max_interval)
+        FIELD_DECLARE(environment_faces_per_frame)
+        FIELD_DECLARE(prefilter_levels_per_frame)
     FIELD_DECLARATION_END()
 };
 
@@ -74,7 +90,13 @@ inline bool operator==(const AtmosphereRenderInitParameters& lhs, const Atmosphe
         && lhs.sky_view_lut_dither_sample_point_enable == rhs.sky_view_lut_dither_sample_point_enable
         && lhs.use_aerial_perspective_lut == rhs.use_aerial_perspective_lut
         && lhs.aerial_perspective_lut_dither_sample_point_enable == rhs.aerial_perspective_lut_dither_sample_point_enable
-        && lhs.aerial_perspective_lut_depth == rhs.aerial_perspective_lut_depth;
+        && lhs.aerial_perspective_lut_depth == rhs.aerial_perspective_lut_depth
+        && lhs.update_scheduler_enable == rhs.update_scheduler_enable
+        && lhs.update_sun_angle_threshold == rhs.update_sun_angle_threshold
+        && lhs.update_altitude_threshold == rhs.update_altitude_threshold
+        && lhs.update_max_interval == rhs.update_max_interval
+        && lhs.environment_faces_per_frame == rhs.environment_faces_per_frame
+        && lhs.prefilter_levels_per_frame == rhs.prefilter_levels_per_frame;
 }
 
 inline bool operator!=(const AtmosphereRenderInitParameters& lhs, const AtmosphereRenderInitParameters& rhs) {
@@ -104,13 +126,73 @@ public:
     }
 
     GLuint environment_luminance_texture() const {
-        return environment_luminance_texture_.id();
+        return environment_luminance_textures_[environment_front_].id();
+    }
+
+    // True while the environment map is being refreshed over several frames. The refresh writes
+    // back textures and swaps them in once complete, so the environment is never sampled half written.
+    bool environment_updating() const {
+        return environment_stage_ != kEnvironmentStageIdle;
     }
 
 private:
+    // Inputs of the sky view LUT at its last refresh
+    struct SkyViewState {
+        glm::vec3 sun_direction{};
+        float altitude = -1.0f;
+        glm::vec3 up_direction{};
+        float inv_shadow_froxel_max_distance = 0.0f;
+        glm::mat4 light_view_projection{};
+        glm::mat4 cloud_shadow_map_mat{};
+        GLuint cloud_shadow_map = 0;
+        GLuint cloud_shadow_froxel = 0;
+        glm::vec3 moon_position{};
+        float moon_radius = 0.0f;
+        float sky_view_lut_steps = 0.0f;
+        uint64_t atmosphere_luts_version = 0;
+        GLuint program = 0;
+    };
+
+    // Inputs of the aerial perspective LUT at its last refresh
+    struct AerialPerspectiveState {
+        glm::mat4 inv_view_projection{};
+        glm::vec3 camera_position{};
+        glm::vec3 sun_direction{};
+        float steps = 0.0f;
+        float max_distance = 0.0f;
+        uint64_t atmosphere_luts_version = 0;
+        GLuint program = 0;
+    };
+
+    // Environment cubemap faces, then mipmaps and SH, then prefiltered roughness levels
+    static constexpr int kEnvironmentStageMipmap = 6;
+    static constexpr int kEnvironmentStagePrefilter = kEnvironmentStageMipmap + 1;
+    static constexpr int kEnvironmentStageCount = kEnvironmentStagePrefilter + IBL::kRoughnessCount;
+    static constexpr int kEnvironmentStageIdle = -1;
+
+    bool NeedsSkyViewUpdate(const SkyViewState& state) const;
+
+    void UpdateEnvironment();
+
     glm::vec3 sun_direction_{};
     float aerial_perspective_lut_max_distance_{};
 
+    bool update_scheduler_enable_;
+    float update_sun_angle_threshold_;
+    float update_altitude_threshold_;
+    int update_max_interval_;
+    int environment_faces_per_frame_;
+    int prefilter_levels_per_frame_;
+
+    SkyViewState sky_view_state_;
+    AerialPerspectiveState aerial_perspective_state_;
+    bool sky_view_valid_ = false;
+    bool aerial_perspective_valid_ = false;
+    int frames_since_sky_view_update_ = 0;
+    int environment_stage_ = kEnvironmentStageIdle;
+    bool environment_dirty_ = false; // sky view changed while the environment was being updated
+    bool environment_valid_ = false; // front textures hold a complete refresh
+
     bool use_sky_view_lut_;
     bool use_aerial_perspective_lut_;
     GLsizei aerial_perspective_lut_depth_;
@@ -121,7 +203,8 @@ private:
     GLTexture sky_view_transmittance_texture_;
     GLTexture aerial_perspective_luminance_texture_;
     GLTexture aerial_perspective_transmittance_texture_;
-    GLTexture environment_luminance_texture_;
+    GLTexture environment_luminance_textures_[2];
+    int environment_front_ = 0;
 
     GLReloadableComputeProgram sky_view_program_;
     GLReloadableComputeProgram aerial_perspective_program_;
@@ -0,0 +1,56 @@
+#include "CameraTrack.h"
+
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <stdexcept>
+
+#include <rapidjson/error/en.h>
+
+void CameraTrack::Load(const char* path) {
+    std::ifstream fin(path);
+    if (!fin)
+        throw std::runtime_error(std::string("Read file failed: ") + path);
+    using namespace rapidjson;
+    auto str = std::string(std::istreambuf_iterator<char>{fin}, {});
+    Document d;
+    if (d.Parse<kParseCommentsFlag | kParseTrailingCommasFlag>(str.c_str()).HasParseError()) {
+        std::ostringstream msg;
+        msg << "Failed to parse \"" << path << "\" (" << "offset " << d.GetErrorOffset() << "): " << GetParseError_En(d.GetParseError());
+        throw std::runtime_error(msg.str());
+    }
+    Deserialize(d);
+    if (keyframes.empty())
+        throw std::runtime_error(std::string("No keyframe in ") + path);
+    if (frame_rate <= 0.0f)
+        throw std::runtime_error(std::string("Invalid frame rate in ") + path);
+    std::stable_sort(keyframes.begin(), keyframes.end(),
+        [](const CameraKeyframe& lhs, const CameraKeyframe& rhs) { return lhs.time < rhs.time; });
+}
+
+float CameraTrack::duration() const {
+    return keyframes.empty() ? 0.0f : keyframes.back().time - keyframes.front().time;
+}
+
+CameraKeyframe CameraTrack::Sample(float time) const {
+    if (keyframes.empty())
+        return {};
+    if (time <= keyframes.front().time)
+        return keyframes.front();
+    if (time >= keyframes.back().time)
+        return keyframes.back();
+    auto next = std::upper_bound(keyframes.begin(), keyframes.end(), time,
+        [](float t, const CameraKeyframe& keyframe) { return t < keyframe.time; });
+    const auto& b = *next;
+    const auto& a = *(next - 1);
+    auto t = b.time > a.time ? (time - a.time) / (b.time - a.time) : 1.0f;
+
+    CameraKeyframe out;
+    out.time = time;
+    out.camera_position = glm::mix(a.camera_position, b.camera_position, t);
+    out.camera_yaw = glm::mix(a.camera_yaw, b.camera_yaw, t);
+    out.camera_pitch = glm::mix(a.camera_pitch, b.camera_pitch, t);
+    out.sun_direction_theta = glm::mix(a.sun_direction_theta, b.sun_direction_theta, t);
+    out.sun_direction_phi = glm::mix(a.sun_direction_phi, b.sun_direction_phi, t);
+    return out;
+}
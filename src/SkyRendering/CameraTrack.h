@@ -0,0 +1,44 @@
+#pragma once
+
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "Serialization.h"
+
+struct CameraKeyframe : public ISerializable {
+    float time = 0.0f; // second
+    glm::vec3 camera_position{ 0.0f, 1.0f, -1.0f };
+    float camera_yaw = 180.0f;
+    float camera_pitch = 0.0f;
+    float sun_direction_theta = 70.0f;
+    float sun_direction_phi = 180.0f;
+
+    FIELD_DECLARATION_BEGIN(ISerializable)
+        FIELD_DECLARE(time)
+        FIELD_DECLARE(camera_position)
+        FIELD_DECLARE(camera_yaw)
+        FIELD_DECLARE(camera_pitch)
+        FIELD_DECLARE(sun_direction_theta)
+        FIELD_DECLARE(sun_direction_phi)
+    FIELD_DECLARATION_END()
+};
+
+// Camera/sun keyframes used by the headless renderer. Keyframes are sorted by time
+// and linearly interpolated.
+class CameraTrack : public ISerializable {
+public:
+    float frame_rate = 30.0f;
+    std::vector<CameraKeyframe> keyframes;
+
+    FIELD_DECLARATION_BEGIN(ISerializable)
+        FIELD_DECLARE(frame_rate)
+        FIELD_DECLARE(keyframes)
+    FIELD_DECLARATION_END()
+
+    void Load(const char* path);
+
+    float duration() const;
+
+    CameraKeyframe Sample(float time) const;
+};
@@ -0,0 +1,92 @@
+#include "CloudDensityReference.h"
+
+#include <cmath>
+#include <stdexcept>
+
+static int WrapTexel(int i, int size, Samplers::Wrap wrap) {
+    if (wrap == Samplers::Wrap::REPEAT) {
+        i %= size;
+        return i < 0 ? i + size : i;
+    }
+    return glm::clamp(i, 0, size - 1);
+}
+
+ReferenceTexture::ReferenceTexture(GLuint texture, int channels, Samplers::Wrap wrap)
+    : channels_(channels), wrap_(wrap) {
+    constexpr GLenum kFormats[] = { GL_RED, GL_RG, GL_RGB, GL_RGBA };
+    if (channels < 1 || channels > 4)
+        throw std::runtime_error("Invalid reference texture channel count");
+    GLint target = 0, level_count = 0;
+    glGetTextureParameteriv(texture, GL_TEXTURE_TARGET, &target);
+    glGetTextureParameteriv(texture, GL_TEXTURE_IMMUTABLE_LEVELS, &level_count);
+    is_3d_ = target == GL_TEXTURE_3D;
+
+    // Noise textures are written with imageStore
+    glMemoryBarrier(GL_TEXTURE_UPDATE_BARRIER_BIT);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    levels_.resize(glm::max(level_count, 1));
+    for (int i = 0; i < static_cast<int>(levels_.size()); ++i) {
+        auto& level = levels_[i];
+        glGetTextureLevelParameteriv(texture, i, GL_TEXTURE_WIDTH, &level.size.x);
+        glGetTextureLevelParameteriv(texture, i, GL_TEXTURE_HEIGHT, &level.size.y);
+        glGetTextureLevelParameteriv(texture, i, GL_TEXTURE_DEPTH, &level.size.z);
+        level.texels.resize(static_cast<size_t>(level.size.x) * level.size.y * level.size.z * channels);
+        glGetTextureImage(texture, i, kFormats[channels - 1], GL_UNSIGNED_BYTE,
+            static_cast<GLsizei>(level.texels.size()), level.texels.data());
+    }
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+}
+
+glm::vec4 ReferenceTexture::Fetch(int level, glm::ivec3 texel) const {
+    const auto& l = levels_[level];
+    auto x = WrapTexel(texel.x, l.size.x, wrap_);
+    auto y = WrapTexel(texel.y, l.size.y, wrap_);
+    auto z = is_3d_ ? WrapTexel(texel.z, l.size.z, wrap_) : 0;
+    const auto* p = &l.texels[((static_cast<size_t>(z) * l.size.y + y) * l.size.x + x) * channels_];
+    glm::vec4 value(0.0f, 0.0f, 0.0f, 1.0f);
+    for (int c = 0; c < channels_; ++c)
+        value[c] = p[c] * (1.0f / 255.0f);
+    return value;
+}
+
+glm::vec4 ReferenceTexture::SampleNearest(int level, glm::vec3 uvw) const {
+    auto texel = glm::ivec3(glm::floor(uvw * glm::vec3(levels_[level].size)));
+    return Fetch(level, texel);
+}
+
+glm::vec4 ReferenceTexture::SampleLinear(int level, glm::vec3 uvw) const {
+    auto p = uvw * glm::vec3(levels_[level].size) - 0.5f;
+    auto p0 = glm::floor(p);
+    auto f = p - p0;
+    auto i0 = glm::ivec3(p0);
+    auto bilinear = [&](int z) {
+        return glm::mix(
+            glm::mix(Fetch(level, { i0.x, i0.y, z }), Fetch(level, { i0.x + 1, i0.y, z }), f.x),
+            glm::mix(Fetch(level, { i0.x, i0.y + 1, z }), Fetch(level, { i0.x + 1, i0.y + 1, z }), f.x),
+            f.y);
+    };
+    if (!is_3d_)
+        return bilinear(0);
+    return glm::mix(bilinear(i0.z), bilinear(i0.z + 1), f.z);
+}
+
+// Level selection and filters of the GL specification (8.14), with GL_LINEAR magnification
+glm::vec4 ReferenceTexture::SampleLod(glm::vec3 uvw, float lod, Samplers::MipmapMin min_filter) const {
+    auto max_level = static_cast<int>(levels_.size()) - 1;
+    if (!(lod > 0.0f))
+        return SampleLinear(0, uvw);
+    auto linear_texel = min_filter == Samplers::MipmapMin::LINEAR_MIPMAP_NEAREST
+        || min_filter == Samplers::MipmapMin::LINEAR_MIPMAP_LINEAR;
+    auto sample = [&](int level) {
+        return linear_texel ? SampleLinear(level, uvw) : SampleNearest(level, uvw);
+    };
+    if (min_filter == Samplers::MipmapMin::NEAREST_MIPMAP_NEAREST
+            || min_filter == Samplers::MipmapMin::LINEAR_MIPMAP_NEAREST) {
+        auto level = lod <= 0.5f ? 0 : static_cast<int>(std::ceil(lod + 0.5f)) - 1;
+        return sample(glm::min(level, max_level));
+    }
+    if (lod >= static_cast<float>(max_level))
+        return sample(max_level);
+    auto level = static_cast<int>(lod);
+    return glm::mix(sample(level), sample(level + 1), lod - static_cast<float>(level));
+}
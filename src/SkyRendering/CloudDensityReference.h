@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "gl.hpp"
+#include "Samplers.h"
+
+// Density lookups of a packet of rays, structure of arrays so that one virtual call serves all
+// lanes. Materials loop over the lanes in scalar code. Only the first count lanes are valid.
+struct CloudDensityPacket {
+    static constexpr int kMaxLanes = 8;
+
+    int count = 0;
+    float x[kMaxLanes];
+    float y[kMaxLanes];
+    float z[kMaxLanes];
+    float height01[kMaxLanes];
+};
+
+// CPU copy of the density of a cloud material, the SampleSigmaT of its shader, used by
+// CloudPathTracerReference. It is created from the GL state of the material (see
+// IVolumetricCloudMaterial::CreateDensityReference) and used without a context, from any thread.
+class ICloudDensityReference {
+public:
+    virtual ~ICloudDensityReference() = default;
+
+    virtual void SampleSigmaT(const CloudDensityPacket& packet, float* sigma_t) const = 0;
+};
+
+// 8-bit normalized 2D or 3D texture read back with its mip chain, sampled like textureLod with
+// GL_LINEAR magnification
+class ReferenceTexture {
+public:
+    ReferenceTexture() = default;
+    ReferenceTexture(GLuint texture, int channels, Samplers::Wrap wrap);
+
+    glm::vec4 Fetch(int level, glm::ivec3 texel) const;
+    glm::vec4 SampleLod(glm::vec3 uvw, float lod, Samplers::MipmapMin min_filter) const;
+
+private:
+    struct Level {
+        glm::ivec3 size;
+        std::vector<uint8_t> texels;
+    };
+
+    glm::vec4 SampleNearest(int level, glm::vec3 uvw) const;
+    glm::vec4 SampleLinear(int level, glm::vec3 uvw) const;
+
+    int channels_ = 1;
+    bool is_3d_ = false;
+    Samplers::Wrap wrap_ = Samplers::Wrap::REPEAT;
+    std::vector<Level> levels_;
+};
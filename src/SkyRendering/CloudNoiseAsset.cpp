@@ -0,0 +1,204 @@
+#include "CloudNoiseAsset.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <filesystem>
+#include <algorithm>
+#include <vector>
+#include <stdexcept>
+#include <cstring>
+
+#include <rapidjson/document.h>
+#include <rapidjson/error/en.h>
+
+#include "MappedFile.h"
+#include "Utils.h"
+#include "VolumetricCloudDefaultMaterial.h"
+
+constexpr char kCloudNoiseDirectory[] = "cloud_noise";
+// Least recently used assets beyond this size are deleted whenever one is written
+constexpr uintmax_t kCloudNoiseCacheBytes = 64ull << 20;
+constexpr uint32_t kCloudNoiseMagic = 0x31534e43; // "CNS1"
+
+struct CloudNoiseAssetHeader {
+    uint32_t magic;
+    uint32_t channels;
+    uint64_t parameter_hash;
+    uint32_t width;
+    uint32_t height;
+    uint32_t depth;
+    uint32_t padding;
+};
+
+uint64_t ComputeCloudNoiseHash(const char* tag, int size, const void* buffer, size_t buffer_size) {
+    auto hash = Fnv1a(kFnv1aOffsetBasis, tag, strlen(tag));
+    hash = Fnv1a(hash, &size, sizeof(size));
+    hash = Fnv1a(hash, &kCloudNoiseBakerVersion, sizeof(kCloudNoiseBakerVersion));
+    return Fnv1a(hash, buffer, buffer_size);
+}
+
+std::string GetCloudNoiseAssetPath(uint64_t hash) {
+    std::stringstream ss;
+    ss << std::hex << std::setw(16) << std::setfill('0') << hash << ".noise";
+    return (std::filesystem::path(kCloudNoiseDirectory) / ss.str()).string();
+}
+
+// Loading an asset bumps its write time, so the oldest ones are the least recently used
+static void EvictCloudNoiseAssets(const std::filesystem::path& directory, const std::filesystem::path& keep) {
+    namespace fs = std::filesystem;
+    struct Asset {
+        fs::path path;
+        fs::file_time_type time;
+        uintmax_t size;
+    };
+    std::vector<Asset> assets;
+    uintmax_t total = 0;
+    std::error_code ec;
+    for (fs::directory_iterator itr(directory, ec), end; !ec && itr != end; itr.increment(ec)) {
+        if (itr->path().extension() != ".noise")
+            continue;
+        Asset asset{ itr->path(), itr->last_write_time(ec), itr->file_size(ec) };
+        if (ec)
+            return;
+        total += asset.size;
+        assets.push_back(std::move(asset));
+    }
+    std::sort(assets.begin(), assets.end(), [](const Asset& a, const Asset& b) { return a.time < b.time; });
+    for (const auto& asset : assets) {
+        if (total <= kCloudNoiseCacheBytes)
+            break;
+        if (fs::equivalent(asset.path, keep, ec) || !fs::remove(asset.path, ec))
+            continue;
+        total -= asset.size;
+    }
+}
+
+bool WriteCloudNoiseAsset(const char* path, uint64_t hash, const CloudNoiseImage& image) {
+    CloudNoiseAssetHeader header{ kCloudNoiseMagic, static_cast<uint32_t>(image.channels), hash,
+        static_cast<uint32_t>(image.width), static_cast<uint32_t>(image.height), static_cast<uint32_t>(image.depth), 0 };
+
+    auto written = WriteFileAtomically(path, [&](std::ostream& fout) {
+        fout.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        fout.write(reinterpret_cast<const char*>(image.texels.data()), image.texels.size());
+    });
+    if (!written)
+        return false;
+    auto directory = std::filesystem::path(path).parent_path();
+    EvictCloudNoiseAssets(directory.empty() ? std::filesystem::path(".") : directory, path);
+    return true;
+}
+
+static void UploadCloudNoise(GLuint texture, int width, int height, int depth, int channels, const void* texels) {
+    GLenum format = channels == 1 ? GL_RED : channels == 2 ? GL_RG : GL_RGBA;
+    // Rows of one or two channel textures are not 4-byte aligned in general
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    if (depth > 1)
+        glTextureSubImage3D(texture, 0, 0, 0, 0, width, height, depth, format, GL_UNSIGNED_BYTE, texels);
+    else
+        glTextureSubImage2D(texture, 0, 0, 0, width, height, format, GL_UNSIGNED_BYTE, texels);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+}
+
+void UploadCloudNoise(GLuint texture, const CloudNoiseImage& image) {
+    UploadCloudNoise(texture, image.width, image.height, image.depth, image.channels, image.texels.data());
+}
+
+static bool UploadCloudNoiseAsset(const char* path, uint64_t hash, GLuint texture, int width, int height, int depth) {
+    MappedFile file(path);
+    if (!file || file.size() < sizeof(CloudNoiseAssetHeader))
+        return false;
+    auto bytes = static_cast<const char*>(file.data());
+    CloudNoiseAssetHeader header;
+    memcpy(&header, bytes, sizeof(header));
+    if (header.magic != kCloudNoiseMagic || header.parameter_hash != hash)
+        return false;
+    if (header.width != static_cast<uint32_t>(width) || header.height != static_cast<uint32_t>(height)
+            || header.depth != static_cast<uint32_t>(depth))
+        return false;
+    if (header.channels != 1 && header.channels != 2 && header.channels != 4)
+        return false;
+    uint64_t texel_size = uint64_t(header.width) * header.height * header.depth * header.channels;
+    if (sizeof(header) + texel_size > file.size())
+        return false;
+
+    UploadCloudNoise(texture, width, height, depth, header.channels, bytes + sizeof(header));
+    return true;
+}
+
+bool LoadCloudNoiseAsset(const char* path, uint64_t hash, GLuint texture, int width, int height, int depth) {
+    if (!UploadCloudNoiseAsset(path, hash, texture, width, height, depth))
+        return false;
+    // Once unmapped, for EvictCloudNoiseAssets
+    std::error_code ec;
+    std::filesystem::last_write_time(path, std::filesystem::file_time_type::clock::now(), ec);
+    return true;
+}
+
+static void ReadNoiseCreateInfo(const rapidjson::Value& common, const std::string& name, NoiseCreateInfo& info) {
+    // Missing fields keep their defaults, as in ISerializable::Deserialize
+    auto find = [&](const char* field) -> const rapidjson::Value* {
+        auto member = common.FindMember((name + "." + field).c_str());
+        if (member != common.MemberEnd() && member->value.IsNumber())
+            return &member->value;
+        std::cerr << "Field \"" << name << "." << field << "\" not found" << std::endl;
+        return nullptr;
+    };
+    if (auto value = find("seed"))
+        info.seed = value->GetInt();
+    if (auto value = find("base_frequency"))
+        info.base_frequency = value->GetInt();
+    if (auto value = find("remap_min"))
+        info.remap_min = value->GetFloat();
+    if (auto value = find("remap_max"))
+        info.remap_max = value->GetFloat();
+}
+
+template<class BufferType>
+static void BakeCloudNoiseAsset(const BufferType& buffer, const char* config_path) {
+    auto hash = ComputeCloudNoiseHash(BufferType::kTag, BufferType::kSize, &buffer, sizeof(buffer));
+    auto path = GetCloudNoiseAssetPath(hash);
+    if (!WriteCloudNoiseAsset(path.c_str(), hash, buffer.Bake()))
+        throw std::runtime_error("Write file failed: " + path);
+    std::cout << "\"" << config_path << "\" " << BufferType::kTag << " -> " << path << std::endl;
+}
+
+void BakeCloudNoiseAssets(const std::vector<const char*>& config_paths) {
+    for (auto config_path : config_paths) {
+        using namespace rapidjson;
+        auto str = ReadFile(config_path);
+        Document d;
+        if (d.Parse<kParseCommentsFlag | kParseTrailingCommasFlag>(str.c_str()).HasParseError()) {
+            std::ostringstream msg;
+            msg << "Failed to parse \"" << config_path << "\" (" << "offset " << d.GetErrorOffset() << "): " << GetParseError_En(d.GetParseError());
+            throw std::runtime_error(msg.str());
+        }
+        // volumetric_cloud_.material.data.materail_common_ of both default materials
+        const Value* common = nullptr;
+        if (d.IsObject() && d.HasMember("volumetric_cloud_")) {
+            const auto& cloud = d["volumetric_cloud_"];
+            if (cloud.HasMember("material") && cloud["material"].HasMember("data")
+                    && cloud["material"]["data"].HasMember("materail_common_"))
+                common = &cloud["material"]["data"]["materail_common_"];
+        }
+        if (common == nullptr) {
+            std::cout << "\"" << config_path << "\" has no default cloud material, skipped" << std::endl;
+            continue;
+        }
+
+        CloudMapBuffer cloud_map;
+        ReadNoiseCreateInfo(*common, "cloud_map_.buffer.uDensity", cloud_map.uDensity);
+        ReadNoiseCreateInfo(*common, "cloud_map_.buffer.uHeight", cloud_map.uHeight);
+        BakeCloudNoiseAsset(cloud_map, config_path);
+
+        DetailBuffer detail;
+        ReadNoiseCreateInfo(*common, "detail_.buffer.uPerlin", detail.uPerlin);
+        ReadNoiseCreateInfo(*common, "detail_.buffer.uWorley", detail.uWorley);
+        BakeCloudNoiseAsset(detail, config_path);
+
+        DisplacementBuffer displacement;
+        ReadNoiseCreateInfo(*common, "displacement_.buffer.uPerlin", displacement.uPerlin);
+        BakeCloudNoiseAsset(displacement, config_path);
+    }
+}
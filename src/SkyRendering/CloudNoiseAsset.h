@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "gl.hpp"
+#include "CloudNoiseBaker.h"
+
+// Baked cloud noise textures, stored as cloud_noise/<hash>.noise: header with the parameter
+// hash and image size, then the level 0 texels. Mips are generated after uploading. The
+// directory is capped, writing an asset deletes the least recently loaded ones beyond the cap.
+
+// Covers the generator tag, the texture size, the NoiseCreateInfo parameters in buffer and
+// kCloudNoiseBakerVersion
+uint64_t ComputeCloudNoiseHash(const char* tag, int size, const void* buffer, size_t buffer_size);
+
+std::string GetCloudNoiseAssetPath(uint64_t hash);
+
+bool WriteCloudNoiseAsset(const char* path, uint64_t hash, const CloudNoiseImage& image);
+
+// Level 0 of a 2D (depth 1) or 3D texture with 1, 2 or 4 channels
+void UploadCloudNoise(GLuint texture, const CloudNoiseImage& image);
+
+// Maps the file and uploads it to level 0 of texture. Returns false without touching the
+// texture if the file is missing, the hash differs or the size is not width x height x depth.
+bool LoadCloudNoiseAsset(const char* path, uint64_t hash, GLuint texture, int width, int height, int depth);
+
+// Bakes the noise of the default cloud material of each config on the CPU, no GL context needed
+void BakeCloudNoiseAssets(const std::vector<const char*>& config_paths);
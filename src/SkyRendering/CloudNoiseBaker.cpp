@@ -0,0 +1,318 @@
+#include "CloudNoiseBaker.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "Utils.h"
+
+// Image rows are shaded kLanes neighbouring texels at a time, one per lane, so that the hashes
+// shared by a batch are computed once. The loops stay scalar: the gradient and feature point
+// lookups are per-lane table reads, so no vectorization is assumed. The nested WangHash of Perlin corners and Worley neighbour cells computes its inner
+// z and y terms once for all corners or cells that share them, and Worley octaves with no more
+// cells than the image has texels read feature points from a table built once per bake.
+constexpr int kLanes = 8;
+constexpr int kOctaves = 8;
+
+// kPerlinGradients of Noise.glsl, one array per component
+static const float kGradientX[16] = { 1, -1, 1, -1, 1, -1, 1, -1, 0, 0, 0, 0, 1, -1, 0, 0 };
+static const float kGradientY[16] = { 1, 1, -1, -1, 0, 0, 0, 0, 1, -1, 1, -1, 1, 1, -1, -1 };
+static const float kGradientZ[16] = { 0, 0, 0, 0, 1, 1, -1, -1, 1, 1, -1, -1, 0, 0, 1, -1 };
+
+// Texel coordinates of a batch, in [0, 1)
+struct NoiseBatch {
+    float x[kLanes];
+    float y[kLanes];
+    float z[kLanes];
+};
+
+static uint32_t WangHash(uint32_t seed) {
+    seed = (seed ^ 61) ^ (seed >> 16);
+    seed *= 9;
+    seed = seed ^ (seed >> 4);
+    seed *= 0x27d4eb2d;
+    seed = seed ^ (seed >> 15);
+    return seed;
+}
+
+static float Mix(float x, float y, float a) {
+    return x * (1.0f - a) + y * a;
+}
+
+// Lattice index of coordinate p * freq, p in [0, 1], wrapped to [0, freq) without a division
+static int WrapLattice(int i, int freq) {
+    i += i < 0 ? freq : 0;
+    return i >= freq ? i - freq : i;
+}
+
+static void PerlinNoise(const NoiseBatch& p, uint32_t freq, uint32_t seed, float* result) {
+    const float f = static_cast<float>(freq);
+    const int n = static_cast<int>(freq);
+    uint32_t lattice[3][2][kLanes];
+    float t[3][kLanes];
+    float fade[3][kLanes];
+    const float* coords[3] = { p.x, p.y, p.z };
+    for (int a = 0; a < 3; ++a) {
+        for (int l = 0; l < kLanes; ++l) {
+            float x = coords[a][l] * f;
+            float x0 = std::floor(x);
+            lattice[a][0][l] = static_cast<uint32_t>(WrapLattice(static_cast<int>(x0), n));
+            lattice[a][1][l] = static_cast<uint32_t>(WrapLattice(static_cast<int>(std::ceil(x)), n));
+            t[a][l] = x - x0;
+            fade[a][l] = t[a][l] * t[a][l] * t[a][l] * (t[a][l] * (t[a][l] * 6.0f - 15.0f) + 10.0f);
+        }
+    }
+
+    // WangHash(seed + WangHash(i + WangHash(j + WangHash(k)))), inner levels shared by corners
+    uint32_t hash_k[2][kLanes];
+    uint32_t hash_jk[2][2][kLanes];
+    for (int k = 0; k < 2; ++k) {
+        for (int l = 0; l < kLanes; ++l)
+            hash_k[k][l] = WangHash(lattice[2][k][l]);
+        for (int j = 0; j < 2; ++j) {
+            for (int l = 0; l < kLanes; ++l)
+                hash_jk[k][j][l] = WangHash(lattice[1][j][l] + hash_k[k][l]);
+        }
+    }
+    float corner[2][2][2][kLanes];
+    for (int k = 0; k < 2; ++k) {
+        for (int j = 0; j < 2; ++j) {
+            for (int i = 0; i < 2; ++i) {
+                uint32_t gradient[kLanes];
+                for (int l = 0; l < kLanes; ++l)
+                    gradient[l] = WangHash(seed + WangHash(lattice[0][i][l] + hash_jk[k][j][l])) & 0xf;
+                for (int l = 0; l < kLanes; ++l) {
+                    auto g = gradient[l];
+                    corner[k][j][i][l] = kGradientX[g] * (t[0][l] - i) + kGradientY[g] * (t[1][l] - j) + kGradientZ[g] * (t[2][l] - k);
+                }
+            }
+        }
+    }
+    for (int l = 0; l < kLanes; ++l) {
+        float u = fade[0][l];
+        float v = fade[1][l];
+        float w = fade[2][l];
+        result[l] = Mix(Mix(Mix(corner[0][0][0][l], corner[0][0][1][l], u),
+                            Mix(corner[0][1][0][l], corner[0][1][1][l], u), v),
+                        Mix(Mix(corner[1][0][0][l], corner[1][0][1][l], u),
+                            Mix(corner[1][1][0][l], corner[1][1][1][l], u), v), w);
+    }
+}
+
+// Feature point of a Worley cell relative to its corner, from three hashes that only differ in
+// the innermost WangHash(z + c)
+static float FeatureOffset(uint32_t seed, uint32_t x, uint32_t hash_yz) {
+    return static_cast<float>(WangHash(seed + WangHash(x + hash_yz))) / 4294967296.0f;
+}
+
+// One FBM layer prepared for a bake. Worley octaves with fewer cells than the image has texels
+// get a table of all their feature points, so texels look them up instead of hashing 27 cells.
+struct FbmLayer {
+    NoiseCreateInfo info;
+    std::vector<float> feature_points[kOctaves]; // xyz per cell, x fastest; empty: hash per texel
+};
+
+static FbmLayer PrepareLayer(const NoiseCreateInfo& info, bool worley, size_t texel_count, unsigned thread_count) {
+    FbmLayer layer{ info, {} };
+    if (!worley)
+        return layer;
+    auto seed = static_cast<uint32_t>(info.seed);
+    auto freq = static_cast<uint32_t>(info.base_frequency);
+    for (int c = 0; c < kOctaves; ++c, freq *= 2) {
+        auto cell_count = static_cast<size_t>(freq) * freq * freq;
+        if (freq == 0 || cell_count > texel_count)
+            break;
+        auto& points = layer.feature_points[c];
+        points.resize(cell_count * 3);
+        ParallelFor(static_cast<int>(freq) * static_cast<int>(freq), thread_count, [&](int row) {
+            auto y = static_cast<uint32_t>(row) % freq;
+            auto z = static_cast<uint32_t>(row) / freq;
+            uint32_t hash_yz[3];
+            for (uint32_t i = 0; i < 3; ++i)
+                hash_yz[i] = WangHash(y + WangHash(z + i));
+            auto point = &points[static_cast<size_t>(row) * freq * 3];
+            for (uint32_t x = 0; x < freq; ++x) {
+                for (int i = 0; i < 3; ++i)
+                    point[x * 3 + i] = FeatureOffset(seed, x, hash_yz[i]);
+            }
+        });
+    }
+    return layer;
+}
+
+static void WorleyNoise(const NoiseBatch& p, uint32_t freq, uint32_t seed, const std::vector<float>& feature_points, float* result) {
+    const float f = static_cast<float>(freq);
+    const int n = static_cast<int>(freq);
+    int cell[3][kLanes];
+    float q[3][kLanes];
+    const float* coords[3] = { p.x, p.y, p.z };
+    for (int a = 0; a < 3; ++a) {
+        for (int l = 0; l < kLanes; ++l) {
+            float x = coords[a][l] * f;
+            cell[a][l] = static_cast<int>(std::floor(x));
+            q[a][l] = x + f;
+        }
+    }
+    for (int l = 0; l < kLanes; ++l)
+        result[l] = 1e10f;
+
+    auto distance = [&](int l, float grid_x, float grid_y, float grid_z, const float* offset) {
+        float dx = q[0][l] - (grid_x + offset[0]);
+        float dy = q[1][l] - (grid_y + offset[1]);
+        float dz = q[2][l] - (grid_z + offset[2]);
+        result[l] = std::min(result[l], std::sqrt(dx * dx + dy * dy + dz * dz));
+    };
+    for (int dk = -1; dk <= 1; ++dk) {
+        uint32_t hash_z[3][kLanes];
+        int z[kLanes];
+        float grid_z[kLanes];
+        for (int l = 0; l < kLanes; ++l) {
+            z[l] = WrapLattice(cell[2][l] + dk, n);
+            grid_z[l] = static_cast<float>(cell[2][l] + n + dk);
+        }
+        if (feature_points.empty()) {
+            for (int c = 0; c < 3; ++c) {
+                for (int l = 0; l < kLanes; ++l)
+                    hash_z[c][l] = WangHash(static_cast<uint32_t>(z[l]) + c);
+            }
+        }
+        for (int dj = -1; dj <= 1; ++dj) {
+            uint32_t hash_yz[3][kLanes];
+            int y[kLanes];
+            float grid_y[kLanes];
+            for (int l = 0; l < kLanes; ++l) {
+                y[l] = WrapLattice(cell[1][l] + dj, n);
+                grid_y[l] = static_cast<float>(cell[1][l] + n + dj);
+            }
+            if (feature_points.empty()) {
+                for (int c = 0; c < 3; ++c) {
+                    for (int l = 0; l < kLanes; ++l)
+                        hash_yz[c][l] = WangHash(static_cast<uint32_t>(y[l]) + hash_z[c][l]);
+                }
+            }
+            for (int di = -1; di <= 1; ++di) {
+                if (feature_points.empty()) {
+                    for (int l = 0; l < kLanes; ++l) {
+                        auto x = static_cast<uint32_t>(WrapLattice(cell[0][l] + di, n));
+                        float offset[3] = { FeatureOffset(seed, x, hash_yz[0][l]), FeatureOffset(seed, x, hash_yz[1][l]),
+                            FeatureOffset(seed, x, hash_yz[2][l]) };
+                        distance(l, static_cast<float>(cell[0][l] + n + di), grid_y[l], grid_z[l], offset);
+                    }
+                }
+                else {
+                    for (int l = 0; l < kLanes; ++l) {
+                        auto x = WrapLattice(cell[0][l] + di, n);
+                        distance(l, static_cast<float>(cell[0][l] + n + di), grid_y[l], grid_z[l],
+                            &feature_points[((static_cast<size_t>(z[l]) * n + y[l]) * n + x) * 3]);
+                    }
+                }
+            }
+        }
+    }
+}
+
+static float RemapTo01(float x, float x0, float x1) {
+    return std::clamp((x - x0) / (x1 - x0), 0.0f, 1.0f);
+}
+
+static float RemapFrom01(float x, float y0, float y1) {
+    return std::clamp(y0 + x * (y1 - y0), 0.0f, 1.0f);
+}
+
+// PerlinFBM or WorleyFBM of NoiseGen.comp
+template<bool kPerlin>
+static void FBM(const NoiseBatch& p, const FbmLayer& layer, float* result) {
+    const auto& info = layer.info;
+    auto f = static_cast<uint32_t>(info.base_frequency);
+    auto seed = static_cast<uint32_t>(info.seed);
+    float a = 0.5f;
+    float sum_a = 0.0f;
+    for (int l = 0; l < kLanes; ++l)
+        result[l] = 0.0f;
+    for (int c = 0; c < kOctaves; ++c) {
+        float noise[kLanes];
+        if (kPerlin)
+            PerlinNoise(p, f, seed, noise);
+        else
+            WorleyNoise(p, f, seed, layer.feature_points[c], noise);
+        for (int l = 0; l < kLanes; ++l) {
+            float value = kPerlin ? noise[l] * 0.5f + 0.5f : noise[l];
+            result[l] += RemapTo01(value, info.remap_min, info.remap_max) * a;
+        }
+        sum_a += a;
+        f *= 2;
+        a *= 0.5f;
+    }
+    for (int l = 0; l < kLanes; ++l)
+        result[l] /= sum_a;
+}
+
+// Fills the image batch by batch. shade(p, values) writes values[channel][lane]; 2D images
+// are evaluated at z = 0 like the GPU path.
+template<class Shade>
+static CloudNoiseImage BakeImage(int width, int height, int depth, int channels, unsigned thread_count, Shade shade) {
+    CloudNoiseImage image;
+    image.width = width;
+    image.height = height;
+    image.depth = depth;
+    image.channels = channels;
+    image.texels.resize(static_cast<size_t>(width) * height * depth * channels);
+
+    ParallelFor(height * depth, thread_count, [&](int row) {
+        int y = row % height;
+        int z = row / height;
+        NoiseBatch p;
+        for (int x = 0; x < width; x += kLanes) {
+            for (int l = 0; l < kLanes; ++l) {
+                // Lanes past the last column repeat it and are not stored
+                p.x[l] = (static_cast<float>(std::min(x + l, width - 1)) + 0.5f) / static_cast<float>(width);
+                p.y[l] = (static_cast<float>(y) + 0.5f) / static_cast<float>(height);
+                p.z[l] = depth > 1 ? (static_cast<float>(z) + 0.5f) / static_cast<float>(depth) : 0.0f;
+            }
+            float values[4][kLanes];
+            shade(p, values);
+            for (int l = 0; l < kLanes && x + l < width; ++l) {
+                auto texel = &image.texels[(static_cast<size_t>(row) * width + x + l) * channels];
+                for (int c = 0; c < channels; ++c)
+                    texel[c] = static_cast<uint8_t>(std::clamp(values[c][l], 0.0f, 1.0f) * 255.0f + 0.5f);
+            }
+        }
+    });
+    return image;
+}
+
+CloudNoiseImage BakeCloudMapNoise(const NoiseCreateInfo& density, const NoiseCreateInfo& height, int size, unsigned thread_count) {
+    auto texel_count = static_cast<size_t>(size) * size;
+    auto density_layer = PrepareLayer(density, false, texel_count, thread_count);
+    auto height_layer = PrepareLayer(height, true, texel_count, thread_count);
+    return BakeImage(size, size, 1, 2, thread_count, [&](const NoiseBatch& p, float (*values)[kLanes]) {
+        FBM<true>(p, density_layer, values[0]);
+        FBM<false>(p, height_layer, values[1]);
+    });
+}
+
+CloudNoiseImage BakeDetailNoise(const NoiseCreateInfo& perlin, const NoiseCreateInfo& worley, int size, unsigned thread_count) {
+    auto texel_count = static_cast<size_t>(size) * size * size;
+    auto perlin_layer = PrepareLayer(perlin, false, texel_count, thread_count);
+    auto worley_layer = PrepareLayer(worley, true, texel_count, thread_count);
+    return BakeImage(size, size, size, 1, thread_count, [&](const NoiseBatch& p, float (*values)[kLanes]) {
+        float perlin_values[kLanes], worley_values[kLanes];
+        FBM<true>(p, perlin_layer, perlin_values);
+        FBM<false>(p, worley_layer, worley_values);
+        for (int l = 0; l < kLanes; ++l)
+            values[0][l] = RemapFrom01(perlin_values[l], worley_values[l], 1.0f);
+    });
+}
+
+CloudNoiseImage BakeDisplacementNoise(const NoiseCreateInfo& perlin, int size, unsigned thread_count) {
+    // One layer per channel, with consecutive seeds
+    FbmLayer layers[4];
+    for (int i = 0; i < 4; ++i) {
+        layers[i].info = perlin;
+        layers[i].info.seed += i;
+    }
+    return BakeImage(size, size, 1, 4, thread_count, [&](const NoiseBatch& p, float (*values)[kLanes]) {
+        for (int i = 0; i < 4; ++i)
+            FBM<true>(p, layers[i], values[i]);
+    });
+}
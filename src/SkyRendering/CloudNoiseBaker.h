@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+// One FBM layer of NoiseGen.comp
+struct NoiseCreateInfo {
+    int seed;
+    int base_frequency;
+    float remap_min;
+    float remap_max;
+
+    void DrawGUI();
+};
+
+// Bumped whenever the baked output changes, which invalidates cached noise assets
+constexpr uint32_t kCloudNoiseBakerVersion = 1;
+
+// 8-bit texels with interleaved channels, row by row then slice by slice, as glTextureSubImage
+// takes them
+struct CloudNoiseImage {
+    int width = 0;
+    int height = 0;
+    int depth = 1;
+    int channels = 1;
+    std::vector<uint8_t> texels;
+};
+
+// CPU port of the CLOUD_MAP_GEN, DETAIL_MAP_GEN and DISPLACEMENT_GEN paths of NoiseGen.comp.
+// The output tiles like the GPU one and matches it up to float rounding, which rarely moves a
+// texel by one step. thread_count == 0 uses all hardware threads.
+CloudNoiseImage BakeCloudMapNoise(const NoiseCreateInfo& density, const NoiseCreateInfo& height,
+    int size, unsigned thread_count = 0);
+
+CloudNoiseImage BakeDetailNoise(const NoiseCreateInfo& perlin, const NoiseCreateInfo& worley,
+    int size, unsigned thread_count = 0);
+
+CloudNoiseImage BakeDisplacementNoise(const NoiseCreateInfo& perlin, int size, unsigned thread_count = 0);
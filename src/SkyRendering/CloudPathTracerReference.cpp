@@ -0,0 +1,514 @@
+#include "CloudPathTracerReference.h"
+
+#include <chrono>
+#include <cmath>
+#include <stdexcept>
+#include <string>
+
+#include "ImageWriter.h"
+#include "Utils.h"
+
+constexpr float kPi = 3.1415926535897932384626433832795f;
+constexpr float kInvPi = 1.0f / kPi;
+
+using EnvironmentLighting = VolumetricCloud::PathTracing::EnvironmentLighting;
+
+static uint32_t WangHash(uint32_t seed) {
+    seed = (seed ^ 61) ^ (seed >> 16);
+    seed *= 9;
+    seed = seed ^ (seed >> 4);
+    seed *= 0x27d4eb2d;
+    seed = seed ^ (seed >> 15);
+    return seed;
+}
+
+static uint32_t PCGHash(uint32_t seed) {
+    uint32_t state = seed * 747796405u + 2891336453u;
+    uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    return (word >> 22u) ^ word;
+}
+
+static float HenyeyGreenstein(float cos_theta, float g) {
+    float a = 1.0f - g * g;
+    float b = 1.0f + g * g - 2.0f * g * cos_theta;
+    b *= std::sqrt(b);
+    return (0.25f * kInvPi) * a / b;
+}
+
+static float HenyeyGreensteinInvertcdf(float xi, float g) {
+    float one_plus_g2 = 1.0f + g * g;
+    float one_minus_g2 = 1.0f - g * g;
+    float one_over_2g = 0.5f / g;
+    float t = (one_minus_g2) / (1.0f - g + 2.0f * g * xi);
+    return one_over_2g * (one_plus_g2 - t * t);
+}
+
+// https://graphics.pixar.com/library/OrthonormalB/paper.pdf
+static void CreateOrthonormalBasis(glm::vec3 N, glm::vec3& t0, glm::vec3& t1) {
+    float s = N.z >= 0.0f ? 1.0f : -1.0f;
+    float a = -1.0f / (s + N.z);
+    float b = N.x * N.y * a;
+    t0 = glm::vec3(1.0f + s * N.x * N.x * a, s * b, -s * N.x);
+    t1 = glm::vec3(b, s + N.y * N.y * a, -N.y);
+}
+
+// Cube map faces as in the GL specification (8.13): major axis index and sign, and the axes and
+// signs of s and t
+struct CubeFace {
+    int major, s_axis, t_axis;
+    float major_sign, s_sign, t_sign;
+};
+
+constexpr CubeFace kCubeFaces[6] = {
+    { 0, 2, 1, 1.0f, -1.0f, -1.0f },
+    { 0, 2, 1, -1.0f, 1.0f, -1.0f },
+    { 1, 0, 2, 1.0f, 1.0f, 1.0f },
+    { 1, 0, 2, -1.0f, 1.0f, -1.0f },
+    { 2, 0, 1, 1.0f, 1.0f, -1.0f },
+    { 2, 0, 1, -1.0f, -1.0f, -1.0f },
+};
+
+static int SelectCubeFace(glm::vec3 direction) {
+    auto a = glm::abs(direction);
+    if (a.x >= a.y && a.x >= a.z)
+        return direction.x >= 0.0f ? 0 : 1;
+    if (a.y >= a.z)
+        return direction.y >= 0.0f ? 2 : 3;
+    return direction.z >= 0.0f ? 4 : 5;
+}
+
+CloudEnvironmentReference::CloudEnvironmentReference(GLuint cube_map) {
+    glGetTextureLevelParameteriv(cube_map, 0, GL_TEXTURE_WIDTH, &size_);
+    texels_.resize(static_cast<size_t>(size_) * size_ * 6 * 4);
+    glMemoryBarrier(GL_TEXTURE_UPDATE_BARRIER_BIT);
+    glGetTextureImage(cube_map, 0, GL_RGBA, GL_FLOAT,
+        static_cast<GLsizei>(texels_.size() * sizeof(float)), texels_.data());
+}
+
+// Texels off the face are looked up on the face their centre lies on, like seamless filtering
+glm::vec3 CloudEnvironmentReference::Fetch(int face, int x, int y) const {
+    if (x < 0 || y < 0 || x >= size_ || y >= size_) {
+        const auto& f = kCubeFaces[face];
+        glm::vec3 direction;
+        direction[f.major] = f.major_sign;
+        direction[f.s_axis] = f.s_sign * ((x + 0.5f) / size_ * 2.0f - 1.0f);
+        direction[f.t_axis] = f.t_sign * ((y + 0.5f) / size_ * 2.0f - 1.0f);
+        face = SelectCubeFace(direction);
+        const auto& g = kCubeFaces[face];
+        auto ma = std::abs(direction[g.major]);
+        auto s = 0.5f * (g.s_sign * direction[g.s_axis] / ma + 1.0f);
+        auto t = 0.5f * (g.t_sign * direction[g.t_axis] / ma + 1.0f);
+        x = glm::clamp(static_cast<int>(s * size_), 0, size_ - 1);
+        y = glm::clamp(static_cast<int>(t * size_), 0, size_ - 1);
+    }
+    const float* texel = &texels_[((static_cast<size_t>(face) * size_ + y) * size_ + x) * 4];
+    return { texel[0], texel[1], texel[2] };
+}
+
+glm::vec3 CloudEnvironmentReference::Sample(glm::vec3 direction) const {
+    if (size_ == 0)
+        return glm::vec3(0.0f);
+    auto face = SelectCubeFace(direction);
+    const auto& f = kCubeFaces[face];
+    auto ma = std::abs(direction[f.major]);
+    auto s = 0.5f * (f.s_sign * direction[f.s_axis] / ma + 1.0f);
+    auto t = 0.5f * (f.t_sign * direction[f.t_axis] / ma + 1.0f);
+    auto x = s * size_ - 0.5f;
+    auto y = t * size_ - 0.5f;
+    auto x0 = std::floor(x);
+    auto y0 = std::floor(y);
+    auto fx = x - x0;
+    auto fy = y - y0;
+    auto ix = static_cast<int>(x0);
+    auto iy = static_cast<int>(y0);
+    return glm::mix(glm::mix(Fetch(face, ix, iy), Fetch(face, ix + 1, iy), fx),
+        glm::mix(Fetch(face, ix, iy + 1), Fetch(face, ix + 1, iy + 1), fx), fy);
+}
+
+// State of one path of a packet. A lane waiting in a query state needs the density at query.
+struct CloudPathTracerReference::Lane {
+    enum class State {
+        kFreeFlight,
+        kFreeFlightQuery,
+        kShadow,
+        kShadowQuery,
+        kDone,
+    };
+
+    State state = State::kDone;
+    bool active = false;
+    glm::ivec2 pixel{};
+    uint32_t seed = 0;
+    glm::vec3 o{};
+    glm::vec3 d{};
+    glm::vec3 L{};
+    glm::vec3 throughput{};
+    bool has_scattered = false;
+    int bounce = 0;
+    float t = 0.0f;
+    float t_max = 0.0f;
+    glm::vec3 query{};
+    glm::vec3 ground_normal{};
+
+    // Ratio tracked ray to the sun. TransmittanceEstimation takes the context by value, so it
+    // draws from a copy of the seed and the path goes on with the numbers it used.
+    uint32_t shadow_seed = 0;
+    float shadow_t = 0.0f;
+    float shadow_t_max = 0.0f;
+    float shadow_transmittance = 1.0f;
+    glm::vec3 light_weight{};
+    bool after_scatter = false;
+};
+
+CloudPathTracerReference::CloudPathTracerReference(CloudReferenceScene scene, const InitParam& param)
+    : scene_(std::move(scene)), param_(param) {
+    if (!scene_.density)
+        throw std::runtime_error("The cloud material has no CPU density");
+    if (scene_.viewport.x <= 0 || scene_.viewport.y <= 0)
+        throw std::runtime_error("Invalid reference viewport");
+    tile_grid_ = (scene_.viewport + kTileSize - 1) / kTileSize;
+    accumulation_.resize(static_cast<size_t>(scene_.viewport.x) * scene_.viewport.y, glm::vec4(0.0f));
+}
+
+float CloudPathTracerReference::Random01(uint32_t& seed) const {
+    float res = static_cast<float>(seed) / 4294967296.0f;
+    seed = param_.prng == VolumetricCloud::PathTracing::PRNG::WangHash ? WangHash(seed) : PCGHash(seed);
+    return res;
+}
+
+glm::vec3 CloudPathTracerReference::ViewDirection(glm::ivec2 pixel) const {
+    auto uv = (glm::vec2(pixel) + 0.5f) / glm::vec2(scene_.viewport);
+    auto xyzw = scene_.inv_mvp * glm::vec4(glm::vec3(uv, 1.0f) * 2.0f - 1.0f, 1.0f);
+    auto frag_pos = glm::vec3(xyzw) / xyzw.w;
+    return glm::normalize(frag_pos - scene_.camera_pos);
+}
+
+glm::vec2 CloudPathTracerReference::CloudRegionIntersect(glm::vec3 o, glm::vec3 d) const {
+    auto half_width = param_.region_box_half_width;
+    glm::vec3 aabb_min(-half_width, -half_width, scene_.bottom_altitude);
+    glm::vec3 aabb_max(half_width, half_width, scene_.top_altitude);
+    glm::vec2 t(0.0f, 1e7f);
+    for (int i = 0; i < 3; ++i) {
+        float t1 = (aabb_min[i] - o[i]) / d[i];
+        float t2 = (aabb_max[i] - o[i]) / d[i];
+        t.x = glm::max(t.x, glm::min(t1, t2));
+        t.y = glm::min(t.y, glm::max(t1, t2));
+    }
+    return t;
+}
+
+float CloudPathTracerReference::GetPhase(float cos_theta) const {
+    return glm::mix(HenyeyGreenstein(cos_theta, param_.back_phase_g),
+        HenyeyGreenstein(cos_theta, param_.forward_phase_g), param_.forward_scattering_ratio);
+}
+
+glm::vec3 CloudPathTracerReference::GetSunIlluminance(glm::vec3 pos) const {
+    glm::vec3 up_dir(pos.x, pos.y, pos.z + scene_.earth_radius);
+    float r = glm::length(up_dir);
+    float mu_s = glm::dot(scene_.sun_direction, up_dir / r);
+    return GetSunVisibility(scene_.atmosphere, scene_.transmittance, r, mu_s) * scene_.atmosphere.solar_illuminance;
+}
+
+glm::vec3 CloudPathTracerReference::GetEnvironmentLuminance(glm::vec3 direction) const {
+    return scene_.environment.Sample(scene_.model * direction);
+}
+
+void CloudPathTracerReference::StartLane(Lane& lane, glm::ivec2 pixel, uint32_t frame) const {
+    auto hash = param_.prng == VolumetricCloud::PathTracing::PRNG::WangHash ? WangHash : PCGHash;
+    lane.pixel = pixel;
+    lane.seed = hash(hash(hash(static_cast<uint32_t>(pixel.x)) + static_cast<uint32_t>(pixel.y))
+        + static_cast<uint32_t>(param_.first_sample) + frame);
+    lane.L = glm::vec3(0.0f);
+    lane.throughput = glm::vec3(1.0f);
+    lane.has_scattered = false;
+    lane.bounce = 0;
+    lane.o = scene_.camera_pos;
+    lane.d = ViewDirection(pixel);
+    auto camera_inter_t = CloudRegionIntersect(lane.o, lane.d);
+    if (camera_inter_t.x >= camera_inter_t.y) {
+        lane.state = Lane::State::kDone;
+        return;
+    }
+    lane.o += camera_inter_t.x * lane.d;
+    BeginSegment(lane);
+    Advance(lane, 0.0f);
+}
+
+// Runs the lane until it waits for a density or its path ends. sigma_t answers the query the
+// lane was waiting for.
+void CloudPathTracerReference::Advance(Lane& lane, float sigma_t) const {
+    auto sigma_t_max = scene_.sigma_t_max;
+    for (;;) {
+        switch (lane.state) {
+        case Lane::State::kFreeFlightQuery:
+            if (Random01(lane.seed) < sigma_t / sigma_t_max)
+                Scatter(lane);
+            else
+                lane.state = Lane::State::kFreeFlight;
+            break;
+        case Lane::State::kFreeFlight:
+            if (sigma_t_max <= 0.0f) {
+                Escape(lane);
+                break;
+            }
+            lane.t += -std::log(1.0f - Random01(lane.seed)) / sigma_t_max;
+            if (lane.t > lane.t_max) {
+                Escape(lane);
+                break;
+            }
+            lane.query = lane.o + lane.d * lane.t;
+            lane.state = Lane::State::kFreeFlightQuery;
+            return;
+        case Lane::State::kShadowQuery:
+            lane.shadow_transmittance *= 1.0f - glm::max(0.0f, sigma_t / sigma_t_max);
+            lane.state = Lane::State::kShadow;
+            break;
+        case Lane::State::kShadow:
+            lane.shadow_t += -std::log(1.0f - Random01(lane.shadow_seed)) / sigma_t_max;
+            if (lane.shadow_t > lane.shadow_t_max) {
+                FinishShadow(lane);
+                break;
+            }
+            lane.query = lane.o + scene_.sun_direction * lane.shadow_t;
+            lane.state = Lane::State::kShadowQuery;
+            return;
+        case Lane::State::kDone:
+            return;
+        }
+    }
+}
+
+// One iteration of the bounce loop of Trace
+void CloudPathTracerReference::BeginSegment(Lane& lane) const {
+    auto max_throughput = glm::max(lane.throughput.r, glm::max(lane.throughput.g, lane.throughput.b));
+    if (lane.bounce >= param_.max_bounces || !(max_throughput > 0.0f)) {
+        lane.state = Lane::State::kDone;
+        return;
+    }
+    auto inter_t = CloudRegionIntersect(lane.o, lane.d);
+    if (inter_t.x >= inter_t.y) {
+        lane.state = Lane::State::kDone;
+        return;
+    }
+    lane.t = inter_t.x;
+    lane.t_max = inter_t.y;
+    lane.state = Lane::State::kFreeFlight;
+}
+
+// SampleLuminanceFromLight from lane.o, light_weight being throughput * bsdf_with_cosine / pdf
+// times the sun illuminance
+void CloudPathTracerReference::BeginShadow(Lane& lane, glm::vec3 light_weight, bool after_scatter) const {
+    lane.light_weight = light_weight;
+    lane.after_scatter = after_scatter;
+    lane.shadow_seed = lane.seed;
+    lane.shadow_transmittance = 1.0f;
+    auto inter_t = CloudRegionIntersect(lane.o, scene_.sun_direction);
+    if (inter_t.x >= inter_t.y || scene_.sigma_t_max <= 0.0f) {
+        FinishShadow(lane);
+        return;
+    }
+    lane.shadow_t = inter_t.x;
+    lane.shadow_t_max = inter_t.y;
+    lane.state = Lane::State::kShadow;
+}
+
+void CloudPathTracerReference::FinishShadow(Lane& lane) const {
+    lane.L += glm::clamp(lane.shadow_transmittance, 0.0f, 1.0f) * lane.light_weight;
+    if (lane.after_scatter) {
+        // GenerateHGSample
+        if (param_.importance_sampling) {
+            float g = Random01(lane.seed) < param_.forward_scattering_ratio ? param_.forward_phase_g : param_.back_phase_g;
+            float cos_theta = HenyeyGreensteinInvertcdf(Random01(lane.seed), g);
+            float sin_theta = std::sqrt(glm::clamp(1.0f - cos_theta * cos_theta, 0.0f, 1.0f));
+            glm::vec3 t0, t1;
+            CreateOrthonormalBasis(lane.d, t0, t1);
+            float phi = 2.0f * kPi * Random01(lane.seed);
+            lane.d = sin_theta * std::sin(phi) * t0 + sin_theta * std::cos(phi) * t1 + cos_theta * lane.d;
+        }
+        else {
+            float phi = 2.0f * kPi * Random01(lane.seed);
+            float cos_theta = 1.0f - 2.0f * Random01(lane.seed);
+            float sin_theta = std::sqrt(glm::clamp(1.0f - cos_theta * cos_theta, 0.0f, 1.0f));
+            glm::vec3 direction(std::cos(phi) * sin_theta, std::sin(phi) * sin_theta, cos_theta);
+            float value = GetPhase(glm::dot(lane.d, direction));
+            float pdf = 1.0f / (4.0f * kPi);
+            lane.d = direction;
+            lane.throughput *= value / pdf;
+        }
+    }
+    else {
+        if (param_.environment_lighting == EnvironmentLighting::GROUND_SINGLE_BOUNCE) {
+            lane.state = Lane::State::kDone;
+            return;
+        }
+        // GenerateLambertSample
+        float sin_theta = std::sqrt(Random01(lane.seed));
+        float cos_theta = std::sqrt(glm::clamp(1.0f - sin_theta * sin_theta, 0.0f, 1.0f));
+        glm::vec3 t0, t1;
+        CreateOrthonormalBasis(lane.ground_normal, t0, t1);
+        float phi = 2.0f * kPi * Random01(lane.seed);
+        lane.d = sin_theta * std::sin(phi) * t0 + sin_theta * std::cos(phi) * t1 + cos_theta * lane.ground_normal;
+        lane.throughput *= scene_.atmosphere.ground_albedo;
+    }
+    ++lane.bounce;
+    BeginSegment(lane);
+}
+
+void CloudPathTracerReference::Scatter(Lane& lane) const {
+    lane.has_scattered = true;
+    lane.o += lane.d * lane.t;
+    float light_bsdf = GetPhase(glm::dot(lane.d, scene_.sun_direction));
+    BeginShadow(lane, lane.throughput * GetSunIlluminance(lane.o) * light_bsdf, true);
+}
+
+// The free flight left the cloud region without an event
+void CloudPathTracerReference::Escape(Lane& lane) const {
+    if (param_.environment_lighting == EnvironmentLighting::OFF || !lane.has_scattered) {
+        lane.state = Lane::State::kDone;
+        return;
+    }
+    if (param_.environment_lighting == EnvironmentLighting::CONST_ENVIRONMENT_MAP) {
+        lane.L += lane.throughput * GetEnvironmentLuminance(lane.d);
+        lane.state = Lane::State::kDone;
+        return;
+    }
+
+    const auto& a = scene_.atmosphere;
+    glm::vec3 up_dir(lane.o.x, lane.o.y, lane.o.z + scene_.earth_radius);
+    float r = glm::length(up_dir);
+    up_dir /= r;
+    float mu = glm::dot(lane.d, up_dir);
+    // RayIntersectsGround and DistanceToBottomAtmosphereBoundary of Atmosphere.glsl
+    float discriminant = r * r * (mu * mu - 1.0f) + a.bottom_radius * a.bottom_radius;
+    if (!(mu < 0.0f && discriminant >= 0.0f)) {
+        lane.L += lane.throughput * GetEnvironmentLuminance(lane.d);
+        lane.state = Lane::State::kDone;
+        return;
+    }
+    lane.o += lane.d * glm::max(-r * mu - std::sqrt(glm::max(discriminant, 0.0f)), 0.0f);
+    lane.ground_normal = glm::normalize(glm::vec3(lane.o.x, lane.o.y, lane.o.z + scene_.earth_radius));
+    glm::vec3 light_bsdf = kInvPi * a.ground_albedo;
+    float NdotL = glm::dot(lane.ground_normal, scene_.sun_direction);
+    BeginShadow(lane, lane.throughput * GetSunIlluminance(lane.o) * light_bsdf * NdotL, false);
+}
+
+void CloudPathTracerReference::RenderTile(int tile, uint32_t frame_begin, uint32_t frame_end, std::vector<glm::vec4>& pass) const {
+    constexpr int kLanes = CloudDensityPacket::kMaxLanes;
+    auto tile_origin = glm::ivec2(tile % tile_grid_.x, tile / tile_grid_.x) * kTileSize;
+    auto tile_size = glm::min(glm::ivec2(kTileSize), scene_.viewport - tile_origin);
+    auto pixel_count = static_cast<int64_t>(tile_size.x) * tile_size.y;
+    auto sample_count = pixel_count * (frame_end - frame_begin);
+    int64_t next_sample = 0;
+
+    auto accumulate = [&](const Lane& lane) {
+        pass[static_cast<size_t>(lane.pixel.y) * scene_.viewport.x + lane.pixel.x]
+            += glm::vec4(lane.L, lane.has_scattered ? 0.0f : 1.0f);
+    };
+    // Samples are taken frame by frame, so the lanes of a packet trace neighbouring pixels
+    auto start_next = [&](Lane& lane) {
+        lane.active = false;
+        while (next_sample < sample_count) {
+            auto i = static_cast<int>(next_sample % pixel_count);
+            auto frame = frame_begin + static_cast<uint32_t>(next_sample / pixel_count);
+            ++next_sample;
+            StartLane(lane, tile_origin + glm::ivec2(i % tile_size.x, i / tile_size.x), frame);
+            if (lane.state != Lane::State::kDone) {
+                lane.active = true;
+                return;
+            }
+            accumulate(lane);
+        }
+    };
+
+    Lane lanes[kLanes];
+    for (auto& lane : lanes)
+        start_next(lane);
+
+    auto inv_thickness = 1.0f / (scene_.top_altitude - scene_.bottom_altitude);
+    CloudDensityPacket packet;
+    Lane* packet_lanes[kLanes];
+    float sigma_t[kLanes];
+    for (;;) {
+        packet.count = 0;
+        for (auto& lane : lanes) {
+            if (!lane.active)
+                continue;
+            auto i = packet.count++;
+            packet.x[i] = lane.query.x;
+            packet.y[i] = lane.query.y;
+            packet.z[i] = lane.query.z;
+            packet.height01[i] = glm::clamp((lane.query.z - scene_.bottom_altitude) * inv_thickness, 0.0f, 1.0f);
+            packet_lanes[i] = &lane;
+        }
+        if (packet.count == 0)
+            break;
+        scene_.density->SampleSigmaT(packet, sigma_t);
+        for (int i = 0; i < packet.count; ++i) {
+            auto& lane = *packet_lanes[i];
+            Advance(lane, sigma_t[i]);
+            if (lane.state == Lane::State::kDone) {
+                accumulate(lane);
+                start_next(lane);
+            }
+        }
+    }
+}
+
+void CloudPathTracerReference::Render(int frame_count, unsigned thread_count) {
+    if (frame_count <= 0)
+        return;
+    cancel_ = false;
+    tiles_done_ = 0;
+    // kFrameId of the GPU pass starts at 1
+    auto frame_begin = frame_cnt_ + 1;
+    auto frame_end = frame_begin + static_cast<uint32_t>(frame_count);
+
+    using Clock = std::chrono::steady_clock;
+    auto begin = Clock::now();
+    std::vector<glm::vec4> pass(accumulation_.size(), glm::vec4(0.0f));
+    ParallelForStealing(tile_grid_.x * tile_grid_.y, thread_count, [&](int tile, unsigned) {
+        if (!cancel_)
+            RenderTile(tile, frame_begin, frame_end, pass);
+        ++tiles_done_;
+    });
+    if (cancel_)
+        return;
+    auto seconds = std::chrono::duration<double>(Clock::now() - begin).count();
+
+    for (size_t i = 0; i < accumulation_.size(); ++i)
+        accumulation_[i] += pass[i];
+    frame_cnt_ += static_cast<uint32_t>(frame_count);
+    samples_per_second_ = static_cast<double>(accumulation_.size()) * frame_count / glm::max(seconds, 1e-6);
+}
+
+float CloudPathTracerReference::progress() const {
+    return static_cast<float>(tiles_done_) / static_cast<float>(tile_grid_.x * tile_grid_.y);
+}
+
+std::vector<glm::vec4> CloudPathTracerReference::Resolve() const {
+    std::vector<glm::vec4> image(accumulation_.size(), glm::vec4(0.0f));
+    if (frame_cnt_ == 0)
+        return image;
+    auto inv_frame_cnt = 1.0f / static_cast<float>(frame_cnt_);
+    for (size_t i = 0; i < image.size(); ++i)
+        image[i] = accumulation_[i] * inv_frame_cnt;
+    return image;
+}
+
+void CloudPathTracerReference::WriteHdr(const char* path) const {
+    auto image = Resolve();
+    auto width = scene_.viewport.x;
+    auto height = scene_.viewport.y;
+    std::vector<float> rgb(static_cast<size_t>(width) * height * 3);
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            const auto& texel = image[static_cast<size_t>(height - 1 - y) * width + x];
+            auto* dst = &rgb[(static_cast<size_t>(y) * width + x) * 3];
+            dst[0] = texel.r;
+            dst[1] = texel.g;
+            dst[2] = texel.b;
+        }
+    }
+    if (!stbi_write_hdr(path, width, height, 3, rgb.data()))
+        throw std::runtime_error(std::string("Failed to write ") + path);
+}
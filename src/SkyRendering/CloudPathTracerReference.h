@@ -0,0 +1,127 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "gl.hpp"
+#include "Atmosphere.h"
+#include "AtmosphereReference.h"
+#include "CloudDensityReference.h"
+#include "VolumetricCloud.h"
+
+// Environment luminance cube map read back at level 0, sampled like texture() with GL_LINEAR and
+// GL_TEXTURE_CUBE_MAP_SEAMLESS. A default constructed one is black.
+class CloudEnvironmentReference {
+public:
+    CloudEnvironmentReference() = default;
+    explicit CloudEnvironmentReference(GLuint cube_map);
+
+    glm::vec3 Sample(glm::vec3 direction) const;
+
+private:
+    glm::vec3 Fetch(int face, int x, int y) const;
+
+    int size_ = 0;
+    std::vector<float> texels_; // RGBA, faces in GL_TEXTURE_CUBE_MAP_POSITIVE_X order
+};
+
+// Everything the render pass of VolumetricCloudPathTracing.comp reads, captured from the
+// renderer by VolumetricCloud::CaptureReferenceScene. Positions and directions are in the cloud
+// space of VolumetricCloudCommonBufferData.
+struct CloudReferenceScene {
+    glm::ivec2 viewport{};
+    glm::mat4 inv_mvp{ 1.0f };
+    glm::vec3 camera_pos{};
+    glm::vec3 sun_direction{ 0.0f, 0.0f, 1.0f };
+    glm::mat3 model{ 1.0f }; // kModelMatrix3, rotates into the environment map space
+    float earth_radius = 0.0f;
+    float bottom_altitude = 0.0f;
+    float top_altitude = 0.0f;
+    float sigma_t_max = 0.0f;
+    AtmosphereBufferData atmosphere{};
+    AtmosphereLut transmittance;
+    CloudEnvironmentReference environment;
+    std::shared_ptr<const ICloudDensityReference> density;
+};
+
+// CPU port of the delta tracking integrator of VolumetricCloudPathTracing.comp, for reference
+// images without a GPU. It always tracks against the global GetSigmaTMax majorant; with
+// InitParam::majorant_grid off it follows the GLSL event for event and draws the same random
+// sequence per pixel and sample index (offset by InitParam::first_sample), so N frames here
+// estimate the same image as N frames of PathTracing without adaptive sampling.
+// Atmosphere scattering in front of the cloud (aerial perspective and the shadow froxel) is not
+// applied: pixels hold cloud luminance in rgb and transmittance in a.
+//
+// The image is split into kTileSize tiles that threads take with work stealing. Inside a tile,
+// paths are traced in packets of CloudDensityPacket::kMaxLanes lanes that query the density
+// together; a lane whose path ends starts the next sample right away, so packets stay full
+// however long single paths are. Packets batch the virtual density call and keep the lanes'
+// texture reads close in memory; the lanes themselves are stepped one at a time in scalar code.
+class CloudPathTracerReference {
+public:
+    using InitParam = VolumetricCloud::PathTracing::InitParam;
+
+    static constexpr int kTileSize = 16;
+
+    CloudPathTracerReference(CloudReferenceScene scene, const InitParam& param);
+
+    // Adds frame_count frames to every pixel on thread_count threads (0: all hardware threads)
+    void Render(int frame_count, unsigned thread_count = 0);
+
+    // May be called from another thread, Render then returns once the tiles in flight are done
+    // and the frames it was adding are not counted
+    void Cancel() {
+        cancel_ = true;
+    }
+
+    // Fraction of the tiles of the running Render that are done
+    float progress() const;
+
+    uint32_t frame_cnt() const {
+        return frame_cnt_;
+    }
+
+    // Samples per second of the last Render
+    double samples_per_second() const {
+        return samples_per_second_;
+    }
+
+    // Average of the accumulated frames, bottom row first like glGetTextureImage
+    std::vector<glm::vec4> Resolve() const;
+
+    // Radiance .hdr of the luminance of Resolve, top row first
+    void WriteHdr(const char* path) const;
+
+private:
+    struct Lane;
+
+    void RenderTile(int tile, uint32_t frame_begin, uint32_t frame_end, std::vector<glm::vec4>& pass) const;
+    glm::vec3 ViewDirection(glm::ivec2 pixel) const;
+    glm::vec2 CloudRegionIntersect(glm::vec3 o, glm::vec3 d) const;
+    float Random01(uint32_t& seed) const;
+    float GetPhase(float cos_theta) const;
+    glm::vec3 GetSunIlluminance(glm::vec3 pos) const;
+    glm::vec3 GetEnvironmentLuminance(glm::vec3 direction) const;
+
+    void StartLane(Lane& lane, glm::ivec2 pixel, uint32_t frame) const;
+    void Advance(Lane& lane, float sigma_t) const;
+    void BeginSegment(Lane& lane) const;
+    void BeginShadow(Lane& lane, glm::vec3 light_weight, bool after_scatter) const;
+    void FinishShadow(Lane& lane) const;
+    void Scatter(Lane& lane) const;
+    void Escape(Lane& lane) const;
+
+    const CloudReferenceScene scene_;
+    const InitParam param_;
+    glm::ivec2 tile_grid_;
+
+    std::vector<glm::vec4> accumulation_;
+    uint32_t frame_cnt_ = 0;
+    double samples_per_second_ = 0.0;
+    std::atomic<int> tiles_done_{ 0 };
+    std::atomic<bool> cancel_{ false };
+};
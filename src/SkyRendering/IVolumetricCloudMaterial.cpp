@@ -3,10 +3,12 @@
 #include "VolumetricCloudDefaultMaterial.h"
 #include "VolumetricCloudMinimalMaterial.h"
 #include "VolumetricCloudVoxelMaterial.h"
+#include "VolumetricCloudVoxelSequenceMaterial.h"
 
 SUBCLASS_DECLARATION_BEGIN(IVolumetricCloudMaterial)
 SUBCLASS_DECLARATION(VolumetricCloudDefaultMaterial0)
 SUBCLASS_DECLARATION(VolumetricCloudDefaultMaterial1)
 SUBCLASS_DECLARATION(VolumetricCloudMinimalMaterial)
 SUBCLASS_DECLARATION(VolumetricCloudVoxelMaterial)
+SUBCLASS_DECLARATION(VolumetricCloudVoxelSequenceMaterial)
 SUBCLASS_DECLARATION_END()
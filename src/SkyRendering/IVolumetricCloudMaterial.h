@@ -1,14 +1,17 @@
 #pragma once
 
+#include <memory>
+
 #include <glm/glm.hpp>
 
 #include "gl.hpp"
 #include "Camera.h"
 #include "Serialization.h"
+#include "CloudDensityReference.h"
 
 class IVolumetricCloudMaterial : public ISerializable {
 public:
-    static constexpr GLuint kMaterialTextureUnitBegin = 7;
+    static constexpr GLuint kMaterialTextureUnitBegin = 8;
 
     virtual ~IVolumetricCloudMaterial() = default;
 
@@ -22,6 +25,12 @@ public:
 
     virtual float GetSigmaTMax() = 0;
 
+    // CPU copy of the density as of the last Update, for CloudPathTracerReference. nullptr if the
+    // material has none. camera_pos is uCameraPos of the cloud shaders, which picks the lods.
+    virtual std::unique_ptr<ICloudDensityReference> CreateDensityReference([[maybe_unused]] glm::vec3 camera_pos) {
+        return nullptr;
+    }
+
 protected:
     FIELD_DECLARATION_BEGIN(ISerializable)
     FIELD_DECLARATION_END()
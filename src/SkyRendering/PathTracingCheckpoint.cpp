@@ -0,0 +1,257 @@
+#include "PathTracingCheckpoint.h"
+
+#include <algorithm>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+
+#include "ImageWriter.h"
+#include "Utils.h"
+
+constexpr uint32_t kPathTracingCheckpointMagic = 0x32435450; // "PTC2"
+
+static_assert(std::is_trivially_copyable_v<PathTracingCheckpoint::InitParam>, "InitParam is stored as raw bytes");
+
+struct PathTracingCheckpointHeader {
+    uint32_t magic;
+    uint32_t init_param_size; // InitParam layout changes invalidate old checkpoints
+    int32_t width;
+    int32_t height;
+    uint32_t frame_cnt;
+    int32_t tile_index;
+    uint32_t has_features;
+    uint32_t merged_range_count;
+    uint64_t scene_hash;
+};
+
+template<class T>
+static void WriteArray(std::ostream& fout, const std::vector<T>& v) {
+    fout.write(reinterpret_cast<const char*>(v.data()), v.size() * sizeof(T));
+}
+
+template<class T>
+static void ReadArray(std::ifstream& fin, std::vector<T>& v, size_t count) {
+    v.resize(count);
+    fin.read(reinterpret_cast<char*>(v.data()), count * sizeof(T));
+}
+
+void PathTracingCheckpoint::Save(const char* path) const {
+    auto pixel_count = static_cast<size_t>(viewport.x) * viewport.y;
+    if (accumulation.size() != pixel_count || statistics.size() != pixel_count || converged.size() != pixel_count
+            || (!features.empty() && features.size() != pixel_count))
+        throw std::runtime_error("Inconsistent path tracing checkpoint");
+    PathTracingCheckpointHeader header{ kPathTracingCheckpointMagic, sizeof(InitParam), viewport.x, viewport.y,
+        frame_cnt, tile_index, features.empty() ? 0u : 1u, static_cast<uint32_t>(merged_sample_ranges.size()), scene_hash };
+
+    // An interrupted save keeps the previous checkpoint
+    auto written = WriteFileAtomically(path, [&](std::ostream& fout) {
+        fout.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        fout.write(reinterpret_cast<const char*>(&init), sizeof(init));
+        fout.write(reinterpret_cast<const char*>(&mvp), sizeof(mvp));
+        fout.write(reinterpret_cast<const char*>(&camera_pos), sizeof(camera_pos));
+        fout.write(reinterpret_cast<const char*>(&model), sizeof(model));
+        WriteArray(fout, merged_sample_ranges);
+        WriteArray(fout, accumulation);
+        WriteArray(fout, statistics);
+        WriteArray(fout, converged);
+        WriteArray(fout, features);
+    });
+    if (!written)
+        throw std::runtime_error(std::string("Write file failed: ") + path);
+}
+
+PathTracingCheckpoint PathTracingCheckpoint::Load(const char* path) {
+    std::ifstream fin(path, std::ios::binary);
+    if (!fin)
+        throw std::runtime_error(std::string("Open file failed: ") + path);
+    PathTracingCheckpointHeader header{};
+    fin.read(reinterpret_cast<char*>(&header), sizeof(header));
+    if (!fin || header.magic != kPathTracingCheckpointMagic)
+        throw std::runtime_error(std::string("Not a path tracing checkpoint: ") + path);
+    if (header.init_param_size != sizeof(InitParam))
+        throw std::runtime_error(std::string("Path tracing checkpoint of another version: ") + path);
+    if (header.width <= 0 || header.height <= 0)
+        throw std::runtime_error(std::string("Invalid path tracing checkpoint: ") + path);
+
+    PathTracingCheckpoint checkpoint;
+    checkpoint.viewport = { header.width, header.height };
+    checkpoint.scene_hash = header.scene_hash;
+    checkpoint.frame_cnt = header.frame_cnt;
+    checkpoint.tile_index = header.tile_index;
+    fin.read(reinterpret_cast<char*>(&checkpoint.init), sizeof(checkpoint.init));
+    fin.read(reinterpret_cast<char*>(&checkpoint.mvp), sizeof(checkpoint.mvp));
+    fin.read(reinterpret_cast<char*>(&checkpoint.camera_pos), sizeof(checkpoint.camera_pos));
+    fin.read(reinterpret_cast<char*>(&checkpoint.model), sizeof(checkpoint.model));
+    ReadArray(fin, checkpoint.merged_sample_ranges, header.merged_range_count);
+    auto pixel_count = static_cast<size_t>(header.width) * header.height;
+    ReadArray(fin, checkpoint.accumulation, pixel_count);
+    ReadArray(fin, checkpoint.statistics, pixel_count);
+    ReadArray(fin, checkpoint.converged, pixel_count);
+    ReadArray(fin, checkpoint.features, header.has_features ? pixel_count : 0);
+    if (!fin)
+        throw std::runtime_error(std::string("Truncated path tracing checkpoint: ") + path);
+    return checkpoint;
+}
+
+static bool NearlyEqual(const glm::mat4& a, const glm::mat4& b) {
+    for (int i = 0; i < 4; ++i) {
+        for (int j = 0; j < 4; ++j) {
+            if (std::abs(a[i][j] - b[i][j]) > 1e-5f * std::max(1.0f, std::abs(a[i][j])))
+                return false;
+        }
+    }
+    return true;
+}
+
+bool PathTracingCheckpoint::IsCompatible(const PathTracingCheckpoint& other) const {
+    // Tiles, sample ranges, adaptive sampling, denoising and the majorant grid only change
+    // which samples are taken or how they are shown
+    const auto& a = init;
+    const auto& b = other.init;
+    return viewport == other.viewport
+        && NearlyEqual(mvp, other.mvp)
+        && NearlyEqual(model, other.model)
+        && glm::all(glm::lessThanEqual(glm::abs(camera_pos - other.camera_pos), glm::vec3(1e-5f)))
+        && scene_hash == other.scene_hash
+        && a.max_bounces == b.max_bounces
+        && a.region_box_half_width == b.region_box_half_width
+        && a.forward_phase_g == b.forward_phase_g
+        && a.back_phase_g == b.back_phase_g
+        && a.forward_scattering_ratio == b.forward_scattering_ratio
+        && a.prng == b.prng
+        && a.environment_lighting == b.environment_lighting;
+}
+
+static bool Intersect(glm::ivec2 a, glm::ivec2 b) {
+    return a.x < a.y && b.x < b.y && a.x < b.y && b.x < a.y;
+}
+
+static bool IntersectAny(glm::ivec2 range, const std::vector<glm::ivec2>& ranges) {
+    return std::any_of(ranges.begin(), ranges.end(), [range](glm::ivec2 r) { return Intersect(range, r); });
+}
+
+// Sample indices the samples since first_sample of pixel i were seeded with
+static glm::ivec2 SampleRange(const PathTracingCheckpoint& c, size_t i) {
+    return { c.init.first_sample, c.init.first_sample + static_cast<int>(c.statistics[i].z - c.statistics[i].w) };
+}
+
+// Covers the sample ranges of every pixel
+static glm::ivec2 SampleRangeBound(const PathTracingCheckpoint& c) {
+    int end = c.init.first_sample;
+    for (size_t i = 0; i < c.statistics.size(); ++i)
+        end = std::max(end, SampleRange(c, i).y);
+    return { c.init.first_sample, end };
+}
+
+void PathTracingCheckpoint::Merge(const PathTracingCheckpoint& other) {
+    if (!IsCompatible(other))
+        throw std::runtime_error("Path tracing checkpoints of different views, scenes or settings");
+    // Merged ranges only say which indices some pixels used, so they are checked against each
+    // other only where both have merged samples
+    bool merged_ranges_intersect = std::any_of(merged_sample_ranges.begin(), merged_sample_ranges.end(),
+        [&other](glm::ivec2 r) { return IntersectAny(r, other.merged_sample_ranges); });
+    for (size_t i = 0; i < statistics.size(); ++i) {
+        const auto& a = statistics[i];
+        const auto& b = other.statistics[i];
+        if (a.z == 0.0f || b.z == 0.0f)
+            continue;
+        auto range_a = SampleRange(*this, i);
+        auto range_b = SampleRange(other, i);
+        if (Intersect(range_a, range_b)
+                || (b.w > 0.0f && IntersectAny(range_a, other.merged_sample_ranges))
+                || (a.w > 0.0f && IntersectAny(range_b, merged_sample_ranges))
+                || (a.w > 0.0f && b.w > 0.0f && merged_ranges_intersect)) {
+            auto x = static_cast<int>(i % viewport.x);
+            auto y = static_cast<int>(i / viewport.x);
+            throw std::runtime_error("Path tracing checkpoints with the same sample indices at pixel ("
+                + std::to_string(x) + ", " + std::to_string(y) + ")");
+        }
+    }
+
+    // Resumed runs have to draw sample indices no part used yet
+    std::vector<glm::ivec2> ranges = merged_sample_ranges;
+    ranges.insert(ranges.end(), other.merged_sample_ranges.begin(), other.merged_sample_ranges.end());
+    ranges.push_back(SampleRangeBound(*this));
+    ranges.push_back(SampleRangeBound(other));
+    std::sort(ranges.begin(), ranges.end(), [](glm::ivec2 a, glm::ivec2 b) { return a.x < b.x; });
+    merged_sample_ranges.clear();
+    for (auto r : ranges) {
+        if (r.x >= r.y)
+            continue;
+        if (!merged_sample_ranges.empty() && r.x <= merged_sample_ranges.back().y)
+            merged_sample_ranges.back().y = std::max(merged_sample_ranges.back().y, r.y);
+        else
+            merged_sample_ranges.push_back(r);
+    }
+    auto next_sample = merged_sample_ranges.empty() ? init.first_sample : merged_sample_ranges.back().y;
+
+    for (size_t i = 0; i < accumulation.size(); ++i) {
+        accumulation[i] += other.accumulation[i];
+        statistics[i] += other.statistics[i];
+        statistics[i].w = statistics[i].z;
+    }
+    if (!features.empty() && !other.features.empty()) {
+        for (size_t i = 0; i < features.size(); ++i)
+            features[i] += other.features[i];
+    }
+    else {
+        features.clear();
+    }
+    std::fill(converged.begin(), converged.end(), uint8_t(0));
+    frame_cnt = std::max(frame_cnt, other.frame_cnt);
+    init.tile_begin = 0;
+    init.tile_end = 0;
+    tile_index = 0;
+    init.first_sample = next_sample;
+    init.sample_cap = 0;
+}
+
+std::vector<glm::vec4> PathTracingCheckpoint::Resolve() const {
+    std::vector<glm::vec4> image(accumulation.size(), glm::vec4(0.0f, 0.0f, 0.0f, 1.0f));
+    for (size_t i = 0; i < image.size(); ++i) {
+        if (statistics[i].z > 0.0f)
+            image[i] = accumulation[i] / statistics[i].z;
+    }
+    return image;
+}
+
+void PathTracingCheckpoint::WriteHdr(const char* path) const {
+    auto image = Resolve();
+    auto width = viewport.x;
+    auto height = viewport.y;
+    std::vector<float> rgb(static_cast<size_t>(width) * height * 3);
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            const auto& texel = image[static_cast<size_t>(height - 1 - y) * width + x];
+            auto* dst = &rgb[(static_cast<size_t>(y) * width + x) * 3];
+            dst[0] = texel.r;
+            dst[1] = texel.g;
+            dst[2] = texel.b;
+        }
+    }
+    if (!stbi_write_hdr(path, width, height, 3, rgb.data()))
+        throw std::runtime_error(std::string("Failed to write ") + path);
+}
+
+void MergePathTracingCheckpoints(const char* output, const std::vector<const char*>& inputs) {
+    if (inputs.empty())
+        throw std::runtime_error("No checkpoints to merge");
+    auto merged = PathTracingCheckpoint::Load(inputs[0]);
+    for (size_t i = 1; i < inputs.size(); ++i)
+        merged.Merge(PathTracingCheckpoint::Load(inputs[i]));
+
+    double sample_count = 0.0;
+    for (const auto& s : merged.statistics)
+        sample_count += s.z;
+    auto extension = std::filesystem::path(output).extension().string();
+    if (extension == ".hdr")
+        merged.WriteHdr(output);
+    else
+        merged.Save(output);
+    std::cout << inputs.size() << " checkpoints -> " << output << ", "
+        << sample_count / merged.statistics.size() << " samples/pixel" << std::endl;
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "VolumetricCloud.h"
+
+// Everything a VolumetricCloud::PathTracing run keeps on the GPU, so that it can be saved,
+// resumed after a restart, or rendered by several workers and merged. Images are bottom row
+// first like glGetTextureImage.
+//
+// Workers split a view either by tiles (InitParam::tile_begin/tile_end, pixels outside their
+// tiles stay zero) or by samples (disjoint ranges of InitParam::first_sample and
+// InitParam::sample_cap). Their checkpoints add up with Merge since every buffer holds sums.
+//
+// The samples of a pixel since first_sample were seeded with the indices
+// [first_sample, first_sample + statistics.z - statistics.w); statistics.w counts those that
+// came from merged checkpoints, which used indices within merged_sample_ranges.
+struct PathTracingCheckpoint {
+    using InitParam = VolumetricCloud::PathTracing::InitParam;
+
+    InitParam init;
+    glm::ivec2 viewport{};
+    glm::mat4 mvp{ 1.0f };
+    glm::vec3 camera_pos{};
+    glm::mat4 model{ 1.0f };
+    uint64_t scene_hash = 0; // VolumetricCloud::PathTracingSceneHash
+    uint32_t frame_cnt = 0;
+    int tile_index = 0;
+
+    std::vector<glm::vec4> accumulation; // sum of cloud luminance and transmittance
+    std::vector<glm::vec4> statistics; // sum of displayed luminance, of its square, sample count, merged sample count
+    std::vector<uint8_t> converged;
+    std::vector<glm::vec2> features; // sum of first scattering distances, paths that scattered; empty without denoise
+    std::vector<glm::ivec2> merged_sample_ranges; // disjoint [begin, end) sample indices, ascending
+
+    // Throws std::runtime_error on failure
+    void Save(const char* path) const;
+    static PathTracingCheckpoint Load(const char* path);
+
+    // Same view, scene and settings for everything that changes the expected image
+    bool IsCompatible(const PathTracingCheckpoint& other) const;
+
+    // Adds the samples of other, which must be compatible. Throws if a pixel has samples of
+    // the same index in both, which would no longer be independent. The result resumes on the
+    // whole frame with fresh sample indices, no sample cap and every pixel active again.
+    void Merge(const PathTracingCheckpoint& other);
+
+    // Mean per pixel, (0, 0, 0, 1) where nothing was rendered
+    std::vector<glm::vec4> Resolve() const;
+
+    // Radiance .hdr of the cloud luminance of Resolve, top row first
+    void WriteHdr(const char* path) const;
+};
+
+// SkyRendering --merge-checkpoints <out> <in>...: writes the merged checkpoint, or its image if
+// out ends with .hdr
+void MergePathTracingCheckpoints(const char* output, const std::vector<const char*>& inputs);
@@ -0,0 +1,319 @@
+#include "VdbReader.h"
+
+#include <array>
+#include <bitset>
+#include <climits>
+#include <cstring>
+#include <stdexcept>
+
+// Layout follows openvdb/io/Archive.cc and openvdb/io/Compression.h
+namespace {
+
+constexpr int64_t kVdbMagic = 0x56444220;
+constexpr uint32_t kMinFileVersion = 222; // OPENVDB_FILE_VERSION_NODE_MASK_COMPRESSION
+constexpr uint32_t kCompressZip = 0x1;
+constexpr uint32_t kCompressActiveMask = 0x2;
+constexpr uint32_t kCompressBlosc = 0x4;
+constexpr int kRootChildSize = 4096;
+
+// Written ahead of the values of every node
+enum NodeMetadata : int8_t {
+	kNoMaskOrInactiveVals,
+	kNoMaskAndMinusBg,
+	kNoMaskAndOneInactiveVal,
+	kMaskAndNoInactiveVals,
+	kMaskAndOneInactiveVal,
+	kMaskAndTwoInactiveVals,
+	kNoMaskAndAllVals,
+};
+
+class VdbStream {
+public:
+	VdbStream(const void* data, size_t size, uint64_t offset = 0)
+		: data_(static_cast<const char*>(data)), size_(size), offset_(offset) {}
+
+	template<class T> T Read() {
+		T value;
+		Read(&value, sizeof(T));
+		return value;
+	}
+	void Read(void* dst, uint64_t size) {
+		Require(size);
+		memcpy(dst, data_ + offset_, size);
+		offset_ += size;
+	}
+	std::string ReadString() {
+		auto size = Read<uint32_t>();
+		Require(size);
+		std::string str(data_ + offset_, size);
+		offset_ += size;
+		return str;
+	}
+	void Skip(uint64_t size) {
+		Require(size);
+		offset_ += size;
+	}
+	void Seek(uint64_t offset) {
+		if (offset > size_)
+			throw std::runtime_error("Truncated VDB file");
+		offset_ = offset;
+	}
+	uint64_t offset() const {
+		return offset_;
+	}
+
+private:
+	void Require(uint64_t size) const {
+		if (size > size_ - offset_)
+			throw std::runtime_error("Truncated VDB file");
+	}
+
+	const char* data_;
+	uint64_t size_;
+	uint64_t offset_;
+};
+
+bool IsOn(const uint64_t* mask, int i) {
+	return (mask[i >> 6] >> (i & 63)) & 1;
+}
+
+int CountOn(const uint64_t* mask, int count) {
+	int on = 0;
+	for (int i = 0; i < count / 64; ++i)
+		on += static_cast<int>(std::bitset<64>(mask[i]).count());
+	return on;
+}
+
+void SkipMetadata(VdbStream& stream) {
+	auto count = stream.Read<uint32_t>();
+	for (uint32_t i = 0; i < count; ++i) {
+		stream.ReadString(); // name
+		stream.ReadString(); // type
+		stream.Skip(stream.Read<uint32_t>());
+	}
+}
+
+struct GridDescriptor {
+	std::string name;
+	std::string type;
+	uint64_t grid_offset;
+	uint64_t buffer_offset;
+};
+
+// Checks the file header and reads the descriptor of the first grid
+GridDescriptor ReadFirstGridDescriptor(VdbStream& stream, const char* path) {
+	if (stream.Read<int64_t>() != kVdbMagic)
+		throw std::runtime_error(std::string("Not a VDB file: ") + path);
+	if (stream.Read<uint32_t>() < kMinFileVersion)
+		throw std::runtime_error(std::string("VDB file version is too old: ") + path);
+	stream.Skip(2 * sizeof(uint32_t)); // library version
+	if (stream.Read<uint8_t>() == 0)
+		throw std::runtime_error(std::string("VDB file without grid offsets: ") + path);
+	stream.Skip(36); // uuid
+	SkipMetadata(stream);
+
+	if (stream.Read<int32_t>() < 1)
+		throw std::runtime_error(std::string("No grid in ") + path);
+	GridDescriptor grid;
+	grid.name = stream.ReadString();
+	grid.type = stream.ReadString();
+	if (!stream.ReadString().empty())
+		throw std::runtime_error("Instanced VDB grids are not supported");
+	grid.grid_offset = stream.Read<uint64_t>();
+	grid.buffer_offset = stream.Read<uint64_t>();
+	return grid;
+}
+
+void SkipTransform(VdbStream& stream) {
+	constexpr uint64_t kVec3d = 3 * sizeof(double);
+	auto type = stream.ReadString();
+	if (type == "UniformScaleMap" || type == "ScaleMap")
+		stream.Skip(5 * kVec3d);
+	else if (type == "UniformScaleTranslateMap" || type == "ScaleTranslateMap")
+		stream.Skip(6 * kVec3d);
+	else if (type == "TranslationMap")
+		stream.Skip(kVec3d);
+	else if (type == "AffineMap" || type == "UnitaryMap")
+		stream.Skip(16 * sizeof(double));
+	else
+		throw std::runtime_error("Unsupported VDB transform " + type);
+}
+
+// Decodes count values of a node whose value mask is value_mask, or skips them if values is null
+void ReadCompressedValues(VdbStream& stream, uint32_t compression, float background,
+		const uint64_t* value_mask, int count, float* values) {
+	auto metadata = stream.Read<int8_t>();
+	if (metadata < kNoMaskOrInactiveVals || metadata > kNoMaskAndAllVals)
+		throw std::runtime_error("Invalid VDB node metadata");
+	float inactive[2] = { metadata == kNoMaskOrInactiveVals ? background : -background, background };
+	if (metadata == kNoMaskAndOneInactiveVal || metadata == kMaskAndOneInactiveVal || metadata == kMaskAndTwoInactiveVals) {
+		inactive[0] = stream.Read<float>();
+		if (metadata == kMaskAndTwoInactiveVals)
+			inactive[1] = stream.Read<float>();
+	}
+	std::array<uint64_t, 512> selection{}; // up to 32^3 values
+	if (metadata == kMaskAndNoInactiveVals || metadata == kMaskAndOneInactiveVal || metadata == kMaskAndTwoInactiveVals)
+		stream.Read(selection.data(), count / 8);
+
+	bool mask_compressed = (compression & kCompressActiveMask) && metadata != kNoMaskAndAllVals;
+	if (values == nullptr) {
+		stream.Skip(sizeof(float) * static_cast<uint64_t>(mask_compressed ? CountOn(value_mask, count) : count));
+	}
+	else if (!mask_compressed) {
+		stream.Read(values, sizeof(float) * static_cast<uint64_t>(count));
+	}
+	else {
+		for (int i = 0; i < count; ++i)
+			values[i] = IsOn(value_mask, i) ? stream.Read<float>() : inactive[IsOn(selection.data(), i) ? 1 : 0];
+	}
+}
+
+struct TopologyContext {
+	VdbStream& stream;
+	uint32_t compression;
+	float background;
+	std::vector<VdbFloatGridReader::Tile>& tiles;
+	std::vector<glm::ivec3>& leaf_origins;
+};
+
+// level 2 nodes have 32^3 children of 128^3 voxels, level 1 nodes 16^3 leaves
+void ReadInternalTopology(TopologyContext& context, glm::ivec3 origin, int level) {
+	auto log2_dim = level == 2 ? 5 : 4;
+	auto child_log2 = level == 2 ? 7 : 3;
+	auto count = 1 << (3 * log2_dim);
+	auto dim_mask = (1 << log2_dim) - 1;
+	std::vector<uint64_t> child_mask(count / 64);
+	std::vector<uint64_t> value_mask(count / 64);
+	std::vector<float> values(count);
+	context.stream.Read(child_mask.data(), count / 8);
+	context.stream.Read(value_mask.data(), count / 8);
+	ReadCompressedValues(context.stream, context.compression, context.background, value_mask.data(), count, values.data());
+
+	auto child_origin = [&](int i) {
+		return origin + glm::ivec3(i >> (2 * log2_dim), (i >> log2_dim) & dim_mask, i & dim_mask) * (1 << child_log2);
+	};
+	for (int i = 0; i < count; ++i) {
+		if (IsOn(value_mask.data(), i) && !IsOn(child_mask.data(), i))
+			context.tiles.push_back({ child_origin(i), 1 << child_log2, values[i] });
+	}
+	for (int i = 0; i < count; ++i) {
+		if (!IsOn(child_mask.data(), i))
+			continue;
+		if (level == 2) {
+			ReadInternalTopology(context, child_origin(i), 1);
+		}
+		else {
+			context.leaf_origins.push_back(child_origin(i));
+			context.stream.Skip(VdbFloatGridReader::kLeafVoxels / 8); // value mask, again in the buffer
+		}
+	}
+}
+
+}
+
+VdbFloatGridReader::VdbFloatGridReader(const char* path) : file_(path) {
+	if (!file_)
+		throw std::runtime_error(std::string("Failed to open ") + path);
+	VdbStream stream(file_.data(), file_.size());
+	auto grid = ReadFirstGridDescriptor(stream, path);
+	grid_name_ = grid.name;
+	if (grid.type != "Tree_float_5_4_3")
+		throw std::runtime_error("Unsupported VDB grid type " + grid.type);
+	auto buffer_offset = grid.buffer_offset;
+
+	stream.Seek(grid.grid_offset);
+	compression_ = stream.Read<uint32_t>();
+	if (compression_ & (kCompressZip | kCompressBlosc))
+		throw VdbCompressionError(std::string("Zip or Blosc compressed VDB files are not supported: ") + path);
+	SkipMetadata(stream);
+	SkipTransform(stream);
+	stream.Skip(sizeof(int32_t)); // buffer count, always 1
+
+	background_ = stream.Read<float>();
+	auto tile_count = stream.Read<uint32_t>();
+	auto child_count = stream.Read<uint32_t>();
+	for (uint32_t i = 0; i < tile_count; ++i) {
+		auto origin = stream.Read<glm::ivec3>();
+		auto value = stream.Read<float>();
+		if (stream.Read<uint8_t>() != 0)
+			tiles_.push_back({ origin, kRootChildSize, value });
+	}
+	std::vector<glm::ivec3> leaf_origins;
+	TopologyContext context{ stream, compression_, background_, tiles_, leaf_origins };
+	for (uint32_t i = 0; i < child_count; ++i)
+		ReadInternalTopology(context, stream.Read<glm::ivec3>(), 2);
+
+	// The buffer section repeats each leaf's value mask followed by its values, in topology order
+	min_ = glm::ivec3(INT_MAX);
+	max_ = glm::ivec3(INT_MIN);
+	stream.Seek(buffer_offset);
+	leaves_.reserve(leaf_origins.size());
+	for (auto origin : leaf_origins) {
+		leaves_.push_back({ origin, stream.offset() });
+		uint64_t value_mask[kLeafVoxels / 64];
+		stream.Read(value_mask, sizeof(value_mask));
+		ReadCompressedValues(stream, compression_, background_, value_mask, kLeafVoxels, nullptr);
+
+		// Word x holds the (y, z) slice x, byte y of a word holds the z row
+		uint64_t yz = 0;
+		for (int x = 0; x < kLeafSize; ++x) {
+			if (value_mask[x] == 0)
+				continue;
+			min_.x = glm::min(min_.x, origin.x + x);
+			max_.x = glm::max(max_.x, origin.x + x);
+			yz |= value_mask[x];
+		}
+		uint64_t z = 0;
+		for (int y = 0; y < kLeafSize; ++y) {
+			auto row = (yz >> (y * 8)) & 0xff;
+			if (row == 0)
+				continue;
+			min_.y = glm::min(min_.y, origin.y + y);
+			max_.y = glm::max(max_.y, origin.y + y);
+			z |= row;
+		}
+		for (int i = 0; i < kLeafSize; ++i) {
+			if ((z >> i) & 1) {
+				min_.z = glm::min(min_.z, origin.z + i);
+				max_.z = glm::max(max_.z, origin.z + i);
+			}
+		}
+	}
+	for (const auto& tile : tiles_) {
+		min_ = glm::min(min_, tile.origin);
+		max_ = glm::max(max_, tile.origin + tile.size - 1);
+	}
+	if (min_.x > max_.x)
+		throw std::runtime_error(std::string("Empty VDB grid in ") + path);
+}
+
+bool VdbFloatGridReader::ReadFileBounds(const char* path, glm::ivec3& min, glm::ivec3& max) {
+	MappedFile file(path);
+	if (!file)
+		throw std::runtime_error(std::string("Failed to open ") + path);
+	VdbStream stream(file.data(), file.size());
+	stream.Seek(ReadFirstGridDescriptor(stream, path).grid_offset);
+	stream.Skip(sizeof(uint32_t)); // compression
+	bool has_min = false, has_max = false;
+	auto count = stream.Read<uint32_t>();
+	for (uint32_t i = 0; i < count; ++i) {
+		auto name = stream.ReadString();
+		auto type = stream.ReadString();
+		auto size = stream.Read<uint32_t>();
+		if (type == "vec3i" && size == sizeof(glm::ivec3) && (name == "file_bbox_min" || name == "file_bbox_max")) {
+			auto value = stream.Read<glm::ivec3>();
+			(name == "file_bbox_min" ? min : max) = value;
+			(name == "file_bbox_min" ? has_min : has_max) = true;
+		}
+		else {
+			stream.Skip(size);
+		}
+	}
+	return has_min && has_max && glm::all(glm::lessThanEqual(min, max));
+}
+
+void VdbFloatGridReader::ReadLeaf(size_t i, float values[kLeafVoxels], uint64_t value_mask[kLeafVoxels / 64]) const {
+	VdbStream stream(file_.data(), file_.size(), leaves_[i].buffer_offset);
+	stream.Read(value_mask, kLeafVoxels / 8);
+	ReadCompressedValues(stream, compression_, background_, value_mask, kLeafVoxels, values);
+}
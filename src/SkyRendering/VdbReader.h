@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "MappedFile.h"
+
+// Dependency-free reader for the first grid of an OpenVDB file, limited to what our cloud
+// assets use: file format 222 or later, a Tree_float_5_4_3 grid, and no compression or "active
+// values" compression. Zip and Blosc compressed files are rejected with VdbCompressionError,
+// they need OpenVDB itself (or re-saving with active values compression).
+//
+// The constructor maps the file and walks the topology once. Leaf values stay in the mapping
+// and are decoded on demand, so a large grid costs little more than its file size.
+class VdbCompressionError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+class VdbFloatGridReader {
+public:
+    static constexpr int kLeafSize = 8;
+    static constexpr int kLeafVoxels = kLeafSize * kLeafSize * kLeafSize;
+
+    struct Tile {
+        glm::ivec3 origin;
+        int size;
+        float value;
+    };
+
+    // Throws std::runtime_error if the file is missing, malformed or unsupported, and
+    // VdbCompressionError if it is Zip or Blosc compressed
+    explicit VdbFloatGridReader(const char* path);
+
+    // Active voxel bounds from the file_bbox_min/file_bbox_max metadata OpenVDB writes with the
+    // first grid, without walking its tree. False if the file does not have them.
+    static bool ReadFileBounds(const char* path, glm::ivec3& min, glm::ivec3& max);
+
+    const std::string& grid_name() const {
+        return grid_name_;
+    }
+    // Index space bounds of the active voxels, inclusive
+    glm::ivec3 min() const {
+        return min_;
+    }
+    glm::ivec3 max() const {
+        return max_;
+    }
+    // Active tiles of the internal and root nodes
+    const std::vector<Tile>& tiles() const {
+        return tiles_;
+    }
+    size_t leaf_count() const {
+        return leaves_.size();
+    }
+    glm::ivec3 leaf_origin(size_t i) const {
+        return leaves_[i].origin;
+    }
+
+    // Decodes leaf i. Voxel (x, y, z) of the leaf is values[(x << 6) | (y << 3) | z] and is active
+    // if that bit of value_mask is set. Safe to call from several threads.
+    void ReadLeaf(size_t i, float values[kLeafVoxels], uint64_t value_mask[kLeafVoxels / 64]) const;
+
+private:
+    struct Leaf {
+        glm::ivec3 origin;
+        uint64_t buffer_offset; // value mask of the leaf in the buffer section
+    };
+
+    MappedFile file_;
+    std::string grid_name_;
+    uint32_t compression_ = 0;
+    float background_ = 0.0f;
+    glm::ivec3 min_{};
+    glm::ivec3 max_{};
+    std::vector<Tile> tiles_;
+    std::vector<Leaf> leaves_;
+};
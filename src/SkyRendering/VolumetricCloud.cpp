@@ -1,12 +1,18 @@
 #include "VolumetricCloud.h"
 
 #include <sstream>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
 
 #include <glm/gtc/type_ptr.hpp>
 
 #include "ImGuiExt.h"
 #include "Textures.h"
+#include "Utils.h"
 #include "VolumetricCloudDefaultMaterial.h"
+#include "CloudPathTracerReference.h"
+#include "PathTracingCheckpoint.h"
 
 struct VolumetricCloudCommonBufferData {
 	glm::mat4 uInvMVP;
@@ -30,6 +36,11 @@ struct VolumetricCloudCommonBufferData {
 	float uAerialPerspectiveLutMaxDistance;
 	float uShadowFroxelMaxDistance;
 	float uEarthRadius;
+
+	uint32_t uAmortizationBlockSize;
+	uint32_t uAmortizationPattern;
+	float uHistoryRejectionMotion;
+	float padding_;
 };
 
 struct VolumetricCloudBufferData {
@@ -45,11 +56,18 @@ struct VolumetricCloudBufferData {
 	float uEnvMultiscatteringSigmaScale;
 	float uShadowDistance;
 	float uEnvBottomVisibility;
-	glm::vec3 padding_;
+	float uEmptySpaceSkipping;
+	float uLightVolumeEnable;
+	float uLightVolumeHalfWidth;
 	float uEnvSunHeightCurveExp;
+
+	glm::vec2 uLightVolumeOffset;
+	glm::vec2 uLightVolumeBuildOffset;
+	float uLightVolumeBuildSliceBegin;
 };
 
 static const glm::ivec2 kShadowMapResolution{ 512, 512 };
+static const glm::ivec3 kLightVolumeResolution{ 256, 256, 32 };
 
 VolumetricCloud::VolumetricCloud() {
 	material = std::make_unique<VolumetricCloudDefaultMaterial0>();
@@ -73,7 +91,7 @@ VolumetricCloud::VolumetricCloud() {
 
 	reconstruct_program_ = {
 		"../shaders/SkyRendering/VolumetricCloudReconstruct.comp",
-		{{16, 8}, {8, 4}, {8, 8}, {16, 4}, {16, 16}, {32, 8}, {32, 16}},
+		{{16, 8}, {8, 4}, {8, 8}, {16, 4}, {16, 16}},
 		[](const std::string& src) { return std::string("#version 460\n") + src; }
 	};
 
@@ -93,6 +111,19 @@ VolumetricCloud::VolumetricCloud() {
 		};
 	}
 
+	auto create_tile_program = [](const std::string& tag) -> GLReloadableComputeProgram {
+		return {
+			"../shaders/SkyRendering/VolumetricCloudTileClassify.comp",
+			{{8, 8}, {16, 8}, {8, 4}, {16, 4}, {16, 16}},
+			[tag](const std::string& src) { return std::string("#version 460\n") + Replace(src, "TAG_CONF", tag); },
+			tag
+		};
+	};
+	tile_classify_program_ = create_tile_program("TILE_CLASSIFY_PASS");
+	tile_list_program_ = create_tile_program("TILE_LIST_PASS");
+	tile_fill_program_[0] = create_tile_program("TILE_FILL_RENDER_PASS");
+	tile_fill_program_[1] = create_tile_program("TILE_FILL_RECONSTRUCT_PASS");
+
 	shadow_froxel_gen_program_ = {
 		"../shaders/SkyRendering/VolumetricCloudShadowFroxel.comp",
 		{{16, 8}, {8, 4}, {8, 8}, {16, 4}, {16, 16}, {32, 8}, {32, 16}},
@@ -103,6 +134,11 @@ VolumetricCloud::VolumetricCloud() {
 		shadow_map.Create(GL_TEXTURE_2D);
 		glTextureStorage2D(shadow_map.id(), 1, GL_RG32F, kShadowMapResolution.x, kShadowMapResolution.y);
 	}
+	for (auto& light_volume : light_volumes_) {
+		light_volume.Create(GL_TEXTURE_3D);
+		glTextureStorage3D(light_volume.id(), 1, GL_R16, kLightVolumeResolution.x, kLightVolumeResolution.y, kLightVolumeResolution.z);
+	}
+
 	shadow_map_sampler_.Create();
 	glSamplerParameteri(shadow_map_sampler_.id(), GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 	glSamplerParameteri(shadow_map_sampler_.id(), GL_TEXTURE_MIN_FILTER, GL_LINEAR);
@@ -112,27 +148,67 @@ VolumetricCloud::VolumetricCloud() {
 	glSamplerParameterfv(shadow_map_sampler_.id(), GL_TEXTURE_BORDER_COLOR, border);
 }
 
+VolumetricCloud::~VolumetricCloud() {
+	if (reference_job_.valid()) {
+		reference_->Cancel();
+		reference_job_.wait();
+	}
+}
+
 void VolumetricCloud::SetViewport(int width, int height) {
 	viewport_ = { width, height };
-	viewport_data_ = std::make_unique<ViewportData>(viewport_);
+	viewport_data_.reset();
+	ResizeViewportData();
 }
 
-VolumetricCloud::ViewportData::ViewportData(glm::ivec2 viewport) {
+int VolumetricCloud::GetAmortizationBlockSize() const {
+	return amortization_pattern == AmortizationPattern::CHECKERBOARD_2X2 ? 2 : 4;
+}
+
+glm::ivec2 VolumetricCloud::GetHalfResolution(float scale, int block_size) const {
+	// Multiple of block_size so that every reconstruct texel has its render texel
+	auto render_resolution = glm::ivec2(glm::ceil(glm::vec2(viewport_) * scale / (2.0f * block_size)));
+	return block_size * glm::max(render_resolution, glm::ivec2(1));
+}
+
+// Reallocates the viewport textures if the resolution scale or the amortization block changed
+void VolumetricCloud::ResizeViewportData() {
+	auto block_size = GetAmortizationBlockSize();
+	auto half_resolution = GetHalfResolution(resolution_bucket_, block_size);
+	if (viewport_data_ && half_resolution == half_resolution_ && block_size == viewport_data_->block_size)
+		return;
+	half_resolution_ = half_resolution;
+	viewport_data_ = std::make_unique<ViewportData>(viewport_, half_resolution_, block_size);
+}
+
+VolumetricCloud::ViewportData::ViewportData(glm::ivec2 viewport, glm::ivec2 half_resolution, int block_size)
+	: block_size(block_size)
+	, render_resolution(half_resolution / block_size) {
 	checkerboard_depth_.Create(GL_TEXTURE_2D);
-	glTextureStorage2D(checkerboard_depth_.id(), 1, GL_R32F, viewport.x / 2, viewport.y / 2);
+	glTextureStorage2D(checkerboard_depth_.id(), 1, GL_R32F, half_resolution.x, half_resolution.y);
 	index_linear_depth_.Create(GL_TEXTURE_2D);
-	glTextureStorage2D(index_linear_depth_.id(), 1, GL_RG32F, viewport.x / 4, viewport.y / 4);
+	glTextureStorage2D(index_linear_depth_.id(), 1, GL_RG32F, render_resolution.x, render_resolution.y);
 	render_texture_.Create(GL_TEXTURE_2D);
-	glTextureStorage2D(render_texture_.id(), 1, GL_RGBA16F, viewport.x / 4, viewport.y / 4);
+	glTextureStorage2D(render_texture_.id(), 1, GL_RGBA16F, render_resolution.x, render_resolution.y);
 	cloud_distance_texture_.Create(GL_TEXTURE_2D);
-	glTextureStorage2D(cloud_distance_texture_.id(), 1, GL_R32F, viewport.x / 4, viewport.y / 4);
+	glTextureStorage2D(cloud_distance_texture_.id(), 1, GL_R32F, render_resolution.x, render_resolution.y);
 	for (auto& tex : reconstruct_texture_) {
 		tex.Create(GL_TEXTURE_2D);
-		glTextureStorage2D(tex.id(), 1, GL_RGBA16F, viewport.x / 2, viewport.y / 2);
+		glTextureStorage2D(tex.id(), 1, GL_RGBA16F, half_resolution.x, half_resolution.y);
+		// Empty history (no cloud) instead of undefined contents after a resize
+		const float clear_color[] = { 0.0f, 0.0f, 0.0f, 1.0f };
+		glClearTexImage(tex.id(), 0, GL_RGBA, GL_FLOAT, clear_color);
 	}
 
 	shadow_froxel.Create(GL_TEXTURE_3D);
 	glTextureStorage3D(shadow_froxel.id(), 1, GL_R16, viewport.x / 12, viewport.y / 12, 128);
+
+	tile_grid_size = (render_resolution + kTileSize - 1) / kTileSize;
+	tile_mask_.Create(GL_TEXTURE_2D);
+	glTextureStorage2D(tile_mask_.id(), 1, GL_R8UI, tile_grid_size.x, tile_grid_size.y);
+	auto tile_count = static_cast<GLsizeiptr>(tile_grid_size.x) * tile_grid_size.y;
+	tile_buffer_.Create();
+	glNamedBufferStorage(tile_buffer_.id(), kTileCommandCount * sizeof(glm::uvec4) + 3 * tile_count * sizeof(GLuint), NULL, GL_DYNAMIC_STORAGE_BIT);
 }
 
 static glm::mat4 GetLightProjection(const Camera& camera, const glm::mat4& light_view, const glm::mat4& inv_model, float max_distance) {
@@ -171,10 +247,13 @@ void VolumetricCloud::Update(const Camera& camera, const Earth& earth, const Atm
 	if (!material)
 		return;
 
+	UpdateDynamicResolution();
+	ResizeViewportData();
+
 	if (material.get() != preframe_material_) {
 		render_program_ = {
 			"../shaders/SkyRendering/VolumetricCloudRender.comp",
-			{{16, 8}, {8, 4}, {8, 8}, {16, 4}, {32, 8}, {32, 16}, {32, 32}},
+			{{8, 8}, {8, 4}, {4, 8}, {4, 4}}, // a work group covers one kTileSize tile
 			CreateShaderPostProcess()
 		};
 		shadow_map_gen_program_ = {
@@ -182,6 +261,12 @@ void VolumetricCloud::Update(const Camera& camera, const Earth& earth, const Atm
 			{{16, 8}, {8, 4}, {8, 8}, {16, 4}, {16, 16}, {32, 8}, {32, 16}},
 			CreateShaderPostProcess()
 		};
+		light_volume_program_ = {
+			"../shaders/SkyRendering/VolumetricCloudLightVolume.comp",
+			{{4, 4, 4}, {8, 4, 4}, {8, 8, 4}, {8, 8, 2}, {16, 8, 2}, {8, 8, 8}},
+			CreateShaderPostProcess()
+		};
+		light_volume_valid_ = false;
 		preframe_material_ = material.get();
 	}
 
@@ -236,7 +321,11 @@ void VolumetricCloud::Update(const Camera& camera, const Earth& earth, const Atm
 	common_buffer.uLightVP = light_vp;
 	common_buffer.uInvLightVP = inv_light_vp;
 	common_buffer.uCameraPos = local_camera_pos;
-	common_buffer.uBaseShadingIndex = frame_id_ & 0x3;
+	auto block_size = viewport_data_->block_size;
+	common_buffer.uBaseShadingIndex = frame_id_ & (block_size * block_size - 1);
+	common_buffer.uAmortizationBlockSize = block_size;
+	common_buffer.uAmortizationPattern = static_cast<uint32_t>(amortization_pattern);
+	common_buffer.uHistoryRejectionMotion = history_rejection_motion;
 	common_buffer.uLinearDepthParam = { 1.0f / camera.zNear, (camera.zFar - camera.zNear) / (camera.zFar * camera.zNear) };
 	common_buffer.uEarthRadius = earth_radius;
 	common_buffer.uSunDirection = local_sun_direction;
@@ -253,9 +342,11 @@ void VolumetricCloud::Update(const Camera& camera, const Earth& earth, const Atm
 	aerial_perspective_luminance_tex_ = aerial_perspective.luminance_tex;
 	aerial_perspective_transmittance_tex_ = aerial_perspective.transmittance_tex;
 	environment_luminance_tex_ = atmosphere_render.environment_luminance_texture();
+	atmosphere_data_ = ComputeAtmosphereBufferData(earth.parameters);
+	local_sun_direction_ = local_sun_direction;
+	earth_radius_ = earth_radius;
 
-
-	VolumetricCloudBufferData buffer;
+	VolumetricCloudBufferData buffer{};
 	buffer.uMaxRaymarchDistance = max_raymarch_distance_;
 	buffer.uMaxRaymarchSteps = max_raymarch_steps_;
 	buffer.uMaxVisibleDistance = max_visible_distance_;
@@ -267,6 +358,39 @@ void VolumetricCloud::Update(const Camera& camera, const Earth& earth, const Atm
 	buffer.uEnvMultiscatteringSigmaScale = env_multiscattering_sigma_scale;
 	buffer.uEnvBottomVisibility = env_bottom_visibility;
 	buffer.uEnvSunHeightCurveExp = env_sun_height_curve_exp;
+	buffer.uEmptySpaceSkipping = empty_space_skipping_enable ? 1.0f : 0.0f;
+	buffer.uLightVolumeEnable = light_volume_enable ? 1.0f : 0.0f;
+	buffer.uLightVolumeHalfWidth = light_volume_half_width;
+
+	// The light volumes stay fixed in cloud space while they are built and read, the offsets move
+	// them to the current local frame. A new or resized volume is built whole in one frame.
+	auto offset = offset_from_first_ + glm::dvec2(delta_local);
+	light_volume_build_count_ = 0;
+	if (light_volume_enable) {
+		if (!light_volume_valid_ || light_volume_half_width != light_volume_built_half_width_) {
+			light_volume_slice_ = 0;
+			light_volume_build_count_ = kLightVolumeResolution.z;
+		} else {
+			light_volume_build_count_ = glm::clamp(light_volume_slices_per_frame, 1, kLightVolumeResolution.z - light_volume_slice_);
+		}
+		auto back = light_volume_front_ ^ 1;
+		if (light_volume_slice_ == 0)
+			light_volume_centers_[back] = offset;
+		buffer.uLightVolumeBuildOffset = glm::vec2(offset - light_volume_centers_[back]);
+		buffer.uLightVolumeBuildSliceBegin = static_cast<float>(light_volume_slice_);
+		light_volume_build_begin_ = light_volume_slice_;
+		light_volume_slice_ += light_volume_build_count_;
+		// RenderShadow completes the back volume before Render reads it
+		if (light_volume_slice_ == kLightVolumeResolution.z) {
+			light_volume_slice_ = 0;
+			light_volume_front_ = back;
+			light_volume_valid_ = true;
+			light_volume_built_half_width_ = light_volume_half_width;
+		}
+	} else {
+		light_volume_valid_ = false;
+	}
+	buffer.uLightVolumeOffset = glm::vec2(offset - light_volume_centers_[light_volume_front_]);
 
 	glNamedBufferSubData(buffer_.id(), 0, sizeof(buffer), &buffer);
 
@@ -279,6 +403,36 @@ void VolumetricCloud::Update(const Camera& camera, const Earth& earth, const Atm
 	light_vp_ = light_vp;
 }
 
+void VolumetricCloud::UpdateDynamicResolution() {
+	// Textures are only reallocated when the scale crosses one of these steps
+	constexpr float kBucketStep = 0.125f;
+	constexpr float kBucketHysteresis = 0.03f;
+	// Wait for the profiler to report frames rendered at the new size (it lags a few frames)
+	constexpr int kCooldownFrames = 8;
+
+	auto min_scale = glm::clamp(std::ceil(dynamic_resolution_min_scale / kBucketStep) * kBucketStep, kBucketStep, 1.0f);
+	if (!dynamic_resolution_enable) {
+		resolution_scale_ = 1.0f;
+	}
+	else if (resolution_cooldown_ > 0) {
+		--resolution_cooldown_;
+	}
+	else if (auto scope = Profiler::Instance().FindScope(profiler_path_); scope && scope->count > 0) {
+		auto gpu_ms = glm::max(scope->GpuStats().last, 1e-3f);
+		// The cost is roughly proportional to the pixel count
+		auto estimate = resolution_bucket_ * glm::sqrt(dynamic_resolution_budget_ms / gpu_ms);
+		resolution_scale_ = glm::clamp(glm::mix(resolution_scale_, estimate, 0.1f), min_scale, 1.0f);
+	}
+
+	auto bucket = glm::clamp(std::floor(resolution_scale_ / kBucketStep) * kBucketStep, min_scale, 1.0f);
+	if (bucket > resolution_bucket_ && resolution_scale_ < bucket + kBucketHysteresis && bucket < 1.0f)
+		bucket = resolution_bucket_;
+	if (bucket == resolution_bucket_)
+		return;
+	resolution_bucket_ = bucket;
+	resolution_cooldown_ = kCooldownFrames;
+}
+
 void VolumetricCloud::RenderShadow() {
 	PERF_MARKER("VolumetricCloudShadow");
 	std::swap(shadow_maps_[0], shadow_maps_[1]);
@@ -322,6 +476,17 @@ void VolumetricCloud::RenderShadow() {
 		shadow_froxel_gen_program_.Dispatch(viewport_ / 12);
 		glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
 	}
+	if (light_volume_build_count_ > 0) {
+		PERF_MARKER("VolumetricCloudLightVolume");
+		auto target = light_volume_build_begin_ + light_volume_build_count_ == kLightVolumeResolution.z
+			? light_volume_front_ : light_volume_front_ ^ 1;
+		glBindBufferBase(GL_UNIFORM_BUFFER, 2, buffer_.id());
+		GLBindImageTextures({ light_volumes_[target].id() });
+
+		glUseProgram(light_volume_program_.id());
+		light_volume_program_.Dispatch(glm::ivec3(kLightVolumeResolution.x, kLightVolumeResolution.y, light_volume_build_count_));
+		glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+	}
 }
 
 void VolumetricCloud::Render(GLuint hdr_texture, GLuint depth_texture) {
@@ -331,6 +496,7 @@ void VolumetricCloud::Render(GLuint hdr_texture, GLuint depth_texture) {
 	}
 
 	PERF_MARKER("VolumetricCloud");
+	profiler_path_ = Profiler::Instance().current_path();
 	{
 		PERF_MARKER("Checkerboard Depth");
 		GLBindTextures({ depth_texture });
@@ -338,7 +504,7 @@ void VolumetricCloud::Render(GLuint hdr_texture, GLuint depth_texture) {
 		GLBindImageTextures({ viewport_data_->checkerboard_depth_.id() });
 
 		glUseProgram(checkerboard_gen_program_.id());
-		checkerboard_gen_program_.Dispatch(viewport_ / 2);
+		checkerboard_gen_program_.Dispatch(half_resolution_);
 		glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
 	}
 
@@ -347,17 +513,43 @@ void VolumetricCloud::Render(GLuint hdr_texture, GLuint depth_texture) {
 
 	{
 		PERF_MARKER("Index Generate");
-		GLBindTextures({ viewport_data_->checkerboard_depth_.id() });
-		GLBindSamplers({ Samplers::GetNearestClampToEdge() });
+		GLBindTextures({ viewport_data_->checkerboard_depth_.id(),
+						Textures::Instance().blue_noise() });
+		GLBindSamplers({ Samplers::GetNearestClampToEdge(),
+						0u });
 		GLBindImageTextures({ viewport_data_->index_linear_depth_.id() });
 
 		glUseProgram(index_gen_program_.id());
-		index_gen_program_.Dispatch(viewport_ / 4);
+		index_gen_program_.Dispatch(viewport_data_->render_resolution);
 		glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
 	}
 
 	glBindBufferBase(GL_UNIFORM_BUFFER, 2, buffer_.id());
 
+	{
+		PERF_MARKER("Tile Classification");
+		glm::uvec4 commands[kTileCommandCount];
+		std::fill(std::begin(commands), std::end(commands), glm::uvec4(0, 1, 1, 0));
+		glNamedBufferSubData(viewport_data_->tile_buffer_.id(), 0, sizeof(commands), commands);
+
+		GLBindTextures({ viewport_data_->checkerboard_depth_.id(),
+						viewport_data_->index_linear_depth_.id() });
+		GLBindSamplers({ Samplers::GetNearestClampToEdge(),
+						Samplers::GetNearestClampToEdge() });
+		GLBindImageTextures({ viewport_data_->tile_mask_.id() });
+		glUseProgram(tile_classify_program_.id());
+		glUniform1f(0, max_visible_distance_);
+		glUniform1i(1, tile_classification_enable ? 0 : 1);
+		tile_classify_program_.Dispatch(viewport_data_->tile_grid_size);
+		glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, viewport_data_->tile_buffer_.id());
+		glUseProgram(tile_list_program_.id());
+		tile_list_program_.Dispatch(viewport_data_->tile_grid_size);
+		glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT);
+		glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, viewport_data_->tile_buffer_.id());
+	}
+
 	{
 		PERF_MARKER("Render");
 		GLBindTextures<1>({ //viewport_data_->checkerboard_depth_.id(),
@@ -366,7 +558,8 @@ void VolumetricCloud::Render(GLuint hdr_texture, GLuint depth_texture) {
 						aerial_perspective_luminance_tex_,
 						aerial_perspective_transmittance_tex_,
 						Textures::Instance().blue_noise(),
-						GetShadowFroxel().shadow_froxel });
+						GetShadowFroxel().shadow_froxel,
+						light_volumes_[light_volume_front_].id() });
 
 		GLBindSamplers<1>({ //Samplers::GetNearestClampToEdge(),
 						Samplers::GetNearestClampToEdge(),
@@ -374,13 +567,18 @@ void VolumetricCloud::Render(GLuint hdr_texture, GLuint depth_texture) {
 						Samplers::GetLinearNoMipmapClampToEdge(),
 						Samplers::GetLinearNoMipmapClampToEdge(),
 						0u,
-						GetShadowFroxel().sampler, });
+						GetShadowFroxel().sampler,
+						Samplers::GetLinearNoMipmapClampToEdge(), });
 
 		GLBindImageTextures({ viewport_data_->render_texture_.id(),
 							viewport_data_->cloud_distance_texture_.id() });
 
 		glUseProgram(render_program_.id());
-		render_program_.Dispatch(viewport_ / 4);
+		render_program_.DispatchIndirect(kTileCommandRender * sizeof(glm::uvec4));
+
+		glUseProgram(tile_fill_program_[0].id());
+		glUniform1f(0, max_visible_distance_);
+		tile_fill_program_[0].DispatchIndirect(kTileCommandRenderFill * sizeof(glm::uvec4));
 		glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
 	}
 
@@ -399,7 +597,10 @@ void VolumetricCloud::Render(GLuint hdr_texture, GLuint depth_texture) {
 		GLBindImageTextures({ viewport_data_->reconstruct_texture_[0].id() });
 
 		glUseProgram(reconstruct_program_.id());
-		reconstruct_program_.Dispatch(viewport_ / 2);
+		reconstruct_program_.DispatchIndirect(kTileCommandReconstruct * sizeof(glm::uvec4));
+
+		glUseProgram(tile_fill_program_[1].id());
+		tile_fill_program_[1].DispatchIndirect(kTileCommandReconstructFill * sizeof(glm::uvec4));
 		glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
 	}
 
@@ -414,26 +615,65 @@ void VolumetricCloud::Render(GLuint hdr_texture, GLuint depth_texture) {
 		GLBindImageTextures({ hdr_texture });
 
 		glUseProgram(upscale_program_.id());
-		upscale_program_.Dispatch(viewport_);
+		upscale_program_.DispatchIndirect(kTileCommandUpscale * sizeof(glm::uvec4));
 		glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
 	}
+	glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, 0);
 
 	using std::swap;
 	swap(viewport_data_->reconstruct_texture_[0], viewport_data_->reconstruct_texture_[1]);
 }
 
+void VolumetricCloud::StartPathTracing() {
+	StopPathTracing();
+	path_tracing_ = std::make_unique<PathTracing>(*this, path_tracing_init_param_);
+}
+
+void VolumetricCloud::StopPathTracing() {
+	if (path_tracing_)
+		previous_samples_per_second_ = path_tracing_->samples_per_second();
+	path_tracing_.reset();
+}
+
+void VolumetricCloud::ResumePathTracing(const PathTracingCheckpoint& checkpoint) {
+	PathTracingCheckpoint current;
+	current.init = checkpoint.init;
+	current.viewport = viewport_;
+	current.mvp = mvp_;
+	current.camera_pos = camera_pos_;
+	current.model = model_;
+	current.scene_hash = PathTracingSceneHash();
+	if (!current.IsCompatible(checkpoint))
+		throw std::runtime_error("The checkpoint was rendered with another viewport, view or scene");
+	StopPathTracing();
+	path_tracing_init_param_ = checkpoint.init;
+	path_tracing_ = std::make_unique<PathTracing>(*this, path_tracing_init_param_);
+	path_tracing_->Restore(checkpoint);
+}
+
 void VolumetricCloud::DrawGUI() {
 	if (ImGui::Button(u8"StartPathTracing")) {
-		path_tracing_ = std::make_unique<PathTracing>(*this, path_tracing_init_param_);
+		StartPathTracing();
 	}
 	ImGui::SameLine();
 	if (ImGui::Button(u8"StopPathTracing")) {
-		path_tracing_.reset();
+		StopPathTracing();
 	}
 	if (ImGui::TreeNode("Path Tracing Settings")) {
 		if (path_tracing_) {
 			ImGui::Text("Frame Count: %u", path_tracing_->frame_cnt());
+			ImGui::Text("Samples/s: %.4g", path_tracing_->samples_per_second());
+			auto pixel_count = static_cast<double>(viewport_.x) * viewport_.y;
+			ImGui::Text("Samples/Pixel: %.1f", path_tracing_->sample_count() / pixel_count);
+			auto active_pixel_count = path_tracing_->active_pixel_count();
+			if (path_tracing_->converged())
+				ImGui::Text("Converged");
+			else if (active_pixel_count >= 0)
+				ImGui::Text("Active Pixels: %.2f%%, Max Error: %.4g",
+					100.0 * active_pixel_count / pixel_count, path_tracing_->max_relative_error());
 		}
+		if (previous_samples_per_second_ > 0.0)
+			ImGui::Text("Previous Run Samples/s: %.4g", previous_samples_per_second_);
 		ImGui::SliderInt("Tile Count (Sqrt)", &path_tracing_init_param_.sqrt_tile_count, 1, 8);
 		static int bounces_slider_max = 1024;
 		ImGui::SliderInt("Bounces Slider Max", &bounces_slider_max, 32, 1024);
@@ -445,6 +685,90 @@ void VolumetricCloud::DrawGUI() {
 		ImGui::EnumSelect("PRNG", &path_tracing_init_param_.prng);
 		ImGui::EnumSelect("Environment Lighting", &path_tracing_init_param_.environment_lighting);
 		ImGui::Checkbox("Importance Sampling", &path_tracing_init_param_.importance_sampling);
+		ImGui::Checkbox("Majorant Grid", &path_tracing_init_param_.majorant_grid);
+		ImGui::SliderInt3("Majorant Grid Size", glm::value_ptr(path_tracing_init_param_.majorant_grid_size), 1, 256);
+		ImGui::Checkbox("Adaptive Sampling", &path_tracing_init_param_.adaptive_sampling);
+		ImGui::SliderFloat("Noise Threshold", &path_tracing_init_param_.noise_threshold, 0.001f, 0.1f, "%.4f", ImGuiSliderFlags_Logarithmic);
+		ImGui::SliderInt("Min Samples", &path_tracing_init_param_.min_samples, 2, 256);
+		ImGui::SliderInt("Max Samples", &path_tracing_init_param_.max_samples, 16, 65536, "%d", ImGuiSliderFlags_Logarithmic);
+		ImGui::SliderInt("Max Samples Per Frame", &path_tracing_init_param_.max_samples_per_frame, 1, 16);
+		ImGui::Checkbox("Denoise", &path_tracing_init_param_.denoise);
+		ImGui::SliderInt("Denoise Iterations", &path_tracing_init_param_.denoise_iterations, 1, 6);
+		ImGui::SliderFloat("Denoise Taper Samples", &path_tracing_init_param_.denoise_taper_samples, 1.0f, 4096.0f, "%.0f", ImGuiSliderFlags_Logarithmic);
+		ImGui::SliderFloat("Denoise Sigma Luminance", &path_tracing_init_param_.denoise_sigma_luminance, 0.1f, 16.0f);
+		ImGui::SliderFloat("Denoise Sigma Depth", &path_tracing_init_param_.denoise_sigma_depth, 0.01f, 1.0f);
+		ImGui::SliderFloat("Denoise Sigma Transmittance", &path_tracing_init_param_.denoise_sigma_transmittance, 0.01f, 1.0f);
+		ImGui::InputInt("Tile Begin", &path_tracing_init_param_.tile_begin);
+		ImGui::InputInt("Tile End (0: Last)", &path_tracing_init_param_.tile_end);
+		ImGui::InputInt("First Sample", &path_tracing_init_param_.first_sample);
+		ImGui::InputInt("Sample Cap (0: None)", &path_tracing_init_param_.sample_cap);
+		constexpr char kCheckpointPath[] = "path_tracing.ckpt";
+		if (path_tracing_ && ImGui::Button("Save Checkpoint")) {
+			try {
+				path_tracing_->Checkpoint().Save(kCheckpointPath);
+				checkpoint_status_ = std::string("Saved ") + kCheckpointPath;
+			}
+			catch (std::exception& e) {
+				checkpoint_status_ = e.what();
+			}
+		}
+		if (path_tracing_)
+			ImGui::SameLine();
+		if (ImGui::Button("Resume Checkpoint")) {
+			try {
+				ResumePathTracing(PathTracingCheckpoint::Load(kCheckpointPath));
+				checkpoint_status_ = std::string("Resumed ") + kCheckpointPath;
+			}
+			catch (std::exception& e) {
+				checkpoint_status_ = e.what();
+			}
+		}
+		if (!checkpoint_status_.empty())
+			ImGui::TextUnformatted(checkpoint_status_.c_str());
+		if (reference_job_.valid()) {
+			if (reference_job_.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+				try {
+					reference_job_.get();
+					if (reference_->frame_cnt() > 0) {
+						reference_->WriteHdr("cloud_reference.hdr");
+						std::stringstream ss;
+						ss << "cloud_reference.hdr, " << reference_->frame_cnt() << " frames, "
+							<< static_cast<int64_t>(reference_->samples_per_second()) << " samples/s";
+						reference_status_ = ss.str();
+					}
+					else {
+						reference_status_ = "Canceled";
+					}
+				}
+				catch (std::exception& e) {
+					reference_status_ = e.what();
+				}
+				reference_.reset();
+			}
+			else {
+				ImGui::ProgressBar(reference_->progress());
+				if (ImGui::Button("Cancel CPU Reference"))
+					reference_->Cancel();
+			}
+		}
+		else {
+			ImGui::SliderInt("CPU Reference Frames", &reference_frames_, 1, 4096, "%d", ImGuiSliderFlags_Logarithmic);
+			if (ImGui::Button("Render CPU Reference")) {
+				try {
+					reference_ = std::make_unique<CloudPathTracerReference>(CaptureReferenceScene(), path_tracing_init_param_);
+					reference_status_.clear();
+					reference_job_ = std::async(std::launch::async, [reference = reference_.get(), frames = reference_frames_] {
+						reference->Render(frames);
+					});
+				}
+				catch (std::exception& e) {
+					reference_.reset();
+					reference_status_ = e.what();
+				}
+			}
+		}
+		if (!reference_status_.empty())
+			ImGui::TextUnformatted(reference_status_.c_str());
 		ImGui::TreePop();
 	}
 	ImGui::SliderFloat("Bottom Altitude", &bottom_altitude_, 0.0f, 10.0f);
@@ -463,6 +787,21 @@ void VolumetricCloud::DrawGUI() {
 	ImGui::SliderFloat("Environment Multiscattering Sigma Scale", &env_multiscattering_sigma_scale, 0.0f, 5.0f);
 	ImGui::SliderFloat("Environment Bottom Visibility", &env_bottom_visibility, 0.0f, 1.0f);
 	ImGui::SliderFloat("Environment Sun Height Curve Exp", &env_sun_height_curve_exp, 0.001f, 2.0f);
+	ImGui::Checkbox("Empty Space Skipping", &empty_space_skipping_enable);
+	ImGui::Checkbox("Light Volume", &light_volume_enable);
+	ImGui::SliderFloat("Light Volume Half Width", &light_volume_half_width, 1.0f, 100.0f);
+	ImGui::SliderInt("Light Volume Slices Per Frame", &light_volume_slices_per_frame, 1, kLightVolumeResolution.z);
+	ImGui::Checkbox("Tile Classification", &tile_classification_enable);
+	ImGui::EnumSelect("Amortization Pattern", &amortization_pattern);
+	ImGui::SliderFloat("History Rejection Motion", &history_rejection_motion, 0.5f, 16.0f);
+	if (ImGui::TreeNode("Dynamic Resolution")) {
+		ImGui::Checkbox("Enable", &dynamic_resolution_enable);
+		ImGui::SliderFloat("Budget (ms)", &dynamic_resolution_budget_ms, 0.1f, 10.0f);
+		ImGui::SliderFloat("Min Scale", &dynamic_resolution_min_scale, 0.25f, 1.0f);
+		ImGui::Text("Scale: %.3f (allocated %.3f, %dx%d)", resolution_scale_, resolution_bucket_,
+			half_resolution_.x * 2, half_resolution_.y * 2);
+		ImGui::TreePop();
+	}
 	auto b_material_tree_node = ImGui::TreeNode("Material");
 	if (ImGui::BeginPopupContextItem()) {
 		for (const auto& [name, factory] : reflection::SubclassInfo<IVolumetricCloudMaterial>::GetFactoryTable()) {
@@ -480,6 +819,46 @@ void VolumetricCloud::DrawGUI() {
 	}
 }
 
+CloudReferenceScene VolumetricCloud::CaptureReferenceScene() const {
+	if (!material)
+		throw std::runtime_error("Volumetric cloud has no material");
+	auto local_camera_pos = glm::vec3(glm::inverse(model_) * glm::vec4(camera_pos_, 1.0f));
+
+	CloudReferenceScene scene;
+	scene.density = material->CreateDensityReference(local_camera_pos);
+	if (!scene.density)
+		throw std::runtime_error("The cloud material has no CPU density");
+	scene.viewport = viewport_;
+	scene.inv_mvp = glm::inverse(mvp_);
+	scene.camera_pos = local_camera_pos;
+	scene.sun_direction = local_sun_direction_;
+	scene.model = glm::mat3(model_);
+	scene.earth_radius = earth_radius_;
+	scene.bottom_altitude = bottom_altitude_;
+	scene.top_altitude = bottom_altitude_ + thickness_;
+	scene.sigma_t_max = material->GetSigmaTMax();
+	scene.atmosphere = atmosphere_data_;
+	scene.transmittance = ReadAtmosphereLut(atmosphere_transmittance_tex_);
+	scene.environment = CloudEnvironmentReference(environment_luminance_tex_);
+	return scene;
+}
+
+uint64_t VolumetricCloud::PathTracingSceneHash() const {
+	if (!material)
+		return 0;
+	// The material type shows in its shader, its parameters in its config
+	auto shader_path = material->ShaderPath();
+	rapidjson::StringBuffer sb;
+	rapidjson::PrettyWriter<rapidjson::StringBuffer> writer(sb);
+	material->Serialize(writer);
+	auto hash = Fnv1a(kFnv1aOffsetBasis, shader_path.data(), shader_path.size());
+	hash = Fnv1a(hash, sb.GetString(), sb.GetSize());
+	float layer[]{ earth_radius_, bottom_altitude_, thickness_ };
+	hash = Fnv1a(hash, layer, sizeof(layer));
+	hash = Fnv1a(hash, &local_sun_direction_, sizeof(local_sun_direction_));
+	return Fnv1a(hash, &atmosphere_data_, sizeof(atmosphere_data_));
+}
+
 std::function<std::string(const std::string&)> VolumetricCloud::CreateShaderPostProcess(std::string additional) const {
 	return[material_path = material->ShaderPath(), additional = std::move(additional)](const std::string& src) {
 		std::stringstream ss;
@@ -493,7 +872,13 @@ std::function<std::string(const std::string&)> VolumetricCloud::CreateShaderPost
 }
 
 VolumetricCloud::PathTracing::PathTracing(const VolumetricCloud& cloud, const InitParam& init)
-	: cloud_(cloud), sqrt_tile_count_(init.sqrt_tile_count) {
+	: cloud_(cloud), init_(init), sqrt_tile_count_(glm::max(init.sqrt_tile_count, 1))
+	, tile_begin_(glm::clamp(init.tile_begin, 0, sqrt_tile_count_ * sqrt_tile_count_ - 1))
+	, tile_end_(init.tile_end > tile_begin_ ? glm::min(init.tile_end, sqrt_tile_count_ * sqrt_tile_count_) : sqrt_tile_count_ * sqrt_tile_count_)
+	, tile_index_(tile_begin_)
+	, majorant_grid_enable_(init.majorant_grid), majorant_grid_size_(glm::max(init.majorant_grid_size, 1))
+	, adaptive_sampling_(init.adaptive_sampling)
+	, denoise_enable_(init.denoise), denoise_iterations_(glm::max(init.denoise_iterations, 1)) {
 	const auto& viewport = cloud.viewport_;
 	accumulating_texture_.Create(GL_TEXTURE_2D);
 	glTextureStorage2D(accumulating_texture_.id(), 1, GL_RGBA32F, viewport.x, viewport.y);
@@ -501,6 +886,22 @@ VolumetricCloud::PathTracing::PathTracing(const VolumetricCloud& cloud, const In
 	glClearTexImage(accumulating_texture_.id(), 0, GL_RGBA, GL_FLOAT, zero);
 	rendered_mask_.Create(GL_TEXTURE_2D);
 	glTextureStorage2D(rendered_mask_.id(), 1, GL_R8UI, viewport.x, viewport.y);
+	uint8_t zero_mask = 0;
+	glClearTexImage(rendered_mask_.id(), 0, GL_RED_INTEGER, GL_UNSIGNED_BYTE, &zero_mask);
+	statistics_texture_.Create(GL_TEXTURE_2D);
+	glTextureStorage2D(statistics_texture_.id(), 1, GL_RGBA32F, viewport.x, viewport.y);
+	glClearTexImage(statistics_texture_.id(), 0, GL_RGBA, GL_FLOAT, zero);
+	if (denoise_enable_) {
+		features_texture_.Create(GL_TEXTURE_2D);
+		glTextureStorage2D(features_texture_.id(), 1, GL_RG32F, viewport.x, viewport.y);
+		glClearTexImage(features_texture_.id(), 0, GL_RG, GL_FLOAT, zero);
+		for (int i = 0; i < 2; ++i) {
+			denoise_color_[i].Create(GL_TEXTURE_2D);
+			glTextureStorage2D(denoise_color_[i].id(), 1, GL_RGBA32F, viewport.x, viewport.y);
+			denoise_variance_[i].Create(GL_TEXTURE_2D);
+			glTextureStorage2D(denoise_variance_[i].id(), 1, GL_R32F, viewport.x, viewport.y);
+		}
+	}
 
 	std::stringstream additional;
 	additional << "#define kSigmaTMax " << cloud_.material->GetSigmaTMax() << "\n";
@@ -517,6 +918,50 @@ VolumetricCloud::PathTracing::PathTracing(const VolumetricCloud& cloud, const In
 		<< cloud_.model_[0][0] << "," << cloud_.model_[0][1] << "," << cloud_.model_[0][2] << ","
 		<< cloud_.model_[1][0] << "," << cloud_.model_[1][1] << "," << cloud_.model_[1][2] << ","
 		<< cloud_.model_[2][0] << "," << cloud_.model_[2][1] << "," << cloud_.model_[2][2] << ")\n";
+	additional << "#define MAJORANT_GRID " << (majorant_grid_enable_ ? 1 : 0) << "\n";
+	additional << "#define kMajorantGridSize ivec3(" << majorant_grid_size_.x << ","
+		<< majorant_grid_size_.y << "," << majorant_grid_size_.z << ")\n";
+	additional << "#define ADAPTIVE_SAMPLING " << (adaptive_sampling_ ? 1 : 0) << "\n";
+	additional << "#define kNoiseThreshold " << glm::max(init.noise_threshold, 1e-6f) << "\n";
+	additional << "#define kMinSamples " << glm::max(init.min_samples, 2) << "u\n";
+	additional << "#define kMaxSamples " << glm::max(init.max_samples, 1) << "u\n";
+	additional << "#define kMaxSamplesPerFrame " << glm::max(init.max_samples_per_frame, 1) << "\n";
+	additional << "#define kFirstSample " << static_cast<uint32_t>(glm::max(init.first_sample, 0)) << "u\n";
+	additional << "#define kSampleCap " << (init.sample_cap > 0 ? static_cast<uint32_t>(init.sample_cap) : 0xffffffffu) << "u\n";
+	additional << "#define DENOISE " << (denoise_enable_ ? 1 : 0) << "\n";
+	additional << "#define kDenoiseTaperSamples " << glm::max(init.denoise_taper_samples, 1e-3f) << "\n";
+	additional << "#define kDenoiseSigmaLuminance " << glm::max(init.denoise_sigma_luminance, 1e-3f) << "\n";
+	additional << "#define kDenoiseSigmaDepth " << glm::max(init.denoise_sigma_depth, 1e-3f) << "\n";
+	additional << "#define kDenoiseSigmaTransmittance " << glm::max(init.denoise_sigma_transmittance, 1e-3f) << "\n";
+	if (majorant_grid_enable_) {
+		majorant_grid_.Create(GL_TEXTURE_3D);
+		glTextureStorage3D(majorant_grid_.id(), 1, GL_R32F, majorant_grid_size_.x, majorant_grid_size_.y, majorant_grid_size_.z);
+		majorant_program_ = {
+			"../shaders/SkyRendering/VolumetricCloudPathTracing.comp",
+			{{8, 8}, {16, 8}, {8, 4}, {16, 16}},
+			cloud_.CreateShaderPostProcess(additional.str() + "#define MAJORANT_GRID_PASS\n"),
+			"MAJORANT_GRID_PASS"
+		};
+	}
+	for (auto& slot : statistics_) {
+		slot.begin.Create(GL_TIMESTAMP);
+		slot.end.Create(GL_TIMESTAMP);
+		slot.buffer.Create();
+		glNamedBufferStorage(slot.buffer.id(), sizeof(StatisticsBufferData), NULL, GL_DYNAMIC_STORAGE_BIT);
+	}
+	auto tile_count = static_cast<size_t>(sqrt_tile_count_) * sqrt_tile_count_;
+	// Tiles of other workers count as converged
+	tile_active_pixel_counts_.assign(tile_count, 0);
+	std::fill(tile_active_pixel_counts_.begin() + tile_begin_, tile_active_pixel_counts_.begin() + tile_end_, -1);
+	tile_max_relative_errors_.assign(tile_count, 0.0f);
+	if (denoise_enable_) {
+		denoise_program_ = {
+			"../shaders/SkyRendering/VolumetricCloudPathTracing.comp",
+			{{16, 8}, {8, 4}, {8, 8}, {16, 4}, {32, 8}, {16, 16}},
+			cloud_.CreateShaderPostProcess(additional.str() + "#define DENOISE_PASS\n"),
+			"DENOISE_PASS"
+		};
+	}
 	render_program_ = {
 		"../shaders/SkyRendering/VolumetricCloudPathTracing.comp",
 		{{16, 8}, {8, 4}, {8, 8}, {16, 4}, {32, 8}, {32, 16}, {32, 32}},
@@ -531,41 +976,195 @@ VolumetricCloud::PathTracing::PathTracing(const VolumetricCloud& cloud, const In
 }
 
 void VolumetricCloud::PathTracing::Render(GLuint hdr_texture) {
-	if (tile_index_ == 0) {
+	for (auto& slot : statistics_)
+		ReadStatistics(slot, false);
+	if (converged()) {
+		Display(hdr_texture);
+		return;
+	}
+
+	if (tile_index_ == tile_begin_)
 		++frame_cnt_;
-		uint8_t zero = 0;
-		glClearTexImage(rendered_mask_.id(), 0, GL_RED_INTEGER, GL_UNSIGNED_BYTE, &zero);
+
+	// Only waits when the GPU is kStatisticsLatency renders behind
+	auto& slot = statistics_[statistics_index_];
+	ReadStatistics(slot, true);
+	StatisticsBufferData statistics{};
+	glNamedBufferSubData(slot.buffer.id(), 0, sizeof(statistics), &statistics);
+	glQueryCounter(slot.begin.id(), GL_TIMESTAMP);
+
+	// Lods follow the camera, so the majorants are rebuilt every frame
+	if (majorant_grid_enable_ && tile_index_ == tile_begin_) {
+		cloud_.material->Bind();
+		glBindBufferBase(GL_UNIFORM_BUFFER, 1, cloud_.common_buffer_.id());
+		glBindImageTexture(4, majorant_grid_.id(), 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_R32F);
+		glUseProgram(majorant_program_.id());
+		majorant_program_.Dispatch(glm::ivec2(majorant_grid_size_));
+		glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
 	}
 
 	GLBindTextures({ cloud_.atmosphere_transmittance_tex_,
 					cloud_.aerial_perspective_luminance_tex_,
 					cloud_.aerial_perspective_transmittance_tex_,
 					cloud_.GetShadowFroxel().shadow_froxel,
-					cloud_.environment_luminance_tex_ });
+					cloud_.environment_luminance_tex_,
+					majorant_grid_.id() });
 	GLBindSamplers({ Samplers::GetLinearNoMipmapClampToEdge(),
 					Samplers::GetLinearNoMipmapClampToEdge(),
 					Samplers::GetLinearNoMipmapClampToEdge(),
 					cloud_.GetShadowFroxel().sampler,
-					Samplers::GetAnisotropySampler(Samplers::Wrap::CLAMP_TO_EDGE) });
+					Samplers::GetAnisotropySampler(Samplers::Wrap::CLAMP_TO_EDGE),
+					Samplers::GetLinearNoMipmapClampToEdge() });
 	GLBindImageTextures({ accumulating_texture_.id(),
 						rendered_mask_.id(),
-						hdr_texture });
+						hdr_texture,
+						statistics_texture_.id() });
+	if (denoise_enable_)
+		glBindImageTexture(5, features_texture_.id(), 0, GL_FALSE, 0, GL_READ_WRITE, GL_RG32F);
 	cloud_.material->Bind();
 	glBindBufferBase(GL_UNIFORM_BUFFER, 1, cloud_.common_buffer_.id());
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, slot.buffer.id());
 	glUseProgram(render_program_.id());
-	glUniform1ui(0, frame_cnt_);
 	auto region = GetRenderRegion();
 	glUniform4iv(1, 1, glm::value_ptr(region));
 	render_program_.Dispatch({ region.z, region.w });
-	glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+	glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_TEXTURE_FETCH_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+	glQueryCounter(slot.end.id(), GL_TIMESTAMP);
+	slot.tile_index = tile_index_;
+	slot.pending = true;
+	statistics_index_ = (statistics_index_ + 1) % kStatisticsLatency;
+
+	Display(hdr_texture);
+
+	if (++tile_index_ == tile_end_)
+		tile_index_ = tile_begin_;
+}
+
+PathTracingCheckpoint VolumetricCloud::PathTracing::Checkpoint() const {
+	PathTracingCheckpoint checkpoint;
+	checkpoint.init = init_;
+	checkpoint.viewport = cloud_.viewport_;
+	checkpoint.mvp = cloud_.mvp_;
+	checkpoint.camera_pos = cloud_.camera_pos_;
+	checkpoint.model = cloud_.model_;
+	checkpoint.scene_hash = cloud_.PathTracingSceneHash();
+	checkpoint.frame_cnt = frame_cnt_;
+	checkpoint.tile_index = tile_index_;
+
+	auto pixel_count = static_cast<size_t>(cloud_.viewport_.x) * cloud_.viewport_.y;
+	auto read = [](GLuint texture, GLenum format, auto& texels, size_t count) {
+		texels.resize(count);
+		glGetTextureImage(texture, 0, format, format == GL_RED_INTEGER ? GL_UNSIGNED_BYTE : GL_FLOAT,
+			static_cast<GLsizei>(count * sizeof(texels[0])), texels.data());
+	};
+	glMemoryBarrier(GL_TEXTURE_UPDATE_BARRIER_BIT);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	read(accumulating_texture_.id(), GL_RGBA, checkpoint.accumulation, pixel_count);
+	read(statistics_texture_.id(), GL_RGBA, checkpoint.statistics, pixel_count);
+	read(rendered_mask_.id(), GL_RED_INTEGER, checkpoint.converged, pixel_count);
+	if (denoise_enable_)
+		read(features_texture_.id(), GL_RG, checkpoint.features, pixel_count);
+	glPixelStorei(GL_PACK_ALIGNMENT, 4);
+	return checkpoint;
+}
+
+void VolumetricCloud::PathTracing::Restore(const PathTracingCheckpoint& checkpoint) {
+	auto pixel_count = static_cast<size_t>(cloud_.viewport_.x) * cloud_.viewport_.y;
+	if (checkpoint.viewport != cloud_.viewport_ || checkpoint.accumulation.size() != pixel_count)
+		throw std::runtime_error("The checkpoint was rendered with another viewport");
+	auto write = [this](GLuint texture, GLenum format, const void* texels) {
+		glTextureSubImage2D(texture, 0, 0, 0, cloud_.viewport_.x, cloud_.viewport_.y, format,
+			format == GL_RED_INTEGER ? GL_UNSIGNED_BYTE : GL_FLOAT, texels);
+	};
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	write(accumulating_texture_.id(), GL_RGBA, checkpoint.accumulation.data());
+	write(statistics_texture_.id(), GL_RGBA, checkpoint.statistics.data());
+	write(rendered_mask_.id(), GL_RED_INTEGER, checkpoint.converged.data());
+	// A checkpoint without features starts them over, the denoiser then sees every pixel as sky
+	if (denoise_enable_ && !checkpoint.features.empty())
+		write(features_texture_.id(), GL_RG, checkpoint.features.data());
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+	frame_cnt_ = checkpoint.frame_cnt;
+	if (checkpoint.tile_index >= tile_begin_ && checkpoint.tile_index < tile_end_)
+		tile_index_ = checkpoint.tile_index;
+	restored_samples_ = 0;
+	for (const auto& statistics : checkpoint.statistics)
+		restored_samples_ += static_cast<int64_t>(statistics.z);
+}
 
+void VolumetricCloud::PathTracing::Display(GLuint hdr_texture) {
+	GLBindImageTextures({ accumulating_texture_.id(),
+						rendered_mask_.id(),
+						hdr_texture,
+						statistics_texture_.id() });
+	if (denoise_enable_) {
+		glBindImageTexture(5, features_texture_.id(), 0, GL_FALSE, 0, GL_READ_ONLY, GL_RG32F);
+		glBindSampler(6, Samplers::GetNearestClampToEdge());
+		glBindSampler(7, Samplers::GetNearestClampToEdge());
+		glUseProgram(denoise_program_.id());
+		// Ping-pong, iteration i writes denoise_color_[i % 2]
+		for (int i = 0; i < denoise_iterations_; ++i) {
+			auto src = (i + 1) % 2;
+			auto dst = i % 2;
+			glBindTextureUnit(6, denoise_color_[src].id());
+			glBindTextureUnit(7, denoise_variance_[src].id());
+			glBindImageTexture(6, denoise_color_[dst].id(), 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+			glBindImageTexture(7, denoise_variance_[dst].id(), 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+			glUniform1i(0, i);
+			denoise_program_.Dispatch(cloud_.viewport_);
+			glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+		}
+		glBindTextureUnit(6, denoise_color_[(denoise_iterations_ - 1) % 2].id());
+	}
 	glUseProgram(display_program_.id());
-	glUniform1ui(0, frame_cnt_);
 	display_program_.Dispatch(cloud_.viewport_);
 	glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+	if (denoise_enable_) {
+		// Later passes bind textures to these units without their own samplers
+		glBindSampler(6, 0);
+		glBindSampler(7, 0);
+	}
+}
+
+void VolumetricCloud::PathTracing::ReadStatistics(PendingStatistics& slot, bool wait) {
+	if (!slot.pending)
+		return;
+	if (!wait) {
+		GLint available = 0;
+		glGetQueryObjectiv(slot.end.id(), GL_QUERY_RESULT_AVAILABLE, &available);
+		if (!available)
+			return;
+	}
+	GLuint64 begin = 0, end = 0;
+	glGetQueryObjectui64v(slot.begin.id(), GL_QUERY_RESULT, &begin);
+	glGetQueryObjectui64v(slot.end.id(), GL_QUERY_RESULT, &end);
+	StatisticsBufferData statistics{};
+	glGetNamedBufferSubData(slot.buffer.id(), 0, sizeof(statistics), &statistics);
+	measured_seconds_ += static_cast<double>(end - begin) * 1e-9;
+	measured_samples_ += statistics.sample_count;
+	tile_active_pixel_counts_[slot.tile_index] = statistics.active_pixel_count;
+	float max_relative_error = 0.0f;
+	std::memcpy(&max_relative_error, &statistics.max_relative_error, sizeof(float));
+	tile_max_relative_errors_[slot.tile_index] = max_relative_error;
+	slot.pending = false;
+}
+
+int64_t VolumetricCloud::PathTracing::active_pixel_count() const {
+	int64_t count = 0;
+	for (auto tile_count : tile_active_pixel_counts_) {
+		if (tile_count < 0)
+			return -1;
+		count += tile_count;
+	}
+	return count;
+}
 
-	++tile_index_;
-	tile_index_ %= sqrt_tile_count_ * sqrt_tile_count_;
+float VolumetricCloud::PathTracing::max_relative_error() const {
+	float error = 0.0f;
+	for (auto tile_error : tile_max_relative_errors_)
+		error = glm::max(error, tile_error);
+	return error;
 }
 
 glm::ivec4 VolumetricCloud::PathTracing::GetRenderRegion() const {
@@ -1,5 +1,9 @@
 #pragma once
 
+#include <future>
+#include <string>
+#include <vector>
+
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 
@@ -13,8 +17,182 @@
 #include "IVolumetricCloudMaterial.h"
 #include "Samplers.h"
 
+struct CloudReferenceScene;
+struct PathTracingCheckpoint;
+class CloudPathTracerReference;
+
 class VolumetricCloud : public ISerializable {
 public:
+    // Which reconstruct texel of each block is ray marched in a frame, see VolumetricCloudIndexGen.comp
+    enum class AmortizationPattern {
+        CHECKERBOARD_2X2, // 4 frames
+        BAYER_4X4, // 16 frames
+        BLUE_NOISE_4X4, // 16 frames
+    };
+
+    class PathTracing {
+    public:
+        enum class PRNG {
+            WangHash,
+            PCGHash
+        };
+
+        enum class EnvironmentLighting {
+            OFF,
+            CONST_ENVIRONMENT_MAP,
+            GROUND_SINGLE_BOUNCE,
+            GROUND_MULTI_BOUNCE,
+        };
+
+        struct InitParam {
+            int sqrt_tile_count = 1;
+            int max_bounces = 128;
+            float region_box_half_width = 100.0f;
+            bool importance_sampling = true;
+            float forward_phase_g = 0.85f;
+            float back_phase_g = -0.15f;
+            float forward_scattering_ratio = 0.7f;
+            PRNG prng = PRNG::PCGHash;
+            EnvironmentLighting environment_lighting = EnvironmentLighting::GROUND_MULTI_BOUNCE;
+            // Per cell majorants over the region box instead of GetSigmaTMax everywhere, see
+            // MajorantIterator in VolumetricCloudPathTracing.comp
+            bool majorant_grid = true;
+            glm::ivec3 majorant_grid_size{ 64, 64, 8 };
+            // Pixels stop once the standard error of their mean luminance falls below
+            // noise_threshold times the mean, or after max_samples; until then those with more
+            // error get up to max_samples_per_frame paths per frame
+            bool adaptive_sampling = true;
+            float noise_threshold = 0.01f;
+            int min_samples = 16;
+            int max_samples = 65536;
+            int max_samples_per_frame = 4;
+            // Edge-aware a-trous filter of the displayed mean, see DENOISE_PASS in
+            // VolumetricCloudPathTracing.comp. It is blended in with weight
+            // denoise_taper_samples / (denoise_taper_samples + pixel sample count).
+            bool denoise = true;
+            int denoise_iterations = 4;
+            float denoise_taper_samples = 64.0f;
+            float denoise_sigma_luminance = 4.0f;
+            float denoise_sigma_depth = 0.1f;
+            float denoise_sigma_transmittance = 0.2f;
+            // For workers of a distributed render: only tiles [tile_begin, tile_end) of the
+            // sqrt_tile_count^2 grid are rendered (tile_end 0: to the last one), and the sample
+            // indices that seed the paths of each pixel start at first_sample
+            int tile_begin = 0;
+            int tile_end = 0;
+            int first_sample = 0;
+            // Pixels stop after sample_cap samples of this run (0: no cap), so that a worker
+            // starting at first_sample + sample_cap never repeats an index of this one
+            int sample_cap = 0;
+        };
+
+        uint32_t frame_cnt() const {
+            return frame_cnt_;
+        }
+
+        // Paths per second of GPU time over the run so far, majorant grid builds included
+        double samples_per_second() const {
+            return measured_seconds_ > 0.0 ? measured_samples_ / measured_seconds_ : 0.0;
+        }
+
+        // Paths traced so far, restored ones included. Like the other statistics it lags the
+        // submitted frames by up to kStatisticsLatency renders.
+        int64_t sample_count() const {
+            return restored_samples_ + measured_samples_;
+        }
+
+        // Renders per frame
+        int tile_count() const {
+            return tile_end_ - tile_begin_;
+        }
+
+        // Pixels of the last measured frame that have not converged, -1 before every tile was
+        // measured once
+        int64_t active_pixel_count() const;
+
+        // Largest relative error among the active pixels with min_samples or more
+        float max_relative_error() const;
+
+        // Every pixel converged, Render only displays the result from now on
+        bool converged() const {
+            return (adaptive_sampling_ || init_.sample_cap > 0) && active_pixel_count() == 0;
+        }
+
+        PathTracing(const VolumetricCloud& cloud, const InitParam& init);
+
+        void Render(GLuint hdr_texture);
+
+        // Reads back the accumulation and everything needed to resume it
+        PathTracingCheckpoint Checkpoint() const;
+
+        // Continues from checkpoint, which must have been saved by a run with the same InitParam,
+        // viewport and view
+        void Restore(const PathTracingCheckpoint& checkpoint);
+
+    private:
+        // Totals of one render dispatch, StatisticsBuffer in VolumetricCloudPathTracing.comp
+        struct StatisticsBufferData {
+            GLuint sample_count;
+            GLuint active_pixel_count;
+            GLuint max_relative_error;
+        };
+
+        // Timestamps and totals of one Render, read back once available
+        struct PendingStatistics {
+            GLQuery begin;
+            GLQuery end;
+            GLBuffer buffer;
+            int tile_index = 0;
+            bool pending = false;
+        };
+
+        static constexpr int kStatisticsLatency = 4;
+
+        glm::ivec4 GetRenderRegion() const;
+
+        // Denoises the accumulation if enabled and composites it over hdr_texture
+        void Display(GLuint hdr_texture);
+
+        // Reads back slot if its results are available, or waits for them if wait
+        void ReadStatistics(PendingStatistics& slot, bool wait);
+
+        const VolumetricCloud& cloud_;
+
+        GLReloadableComputeProgram render_program_;
+        GLReloadableComputeProgram display_program_;
+        GLTexture accumulating_texture_;
+        GLTexture rendered_mask_; // Converged pixels
+        GLTexture statistics_texture_;
+        uint32_t frame_cnt_ = 0;
+        const InitParam init_;
+        const int sqrt_tile_count_;
+        const int tile_begin_;
+        const int tile_end_;
+        int tile_index_;
+
+        const bool majorant_grid_enable_;
+        const glm::ivec3 majorant_grid_size_;
+        GLReloadableComputeProgram majorant_program_;
+        GLTexture majorant_grid_;
+
+        const bool adaptive_sampling_;
+        PendingStatistics statistics_[kStatisticsLatency];
+        int statistics_index_ = 0;
+        int64_t measured_samples_ = 0;
+        int64_t restored_samples_ = 0;
+        double measured_seconds_ = 0.0;
+        // Latest active pixel count and max relative error per tile
+        std::vector<int64_t> tile_active_pixel_counts_;
+        std::vector<float> tile_max_relative_errors_;
+
+        const bool denoise_enable_;
+        const int denoise_iterations_;
+        GLReloadableComputeProgram denoise_program_;
+        GLTexture features_texture_;
+        GLTexture denoise_color_[2];
+        GLTexture denoise_variance_[2];
+    };
+
     std::unique_ptr<IVolumetricCloudMaterial> material;
 
     float bottom_altitude_ = 2.0f;
@@ -33,6 +211,16 @@ public:
     float env_multiscattering_sigma_scale = 0.5f;
     float env_bottom_visibility = 0.4f;
     float env_sun_height_curve_exp = 1.0f;
+    bool empty_space_skipping_enable = true;
+    bool light_volume_enable = false;
+    float light_volume_half_width = 10.0f;
+    int light_volume_slices_per_frame = 4;
+    bool dynamic_resolution_enable = false;
+    float dynamic_resolution_budget_ms = 2.0f;
+    float dynamic_resolution_min_scale = 0.5f;
+    bool tile_classification_enable = true;
+    AmortizationPattern amortization_pattern = AmortizationPattern::CHECKERBOARD_2X2;
+    float history_rejection_motion = 2.0f;
 
     FIELD_DECLARATION_BEGIN(ISerializable)
         FIELD_DECLARE(material)
@@ -52,10 +240,22 @@ public:
         FIELD_DECLARE(env_multiscattering_sigma_scale)
         FIELD_DECLARE(env_bottom_visibility)
         FIELD_DECLARE(env_sun_height_curve_exp)
+        FIELD_DECLARE(empty_space_skipping_enable)
+        FIELD_DECLARE(light_volume_enable)
+        FIELD_DECLARE(light_volume_half_width)
+        FIELD_DECLARE(light_volume_slices_per_frame)
+        FIELD_DECLARE(dynamic_resolution_enable)
+        FIELD_DECLARE(dynamic_resolution_budget_ms)
+        FIELD_DECLARE(dynamic_resolution_min_scale)
+        FIELD_DECLARE(tile_classification_enable)
+        FIELD_DECLARE(amortization_pattern)
+        FIELD_DECLARE(history_rejection_motion)
     FIELD_DECLARATION_END()
 
     VolumetricCloud();
 
+    ~VolumetricCloud();
+
     struct {
         GLuint shadow_map;
         GLuint sampler;
@@ -82,7 +282,50 @@ public:
 
     void DrawGUI();
 
+    // Reads back what PathTracing would render with the current frame's state for
+    // CloudPathTracerReference. Throws if the material has no CPU density.
+    CloudReferenceScene CaptureReferenceScene() const;
+
+    // Hash of what a path traced image depends on besides the view and the InitParam: the
+    // material and its parameters, the cloud layer, the sun and the atmosphere
+    uint64_t PathTracingSceneHash() const;
+
+    const PathTracing::InitParam& path_tracing_init_param() const {
+        return path_tracing_init_param_;
+    }
+
+    void set_path_tracing_init_param(const PathTracing::InitParam& init) {
+        path_tracing_init_param_ = init;
+    }
+
+    // Null unless path tracing
+    const PathTracing* path_tracing() const {
+        return path_tracing_.get();
+    }
+
+    // Starts path tracing over with path_tracing_init_param()
+    void StartPathTracing();
+
+    void StopPathTracing();
+
+    // Continues a saved run with its InitParam. Throws if the checkpoint does not match the
+    // viewport or the current view.
+    void ResumePathTracing(const PathTracingCheckpoint& checkpoint);
+
 private:
+    // Render texels per tile edge, see VolumetricCloudTiles.glsl
+    static constexpr int kTileSize = 8;
+
+    // Indirect dispatch commands at the head of the tile buffer
+    enum TileCommand {
+        kTileCommandRender,
+        kTileCommandRenderFill,
+        kTileCommandReconstruct,
+        kTileCommandReconstructFill,
+        kTileCommandUpscale,
+        kTileCommandCount,
+    };
+
     template<GLuint first = 0, GLsizei N> static void GLBindTextures(const GLuint(&arr)[N]) {
         static_assert(first + N <= IVolumetricCloudMaterial::kMaterialTextureUnitBegin);
         ::GLBindTextures(arr, first);
@@ -94,10 +337,23 @@ private:
 
     std::function<std::string(const std::string&)> CreateShaderPostProcess(std::string additional = "") const;
 
+    int GetAmortizationBlockSize() const;
+
+    glm::ivec2 GetHalfResolution(float scale, int block_size) const;
+
+    void ResizeViewportData();
+
+    void UpdateDynamicResolution();
+
     IVolumetricCloudMaterial* preframe_material_;
 
     struct ViewportData {
-        ViewportData(glm::ivec2 viewport);
+        // half_resolution is the size of the checkerboard and reconstruct textures, the render
+        // textures are 1 / block_size of it
+        ViewportData(glm::ivec2 viewport, glm::ivec2 half_resolution, int block_size);
+
+        int block_size;
+        glm::ivec2 render_resolution;
 
         GLTexture checkerboard_depth_;
         GLTexture index_linear_depth_;
@@ -106,11 +362,21 @@ private:
         GLTexture reconstruct_texture_[2];
 
         GLTexture shadow_froxel;
+
+        glm::ivec2 tile_grid_size;
+        GLTexture tile_mask_;
+        GLBuffer tile_buffer_; // commands followed by the render, reconstruct and upscale tile lists
     };
 
     glm::ivec2 viewport_{};
+    glm::ivec2 half_resolution_{};
     std::unique_ptr<ViewportData> viewport_data_;
 
+    float resolution_scale_ = 1.0f; // continuous controller output
+    float resolution_bucket_ = 1.0f; // scale the textures are allocated with
+    int resolution_cooldown_ = 0;
+    std::string profiler_path_;
+
     GLSampler shadow_map_sampler_;
     GLTexture shadow_maps_[3]; // current raw, previous raw, current 
 
@@ -118,11 +384,26 @@ private:
     GLReloadableComputeProgram shadow_map_blur_program_[2];
     GLReloadableComputeProgram shadow_froxel_gen_program_;
 
+    // Transmittance to sun, see VolumetricCloudLighting.glsl. The back volume is rebuilt
+    // light_volume_slices_per_frame slices per frame and swapped with the front one once complete.
+    GLTexture light_volumes_[2];
+    GLReloadableComputeProgram light_volume_program_;
+    glm::dvec2 light_volume_centers_[2]{}; // offset_from_first_ each volume was built around
+    int light_volume_front_ = 0;
+    int light_volume_slice_ = 0; // next slice of the back volume
+    int light_volume_build_begin_ = 0; // slices built by this frame's RenderShadow
+    int light_volume_build_count_ = 0;
+    bool light_volume_valid_ = false; // front volume holds a complete build
+    float light_volume_built_half_width_ = 0.0f;
+
     GLReloadableComputeProgram checkerboard_gen_program_;
     GLReloadableComputeProgram index_gen_program_;
     GLReloadableComputeProgram render_program_;
     GLReloadableComputeProgram reconstruct_program_;
     GLReloadableComputeProgram upscale_program_;
+    GLReloadableComputeProgram tile_classify_program_;
+    GLReloadableComputeProgram tile_list_program_;
+    GLReloadableComputeProgram tile_fill_program_[2]; // render, reconstruct
 
     GLBuffer common_buffer_;
     GLBuffer buffer_;
@@ -141,53 +422,17 @@ private:
     GLuint aerial_perspective_transmittance_tex_ = 0;
     GLuint environment_luminance_tex_ = 0;
 
-    class PathTracing {
-    public:
-        enum class PRNG {
-            WangHash,
-            PCGHash
-        };
-
-        enum class EnvironmentLighting {
-            OFF,
-            CONST_ENVIRONMENT_MAP,
-            GROUND_SINGLE_BOUNCE,
-            GROUND_MULTI_BOUNCE,
-        };
-
-        struct InitParam {
-            int sqrt_tile_count = 1;
-            int max_bounces = 128;
-            float region_box_half_width = 100.0f;
-            bool importance_sampling = true;
-            float forward_phase_g = 0.85f;
-            float back_phase_g = -0.15f;
-            float forward_scattering_ratio = 0.7f;
-            PRNG prng = PRNG::PCGHash;
-            EnvironmentLighting environment_lighting = EnvironmentLighting::GROUND_MULTI_BOUNCE;
-        };
-
-        uint32_t frame_cnt() const {
-            return frame_cnt_;
-        }
-
-        PathTracing(const VolumetricCloud& cloud, const InitParam& init);
-
-        void Render(GLuint hdr_texture);
+    AtmosphereBufferData atmosphere_data_{};
+    glm::vec3 local_sun_direction_{ 0.0f, 0.0f, 1.0f };
+    float earth_radius_ = 0.0f;
 
-    private:
-        glm::ivec4 GetRenderRegion() const;
-
-        const VolumetricCloud& cloud_;
-
-        GLReloadableComputeProgram render_program_;
-        GLReloadableComputeProgram display_program_;
-        GLTexture accumulating_texture_;
-        GLTexture rendered_mask_;
-        uint32_t frame_cnt_ = 0;
-        const int sqrt_tile_count_;
-        int tile_index_ = 0;
-    };
     std::unique_ptr<PathTracing> path_tracing_;
     PathTracing::InitParam path_tracing_init_param_;
+    double previous_samples_per_second_ = 0.0; // of the last stopped run, to compare settings
+
+    std::unique_ptr<CloudPathTracerReference> reference_;
+    std::future<void> reference_job_;
+    int reference_frames_ = 64;
+    std::string reference_status_;
+    std::string checkpoint_status_;
 };
@@ -0,0 +1,281 @@
+#include "VolumetricCloudBrickPool.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <ostream>
+#include <stdexcept>
+
+#include <glm/gtc/type_precision.hpp>
+
+#include "MappedFile.h"
+#include "PerformanceMarker.h"
+#include "Utils.h"
+
+namespace {
+
+constexpr int kBrickSize = VolumetricCloudBrickPool::kBrickSize;
+constexpr int kBrickStorage = VolumetricCloudBrickPool::kBrickStorage;
+constexpr uint32_t kBrickConstant = 0x80000000u;
+constexpr uint32_t kBrickPoolMagic = 0x31504256; // "VBP1"
+
+struct BrickPoolAssetHeader {
+	uint32_t magic;
+	uint32_t level_count;
+	uint64_t source_hash;
+	uint64_t brick_count;
+	glm::ivec3 size;
+	glm::ivec3 indirection_size; // R32UI texels, follow the level table
+	glm::ivec3 atlas_size; // R8 texels, follow the indirection
+	uint32_t padding;
+};
+
+using Footprint = std::array<uint8_t, kBrickStorage * kBrickStorage * kBrickStorage>;
+
+// Brick coordinates start at -1, the border brick whose apron reaches texel 0
+uint64_t BrickKey(glm::ivec3 brick) {
+	auto b = glm::u64vec3(brick + 1);
+	return b.x | (b.y << 21) | (b.z << 42);
+}
+
+glm::ivec3 BrickCoord(uint64_t key) {
+	constexpr uint64_t kMask = (1ull << 21) - 1;
+	return glm::ivec3(glm::u64vec3(key & kMask, (key >> 21) & kMask, key >> 42)) - 1;
+}
+
+int VoxelIndex(glm::ivec3 voxel) {
+	return (voxel.z * kBrickSize + voxel.y) * kBrickSize + voxel.x;
+}
+
+template<class BrickMap>
+BrickMap Downsample(const BrickMap& bricks) {
+	BrickMap parents;
+	for (const auto& [key, brick] : bricks) {
+		auto coord = BrickCoord(key);
+		auto& parent = parents[BrickKey(coord >> 1)];
+		// Each child fills one octant of its parent
+		auto base = (coord & 1) * (kBrickSize / 2);
+		for (int z = 0; z < kBrickSize / 2; ++z) {
+			for (int y = 0; y < kBrickSize / 2; ++y) {
+				for (int x = 0; x < kBrickSize / 2; ++x) {
+					int sum = 0;
+					for (int i = 0; i < 8; ++i)
+						sum += brick[VoxelIndex(glm::ivec3(x, y, z) * 2 + glm::ivec3(i & 1, (i >> 1) & 1, i >> 2))];
+					parent[VoxelIndex(base + glm::ivec3(x, y, z))] = static_cast<uint8_t>((sum + 4) / 8);
+				}
+			}
+		}
+	}
+	return parents;
+}
+
+// Bricks whose footprint touches a written brick: the bricks themselves and their low neighbours
+template<class BrickMap>
+std::vector<uint64_t> GetCandidates(const BrickMap& bricks) {
+	std::vector<uint64_t> candidates;
+	candidates.reserve(bricks.size() * 2);
+	for (const auto& [key, brick] : bricks) {
+		auto coord = BrickCoord(key);
+		for (int i = 0; i < 8; ++i)
+			candidates.push_back(BrickKey(coord - glm::ivec3(i & 1, (i >> 1) & 1, i >> 2)));
+	}
+	std::sort(candidates.begin(), candidates.end());
+	candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+	return candidates;
+}
+
+// Gathers the texels a brick is sampled from, returns whether they are all equal
+template<class BrickMap>
+bool GetFootprint(const BrickMap& bricks, glm::ivec3 brick, Footprint& footprint) {
+	const typename BrickMap::mapped_type* neighbors[8];
+	for (int i = 0; i < 8; ++i) {
+		auto iter = bricks.find(BrickKey(brick + glm::ivec3(i & 1, (i >> 1) & 1, i >> 2)));
+		neighbors[i] = iter != bricks.end() ? &iter->second : nullptr;
+	}
+	bool constant = true;
+	int index = 0;
+	for (int z = 0; z < kBrickStorage; ++z) {
+		for (int y = 0; y < kBrickStorage; ++y) {
+			for (int x = 0; x < kBrickStorage; ++x) {
+				glm::ivec3 texel(x, y, z);
+				auto high = glm::ivec3(glm::greaterThanEqual(texel, glm::ivec3(kBrickSize)));
+				auto neighbor = neighbors[high.x | (high.y << 1) | (high.z << 2)];
+				auto value = neighbor ? (*neighbor)[VoxelIndex(texel - high * kBrickSize)] : uint8_t(0);
+				footprint[index++] = value;
+				constant = constant && value == footprint[0];
+			}
+		}
+	}
+	return constant;
+}
+
+}
+
+void VolumetricCloudBrickPool::Writer::Write(glm::ivec3 voxel, float value) {
+	auto key = BrickKey(voxel / kBrickSize);
+	if (key != cached_key_) {
+		auto iter = bricks_.find(key);
+		cached_brick_ = iter != bricks_.end() ? &iter->second : nullptr;
+		cached_key_ = key;
+	}
+	if (cached_brick_)
+		(*cached_brick_)[VoxelIndex(voxel % kBrickSize)] = static_cast<uint8_t>(glm::clamp(value, 0.0f, 1.0f) * 255.0f + 0.5f);
+}
+
+void VolumetricCloudBrickPool::Allocate(glm::ivec3 min_voxel, glm::ivec3 max_voxel) {
+	auto min_brick = min_voxel / kBrickSize;
+	auto max_brick = max_voxel / kBrickSize;
+	for (int z = min_brick.z; z <= max_brick.z; ++z) {
+		for (int y = min_brick.y; y <= max_brick.y; ++y) {
+			for (int x = min_brick.x; x <= max_brick.x; ++x)
+				bricks_.try_emplace(BrickKey({ x, y, z }), Brick{});
+		}
+	}
+}
+
+void VolumetricCloudBrickPool::Upload(glm::ivec3 size) {
+	PERF_MARKER("VolumetricCloudBrickPool");
+	size_ = size;
+	std::vector<BrickMap> level_bricks;
+	level_bricks.push_back(std::move(bricks_));
+	bricks_ = BrickMap();
+
+	levels_.clear();
+	glm::ivec3 indirection_size(0, 1, 1);
+	for (auto level_size = size;; level_size = (level_size + 1) / 2) {
+		auto grid = (level_size + kBrickSize - 1) / kBrickSize + 1;
+		levels_.push_back(glm::ivec4(grid, indirection_size.x));
+		indirection_size = glm::ivec3(indirection_size.x + grid.x, glm::max(glm::ivec2(indirection_size.y, indirection_size.z), glm::ivec2(grid.y, grid.z)));
+		if (glm::all(glm::lessThanEqual(level_size, glm::ivec3(kBrickSize))) || levels_.size() == static_cast<size_t>(kMaxLevels))
+			break;
+		level_bricks.push_back(Downsample(level_bricks.back()));
+	}
+
+	// Classify first to size the atlas
+	Footprint footprint;
+	std::vector<std::vector<uint64_t>> candidates;
+	brick_count_ = 0;
+	for (const auto& bricks : level_bricks) {
+		candidates.push_back(GetCandidates(bricks));
+		for (auto key : candidates.back())
+			brick_count_ += GetFootprint(bricks, BrickCoord(key), footprint) ? 0 : 1;
+	}
+
+	GLint max_texture_size = 0;
+	glGetIntegerv(GL_MAX_3D_TEXTURE_SIZE, &max_texture_size);
+	auto max_bricks = glm::min(max_texture_size / kBrickStorage, 1024); // 10 bits per axis in the indirection
+	auto atlas_width = glm::min(static_cast<int>(std::ceil(std::cbrt(static_cast<double>(glm::max(brick_count_, size_t(1)))))), max_bricks);
+	auto slab_bricks = static_cast<size_t>(atlas_width) * atlas_width;
+	auto atlas_depth = static_cast<int>((glm::max(brick_count_, size_t(1)) + slab_bricks - 1) / slab_bricks);
+	if (atlas_depth > max_bricks)
+		throw std::runtime_error("Voxel bricks exceed the maximum 3D texture size");
+	glm::ivec3 atlas_size(atlas_width * kBrickStorage, atlas_width * kBrickStorage, atlas_depth * kBrickStorage);
+	atlas_size_ = atlas_size;
+	indirection_size_ = indirection_size;
+
+	atlas_ = GLTexture();
+	atlas_.Create(GL_TEXTURE_3D);
+	glTextureStorage3D(atlas_.id(), 1, GL_R8, atlas_size.x, atlas_size.y, atlas_size.z);
+
+	// Fill and upload the atlas one slab of bricks at a time
+	std::vector<uint32_t> indirection(static_cast<size_t>(indirection_size.x) * indirection_size.y * indirection_size.z, kBrickConstant);
+	std::vector<uint8_t> slab(static_cast<size_t>(atlas_size.x) * atlas_size.y * kBrickStorage);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	auto upload_slab = [&](int slab_index) {
+		glTextureSubImage3D(atlas_.id(), 0, 0, 0, slab_index * kBrickStorage, atlas_size.x, atlas_size.y, kBrickStorage,
+			GL_RED, GL_UNSIGNED_BYTE, slab.data());
+	};
+	size_t slot = 0;
+	for (size_t level = 0; level < level_bricks.size(); ++level) {
+		for (auto key : candidates[level]) {
+			auto brick = BrickCoord(key);
+			auto index = brick + 1 + glm::ivec3(levels_[level].w, 0, 0);
+			auto& entry = indirection[(static_cast<size_t>(index.z) * indirection_size.y + index.y) * indirection_size.x + index.x];
+			if (GetFootprint(level_bricks[level], brick, footprint)) {
+				entry = kBrickConstant | footprint[0];
+				continue;
+			}
+			glm::ivec3 slot_coord(slot % atlas_width, slot / atlas_width % atlas_width, slot / slab_bricks);
+			entry = slot_coord.x | (slot_coord.y << 10) | (slot_coord.z << 20);
+			for (int z = 0; z < kBrickStorage; ++z) {
+				for (int y = 0; y < kBrickStorage; ++y) {
+					auto row = (static_cast<size_t>(z) * atlas_size.y + slot_coord.y * kBrickStorage + y) * atlas_size.x + slot_coord.x * kBrickStorage;
+					std::copy_n(&footprint[(z * kBrickStorage + y) * kBrickStorage], kBrickStorage, &slab[row]);
+				}
+			}
+			if (++slot % slab_bricks == 0)
+				upload_slab(slot_coord.z);
+		}
+		level_bricks[level] = BrickMap();
+	}
+	if (slot % slab_bricks != 0)
+		upload_slab(static_cast<int>(slot / slab_bricks));
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+	indirection_ = GLTexture();
+	indirection_.Create(GL_TEXTURE_3D);
+	glTextureStorage3D(indirection_.id(), 1, GL_R32UI, indirection_size.x, indirection_size.y, indirection_size.z);
+	glTextureSubImage3D(indirection_.id(), 0, 0, 0, 0, indirection_size.x, indirection_size.y, indirection_size.z,
+		GL_RED_INTEGER, GL_UNSIGNED_INT, indirection.data());
+}
+
+bool VolumetricCloudBrickPool::Save(const char* path, uint64_t hash) const {
+	BrickPoolAssetHeader header{ kBrickPoolMagic, static_cast<uint32_t>(levels_.size()), hash, brick_count_,
+		size_, indirection_size_, atlas_size_, 0 };
+	std::vector<uint32_t> indirection(static_cast<size_t>(indirection_size_.x) * indirection_size_.y * indirection_size_.z);
+	std::vector<uint8_t> atlas(static_cast<size_t>(atlas_size_.x) * atlas_size_.y * atlas_size_.z);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glGetTextureImage(indirection_.id(), 0, GL_RED_INTEGER, GL_UNSIGNED_INT,
+		static_cast<GLsizei>(indirection.size() * sizeof(uint32_t)), indirection.data());
+	glGetTextureImage(atlas_.id(), 0, GL_RED, GL_UNSIGNED_BYTE, static_cast<GLsizei>(atlas.size()), atlas.data());
+	glPixelStorei(GL_PACK_ALIGNMENT, 4);
+
+	return WriteFileAtomically(path, [&](std::ostream& fout) {
+		fout.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		fout.write(reinterpret_cast<const char*>(levels_.data()), sizeof(glm::ivec4) * levels_.size());
+		fout.write(reinterpret_cast<const char*>(indirection.data()), sizeof(uint32_t) * indirection.size());
+		fout.write(reinterpret_cast<const char*>(atlas.data()), atlas.size());
+	});
+}
+
+bool VolumetricCloudBrickPool::Load(const char* path, uint64_t hash) {
+	MappedFile file(path);
+	if (!file || file.size() < sizeof(BrickPoolAssetHeader))
+		return false;
+	auto bytes = static_cast<const char*>(file.data());
+	BrickPoolAssetHeader header;
+	memcpy(&header, bytes, sizeof(header));
+	if (header.magic != kBrickPoolMagic || header.source_hash != hash
+			|| header.level_count == 0 || header.level_count > static_cast<uint32_t>(kMaxLevels))
+		return false;
+	auto indirection_count = static_cast<uint64_t>(header.indirection_size.x) * header.indirection_size.y * header.indirection_size.z;
+	auto atlas_count = static_cast<uint64_t>(header.atlas_size.x) * header.atlas_size.y * header.atlas_size.z;
+	auto levels_offset = sizeof(header);
+	auto indirection_offset = levels_offset + sizeof(glm::ivec4) * header.level_count;
+	auto atlas_offset = indirection_offset + sizeof(uint32_t) * indirection_count;
+	if (atlas_offset + atlas_count != file.size())
+		return false;
+
+	PERF_MARKER("VolumetricCloudBrickPool");
+	size_ = header.size;
+	brick_count_ = header.brick_count;
+	atlas_size_ = header.atlas_size;
+	indirection_size_ = header.indirection_size;
+	levels_.resize(header.level_count);
+	memcpy(levels_.data(), bytes + levels_offset, sizeof(glm::ivec4) * levels_.size());
+
+	atlas_ = GLTexture();
+	atlas_.Create(GL_TEXTURE_3D);
+	glTextureStorage3D(atlas_.id(), 1, GL_R8, atlas_size_.x, atlas_size_.y, atlas_size_.z);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTextureSubImage3D(atlas_.id(), 0, 0, 0, 0, atlas_size_.x, atlas_size_.y, atlas_size_.z,
+		GL_RED, GL_UNSIGNED_BYTE, bytes + atlas_offset);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+	indirection_ = GLTexture();
+	indirection_.Create(GL_TEXTURE_3D);
+	glTextureStorage3D(indirection_.id(), 1, GL_R32UI, indirection_size_.x, indirection_size_.y, indirection_size_.z);
+	glTextureSubImage3D(indirection_.id(), 0, 0, 0, 0, indirection_size_.x, indirection_size_.y, indirection_size_.z,
+		GL_RED_INTEGER, GL_UNSIGNED_INT, bytes + indirection_offset);
+	return true;
+}
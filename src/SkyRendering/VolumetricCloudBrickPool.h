@@ -0,0 +1,90 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "gl.hpp"
+
+// Sparse GPU layout of a voxel density grid. Voxels are grouped into kBrickSize^3 bricks, and
+// only bricks whose filter footprint is not constant are stored in an R8 atlas. Each lod has an
+// R32UI indirection grid, packed side by side along x in one 3D texture:
+//   bit 31 clear  brick is in the atlas at (bits 0-9, 10-19, 20-29), in bricks
+//   bit 31 set    brick is constant with value (bits 0-7) / 255
+// Atlas bricks carry one texel of apron on the high side so that a trilinear sample never
+// leaves the brick its lower corner lies in. Constant zero bricks are the skip structure, see
+// VolumetricCloudBrickPool.glsl.
+class VolumetricCloudBrickPool {
+public:
+    static constexpr int kBrickSize = 8;
+    static constexpr int kBrickStorage = kBrickSize + 1;
+    static constexpr int kMaxLevels = 16;
+
+    using Brick = std::array<uint8_t, kBrickSize * kBrickSize * kBrickSize>;
+    using BrickMap = std::unordered_map<uint64_t, Brick>;
+
+    // Writes level 0 voxels into bricks created by Allocate. Bricks are not created here, so
+    // several writers may fill the same pool from different threads.
+    class Writer {
+    public:
+        explicit Writer(BrickMap& bricks) : bricks_(bricks) {}
+
+        // Voxels outside the allocated bricks are dropped
+        void Write(glm::ivec3 voxel, float value);
+
+    private:
+        BrickMap& bricks_;
+        uint64_t cached_key_ = ~0ull;
+        Brick* cached_brick_ = nullptr;
+    };
+
+    // Creates the zero bricks covering the level 0 voxels [min_voxel, max_voxel], coordinates
+    // must be non-negative
+    void Allocate(glm::ivec3 min_voxel, glm::ivec3 max_voxel);
+
+    Writer CreateWriter() {
+        return Writer(bricks_);
+    }
+
+    // Builds the lod chain of the written voxels and uploads it. Frees the staging bricks.
+    void Upload(glm::ivec3 size);
+
+    // Cache of the uploaded pool: a header with the source hash, the lod table, then the
+    // indirection and atlas texels exactly as uploaded
+    bool Save(const char* path, uint64_t hash) const;
+
+    // Maps the file and uploads it directly. Returns false if it is missing or stale.
+    bool Load(const char* path, uint64_t hash);
+
+    GLuint atlas() const {
+        return atlas_.id();
+    }
+    GLuint indirection() const {
+        return indirection_.id();
+    }
+    glm::ivec3 size() const {
+        return size_;
+    }
+    // xyz: indirection grid size of the lod (bricks, including the -1 border), w: x offset of
+    // the lod in the indirection texture
+    const std::vector<glm::ivec4>& levels() const {
+        return levels_;
+    }
+    size_t brick_count() const {
+        return brick_count_;
+    }
+
+private:
+    BrickMap bricks_;
+
+    glm::ivec3 size_{};
+    std::vector<glm::ivec4> levels_;
+    size_t brick_count_ = 0;
+    glm::ivec3 atlas_size_{};
+    glm::ivec3 indirection_size_{};
+    GLTexture atlas_;
+    GLTexture indirection_;
+};
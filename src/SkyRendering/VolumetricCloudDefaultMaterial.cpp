@@ -6,21 +6,6 @@
 #include "Samplers.h"
 #include "ImGuiExt.h"
 
-struct SampleInfo {
-	glm::vec2 bias;
-	float frequency;
-	float k_lod;
-};
-
-struct VolumetricCloudDefaultMaterialCommonBufferData {
-	SampleInfo uCloudMapSampleInfo;
-	SampleInfo uDetailSampleInfo;
-	SampleInfo uDisplacementSampleInfo;
-	glm::vec2 padding0;
-	float uLodBias;
-	float uDensity;
-};
-
 static float CalKLod(const TextureWithInfo& tex, glm::vec2 viewport, const Camera& camera) {
 	auto max_width = static_cast<float>(glm::max(tex.x, glm::max(tex.y, tex.z)));
 	auto tan_half_fovy = glm::tan(glm::radians(camera.fovy) * 0.5f);
@@ -29,10 +14,8 @@ static float CalKLod(const TextureWithInfo& tex, glm::vec2 viewport, const Camer
 
 VolumetricCloudDefaultMaterialCommon::VolumetricCloudDefaultMaterialCommon() {
 	{
-		constexpr int w = 512;
-		cloud_map_.texture.x = cloud_map_.texture.y = w;
-		cloud_map_.texture.tex.Create(GL_TEXTURE_2D);
-		glTextureStorage2D(cloud_map_.texture.id(), GetMipmapLevels(w, w), GL_RG8, w, w);
+		constexpr int w = CloudMapBuffer::kSize;
+		cloud_map_.Allocate(GL_RG8, w, w, 1);
 		cloud_map_.texture.repeat_size = 18.99f;
 
 		cloud_map_.program = {
@@ -41,12 +24,16 @@ VolumetricCloudDefaultMaterialCommon::VolumetricCloudDefaultMaterialCommon() {
 			[](const std::string& src) { return std::string("#version 460\n#define CLOUD_MAP_GEN\n") + src; },
 			"CLOUD_MAP"
 		};
+		cloud_map_.mip_program = {
+			"../shaders/SkyRendering/NoiseGen.comp",
+			{{16, 8}, {32, 16}, {32, 32}, {8, 8}, {16, 16}, {8, 4}},
+			[](const std::string& src) { return std::string("#version 460\n#define MIP_GEN\n#define MIP_FORMAT rg8\n") + src; },
+			"CLOUD_MAP_MIP"
+		};
 	}
 	{
-		constexpr int w = 128;
-		detail_.texture.x = detail_.texture.y = detail_.texture.z = w;
-		detail_.texture.tex.Create(GL_TEXTURE_3D);
-		glTextureStorage3D(detail_.texture.id(), GetMipmapLevels(w, w, w), GL_R8, w, w, w);
+		constexpr int w = DetailBuffer::kSize;
+		detail_.Allocate(GL_R8, w, w, w);
 		detail_.texture.repeat_size = 5.33f;
 
 		detail_.program = {
@@ -55,12 +42,16 @@ VolumetricCloudDefaultMaterialCommon::VolumetricCloudDefaultMaterialCommon() {
 			[](const std::string& src) { return std::string("#version 460\n#define DETAIL_MAP_GEN\n") + src; },
 			"DETAIL_MAP"
 		};
+		detail_.mip_program = {
+			"../shaders/SkyRendering/NoiseGen.comp",
+			{{4, 4, 4}, {8, 4, 4}, {8, 8, 4}},
+			[](const std::string& src) { return std::string("#version 460\n#define MIP_GEN\n#define MIP_GEN_3D\n#define MIP_FORMAT r8\n") + src; },
+			"DETAIL_MAP_MIP"
+		};
 	}
 	{
-		constexpr int w = 128;
-		displacement_.texture.x = displacement_.texture.y = w;
-		displacement_.texture.tex.Create(GL_TEXTURE_2D);
-		glTextureStorage2D(displacement_.texture.id(), GetMipmapLevels(w, w), GL_RGBA8, w, w);
+		constexpr int w = DisplacementBuffer::kSize;
+		displacement_.Allocate(GL_RGBA8, w, w, 1);
 		displacement_.texture.repeat_size = 3.51f;
 
 		displacement_.program = {
@@ -69,6 +60,12 @@ VolumetricCloudDefaultMaterialCommon::VolumetricCloudDefaultMaterialCommon() {
 			[](const std::string& src) { return std::string("#version 460\n#define DISPLACEMENT_GEN\n") + src; },
 			"DISPLACEMENT"
 		};
+		displacement_.mip_program = {
+			"../shaders/SkyRendering/NoiseGen.comp",
+			{{16, 8}, {32, 16}, {32, 32}, {8, 8}, {16, 16}, {8, 4}},
+			[](const std::string& src) { return std::string("#version 460\n#define MIP_GEN\n#define MIP_FORMAT rgba8\n") + src; },
+			"DISPLACEMENT_MIP"
+		};
 	}
 
 	buffer_.Create();
@@ -76,9 +73,16 @@ VolumetricCloudDefaultMaterialCommon::VolumetricCloudDefaultMaterialCommon() {
 }
 
 void VolumetricCloudDefaultMaterialCommon::Update(glm::vec2 viewport, const Camera& camera, const glm::dvec2& offset_from_first, glm::vec2& additional_delta) {
-	cloud_map_.GenerateIfParameterChanged();
-	detail_.GenerateIfParameterChanged();
-	displacement_.GenerateIfParameterChanged();
+	// The textures share one budget, so regenerating all of them takes longer but never costs
+	// more per frame
+	auto time_sliced = noise_generation_budget_ms_ > 0.0f;
+	auto budget_ms = noise_generation_budget_ms_;
+	if (cloud_map_.GenerateIfParameterChanged(noise_baker_, time_sliced, budget_ms))
+		cloud_map_skip_grid_.Build(cloud_map_.texture.id(), GL_TEXTURE_2D, glm::ivec3(cloud_map_.texture.x, cloud_map_.texture.y, 1), true);
+	if (budget_ms > 0.0f || !time_sliced)
+		detail_.GenerateIfParameterChanged(noise_baker_, time_sliced, budget_ms);
+	if (budget_ms > 0.0f || !time_sliced)
+		displacement_.GenerateIfParameterChanged(noise_baker_, time_sliced, budget_ms);
 
 
 	VolumetricCloudDefaultMaterialCommonBufferData buffer;
@@ -99,6 +103,7 @@ void VolumetricCloudDefaultMaterialCommon::Update(glm::vec2 viewport, const Came
 	gen_sample_info(displacement_.texture, buffer.uDisplacementSampleInfo, offset_from_first_cur);
 
 	glNamedBufferSubData(buffer_.id(), 0, sizeof(buffer), &buffer);
+	buffer_data_ = buffer;
 }
 
 void VolumetricCloudDefaultMaterialCommon::Bind() {
@@ -108,11 +113,13 @@ void VolumetricCloudDefaultMaterialCommon::Bind() {
 		cloud_map_.texture.id(),
 		detail_.texture.id(),
 		displacement_.texture.id(),
+		cloud_map_skip_grid_.texture(),
 		}, IVolumetricCloudMaterial::kMaterialTextureUnitBegin);
 	GLBindSamplers({ 
 		Samplers::Get(Samplers::Wrap::REPEAT, Samplers::Mag::LINEAR, minfilter2d_),
 		Samplers::Get(Samplers::Wrap::REPEAT, Samplers::Mag::LINEAR, minfilter3d_),
 		Samplers::Get(Samplers::Wrap::REPEAT, Samplers::Mag::LINEAR, minfilter_displacement_),
+		0u,
 		}, IVolumetricCloudMaterial::kMaterialTextureUnitBegin);
 }
 
@@ -120,6 +127,114 @@ float VolumetricCloudDefaultMaterialCommon::GetSigmaTMax() {
 	return density_;
 }
 
+VolumetricCloudDefaultDensityReference VolumetricCloudDefaultMaterialCommon::ReadDensityReference(glm::vec3 camera_pos) const {
+	return {
+		ReferenceTexture(cloud_map_.texture.tex.id(), 2, Samplers::Wrap::REPEAT),
+		ReferenceTexture(detail_.texture.tex.id(), 1, Samplers::Wrap::REPEAT),
+		ReferenceTexture(displacement_.texture.tex.id(), 4, Samplers::Wrap::REPEAT),
+		buffer_data_,
+		minfilter2d_,
+		minfilter3d_,
+		minfilter_displacement_,
+		camera_pos
+	};
+}
+
+glm::vec4 VolumetricCloudDefaultDensityReference::GetUVWLod(glm::vec3 pos, const SampleInfo& sample_info) const {
+	auto uvw = pos * sample_info.frequency + glm::vec3(sample_info.bias, 0.0f);
+	auto lod = glm::log2(sample_info.k_lod * glm::distance(pos, camera_pos)) + buffer.uLodBias;
+	return glm::vec4(uvw, lod);
+}
+
+static float CalHeightMask(float cloud_type, float height01) {
+	float height_in_type = glm::clamp(height01 / cloud_type, 0.0f, 1.0f);
+	return glm::clamp(height_in_type * (height_in_type - 1.0f) * -4.0f, 0.0f, 1.0f);
+}
+
+static float Remap01(float x, float x0, float x1) {
+	return glm::clamp((x - x0) / (x1 - x0), 0.0f, 1.0f);
+}
+
+// SampleSigmaT of VolumetricCloudDefaultMaterial0.glsl
+class DefaultMaterial0DensityReference : public ICloudDensityReference {
+public:
+	DefaultMaterial0DensityReference(VolumetricCloudDefaultDensityReference common, glm::vec2 detail_param, float displacement_scale)
+		: common_(std::move(common)), detail_param_(detail_param), displacement_scale_(displacement_scale) {}
+
+	void SampleSigmaT(const CloudDensityPacket& packet, float* sigma_t) const override {
+		const auto& c = common_;
+		for (int i = 0; i < packet.count; ++i) {
+			glm::vec3 pos(packet.x[i], packet.y[i], packet.z[i]);
+			auto height01 = packet.height01[i];
+			auto uvwlod = c.GetUVWLod(pos, c.buffer.uCloudMapSampleInfo);
+			auto cloud_type = glm::vec2(c.cloud_map.SampleLod(uvwlod, uvwlod.w, c.minfilter2d));
+
+			glm::vec3 displace_vector(0.0f);
+			uvwlod = c.GetUVWLod(pos, c.buffer.uDisplacementSampleInfo);
+			auto displacement_xy = c.displacement.SampleLod(uvwlod, uvwlod.w, c.minfilter_displacement);
+			auto displacement_xz = c.displacement.SampleLod({ uvwlod.x, uvwlod.z, 0.0f }, uvwlod.w, c.minfilter_displacement);
+			displace_vector.x += displacement_xy.r + displacement_xz.b;
+			displace_vector.y += displacement_xy.g;
+			displace_vector.z += displacement_xz.a;
+
+			pos += displacement_scale_ * displace_vector;
+			uvwlod = c.GetUVWLod(pos, c.buffer.uDetailSampleInfo);
+			auto detail = c.detail.SampleLod(uvwlod, uvwlod.w, c.minfilter3d).r;
+			detail = detail * detail_param_.x + detail_param_.y;
+			sigma_t[i] = Remap01(cloud_type.r * CalHeightMask(cloud_type.g, height01), detail, 1.0f) * height01 * c.buffer.uDensity;
+		}
+	}
+
+private:
+	VolumetricCloudDefaultDensityReference common_;
+	glm::vec2 detail_param_;
+	float displacement_scale_;
+};
+
+// SampleSigmaT of VolumetricCloudDefaultMaterial1.glsl, parameters as uploaded
+class DefaultMaterial1DensityReference : public ICloudDensityReference {
+public:
+	struct Parameters {
+		float base_density_threshold;
+		float base_height_hardness;
+		float base_edge_hardness;
+		float detail_base;
+		float detail_scale;
+		float height_cut;
+		float edge_cut;
+	};
+
+	DefaultMaterial1DensityReference(VolumetricCloudDefaultDensityReference common, const Parameters& parameters)
+		: common_(std::move(common)), p_(parameters) {}
+
+	void SampleSigmaT(const CloudDensityPacket& packet, float* sigma_t) const override {
+		const auto& c = common_;
+		for (int i = 0; i < packet.count; ++i) {
+			glm::vec3 pos(packet.x[i], packet.y[i], packet.z[i]);
+			auto height01 = packet.height01[i];
+			auto uvwlod = c.GetUVWLod(pos, c.buffer.uCloudMapSampleInfo);
+			auto cloud_type = glm::vec2(c.cloud_map.SampleLod(uvwlod, uvwlod.w, c.minfilter2d));
+
+			auto density = glm::clamp((cloud_type.r - p_.base_density_threshold) * p_.base_edge_hardness, 0.0f, 1.0f);
+			density *= glm::clamp((1.0f - height01) * p_.base_height_hardness, 0.0f, 1.0f);
+			if (density == 0.0f) {
+				sigma_t[i] = 0.0f;
+				continue;
+			}
+
+			uvwlod = c.GetUVWLod(pos, c.buffer.uDetailSampleInfo);
+			auto detail = c.detail.SampleLod(uvwlod, uvwlod.w, c.minfilter3d).r;
+			detail = (detail + p_.detail_base) * p_.detail_scale;
+			detail *= glm::max(glm::clamp(height01 - p_.height_cut, 0.0f, 1.0f), glm::clamp(p_.edge_cut - cloud_type.r, 0.0f, 1.0f));
+			sigma_t[i] = glm::clamp(density - detail, 0.0f, 1.0f) * c.buffer.uDensity * height01;
+		}
+	}
+
+private:
+	VolumetricCloudDefaultDensityReference common_;
+	Parameters p_;
+};
+
 void VolumetricCloudDefaultMaterialCommon::DrawGUI() {
 	if (ImGui::TreeNode("Cloud Map")) {
 		cloud_map_.buffer.DrawGUI();
@@ -133,6 +248,19 @@ void VolumetricCloudDefaultMaterialCommon::DrawGUI() {
 		displacement_.buffer.DrawGUI();
 		ImGui::TreePop();
 	}
+	ImGui::EnumSelect("Noise Baker", &noise_baker_);
+	if (noise_baker_ == NoiseBaker::CPU) {
+		ImGui::SameLine();
+		if (ImGui::Button("Save Noise Assets")) {
+			cloud_map_.WriteBakedAsset();
+			detail_.WriteBakedAsset();
+			displacement_.WriteBakedAsset();
+		}
+	}
+	ImGui::SliderFloat("Noise Generation Budget (ms)", &noise_generation_budget_ms_, 0.0f, 8.0f);
+	auto progress = glm::min(cloud_map_.progress(), glm::min(detail_.progress(), displacement_.progress()));
+	if (progress < 1.0f)
+		ImGui::ProgressBar(progress, ImVec2(-1, 0), "Generating Noise");
 	ImGui::EnumSelect("Sampler 2D Filter", &minfilter2d_);
 	ImGui::EnumSelect("Sampler 3D Filter", &minfilter3d_);
 	ImGui::EnumSelect("Sampler Displacement Filter", &minfilter_displacement_);
@@ -147,6 +275,18 @@ void VolumetricCloudDefaultMaterialCommon::DrawGUI() {
 	ImGui::SliderFloat("Detail Wind Magnify", &detail_wind_magnify_, -1.0f, 5.0f);
 }
 
+CloudNoiseImage CloudMapBuffer::Bake(unsigned thread_count) const {
+	return BakeCloudMapNoise(uDensity, uHeight, kSize, thread_count);
+}
+
+CloudNoiseImage DetailBuffer::Bake(unsigned thread_count) const {
+	return BakeDetailNoise(uPerlin, uWorley, kSize, thread_count);
+}
+
+CloudNoiseImage DisplacementBuffer::Bake(unsigned thread_count) const {
+	return BakeDisplacementNoise(uPerlin, kSize, thread_count);
+}
+
 void NoiseCreateInfo::DrawGUI() {
 	ImGui::InputInt("Seed", &seed);
 	ImGui::SliderInt("Base Frequency", &base_frequency, 1, 16);
@@ -213,6 +353,11 @@ float VolumetricCloudDefaultMaterial0::GetSigmaTMax() {
 	return materail_common_.GetSigmaTMax();
 }
 
+std::unique_ptr<ICloudDensityReference> VolumetricCloudDefaultMaterial0::CreateDensityReference(glm::vec3 camera_pos) {
+	return std::make_unique<DefaultMaterial0DensityReference>(materail_common_.ReadDensityReference(camera_pos),
+		detail_param_, displacement_scale_);
+}
+
 void VolumetricCloudDefaultMaterial0::DrawGUI() {
 	materail_common_.DrawGUI();
 
@@ -264,6 +409,18 @@ float VolumetricCloudDefaultMaterial1::GetSigmaTMax() {
 	return materail_common_.GetSigmaTMax();
 }
 
+std::unique_ptr<ICloudDensityReference> VolumetricCloudDefaultMaterial1::CreateDensityReference(glm::vec3 camera_pos) {
+	DefaultMaterial1DensityReference::Parameters parameters;
+	parameters.base_density_threshold = base_density_threshold_;
+	parameters.base_height_hardness = base_height_hardness_;
+	parameters.base_edge_hardness = base_edge_hardness_;
+	parameters.detail_base = detail_base_;
+	parameters.detail_scale = detail_scale_;
+	parameters.height_cut = 1.0f - height_cut_;
+	parameters.edge_cut = edge_cut_;
+	return std::make_unique<DefaultMaterial1DensityReference>(materail_common_.ReadDensityReference(camera_pos), parameters);
+}
+
 void VolumetricCloudDefaultMaterial1::DrawGUI() {
 	materail_common_.DrawGUI();
 
@@ -1,10 +1,23 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstring>
+#include <future>
+#include <thread>
+#include <utility>
+#include <vector>
+
 #include <glm/glm.hpp>
 
+#include "CloudNoiseAsset.h"
+#include "ImageLoader.h"
+#include "PerformanceMarker.h"
 #include "IVolumetricCloudMaterial.h"
 #include "Samplers.h"
 #include "GLReloadableProgram.h"
+#include "VolumetricCloudSkipGrid.h"
 
 struct TextureWithInfo {
     GLuint id() { return tex.id(); }
@@ -17,72 +30,343 @@ struct TextureWithInfo {
     int channel = 1;
 };
 
+enum class NoiseBaker {
+    GPU, // NoiseGen.comp, fast enough to drag the sliders
+    CPU, // CloudNoiseBaker on a worker thread, result cached on disk
+};
+
+// Noise texture regenerated whenever its BufferType parameters change. GPU generation can be
+// time sliced: slabs of slices (rows of 2D textures) and then the mips above them are written to
+// a back texture over several frames, and the front texture is swapped once all levels are
+// done. CPU bakes run on a worker thread and are uploaded when they finish. Either way,
+// parameters that change meanwhile are picked up by the next generation.
 template<class BufferType>
 class DynamicTexture {
 public:
     GLReloadableComputeProgram program;
+    GLReloadableComputeProgram mip_program;
     TextureWithInfo texture;
     BufferType buffer;
 
     DynamicTexture() {
         gl_buffer_.Create();
         glNamedBufferStorage(gl_buffer_.id(), sizeof(buffer), nullptr, GL_DYNAMIC_STORAGE_BIT);
+        for (auto& step : steps_) {
+            step.begin.Create(GL_TIMESTAMP);
+            step.end.Create(GL_TIMESTAMP);
+        }
     }
 
-    void GenerateIfParameterChanged() {
-        if (is_first_update_ || memcmp(&buffer, &pre_buffer_, sizeof(buffer)) != 0) {
-            Generate();
+    // Front and back textures with complete mip chains. z == 1 creates 2D textures.
+    void Allocate(GLenum internal_format, int x, int y, int z) {
+        texture.x = x;
+        texture.y = y;
+        texture.z = z;
+        format_ = internal_format;
+        levels_ = z > 1 ? GetMipmapLevels(x, y, z) : GetMipmapLevels(x, y);
+        for (auto tex : { &texture.tex, &back_ }) {
+            tex->Create(z > 1 ? GL_TEXTURE_3D : GL_TEXTURE_2D);
+            if (z > 1)
+                glTextureStorage3D(tex->id(), levels_, format_, x, y, z);
+            else
+                glTextureStorage2D(tex->id(), levels_, format_, x, y);
+        }
+    }
+
+    // Starts a generation if the parameters differ from the last one started, and continues a
+    // sliced one within budget_ms, which is reduced by the estimated GPU time. Without
+    // time_sliced (and for the first generation) everything runs now; the first CPU bake is
+    // waited for. Returns true when a new front texture is in place.
+    bool GenerateIfParameterChanged(NoiseBaker baker, bool time_sliced, float& budget_ms) {
+        ResolveTimings();
+        auto swapped = bake_job_.valid() && FinishBake(false);
+        WriteSettledAsset();
+        if (!generating_ && !bake_job_.valid() && (is_first_update_ || memcmp(&buffer, &pre_buffer_, sizeof(buffer)) != 0)) {
             pre_buffer_ = buffer;
+            if (Begin(baker))
+                return true;
+        }
+        if (generating_)
+            return Continue(time_sliced && !is_first_update_, budget_ms);
+        if (bake_job_.valid() && is_first_update_)
+            return FinishBake(true);
+        return swapped;
+    }
+
+    // Writes the last CPU bake to the asset cache now instead of once its parameters settle
+    void WriteBakedAsset() {
+        if (unsaved_image_.texels.empty())
+            return;
+        auto hash = ComputeCloudNoiseHash(BufferType::kTag, BufferType::kSize, &unsaved_buffer_, sizeof(unsaved_buffer_));
+        WriteCloudNoiseAsset(GetCloudNoiseAssetPath(hash).c_str(), hash, unsaved_image_);
+        unsaved_image_ = CloudNoiseImage();
+    }
+
+    // Fraction of the running generation that is done, 1 when idle and 0 during a CPU bake
+    float progress() const {
+        if (bake_job_.valid())
+            return 0.0f;
+        if (!generating_)
+            return 1.0f;
+        int done = 0, total = 0;
+        for (int level = 0; level < levels_; ++level) {
+            done += complete_[level];
+            total += SliceCount(level);
         }
+        return static_cast<float>(done) / static_cast<float>(total);
     }
 
-    void Generate() {
+private:
+    // Timestamps of a generation step, reused once resolved
+    struct Step {
+        GLQuery begin;
+        GLQuery end;
+        int slices = 0;
+        bool pending = false; // not resolved yet
+    };
+    static constexpr int kStepLatency = 3;
+
+    int SliceCount(int level) const {
+        return glm::max((texture.z > 1 ? texture.z : texture.y) >> level, 1);
+    }
+
+    glm::ivec3 LevelSize(int level) const {
+        return glm::max(glm::ivec3(texture.x, texture.y, texture.z) >> level, 1);
+    }
+
+    // Region of slices [begin, end) of a level
+    void SetRegion(int level, int begin, int end) const {
+        auto size = LevelSize(level);
+        if (texture.z > 1) {
+            glUniform3i(0, 0, 0, begin);
+            glUniform3i(1, size.x, size.y, end);
+        }
+        else {
+            glUniform3i(0, 0, begin, 0);
+            glUniform3i(1, size.x, end, 1);
+        }
+    }
+
+    glm::ivec3 RegionSize(int level, int slices) const {
+        auto size = LevelSize(level);
+        return texture.z > 1 ? glm::ivec3(size.x, size.y, slices) : glm::ivec3(size.x, slices, 1);
+    }
+
+    // A baked asset of the same parameters is loaded with either baker. Returns true if the
+    // texture is complete already.
+    bool Begin(NoiseBaker baker) {
+        auto hash = ComputeCloudNoiseHash(BufferType::kTag, BufferType::kSize, &buffer, sizeof(buffer));
+        auto path = GetCloudNoiseAssetPath(hash);
+        auto loaded = LoadCloudNoiseAsset(path.c_str(), hash, back_.id(), texture.x, texture.y, texture.z);
+        if (!loaded && baker == NoiseBaker::CPU) {
+            // One hardware thread is left to the render thread
+            auto thread_count = std::max(std::thread::hardware_concurrency(), 2u) - 1;
+            baking_buffer_ = buffer;
+            bake_job_ = std::async(std::launch::async, [bake = buffer, thread_count] { return bake.Bake(thread_count); });
+            return false;
+        }
+        if (loaded) {
+            glGenerateTextureMipmap(back_.id());
+            Swap();
+            return true;
+        }
         glNamedBufferSubData(gl_buffer_.id(), 0, sizeof(buffer), &buffer);
-        glBindBufferBase(GL_UNIFORM_BUFFER, 1, gl_buffer_.id());
+        complete_.assign(levels_, 0);
+        generating_ = true;
+        return false;
+    }
+
+    bool Continue(bool time_sliced, float& budget_ms) {
+        PERF_MARKER(BufferType::kTag);
+        auto remaining = SliceCount(0) - complete_[0];
+        auto slices = remaining;
+        if (time_sliced) {
+            // Until the first step is measured, one slice per frame
+            slices = glm::clamp(static_cast<int>(budget_ms * slices_per_ms_), 1, remaining);
+            budget_ms -= slices_per_ms_ > 0.0f ? static_cast<float>(slices) / slices_per_ms_ : budget_ms;
+        }
+
+        // A step whose slot is still in flight is not timed
+        auto& step = steps_[step_index_];
+        auto timed = !step.pending;
+        if (timed) {
+            step.slices = slices;
+            glQueryCounter(step.begin.id(), GL_TIMESTAMP);
+        }
+
+        if (slices > 0) {
+            glBindBufferBase(GL_UNIFORM_BUFFER, 1, gl_buffer_.id());
+            GLBindImageTextures({ back_.id() });
+            glUseProgram(program.id());
+            SetRegion(0, complete_[0], complete_[0] + slices);
+            program.Dispatch(RegionSize(0, slices));
+            complete_[0] += slices;
+        }
+        // Each mip slice is built as soon as the two slices below it are done
+        glUseProgram(mip_program.id());
+        for (int level = 1; level < levels_; ++level) {
+            auto target = complete_[level - 1] == SliceCount(level - 1) ? SliceCount(level) : complete_[level - 1] / 2;
+            if (target <= complete_[level])
+                break;
+            glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+            glBindImageTexture(0, back_.id(), level - 1, GL_TRUE, 0, GL_READ_ONLY, format_);
+            glBindImageTexture(1, back_.id(), level, GL_TRUE, 0, GL_WRITE_ONLY, format_);
+            SetRegion(level, complete_[level], target);
+            mip_program.Dispatch(RegionSize(level, target - complete_[level]));
+            complete_[level] = target;
+        }
+
+        if (timed) {
+            glQueryCounter(step.end.id(), GL_TIMESTAMP);
+            step.pending = true;
+            step_index_ = (step_index_ + 1) % kStepLatency;
+        }
+
+        if (complete_[levels_ - 1] < SliceCount(levels_ - 1))
+            return false;
+        generating_ = false;
+        Swap();
+        return true;
+    }
+
+    // Uploads a finished CPU bake, or waits for it if wait. Returns false if it is still running.
+    bool FinishBake(bool wait) {
+        if (!wait && bake_job_.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+            return false;
+        unsaved_image_ = bake_job_.get();
+        unsaved_buffer_ = baking_buffer_;
+        unsaved_since_ = Clock::now();
+        UploadCloudNoise(back_.id(), unsaved_image_);
+        glGenerateTextureMipmap(back_.id());
+        Swap();
+        return true;
+    }
 
-        GLBindImageTextures({ texture.id() });
-        glUseProgram(program.id());
-        program.Dispatch(glm::ivec3(texture.x, texture.y, texture.z));
-        // https://stackoverflow.com/questions/24693861/which-memory-barrier-does-glgeneratemipmap-require
-        glGenerateTextureMipmap(texture.id());
+    // Only the parameters a slider drag stops at are worth an asset
+    void WriteSettledAsset() {
+        if (unsaved_image_.texels.empty())
+            return;
+        if (memcmp(&buffer, &unsaved_buffer_, sizeof(buffer)) != 0)
+            unsaved_since_ = Clock::now();
+        else if (Clock::now() - unsaved_since_ >= kAssetSettleTime)
+            WriteBakedAsset();
+    }
+
+    void Swap() {
+        std::swap(texture.tex, back_);
+        glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
         is_first_update_ = false;
     }
 
-private:
+    // Measures the base slices generated per ms of finished steps, without waiting for the GPU
+    void ResolveTimings() {
+        for (int i = 0; i < kStepLatency; ++i) {
+            // Oldest first, so that the rate follows the order of the steps
+            auto& step = steps_[(step_index_ + i) % kStepLatency];
+            if (!step.pending)
+                continue;
+            GLint available = 0;
+            glGetQueryObjectiv(step.end.id(), GL_QUERY_RESULT_AVAILABLE, &available);
+            if (!available)
+                break;
+            GLuint64 begin, end;
+            glGetQueryObjectui64v(step.begin.id(), GL_QUERY_RESULT, &begin);
+            glGetQueryObjectui64v(step.end.id(), GL_QUERY_RESULT, &end);
+            auto ms = glm::max(static_cast<float>(static_cast<double>(end - begin) * 1e-6), 1e-3f);
+            if (step.slices > 0) {
+                auto rate = static_cast<float>(step.slices) / ms;
+                slices_per_ms_ = slices_per_ms_ > 0.0f ? glm::mix(slices_per_ms_, rate, 0.25f) : rate;
+            }
+            step.pending = false;
+        }
+    }
+
+    using Clock = std::chrono::steady_clock;
+    static constexpr std::chrono::seconds kAssetSettleTime{ 1 };
+
     GLBuffer gl_buffer_;
     BufferType pre_buffer_;
     bool is_first_update_ = true;
-};
 
-struct NoiseCreateInfo {
-    int seed;
-    int base_frequency;
-    float remap_min;
-    float remap_max;
-
-    void DrawGUI();
+    std::future<CloudNoiseImage> bake_job_;
+    BufferType baking_buffer_;
+    CloudNoiseImage unsaved_image_; // last CPU bake not in the asset cache yet, empty if none
+    BufferType unsaved_buffer_;
+    Clock::time_point unsaved_since_; // since when the parameters equal unsaved_buffer_
+
+    GLTexture back_;
+    GLenum format_ = GL_R8;
+    int levels_ = 1;
+    bool generating_ = false;
+    std::vector<int> complete_; // finished slices of each level of back_
+    std::array<Step, kStepLatency> steps_;
+    int step_index_ = 0; // next slot, the oldest one
+    float slices_per_ms_ = 0.0f;
 };
 
 struct CloudMapBuffer {
+    static constexpr char kTag[] = "CLOUD_MAP";
+    static constexpr int kSize = 512;
+
     NoiseCreateInfo uDensity{ 0, 3, 0.35f, 0.75f };
     NoiseCreateInfo uHeight{ 0, 5, 0.8f, 0.4f };
 
+    CloudNoiseImage Bake(unsigned thread_count = 0) const;
     void DrawGUI();
 };
 
 struct DetailBuffer {
+    static constexpr char kTag[] = "DETAIL_MAP";
+    static constexpr int kSize = 128;
+
     NoiseCreateInfo uPerlin{ 0, 7, 0.23f, 1.0f };
     NoiseCreateInfo uWorley{ 0, 11, 1.0f, 0.0f };
 
+    CloudNoiseImage Bake(unsigned thread_count = 0) const;
     void DrawGUI();
 };
 
 struct DisplacementBuffer {
+    static constexpr char kTag[] = "DISPLACEMENT";
+    static constexpr int kSize = 128;
+
     NoiseCreateInfo uPerlin{ 0, 6, 0.25f, 0.75f };
 
+    CloudNoiseImage Bake(unsigned thread_count = 0) const;
     void DrawGUI();
 };
 
+struct SampleInfo {
+    glm::vec2 bias;
+    float frequency;
+    float k_lod;
+};
+
+struct VolumetricCloudDefaultMaterialCommonBufferData {
+    SampleInfo uCloudMapSampleInfo;
+    SampleInfo uDetailSampleInfo;
+    SampleInfo uDisplacementSampleInfo;
+    glm::vec2 padding0;
+    float uLodBias;
+    float uDensity;
+};
+
+// Textures and sample parameters shared by the default materials, read back for their
+// ICloudDensityReference
+struct VolumetricCloudDefaultDensityReference {
+    ReferenceTexture cloud_map;
+    ReferenceTexture detail;
+    ReferenceTexture displacement;
+    VolumetricCloudDefaultMaterialCommonBufferData buffer;
+    Samplers::MipmapMin minfilter2d;
+    Samplers::MipmapMin minfilter3d;
+    Samplers::MipmapMin minfilter_displacement;
+    glm::vec3 camera_pos;
+
+    // GetUVWLod of VolumetricCloudDefaultMaterialCommon.glsl
+    glm::vec4 GetUVWLod(glm::vec3 pos, const SampleInfo& sample_info) const;
+};
+
 class VolumetricCloudDefaultMaterialCommon : public ISerializable {
 public:
     VolumetricCloudDefaultMaterialCommon();
@@ -95,6 +379,8 @@ public:
 
     void DrawGUI();
 
+    VolumetricCloudDefaultDensityReference ReadDensityReference(glm::vec3 camera_pos) const;
+
 private:
 #define DECLARE_NOISE(name) \
     FIELD_DECLARE(name.seed) \
@@ -118,6 +404,8 @@ private:
         FIELD_DECLARE(minfilter2d_)
         FIELD_DECLARE(minfilter3d_)
         FIELD_DECLARE(minfilter_displacement_)
+        FIELD_DECLARE(noise_baker_)
+        FIELD_DECLARE(noise_generation_budget_ms_)
     FIELD_DECLARATION_END()
 
 #undef DECLARE_NOISE
@@ -131,12 +419,17 @@ private:
     Samplers::MipmapMin minfilter2d_ = Samplers::MipmapMin::NEAREST_MIPMAP_NEAREST;
     Samplers::MipmapMin minfilter3d_ = Samplers::MipmapMin::NEAREST_MIPMAP_NEAREST;
     Samplers::MipmapMin minfilter_displacement_ = Samplers::MipmapMin::NEAREST_MIPMAP_NEAREST;
+    NoiseBaker noise_baker_ = NoiseBaker::GPU;
+    float noise_generation_budget_ms_ = 1.0f; // 0 generates a texture within one frame
 
     glm::dvec2 detail_offset_from_first_{ 0, 0 };
+    VolumetricCloudDefaultMaterialCommonBufferData buffer_data_{}; // uploaded by the last Update
 
     DynamicTexture<CloudMapBuffer> cloud_map_;
     DynamicTexture<DetailBuffer> detail_;
     DynamicTexture<DisplacementBuffer> displacement_;
+
+    VolumetricCloudSkipGrid cloud_map_skip_grid_;
 };
 
 class VolumetricCloudDefaultMaterial0 : public IVolumetricCloudMaterial {
@@ -151,6 +444,8 @@ public:
 
     float GetSigmaTMax() override;
 
+    std::unique_ptr<ICloudDensityReference> CreateDensityReference(glm::vec3 camera_pos) override;
+
     void DrawGUI() override;
 
 private:
@@ -180,6 +475,8 @@ public:
 
     float GetSigmaTMax() override;
 
+    std::unique_ptr<ICloudDensityReference> CreateDensityReference(glm::vec3 camera_pos) override;
+
     void DrawGUI() override;
 
 private:
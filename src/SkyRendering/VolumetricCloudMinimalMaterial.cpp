@@ -28,6 +28,23 @@ float VolumetricCloudMinimalMaterial::GetSigmaTMax() {
 	return density_;
 }
 
+class MinimalDensityReference : public ICloudDensityReference {
+public:
+	explicit MinimalDensityReference(float density) : density_(density) {}
+
+	void SampleSigmaT(const CloudDensityPacket& packet, float* sigma_t) const override {
+		for (int i = 0; i < packet.count; ++i)
+			sigma_t[i] = density_;
+	}
+
+private:
+	float density_;
+};
+
+std::unique_ptr<ICloudDensityReference> VolumetricCloudMinimalMaterial::CreateDensityReference([[maybe_unused]] glm::vec3 camera_pos) {
+	return std::make_unique<MinimalDensityReference>(density_);
+}
+
 void VolumetricCloudMinimalMaterial::DrawGUI() {
 	ImGui::SliderFloat("Density", &density_, 0.0f, 1.0f);
 }
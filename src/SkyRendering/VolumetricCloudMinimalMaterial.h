@@ -12,6 +12,8 @@ public:
 
     float GetSigmaTMax() override;
 
+    std::unique_ptr<ICloudDensityReference> CreateDensityReference(glm::vec3 camera_pos) override;
+
     void DrawGUI() override;
 
 private:
@@ -0,0 +1,78 @@
+#include "VolumetricCloudSkipGrid.h"
+
+#include "ImageLoader.h"
+#include "PerformanceMarker.h"
+
+static GLReloadableComputeProgram CreateSkipGridProgram(const std::string& tag) {
+	return {
+		"../shaders/SkyRendering/VolumetricCloudSkipGrid.comp",
+		{{8, 8}, {16, 8}, {16, 16}},
+		[tag](const std::string& src) { return std::string("#version 460\n") + Replace(src, "TAG_CONF", tag); },
+		tag
+	};
+}
+
+VolumetricCloudSkipGrid::VolumetricCloudSkipGrid() {
+	source_program_[0] = CreateSkipGridProgram("SKIP_GRID_SOURCE_2D_PASS");
+	source_program_[1] = CreateSkipGridProgram("SKIP_GRID_SOURCE_3D_PASS");
+	downsample_program_ = CreateSkipGridProgram("SKIP_GRID_DOWNSAMPLE_PASS");
+	dilate_program_ = CreateSkipGridProgram("SKIP_GRID_DILATE_PASS");
+}
+
+int VolumetricCloudSkipGrid::Resize(glm::ivec2 size) {
+	auto levels = GetMipmapLevels(size.x, size.y);
+	if (size != size_) {
+		size_ = size;
+		for (auto texture : { &raw_, &grid_ }) {
+			*texture = GLTexture();
+			texture->Create(GL_TEXTURE_2D);
+			glTextureStorage2D(texture->id(), levels, GL_R32F, size.x, size.y);
+		}
+	}
+	return levels;
+}
+
+void VolumetricCloudSkipGrid::Build(GLuint source, GLenum target, glm::ivec3 source_size, bool wrap) {
+	PERF_MARKER("VolumetricCloudSkipGrid");
+	auto size = (glm::ivec2(source_size) + kCellTexels - 1) / kCellTexels;
+	auto levels = Resize(size);
+	// The source was just written by a compute pass or an upload
+	glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+
+	auto& source_program = source_program_[target == GL_TEXTURE_3D ? 1 : 0];
+	GLBindTextures({ source });
+	GLBindSamplers({ 0u });
+	glBindImageTexture(0, raw_.id(), 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+	glUseProgram(source_program.id());
+	source_program.Dispatch(size);
+	glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+	DownsampleAndDilate(levels, wrap);
+}
+
+void VolumetricCloudSkipGrid::Build(const float* cells, glm::ivec2 size, bool wrap) {
+	PERF_MARKER("VolumetricCloudSkipGrid");
+	auto levels = Resize(size);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	glTextureSubImage2D(raw_.id(), 0, 0, 0, size.x, size.y, GL_RED, GL_FLOAT, cells);
+	DownsampleAndDilate(levels, wrap);
+}
+
+void VolumetricCloudSkipGrid::DownsampleAndDilate(int levels, bool wrap) {
+	auto size = size_;
+	glUseProgram(downsample_program_.id());
+	for (int level = 1; level < levels; ++level) {
+		glBindImageTexture(0, raw_.id(), level - 1, GL_FALSE, 0, GL_READ_ONLY, GL_R32F);
+		glBindImageTexture(1, raw_.id(), level, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+		downsample_program_.Dispatch(glm::max(size >> level, 1));
+		glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+	}
+
+	glUseProgram(dilate_program_.id());
+	glUniform1i(0, wrap ? 1 : 0);
+	for (int level = 0; level < levels; ++level) {
+		glBindImageTexture(0, raw_.id(), level, GL_FALSE, 0, GL_READ_ONLY, GL_R32F);
+		glBindImageTexture(1, grid_.id(), level, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+		dilate_program_.Dispatch(glm::max(size >> level, 1));
+	}
+	glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include "gl.hpp"
+#include "GLReloadableProgram.h"
+
+// Coarse 2D grid over a cloud material density texture used by the raymarcher to leap over
+// empty space. Each cell stores the maximum red value of a column of kCellTexels x kCellTexels
+// source texels (all slices of a 3D source), dilated by one cell, with a max mip chain.
+// Sampled with SkipGridEmptyDistance in VolumetricCloudSkipGrid.glsl.
+class VolumetricCloudSkipGrid {
+public:
+    static constexpr int kCellTexels = 8;
+
+    VolumetricCloudSkipGrid();
+
+    // source must have complete level 0 contents. wrap matches the source sampler addressing
+    // (repeat or clamp to a zero border).
+    void Build(GLuint source, GLenum target, glm::ivec3 source_size, bool wrap);
+
+    // Same from the undilated level 0 cells (size x size.y floats, row major) computed on the
+    // CPU, which leaves only the small mip and dilate passes to the GPU
+    void Build(const float* cells, glm::ivec2 size, bool wrap);
+
+    GLuint texture() const {
+        return grid_.id();
+    }
+
+private:
+    int Resize(glm::ivec2 size);
+
+    void DownsampleAndDilate(int levels, bool wrap);
+
+    glm::ivec2 size_{};
+    GLTexture raw_;
+    GLTexture grid_;
+
+    GLReloadableComputeProgram source_program_[2]; // 2D, 3D
+    GLReloadableComputeProgram downsample_program_;
+    GLReloadableComputeProgram dilate_program_;
+};
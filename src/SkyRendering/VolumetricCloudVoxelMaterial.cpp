@@ -5,14 +5,21 @@
 #include <openvdb/openvdb.h>
 #else
 #define HAS_INCLUDE_OPENVDB 0
-#include <Windows.h>
-#undef max
-#undef min
 #endif
 
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <iomanip>
+#include <sstream>
+
 #include <imgui.h>
 
-#include "ImageLoader.h"
+#include "Utils.h"
+#include "VdbReader.h"
+
+constexpr char kVoxelPath[] = "../data/wdas/wdas_cloud_sixteenth.vdb";
+constexpr char kVoxelCacheDirectory[] = "voxel_cache";
 
 struct VolumetricCloudVoxelMaterial::BufferData {
 	glm::vec2 uSampleFrequency;
@@ -20,70 +27,151 @@ struct VolumetricCloudVoxelMaterial::BufferData {
 	float uDensity;
 	glm::vec2 uSampleBias;
 	float uSampleLodK;
+	int uBrickLevelCount;
+	glm::vec3 uVoxelSize;
 	float voxel_material_padding;
+	glm::ivec4 uBrickLevels[VolumetricCloudBrickPool::kMaxLevels];
 };
 
-VolumetricCloudVoxelMaterial::VolumetricCloudVoxelMaterial() {
-	buffer_.Create();
-	glNamedBufferStorage(buffer_.id(), sizeof(BufferData), NULL, GL_DYNAMIC_STORAGE_BIT);
+// Changes whenever the source file is replaced or touched, without reading it
+static uint64_t ComputeVoxelSourceHash(const char* path) {
+	std::error_code ec;
+	auto size = static_cast<uint64_t>(std::filesystem::file_size(path, ec));
+	auto time = static_cast<int64_t>(std::filesystem::last_write_time(path, ec).time_since_epoch().count());
+	auto hash = Fnv1a(kFnv1aOffsetBasis, path, strlen(path));
+	hash = Fnv1a(hash, &size, sizeof(size));
+	return Fnv1a(hash, &time, sizeof(time));
+}
 
-	sampler_.Create();
-	glSamplerParameteri(sampler_.id(), GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glSamplerParameteri(sampler_.id(), GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
-	glSamplerParameteri(sampler_.id(), GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
-	glSamplerParameteri(sampler_.id(), GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
-	glSamplerParameteri(sampler_.id(), GL_TEXTURE_WRAP_R, GL_CLAMP_TO_BORDER);
-	float border_color[] = { 0.0f, 0.0f, 0.0f, 0.0f };
-	glSamplerParameterfv(sampler_.id(), GL_TEXTURE_BORDER_COLOR, border_color);
+static std::string GetVoxelCachePath(uint64_t hash) {
+	std::stringstream ss;
+	ss << std::hex << std::setw(16) << std::setfill('0') << hash << ".bricks";
+	return (std::filesystem::path(kVoxelCacheDirectory) / ss.str()).string();
+}
+
+// Quantizes the active voxels of the grid's bounding box into the pool, yz swapped so that the
+// VDB up axis becomes our z. Leaves and tiles are converted in parallel.
+static void ConvertVdb(const char* path, VolumetricCloudBrickPool& bricks) {
+	VdbFloatGridReader reader(path);
+	auto min = reader.min();
+	auto dim = reader.max() - min + 1;
+	auto to_voxel = [min](glm::ivec3 coord) {
+		auto offset = coord - min;
+		return glm::ivec3(offset.x, offset.z, offset.y);
+	};
+	auto clamp_to_grid = [dim](glm::ivec3 coord) {
+		return glm::clamp(coord, glm::ivec3(0), dim - 1);
+	};
+
+	constexpr int kLeafSize = VdbFloatGridReader::kLeafSize;
+	for (size_t i = 0; i < reader.leaf_count(); ++i) {
+		auto origin = reader.leaf_origin(i);
+		bricks.Allocate(to_voxel(clamp_to_grid(origin)), to_voxel(clamp_to_grid(origin + kLeafSize - 1)));
+	}
+	for (const auto& tile : reader.tiles())
+		bricks.Allocate(to_voxel(clamp_to_grid(tile.origin)), to_voxel(clamp_to_grid(tile.origin + tile.size - 1)));
+
+	auto leaf_count = static_cast<int>(reader.leaf_count());
+	ParallelFor(leaf_count + static_cast<int>(reader.tiles().size()), 0, [&](int i) {
+		auto writer = bricks.CreateWriter();
+		if (i < leaf_count) {
+			float values[VdbFloatGridReader::kLeafVoxels];
+			uint64_t value_mask[VdbFloatGridReader::kLeafVoxels / 64];
+			reader.ReadLeaf(i, values, value_mask);
+			auto origin = reader.leaf_origin(i);
+			for (int j = 0; j < VdbFloatGridReader::kLeafVoxels; ++j) {
+				if ((value_mask[j >> 6] >> (j & 63)) & 1)
+					writer.Write(to_voxel(origin + glm::ivec3(j >> 6, (j >> 3) & 7, j & 7)), values[j]);
+			}
+		}
+		else {
+			const auto& tile = reader.tiles()[i - leaf_count];
+			auto lo = clamp_to_grid(tile.origin);
+			auto hi = clamp_to_grid(tile.origin + tile.size - 1);
+			for (int x = lo.x; x <= hi.x; ++x) {
+				for (int y = lo.y; y <= hi.y; ++y) {
+					for (int z = lo.z; z <= hi.z; ++z)
+						writer.Write(to_voxel({ x, y, z }), tile.value);
+				}
+			}
+		}
+	});
+	bricks.Upload({ dim.x, dim.z, dim.y });
+}
 
 #if HAS_INCLUDE_OPENVDB
-    openvdb::initialize();
-	std::string path = "../data/wdas/wdas_cloud_sixteenth.vdb";
-    openvdb::io::File file(path);
-    file.open();
-    auto base_grid = file.readGrid(file.beginName().gridName());
-    file.close();
-    auto grid = openvdb::gridPtrCast<openvdb::FloatGrid>(base_grid);
-    auto mincoord = openvdb::Coord::max();
-    auto maxcoord = openvdb::Coord::min();
-    for (auto iter = grid->beginValueOn(); iter; ++iter) {
-        mincoord.minComponent(iter.getBoundingBox().min());
-        maxcoord.maxComponent(iter.getBoundingBox().max());
-    }
-    auto dim = maxcoord - mincoord + openvdb::Coord(1);
-    voxel_dim_ = { dim.x(), dim.z(), dim.y() }; // swap yz
-    std::vector<float> data(size_t(voxel_dim_.x) * voxel_dim_.y * voxel_dim_.z, 0.0f);
-
-    for (auto iter = grid->beginValueOn(); iter; ++iter) {
+// Fallback for Zip and Blosc compressed files, which the native reader does not decode. Serial and
+// slower, but only runs when the brick cache is missing.
+static void ConvertVdbWithOpenVdb(const char* path, VolumetricCloudBrickPool& bricks) {
+	openvdb::initialize();
+	openvdb::io::File file(path);
+	file.open();
+	auto base_grid = file.readGrid(file.beginName().gridName());
+	file.close();
+	auto grid = openvdb::gridPtrCast<openvdb::FloatGrid>(base_grid);
+	if (!grid)
+		throw std::runtime_error(std::string("Unsupported VDB grid type in ") + path);
+	auto mincoord = openvdb::Coord::max();
+	auto maxcoord = openvdb::Coord::min();
+	for (auto iter = grid->cbeginValueOn(); iter; ++iter) {
+		mincoord.minComponent(iter.getBoundingBox().min());
+		maxcoord.maxComponent(iter.getBoundingBox().max());
+	}
+	auto dim = maxcoord - mincoord + openvdb::Coord(1);
+	auto to_voxel = [mincoord](const openvdb::Coord& coord) {
+		auto offset = coord - mincoord;
+		return glm::ivec3(offset.x(), offset.z(), offset.y()); // swap yz
+	};
+
+	for (auto iter = grid->cbeginValueOn(); iter; ++iter) {
+		auto bbox = iter.getBoundingBox();
+		auto lo = to_voxel(bbox.min());
+		auto hi = to_voxel(bbox.max());
+		bricks.Allocate(glm::min(lo, hi), glm::max(lo, hi));
+	}
+	auto writer = bricks.CreateWriter();
+	for (auto iter = grid->cbeginValueOn(); iter; ++iter) {
 		auto value = iter.getValue();
 		auto minxyz = iter.getBoundingBox().min();
 		auto maxxyz = iter.getBoundingBox().max();
 		for (auto x = minxyz.x(); x <= maxxyz.x(); ++x) {
 			for (auto y = minxyz.y(); y <= maxxyz.y(); ++y) {
-				for (auto z = minxyz.z(); z <= maxxyz.z(); ++z) {
-					auto offset = decltype(mincoord){ x,y,z } - mincoord;
-					data[size_t(voxel_dim_.x) * voxel_dim_.y * offset.y() + size_t(voxel_dim_.x) * offset.z() + offset.x()] = value;
-				}
+				for (auto z = minxyz.z(); z <= maxxyz.z(); ++z)
+					writer.Write(to_voxel({ x, y, z }), value);
 			}
 		}
-    }
+	}
+	bricks.Upload({ dim.x(), dim.z(), dim.y() });
+}
+#endif
+
+VolumetricCloudVoxelMaterial::VolumetricCloudVoxelMaterial() {
+	buffer_.Create();
+	glNamedBufferStorage(buffer_.id(), sizeof(BufferData), NULL, GL_DYNAMIC_STORAGE_BIT);
 
-	voxel_.Create(GL_TEXTURE_3D);
-	glTextureStorage3D(voxel_.id(), GetMipmapLevels(voxel_dim_.x, voxel_dim_.y, voxel_dim_.z)
-		, GL_R8, voxel_dim_.x, voxel_dim_.y, voxel_dim_.z);
-	glTextureSubImage3D(voxel_.id(), 0, 0, 0, 0, voxel_dim_.x, voxel_dim_.y, voxel_dim_.z, GL_RED, GL_FLOAT, data.data());
-	glGenerateTextureMipmap(voxel_.id());
+	sampler_.Create();
+	glSamplerParameteri(sampler_.id(), GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glSamplerParameteri(sampler_.id(), GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	// Bricks carry their own apron, the atlas edge is never filtered across
+	glSamplerParameteri(sampler_.id(), GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glSamplerParameteri(sampler_.id(), GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glSamplerParameteri(sampler_.id(), GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+
+	auto hash = ComputeVoxelSourceHash(kVoxelPath);
+	auto cache_path = GetVoxelCachePath(hash);
+	if (!bricks_.Load(cache_path.c_str(), hash)) {
+#if HAS_INCLUDE_OPENVDB
+		try {
+			ConvertVdb(kVoxelPath, bricks_);
+		} catch (const VdbCompressionError&) {
+			ConvertVdbWithOpenVdb(kVoxelPath, bricks_);
+		}
 #else
-#define OPENVDB_NOT_FOUND_MSG \
-	"  To make voxel material available, you need to install OpenVDB and apply user-wide integration:\n\n" \
-	"    vcpkg install openvdb:x64-windows\n" \
-	"    vcpkg integrate install\n\n" \
-	"  Then restart Visual Studio and rebuild the project\n\n" \
-	"  You can download vcpkg from https://github.com/microsoft/vcpkg \n"
-#pragma message(OPENVDB_NOT_FOUND_MSG)
-	MessageBoxA(0, OPENVDB_NOT_FOUND_MSG, "Error", MB_OK);
-	throw std::runtime_error(OPENVDB_NOT_FOUND_MSG);
+		ConvertVdb(kVoxelPath, bricks_);
 #endif
+		bricks_.Save(cache_path.c_str(), hash);
+	}
+	voxel_dim_ = bricks_.size();
 }
 
 std::string VolumetricCloudVoxelMaterial::ShaderPath() {
@@ -100,21 +188,112 @@ void VolumetricCloudVoxelMaterial::Update(glm::vec2 viewport, const Camera& came
 	auto max_width = static_cast<float>(glm::max(voxel_dim_.x, glm::max(voxel_dim_.y, voxel_dim_.z)));
 	auto tan_half_fovy = glm::tan(glm::radians(camera.fovy) * 0.5f);
 	buffer.uSampleLodK = max_width * tan_half_fovy / (std::min(width_.x, width_.y) * static_cast<float>(glm::min(viewport.x, viewport.y)));
+	const auto& levels = bricks_.levels();
+	buffer.uBrickLevelCount = static_cast<int>(levels.size());
+	buffer.uVoxelSize = glm::vec3(voxel_dim_);
+	std::copy(levels.begin(), levels.end(), buffer.uBrickLevels);
 
 	glNamedBufferSubData(buffer_.id(), 0, sizeof(buffer), &buffer);
+	sample_bias_ = buffer.uSampleBias;
+	sample_lod_k_ = buffer.uSampleLodK;
 }
 
 void VolumetricCloudVoxelMaterial::Bind() {
 	glBindBufferBase(GL_UNIFORM_BUFFER, 3, buffer_.id());
 
-	GLBindTextures({voxel_.id()}, IVolumetricCloudMaterial::kMaterialTextureUnitBegin);
-	GLBindSamplers({ sampler_.id() }, IVolumetricCloudMaterial::kMaterialTextureUnitBegin);
+	GLBindTextures({ bricks_.atlas(), bricks_.indirection() }, IVolumetricCloudMaterial::kMaterialTextureUnitBegin);
+	GLBindSamplers({ sampler_.id(), 0u }, IVolumetricCloudMaterial::kMaterialTextureUnitBegin);
 }
 
 float VolumetricCloudVoxelMaterial::GetSigmaTMax() {
 	return density_;
 }
 
+// SampleSigmaT of VolumetricCloudMaterialVoxel.glsl on the read back brick pool
+class VoxelDensityReference : public ICloudDensityReference {
+public:
+	static constexpr int kBrickSize = VolumetricCloudBrickPool::kBrickSize;
+	static constexpr uint32_t kBrickConstant = 0x80000000u;
+
+	struct Parameters {
+		glm::vec2 sample_frequency;
+		glm::vec2 sample_bias;
+		float sample_lod_k;
+		float lod_bias;
+		float density;
+		glm::vec3 voxel_size;
+		glm::vec3 camera_pos;
+	};
+
+	VoxelDensityReference(const VolumetricCloudBrickPool& bricks, const Parameters& parameters)
+		: atlas_(bricks.atlas(), 1, Samplers::Wrap::CLAMP_TO_EDGE), levels_(bricks.levels()), p_(parameters) {
+		auto id = bricks.indirection();
+		glGetTextureLevelParameteriv(id, 0, GL_TEXTURE_WIDTH, &indirection_size_.x);
+		glGetTextureLevelParameteriv(id, 0, GL_TEXTURE_HEIGHT, &indirection_size_.y);
+		glGetTextureLevelParameteriv(id, 0, GL_TEXTURE_DEPTH, &indirection_size_.z);
+		indirection_.resize(static_cast<size_t>(indirection_size_.x) * indirection_size_.y * indirection_size_.z);
+		glGetTextureImage(id, 0, GL_RED_INTEGER, GL_UNSIGNED_INT,
+			static_cast<GLsizei>(indirection_.size() * sizeof(uint32_t)), indirection_.data());
+		GLint width = 0, height = 0, depth = 0;
+		glGetTextureLevelParameteriv(bricks.atlas(), 0, GL_TEXTURE_WIDTH, &width);
+		glGetTextureLevelParameteriv(bricks.atlas(), 0, GL_TEXTURE_HEIGHT, &height);
+		glGetTextureLevelParameteriv(bricks.atlas(), 0, GL_TEXTURE_DEPTH, &depth);
+		atlas_size_ = glm::vec3(width, height, depth);
+	}
+
+	void SampleSigmaT(const CloudDensityPacket& packet, float* sigma_t) const override {
+		auto level_count = static_cast<int>(levels_.size());
+		for (int i = 0; i < packet.count; ++i) {
+			glm::vec3 pos(packet.x[i], packet.y[i], packet.z[i]);
+			glm::vec3 uvw(glm::vec2(pos) * p_.sample_frequency + p_.sample_bias, packet.height01[i]);
+			auto lod = glm::log2(p_.sample_lod_k * glm::distance(pos, p_.camera_pos)) + p_.lod_bias;
+			auto level = static_cast<int>(glm::clamp(glm::floor(lod + 0.5f), 0.0f, static_cast<float>(level_count - 1)));
+			sigma_t[i] = SampleBricks(levels_[level], uvw * p_.voxel_size / static_cast<float>(1 << level)) * p_.density;
+		}
+	}
+
+private:
+	// VolumetricCloudBrickPool.glsl
+	uint32_t FetchBrickEntry(glm::ivec4 level, glm::ivec3 brick) const {
+		auto index = brick + 1;
+		if (glm::any(glm::lessThan(index, glm::ivec3(0))) || glm::any(glm::greaterThanEqual(index, glm::ivec3(level))))
+			return kBrickConstant;
+		index.x += level.w;
+		return indirection_[(static_cast<size_t>(index.z) * indirection_size_.y + index.y) * indirection_size_.x + index.x];
+	}
+
+	float SampleBricks(glm::ivec4 level, glm::vec3 texel_pos) const {
+		auto corner = texel_pos - 0.5f;
+		auto brick = glm::ivec3(glm::floor(corner / static_cast<float>(kBrickSize)));
+		auto entry = FetchBrickEntry(level, brick);
+		if (entry & kBrickConstant)
+			return static_cast<float>(entry & 0xffu) / 255.0f;
+		glm::uvec3 slot(entry & 0x3ffu, (entry >> 10) & 0x3ffu, entry >> 20);
+		auto local = glm::clamp(corner - glm::vec3(brick * kBrickSize), glm::vec3(0.0f), glm::vec3(kBrickSize));
+		auto atlas_pos = glm::vec3(slot * static_cast<uint32_t>(VolumetricCloudBrickPool::kBrickStorage)) + local + 0.5f;
+		return atlas_.SampleLod(atlas_pos / atlas_size_, 0.0f, Samplers::MipmapMin::LINEAR_MIPMAP_LINEAR).r;
+	}
+
+	ReferenceTexture atlas_;
+	glm::vec3 atlas_size_;
+	std::vector<uint32_t> indirection_;
+	glm::ivec3 indirection_size_{};
+	std::vector<glm::ivec4> levels_;
+	Parameters p_;
+};
+
+std::unique_ptr<ICloudDensityReference> VolumetricCloudVoxelMaterial::CreateDensityReference(glm::vec3 camera_pos) {
+	VoxelDensityReference::Parameters parameters;
+	parameters.sample_frequency = 1.0f / width_;
+	parameters.sample_bias = sample_bias_;
+	parameters.sample_lod_k = sample_lod_k_;
+	parameters.lod_bias = lod_bias_;
+	parameters.density = density_;
+	parameters.voxel_size = glm::vec3(voxel_dim_);
+	parameters.camera_pos = camera_pos;
+	return std::make_unique<VoxelDensityReference>(bricks_, parameters);
+}
+
 void VolumetricCloudVoxelMaterial::DrawGUI() {
 	static float density_slider_max = 100.0f;
 	ImGui::SliderFloat("Density Slider Max", &density_slider_max, 20.0f, 1000.0f);
@@ -124,4 +303,8 @@ void VolumetricCloudVoxelMaterial::DrawGUI() {
 	ImGui::SliderFloat("Base Y", &base_.y, -10.0f, 10.0f);
 	ImGui::SliderFloat("Width X", &width_.x, 0.1f, 10.0f);
 	ImGui::SliderFloat("Width Y", &width_.y, 0.1f, 10.0f);
+	auto dense_mb = static_cast<double>(voxel_dim_.x) * voxel_dim_.y * voxel_dim_.z * 8.0 / 7.0 / (1 << 20);
+	auto atlas_mb = static_cast<double>(bricks_.brick_count()) * VolumetricCloudBrickPool::kBrickStorage
+		* VolumetricCloudBrickPool::kBrickStorage * VolumetricCloudBrickPool::kBrickStorage / (1 << 20);
+	ImGui::Text("%zu bricks, %.1f MB (dense %.1f MB)", bricks_.brick_count(), atlas_mb, dense_mb);
 }
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "IVolumetricCloudMaterial.h"
+#include "VolumetricCloudBrickPool.h"
 
 class VolumetricCloudVoxelMaterial : public IVolumetricCloudMaterial {
 public:
@@ -14,6 +15,8 @@ public:
 
     float GetSigmaTMax() override;
 
+    std::unique_ptr<ICloudDensityReference> CreateDensityReference(glm::vec3 camera_pos) override;
+
     void DrawGUI() override;
 
 private:
@@ -27,9 +30,11 @@ private:
     struct BufferData;
 
     GLBuffer buffer_;
-    GLTexture voxel_;
+    VolumetricCloudBrickPool bricks_;
     GLSampler sampler_;
     glm::ivec3 voxel_dim_{ 1,1,1 };
+    glm::vec2 sample_bias_{ 0.0f, 0.0f }; // as of the last Update
+    float sample_lod_k_ = 0.0f;
 
     float lod_bias_ = 2.75f;
     float density_ = 20.0f;
@@ -0,0 +1,123 @@
+#include "VolumetricCloudVoxelSequenceMaterial.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+#include <imgui.h>
+
+struct VolumetricCloudVoxelSequenceMaterial::BufferData {
+	glm::vec2 uSampleFrequency;
+	float uLodBias;
+	float uDensity;
+	glm::vec2 uSampleBias;
+	float uSampleLodK;
+	float voxel_material_padding;
+	glm::vec2 uFrameWeights;
+	glm::vec2 voxel_sequence_padding;
+};
+
+VolumetricCloudVoxelSequenceMaterial::VolumetricCloudVoxelSequenceMaterial() {
+	buffer_.Create();
+	glNamedBufferStorage(buffer_.id(), sizeof(BufferData), NULL, GL_DYNAMIC_STORAGE_BIT);
+
+	sampler_.Create();
+	glSamplerParameteri(sampler_.id(), GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glSamplerParameteri(sampler_.id(), GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+	glSamplerParameteri(sampler_.id(), GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
+	glSamplerParameteri(sampler_.id(), GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+	glSamplerParameteri(sampler_.id(), GL_TEXTURE_WRAP_R, GL_CLAMP_TO_BORDER);
+	float border_color[] = { 0.0f, 0.0f, 0.0f, 0.0f };
+	glSamplerParameterfv(sampler_.id(), GL_TEXTURE_BORDER_COLOR, border_color);
+}
+
+std::string VolumetricCloudVoxelSequenceMaterial::ShaderPath() {
+	return "../shaders/SkyRendering/VolumetricCloudMaterialVoxelSequence.glsl";
+}
+
+void VolumetricCloudVoxelSequenceMaterial::Update(glm::vec2 viewport, const Camera& camera, const glm::dvec2& offset_from_first, glm::vec2& additional_delta) {
+	// Created here rather than in the constructor, after the fields are deserialized
+	if (!streamer_)
+		streamer_ = std::make_unique<VoxelSequenceStreamer>(path_pattern_, first_frame_, frame_count_, prefetch_depth_);
+
+	auto now = std::chrono::steady_clock::now();
+	if (playing_ && last_update_ != std::chrono::steady_clock::time_point{})
+		position_ += std::chrono::duration<double>(now - last_update_).count() * frames_per_second_;
+	last_update_ = now;
+	position_ = std::fmod(position_, static_cast<double>(std::max(frame_count_, 1)));
+	streamer_->Update(position_);
+
+	BufferData buffer;
+	buffer.uLodBias = lod_bias_;
+	buffer.uDensity = density_;
+	buffer.uSampleFrequency = 1.0f / width_;
+	buffer.uSampleBias = glm::vec2((offset_from_first + glm::dvec2(base_)) / glm::dvec2(width_));
+
+	auto voxel_dim = glm::max(streamer_->size(), glm::ivec3(1));
+	auto max_width = static_cast<float>(glm::max(voxel_dim.x, glm::max(voxel_dim.y, voxel_dim.z)));
+	auto tan_half_fovy = glm::tan(glm::radians(camera.fovy) * 0.5f);
+	buffer.uSampleLodK = max_width * tan_half_fovy / (std::min(width_.x, width_.y) * static_cast<float>(glm::min(viewport.x, viewport.y)));
+	buffer.uFrameWeights = streamer_->weights();
+
+	glNamedBufferSubData(buffer_.id(), 0, sizeof(buffer), &buffer);
+}
+
+void VolumetricCloudVoxelSequenceMaterial::Bind() {
+	glBindBufferBase(GL_UNIFORM_BUFFER, 3, buffer_.id());
+
+	GLuint textures[] = { 0, 0, 0, 0 };
+	if (streamer_) {
+		textures[0] = streamer_->texture(0);
+		textures[1] = streamer_->texture(1);
+		textures[2] = streamer_->skip_grid(0);
+		textures[3] = streamer_->skip_grid(1);
+	}
+	GLBindTextures(textures, IVolumetricCloudMaterial::kMaterialTextureUnitBegin);
+	GLBindSamplers({ sampler_.id(), sampler_.id(), 0u, 0u }, IVolumetricCloudMaterial::kMaterialTextureUnitBegin);
+}
+
+float VolumetricCloudVoxelSequenceMaterial::GetSigmaTMax() {
+	return density_;
+}
+
+void VolumetricCloudVoxelSequenceMaterial::DrawGUI() {
+	char pattern[512];
+	snprintf(pattern, sizeof(pattern), "%s", path_pattern_.c_str());
+	if (ImGui::InputText("Path Pattern", pattern, sizeof(pattern)))
+		path_pattern_ = pattern;
+	ImGui::InputInt("First Frame", &first_frame_);
+	ImGui::InputInt("Frame Count", &frame_count_);
+	frame_count_ = std::max(frame_count_, 1);
+	ImGui::SliderInt("Prefetch Depth", &prefetch_depth_, 2, 16);
+	if (ImGui::Button("Reload"))
+		streamer_.reset();
+
+	ImGui::Checkbox("Playing", &playing_);
+	ImGui::SliderFloat("Frames Per Second", &frames_per_second_, 0.0f, 60.0f);
+	auto position = static_cast<float>(position_);
+	if (ImGui::SliderFloat("Position", &position, 0.0f, static_cast<float>(frame_count_)))
+		position_ = position;
+
+	static float density_slider_max = 100.0f;
+	ImGui::SliderFloat("Density Slider Max", &density_slider_max, 20.0f, 1000.0f);
+	ImGui::SliderFloat("Density", &density_, 0.0f, density_slider_max);
+	ImGui::SliderFloat("Lod Bias", &lod_bias_, -2.0f, 10.0f);
+	ImGui::SliderFloat("Base X", &base_.x, -10.0f, 10.0f);
+	ImGui::SliderFloat("Base Y", &base_.y, -10.0f, 10.0f);
+	ImGui::SliderFloat("Width X", &width_.x, 0.1f, 10.0f);
+	ImGui::SliderFloat("Width Y", &width_.y, 0.1f, 10.0f);
+
+	if (!streamer_)
+		return;
+	if (!streamer_->error().empty()) {
+		ImGui::TextColored(ImVec4(1.0f, 0.3f, 0.3f, 1.0f), "%s", streamer_->error().c_str());
+		return;
+	}
+	auto size = streamer_->size();
+	if (size.x == 0) {
+		ImGui::Text("Scanning frames...");
+		return;
+	}
+	ImGui::Text("%d x %d x %d, resident %d %d, %d decoded ahead", size.x, size.y, size.z,
+		streamer_->resident_frame(0), streamer_->resident_frame(1), streamer_->decoded_count());
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <chrono>
+#include <memory>
+#include <string>
+
+#include "IVolumetricCloudMaterial.h"
+#include "VoxelSequenceStreamer.h"
+
+// Voxel cloud animated by a numbered sequence of VDB files, blending the two frames around
+// the playback position. Sequence parameters take effect on Reload.
+class VolumetricCloudVoxelSequenceMaterial : public IVolumetricCloudMaterial {
+public:
+    VolumetricCloudVoxelSequenceMaterial();
+
+    std::string ShaderPath() override;
+
+    void Update(glm::vec2 viewport, const Camera& camera, const glm::dvec2& offset_from_first, glm::vec2& additional_delta) override;
+
+    void Bind() override;
+
+    float GetSigmaTMax() override;
+
+    void DrawGUI() override;
+
+private:
+    FIELD_DECLARATION_BEGIN(ISerializable)
+        FIELD_DECLARE(path_pattern_)
+        FIELD_DECLARE(first_frame_)
+        FIELD_DECLARE(frame_count_)
+        FIELD_DECLARE(frames_per_second_)
+        FIELD_DECLARE(prefetch_depth_)
+        FIELD_DECLARE(lod_bias_)
+        FIELD_DECLARE(density_)
+        FIELD_DECLARE(base_)
+        FIELD_DECLARE(width_)
+    FIELD_DECLARATION_END()
+
+    struct BufferData;
+
+    GLBuffer buffer_;
+    GLSampler sampler_;
+    std::unique_ptr<VoxelSequenceStreamer> streamer_;
+
+    bool playing_ = true;
+    double position_ = 0.0;
+    std::chrono::steady_clock::time_point last_update_{};
+
+    std::string path_pattern_ = "../data/sequence/cloud_%04d.vdb";
+    int first_frame_ = 0;
+    int frame_count_ = 1;
+    float frames_per_second_ = 24.0f;
+    int prefetch_depth_ = 4;
+    float lod_bias_ = 2.75f;
+    float density_ = 20.0f;
+    glm::vec2 base_{ 0.0f, 0.0f };
+    glm::vec2 width_{ 2.0f, 2.0f };
+};
@@ -0,0 +1,351 @@
+#include "VoxelSequenceStreamer.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+
+#include "ImageLoader.h"
+#include "VdbReader.h"
+
+// Splits pattern around its only %d or %i conversion, which may have a zero flag and a width
+static bool ParsePathPattern(const std::string& pattern, std::string& prefix, std::string& suffix, int& width, char& fill) {
+	bool found = false;
+	for (size_t i = 0; i < pattern.size(); ++i) {
+		auto& part = found ? suffix : prefix;
+		if (pattern[i] != '%') {
+			part += pattern[i];
+			continue;
+		}
+		if (++i == pattern.size())
+			return false;
+		if (pattern[i] == '%') {
+			part += '%';
+			continue;
+		}
+		if (found)
+			return false;
+		fill = ' ';
+		if (pattern[i] == '0') {
+			fill = '0';
+			++i;
+		}
+		width = 0;
+		for (; i < pattern.size() && pattern[i] >= '0' && pattern[i] <= '9' && width < 64; ++i)
+			width = width * 10 + (pattern[i] - '0');
+		if (i == pattern.size() || (pattern[i] != 'd' && pattern[i] != 'i'))
+			return false;
+		found = true;
+	}
+	return found;
+}
+
+VoxelSequenceStreamer::VoxelSequenceStreamer(std::string path_pattern, int first_frame, int frame_count, int prefetch_depth)
+	: first_frame_(first_frame)
+	, frame_count_(std::max(frame_count, 1))
+	, slots_(std::max(prefetch_depth, 2)) {
+	if (!ParsePathPattern(path_pattern, path_prefix_, path_suffix_, frame_width_, frame_fill_)) {
+		error_message_ = "Path pattern needs exactly one %d conversion: " + path_pattern;
+		return;
+	}
+	worker_ = std::thread(&VoxelSequenceStreamer::WorkerMain, this);
+}
+
+VoxelSequenceStreamer::~VoxelSequenceStreamer() {
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		stop_ = true;
+	}
+	work_available_.notify_all();
+	if (worker_.joinable())
+		worker_.join();
+
+	for (auto& slot : slots_) {
+		if (slot.fence)
+			glDeleteSync(slot.fence);
+	}
+	if (mapped_)
+		glUnmapNamedBuffer(staging_.id());
+}
+
+std::string VoxelSequenceStreamer::FramePath(int frame) const {
+	std::stringstream ss;
+	ss << path_prefix_ << std::setfill(frame_fill_) << std::internal << std::setw(frame_width_)
+		<< first_frame_ + frame << path_suffix_;
+	return ss.str();
+}
+
+// Frames the worker decodes ahead, starting at the current one
+bool VoxelSequenceStreamer::InWindow(int frame) const {
+	return (frame - window_start_ + frame_count_) % frame_count_ < static_cast<int>(slots_.size());
+}
+
+// The first frame of the window that is neither resident nor in a slot, and a free slot for it
+bool VoxelSequenceStreamer::FindWork(int& frame, int& slot) const {
+	if (mapped_ == nullptr)
+		return false;
+	auto free_slot = std::find_if(slots_.begin(), slots_.end(), [](const Slot& s) { return s.state == SlotState::FREE; });
+	if (free_slot == slots_.end())
+		return false;
+	auto window = std::min(static_cast<int>(slots_.size()), frame_count_);
+	for (int i = 0; i < window; ++i) {
+		auto f = (window_start_ + i) % frame_count_;
+		if (texture_frames_[0] == f || texture_frames_[1] == f)
+			continue;
+		if (std::any_of(slots_.begin(), slots_.end(), [f](const Slot& s) { return s.state != SlotState::FREE && s.frame == f; }))
+			continue;
+		frame = f;
+		slot = static_cast<int>(free_slot - slots_.begin());
+		return true;
+	}
+	return false;
+}
+
+void VoxelSequenceStreamer::WorkerMain() {
+	try {
+		// Every frame is placed in the union of all bounds, so one texture layout fits them all.
+		// The grid metadata has them; only frames written without it are walked.
+		glm::ivec3 min(INT_MAX), max(INT_MIN);
+		for (int i = 0; i < frame_count_ && !stop_; ++i) {
+			auto path = FramePath(i);
+			glm::ivec3 frame_min, frame_max;
+			if (!VdbFloatGridReader::ReadFileBounds(path.c_str(), frame_min, frame_max)) {
+				VdbFloatGridReader reader(path.c_str());
+				frame_min = reader.min();
+				frame_max = reader.max();
+			}
+			min = glm::min(min, frame_min);
+			max = glm::max(max, frame_max);
+		}
+		std::unique_lock<std::mutex> lock(mutex_);
+		grid_min_ = min;
+		auto dim = max - min + 1;
+		scanned_size_ = glm::ivec3(dim.x, dim.z, dim.y);
+
+		for (;;) {
+			int frame = -1, slot = -1;
+			work_available_.wait(lock, [&] { return stop_ || FindWork(frame, slot); });
+			if (stop_)
+				return;
+			slots_[slot].state = SlotState::DECODING;
+			slots_[slot].frame = frame;
+			auto dst = mapped_ + slot * slot_bytes_;
+			auto& skip_cells = slots_[slot].skip_cells;
+			lock.unlock();
+			Decode(frame, dst);
+			BuildMips(dst);
+			BuildSkipCells(dst, skip_cells);
+			lock.lock();
+			slots_[slot].state = SlotState::READY;
+		}
+	}
+	catch (...) {
+		std::lock_guard<std::mutex> lock(mutex_);
+		error_ = std::current_exception();
+	}
+}
+
+// Quantizes the active voxels of the frame into dst, yz swapped so that the VDB up axis
+// becomes our z, as VolumetricCloudVoxelMaterial does
+void VoxelSequenceStreamer::Decode(int frame, uint8_t* dst) const {
+	VdbFloatGridReader reader(FramePath(frame).c_str());
+	memset(dst, 0, slot_bytes_);
+	auto min = grid_min_;
+	auto size = size_;
+	auto grid_max = min + glm::ivec3(size.x, size.z, size.y) - 1;
+	// The bounds may come from metadata, which is trusted only as far as the slot's extent
+	auto store = [&](glm::ivec3 coord, float value) {
+		if (glm::any(glm::lessThan(coord, min)) || glm::any(glm::greaterThan(coord, grid_max)))
+			return;
+		auto offset = coord - min;
+		dst[(static_cast<size_t>(offset.y) * size.y + offset.z) * size.x + offset.x]
+			= static_cast<uint8_t>(glm::clamp(value, 0.0f, 1.0f) * 255.0f + 0.5f);
+	};
+
+	float values[VdbFloatGridReader::kLeafVoxels];
+	uint64_t value_mask[VdbFloatGridReader::kLeafVoxels / 64];
+	for (size_t i = 0; i < reader.leaf_count(); ++i) {
+		reader.ReadLeaf(i, values, value_mask);
+		auto origin = reader.leaf_origin(i);
+		for (int j = 0; j < VdbFloatGridReader::kLeafVoxels; ++j) {
+			if ((value_mask[j >> 6] >> (j & 63)) & 1)
+				store(origin + glm::ivec3(j >> 6, (j >> 3) & 7, j & 7), values[j]);
+		}
+	}
+	for (const auto& tile : reader.tiles()) {
+		auto lo = glm::max(tile.origin, min);
+		auto hi = glm::min(tile.origin + tile.size - 1, grid_max);
+		for (int x = lo.x; x <= hi.x; ++x) {
+			for (int y = lo.y; y <= hi.y; ++y) {
+				for (int z = lo.z; z <= hi.z; ++z)
+					store({ x, y, z }, tile.value);
+			}
+		}
+	}
+}
+
+// Box filtered mips after level 0, the last texel of an odd dimension repeats
+void VoxelSequenceStreamer::BuildMips(uint8_t* dst) const {
+	auto src_size = size_;
+	for (size_t level = 1; level + 1 < level_offsets_.size(); ++level) {
+		auto src = dst + level_offsets_[level - 1];
+		auto out = dst + level_offsets_[level];
+		auto size = glm::max(src_size >> 1, 1);
+		auto texel = [&](int x, int y, int z) {
+			x = glm::min(x, src_size.x - 1);
+			y = glm::min(y, src_size.y - 1);
+			z = glm::min(z, src_size.z - 1);
+			return static_cast<int>(src[(static_cast<size_t>(z) * src_size.y + y) * src_size.x + x]);
+		};
+		for (int z = 0; z < size.z; ++z) {
+			for (int y = 0; y < size.y; ++y) {
+				for (int x = 0; x < size.x; ++x) {
+					int sum = 4;
+					for (int i = 0; i < 8; ++i)
+						sum += texel(x * 2 + (i & 1), y * 2 + ((i >> 1) & 1), z * 2 + (i >> 2));
+					out[(static_cast<size_t>(z) * size.y + y) * size.x + x] = static_cast<uint8_t>(sum / 8);
+				}
+			}
+		}
+		src_size = size;
+	}
+}
+
+// Maximum of every column of kCellTexels x kCellTexels texels, as the skip grid's source pass
+void VoxelSequenceStreamer::BuildSkipCells(const uint8_t* dst, std::vector<float>& cells) const {
+	constexpr int kCellTexels = VolumetricCloudSkipGrid::kCellTexels;
+	std::vector<uint8_t> max(static_cast<size_t>(skip_grid_size_.x) * skip_grid_size_.y, 0);
+	for (int z = 0; z < size_.z; ++z) {
+		for (int y = 0; y < size_.y; ++y) {
+			auto row = dst + (static_cast<size_t>(z) * size_.y + y) * size_.x;
+			auto cell_row = &max[static_cast<size_t>(y / kCellTexels) * skip_grid_size_.x];
+			for (int x = 0; x < size_.x; ++x)
+				cell_row[x / kCellTexels] = std::max(cell_row[x / kCellTexels], row[x]);
+		}
+	}
+	cells.resize(max.size());
+	for (size_t i = 0; i < max.size(); ++i)
+		cells[i] = static_cast<float>(max[i]) / 255.0f;
+}
+
+void VoxelSequenceStreamer::Allocate() {
+	size_ = scanned_size_;
+	auto levels = GetMipmapLevels(size_.x, size_.y, size_.z);
+	level_offsets_.assign(1, 0);
+	for (int level = 0; level < levels; ++level) {
+		auto size = glm::max(size_ >> level, 1);
+		level_offsets_.push_back(level_offsets_.back() + static_cast<size_t>(size.x) * size.y * size.z);
+	}
+	slot_bytes_ = level_offsets_.back();
+	skip_grid_size_ = (glm::ivec2(size_) + VolumetricCloudSkipGrid::kCellTexels - 1) / VolumetricCloudSkipGrid::kCellTexels;
+	for (auto& texture : textures_) {
+		texture.Create(GL_TEXTURE_3D);
+		glTextureStorage3D(texture.id(), levels, GL_R8, size_.x, size_.y, size_.z);
+	}
+
+	// Coherent, so the worker's writes need no flush before the upload reads them
+	constexpr GLbitfield kFlags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+	auto bytes = static_cast<GLsizeiptr>(slot_bytes_ * slots_.size());
+	staging_.Create();
+	glNamedBufferStorage(staging_.id(), bytes, NULL, kFlags);
+	mapped_ = static_cast<uint8_t*>(glMapNamedBufferRange(staging_.id(), 0, bytes, kFlags));
+	if (mapped_ == nullptr)
+		throw std::runtime_error("Failed to map the voxel sequence staging buffer");
+}
+
+void VoxelSequenceStreamer::Upload(int slot, int texture) {
+	auto id = textures_[texture].id();
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, staging_.id());
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	for (size_t level = 0; level + 1 < level_offsets_.size(); ++level) {
+		auto size = glm::max(size_ >> static_cast<int>(level), 1);
+		glTextureSubImage3D(id, static_cast<GLint>(level), 0, 0, 0, size.x, size.y, size.z, GL_RED, GL_UNSIGNED_BYTE,
+			reinterpret_cast<const void*>(slot * slot_bytes_ + level_offsets_[level]));
+	}
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	slots_[slot].fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	slots_[slot].state = SlotState::UPLOADED;
+	texture_frames_[texture] = slots_[slot].frame;
+
+	skip_grids_[texture].Build(slots_[slot].skip_cells.data(), skip_grid_size_, false);
+}
+
+void VoxelSequenceStreamer::Update(double position) {
+	std::unique_lock<std::mutex> lock(mutex_);
+	if (error_) {
+		if (error_message_.empty()) {
+			try {
+				std::rethrow_exception(error_);
+			}
+			catch (const std::exception& e) {
+				error_message_ = e.what();
+			}
+			catch (...) {
+				error_message_ = "Unknown error";
+			}
+		}
+		return;
+	}
+	if (mapped_ == nullptr) {
+		if (scanned_size_.x == 0)
+			return;
+		Allocate();
+	}
+
+	auto frame_position = position - glm::floor(position / frame_count_) * frame_count_;
+	auto f0 = std::min(static_cast<int>(frame_position), frame_count_ - 1);
+	auto f1 = (f0 + 1) % frame_count_;
+	auto blend = static_cast<float>(frame_position - f0);
+	window_start_ = f0;
+
+	for (auto& slot : slots_) {
+		if (slot.state == SlotState::UPLOADED) {
+			auto status = glClientWaitSync(slot.fence, 0, 0);
+			if (status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED) {
+				glDeleteSync(slot.fence);
+				slot = Slot();
+			}
+		}
+		else if (slot.state == SlotState::READY && !InWindow(slot.frame)) {
+			slot = Slot(); // skipped over, e.g. after a seek
+		}
+	}
+
+	// Upload into the texture that holds neither wanted frame, which keeps the other one
+	// displayable until both are in
+	for (auto frame : { f0, f1 }) {
+		if (texture_frames_[0] == frame || texture_frames_[1] == frame)
+			continue;
+		auto ready = std::find_if(slots_.begin(), slots_.end(), [frame](const Slot& s) {
+			return s.state == SlotState::READY && s.frame == frame;
+		});
+		if (ready == slots_.end())
+			continue;
+		auto is_wanted = [&](int t) { return texture_frames_[t] == f0 || texture_frames_[t] == f1; };
+		auto target = !is_wanted(0) ? 0 : !is_wanted(1) ? 1 : -1;
+		if (target >= 0)
+			Upload(static_cast<int>(ready - slots_.begin()), target);
+	}
+
+	auto t0 = texture_frames_[0] == f0 ? 0 : texture_frames_[1] == f0 ? 1 : -1;
+	auto t1 = texture_frames_[0] == f1 ? 0 : texture_frames_[1] == f1 ? 1 : -1;
+	if (t0 >= 0 && t1 >= 0 && t0 != t1) {
+		weights_[t0] = 1.0f - blend;
+		weights_[t1] = blend;
+	}
+	else if (t0 >= 0 || t1 >= 0) {
+		weights_ = glm::vec2(0.0f);
+		weights_[t0 >= 0 ? t0 : t1] = 1.0f;
+	}
+	lock.unlock();
+	work_available_.notify_one();
+}
+
+int VoxelSequenceStreamer::decoded_count() const {
+	std::lock_guard<std::mutex> lock(mutex_);
+	return static_cast<int>(std::count_if(slots_.begin(), slots_.end(), [](const Slot& s) { return s.state == SlotState::READY; }));
+}
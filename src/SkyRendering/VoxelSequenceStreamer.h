@@ -0,0 +1,118 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "gl.hpp"
+#include "VolumetricCloudSkipGrid.h"
+
+// Plays back a numbered sequence of VDB frames (see VdbReader.h) as dense R8 3D textures. A
+// worker thread decodes the frames ahead of the playback position straight into a ring of
+// slots in one persistently mapped pixel unpack buffer, together with their mip chains and
+// skip grid cells. Update uploads decoded slots into two textures, so the frames on both
+// sides of the position are resident and can be blended, and recycles a slot once the fence
+// after its upload has passed. The render thread never waits on the disk, the decoder or the
+// GPU, and never reduces a whole volume; a frame that is late just keeps the previous one.
+class VoxelSequenceStreamer {
+public:
+    // path_pattern holds one integer conversion, %d or %i with an optional zero flag and width
+    // (e.g. "cloud_%04d.vdb"), that is replaced by first_frame .. first_frame + frame_count - 1;
+    // %% is a literal percent sign. Any other pattern is reported by error() and nothing is
+    // loaded. prefetch_depth is the number of slots.
+    VoxelSequenceStreamer(std::string path_pattern, int first_frame, int frame_count, int prefetch_depth);
+    ~VoxelSequenceStreamer();
+
+    VoxelSequenceStreamer(const VoxelSequenceStreamer&) = delete;
+    VoxelSequenceStreamer& operator=(const VoxelSequenceStreamer&) = delete;
+
+    // position is in frames and wraps around the sequence
+    void Update(double position);
+
+    // Texture size, zero until the worker has scanned the bounds of every frame
+    glm::ivec3 size() const {
+        return size_;
+    }
+    GLuint texture(int i) const {
+        return textures_[i].id();
+    }
+    GLuint skip_grid(int i) const {
+        return skip_grids_[i].texture();
+    }
+    // Blend weight of each texture for the last Update position
+    glm::vec2 weights() const {
+        return weights_;
+    }
+    int resident_frame(int i) const {
+        return texture_frames_[i];
+    }
+    int decoded_count() const;
+    // Message of the exception that stopped the worker, empty while it is fine
+    const std::string& error() const {
+        return error_message_;
+    }
+
+private:
+    enum class SlotState {
+        FREE,
+        DECODING,
+        READY,
+        UPLOADED, // waiting for the fence
+    };
+
+    struct Slot {
+        SlotState state = SlotState::FREE;
+        int frame = -1;
+        GLsync fence = nullptr;
+        std::vector<float> skip_cells; // level 0 of the skip grid, written while DECODING
+    };
+
+    std::string FramePath(int frame) const;
+    bool InWindow(int frame) const;
+    bool FindWork(int& frame, int& slot) const;
+    void WorkerMain();
+    void Decode(int frame, uint8_t* dst) const;
+    void BuildMips(uint8_t* dst) const;
+    void BuildSkipCells(const uint8_t* dst, std::vector<float>& cells) const;
+    void Allocate();
+    void Upload(int slot, int texture);
+
+    // path_pattern split around its conversion, which is never passed to printf
+    std::string path_prefix_;
+    std::string path_suffix_;
+    int frame_width_ = 0;
+    char frame_fill_ = ' ';
+    const int first_frame_;
+    const int frame_count_;
+
+    // Shared with the worker, guarded by mutex_
+    mutable std::mutex mutex_;
+    std::condition_variable work_available_;
+    std::vector<Slot> slots_;
+    int texture_frames_[2] = { -1, -1 };
+    int window_start_ = 0;
+    glm::ivec3 grid_min_{};
+    glm::ivec3 scanned_size_{};
+    uint8_t* mapped_ = nullptr;
+    std::exception_ptr error_;
+    std::atomic<bool> stop_{ false };
+
+    glm::ivec3 size_{};
+    std::vector<size_t> level_offsets_; // of each mip in a slot, then the slot size
+    size_t slot_bytes_ = 0;
+    glm::ivec2 skip_grid_size_{};
+    GLBuffer staging_;
+    GLTexture textures_[2];
+    VolumetricCloudSkipGrid skip_grids_[2];
+    glm::vec2 weights_{ 0.0f };
+    std::string error_message_;
+
+    std::thread worker_;
+};
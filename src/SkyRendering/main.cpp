@@ -1,20 +1,154 @@
 #include "AppWindow.h"
+#include "ShaderPreprocessor.h"
+#include "AtmosphereLutAsset.h"
+#include "CloudNoiseAsset.h"
+#include "PathTracingCheckpoint.h"
+#include "Utils.h"
 
 #include <iostream>
 #include <stdexcept>
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <vector>
+#include <deque>
+#include <filesystem>
 
+#ifdef _WIN32
 // Run with Nvidia GPU on laptop
 extern "C" {
     _declspec(dllexport) unsigned NvOptimusEnablement = 0x00000001;
 }
+#endif
 
+// SkyRendering [config.json]
+// SkyRendering [config.json] --headless <track.json> [--frames N] [--size WxH] [--output dir]
+// SkyRendering --benchmark-preprocessor [iterations]
+// SkyRendering [config.json] --validate-luts
+// SkyRendering [config.json] --cloud-reference <out.hdr> [--frames N] [--size WxH] [--threads N]
+// SkyRendering [config.json] --path-trace <out.ckpt> [--frames N] [--size WxH] [--resume <in.ckpt>]
+//     [--checkpoint-interval N] [--tile-grid N] [--tiles B:E] [--first-sample N] [--max-samples N]
+// SkyRendering --merge-checkpoints <out.ckpt|out.hdr> <in.ckpt>...
+// SkyRendering --bake-luts <config.json>...
+// SkyRendering --bake-noise <config.json>...
+// Paths given on the command line are relative to the working directory the program was started in,
+// default ones to the exe directory
 int main(int argc, char* argv[]) {
     try {
-        const char* configpath = argc > 1 ? argv[1] : "config.json";
-        AppWindow app(configpath, 1280, 720);
-        app.MainLoop();
+        // The windows and bakers switch to the exe directory, so user paths are made absolute beforehand
+        std::deque<std::string> absolute_paths;
+        auto absolute = [&absolute_paths](const char* path) {
+            absolute_paths.push_back(std::filesystem::absolute(path).string());
+            return absolute_paths.back().c_str();
+        };
+        auto absolute_list = [&absolute](char** begin, char** end) {
+            std::vector<const char*> paths;
+            for (auto it = begin; it != end; ++it)
+                paths.push_back(absolute(*it));
+            return paths;
+        };
+        const char* configpath = "config.json";
+        const char* trackpath = nullptr;
+        const char* referencepath = nullptr;
+        AppWindow::PathTracingJob path_tracing_job;
+        unsigned threads = 0;
+        bool validate_luts = false;
+        const char* outputdir = "";
+        int frames = 0;
+        int width = 1280;
+        int height = 720;
+        for (int i = 1; i < argc; ++i) {
+            auto has_value = i + 1 < argc;
+            if (strcmp(argv[i], "--benchmark-preprocessor") == 0) {
+                SetCurrentDirToExe();
+                ShaderPreprocessor::Instance().Benchmark("../shaders", has_value ? std::atoi(argv[i + 1]) : 20);
+                return 0;
+            }
+            else if (strcmp(argv[i], "--bake-luts") == 0) {
+                auto configs = absolute_list(argv + i + 1, argv + argc);
+                SetCurrentDirToExe();
+                BakeAtmosphereLutAssets(configs);
+                return 0;
+            }
+            else if (strcmp(argv[i], "--bake-noise") == 0) {
+                auto configs = absolute_list(argv + i + 1, argv + argc);
+                SetCurrentDirToExe();
+                BakeCloudNoiseAssets(configs);
+                return 0;
+            }
+            else if (strcmp(argv[i], "--merge-checkpoints") == 0 && has_value) {
+                MergePathTracingCheckpoints(argv[i + 1], std::vector<const char*>(argv + i + 2, argv + argc));
+                return 0;
+            }
+            else if (strcmp(argv[i], "--validate-luts") == 0)
+                validate_luts = true;
+            else if (strcmp(argv[i], "--headless") == 0 && has_value)
+                trackpath = absolute(argv[++i]);
+            else if (strcmp(argv[i], "--cloud-reference") == 0 && has_value)
+                referencepath = absolute(argv[++i]);
+            else if (strcmp(argv[i], "--path-trace") == 0 && has_value)
+                path_tracing_job.output = absolute(argv[++i]);
+            else if (strcmp(argv[i], "--resume") == 0 && has_value)
+                path_tracing_job.resume = absolute(argv[++i]);
+            else if (strcmp(argv[i], "--checkpoint-interval") == 0 && has_value)
+                path_tracing_job.checkpoint_interval = std::atoi(argv[++i]);
+            else if (strcmp(argv[i], "--tile-grid") == 0 && has_value)
+                path_tracing_job.sqrt_tile_count = std::atoi(argv[++i]);
+            else if (strcmp(argv[i], "--first-sample") == 0 && has_value)
+                path_tracing_job.first_sample = std::atoi(argv[++i]);
+            else if (strcmp(argv[i], "--max-samples") == 0 && has_value)
+                path_tracing_job.max_samples = std::atoi(argv[++i]);
+            else if (strcmp(argv[i], "--tiles") == 0 && has_value) {
+                std::string tiles = argv[++i];
+                auto colon = tiles.find(':');
+                if (colon == std::string::npos)
+                    throw std::runtime_error("Invalid tile range: " + tiles);
+                path_tracing_job.tile_begin = std::stoi(tiles.substr(0, colon));
+                path_tracing_job.tile_end = std::stoi(tiles.substr(colon + 1));
+            }
+            else if (strcmp(argv[i], "--threads") == 0 && has_value)
+                threads = static_cast<unsigned>(std::atoi(argv[++i]));
+            else if (strcmp(argv[i], "--frames") == 0 && has_value)
+                frames = std::atoi(argv[++i]);
+            else if (strcmp(argv[i], "--output") == 0 && has_value)
+                outputdir = absolute(argv[++i]);
+            else if (strcmp(argv[i], "--size") == 0 && has_value) {
+                std::string size = argv[++i];
+                auto x = size.find('x');
+                if (x == std::string::npos)
+                    throw std::runtime_error("Invalid size: " + size);
+                width = std::stoi(size.substr(0, x));
+                height = std::stoi(size.substr(x + 1));
+            }
+            else
+                configpath = absolute(argv[i]);
+        }
+
+        if (validate_luts) {
+            AppWindow app(configpath, 64, 64, true);
+            return app.ValidateAtmosphereLuts(std::cout) ? 0 : 1;
+        }
+        else if (path_tracing_job.output) {
+            AppWindow app(configpath, width, height, true);
+            if (frames > 0)
+                path_tracing_job.frame_count = frames;
+            app.RenderPathTracing(path_tracing_job);
+        }
+        else if (referencepath) {
+            AppWindow app(configpath, width, height, true);
+            app.RenderCloudReference(referencepath, frames > 0 ? frames : 64, threads);
+        }
+        else if (trackpath) {
+            AppWindow app(configpath, width, height, true);
+            app.RenderSequence(trackpath, frames, outputdir);
+        }
+        else {
+            AppWindow app(configpath, width, height);
+            app.MainLoop();
+        }
     } catch (std::exception& e) {
         std::cout << e.what() << std::endl;
+        return 1;
     }
 
     return 0;